@@ -0,0 +1,379 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "FrameBuffer.cpp"
+#include "AsyncDecoder.cpp"
+// average_rows_2x2
+#include "ConvertCPU.cpp"
+
+// Motion detection on the luma plane of decoded frames, as they are captured, instead of
+//  re-decoding every segment with src/activity.py. Does the same steps (mask the timestamp,
+//  absdiff, threshold at 30, open, sum the changed area), but:
+//  - On luma downsampled by 2^downsample_levels in each dimension, instead of full size BGR
+//  - Against a running background (each frame moves it 1/2^background_halvings of the way),
+//      instead of the segment's first frame. A first frame with something in it fades out of
+//      the background, rather than making every other frame look changed.
+//  - The opening is 2x2 at the downsampled size, instead of a 5x5 ellipse at full size
+// With ActivityBaseline::Bidirectional it instead scores like activity.py, against the first and
+//  the last frame, keeping whichever direction changed less in total.
+// Scores are in full size pixels, so they compare against CHANGE_PIXEL_THRESHOLD (src/activity.ts)
+//  like activity.py's contour areas.
+
+enum class ActivityBaseline {
+    // A background that follows the frames. Scores are final as soon as the frame is added.
+    Running,
+    // activity.py's forward and reverse passes: each frame against the segment's first frame,
+    //  then each against its last, using the direction with the smaller total (so a first frame
+    //  with something in it doesn't make the whole segment look active). Instead of keeping
+    //  every decoded frame, only the downsampled luma is kept, for at most max_window_frames
+    //  frames. Longer segments are scored as consecutive windows of that many frames, each
+    //  with its own first and last frame, so memory doesn't grow with the segment.
+    Bidirectional,
+};
+
+struct ActivityOptions {
+    ActivityBaseline baseline = ActivityBaseline::Running;
+    // For Bidirectional. Keep it at least the keyframe interval, so a 1x segment is one window.
+    int max_window_frames = 64;
+    int downsample_levels = 2;
+    // Luma difference that counts as changed (activity.py's cv2.threshold)
+    int pixel_threshold = 30;
+    int background_halvings = 2;
+    // The clockoverlay timestamp, blacked out by activity.py. Full size pixels from the top left.
+    //  Our own overlay replaces this with its exact bounds (see set_mask).
+    int mask_height = 120;
+    int mask_width_divisor = 2;
+    // Changed pixels for a frame to count as activity (CHANGE_PIXEL_THRESHOLD)
+    int64_t change_threshold = 200;
+};
+
+struct ActivityScore {
+    // For Bidirectional, against the window's first frame. The final score may be the reverse one.
+    int64_t changes = 0;
+    // This frame has the most changes so far in the segment, and is over change_threshold. The
+    //  caller copies it if it wants the preview, as the detector doesn't keep frames. For
+    //  Bidirectional this is only the forward pass's pick, so check it against the finished
+    //  segment's most_active_sequence (if the reverse pass won, that frame wasn't kept).
+    bool most_active = false;
+};
+
+// What activity.py printed and wrote to .metadata, for one segment
+struct ActivitySegment {
+    std::vector<int64_t> changes;       // Per frame
+    int most_active_index = -1;         // -1 if no frame is over change_threshold
+    int64_t most_active_changes = 0;
+    uint32_t most_active_sequence = 0;
+
+    bool has_activity() const { return most_active_index >= 0; }
+};
+
+// Frames are added from one thread
+class ActivityDetector {
+public:
+    ActivityDetector(int width, int height, const ActivityOptions& options = ActivityOptions());
+
+    // Luma plane of a full size frame
+    ActivityScore add_frame(const uint8_t* y, int stride, uint32_t sequence = 0);
+    ActivityScore add_frame(const FrameBuffer& frame) { return add_frame(frame.y(), frame.width, frame.sequence); }
+    ActivityScore add_frame(const DecodedImage& image) { return add_frame(image.planes[0], image.strides[0], image.sequence); }
+
+    // The scores since the last call, and start a new segment. The background carries over.
+    ActivitySegment finish_segment();
+    // Frames added since finish_segment
+    int segment_frames() const { return (int)segment.changes.size() + window_frames; }
+
+    // Changes inside this rectangle (full size pixels) are ignored, replacing the options' mask.
+    //  For the TimestampOverlay's bounds. A zero size masks nothing.
+    void set_mask(int x, int y, int mask_width, int mask_height);
+
+    int small_width() const { return width; }
+    int small_height() const { return height; }
+
+private:
+    ActivityOptions options;
+    int full_width;
+    int full_height;
+    int width;      // Downsampled
+    int height;
+    int scale;      // Full size pixels per downsampled pixel, in each dimension
+    int mask_left;  // Downsampled, covering every full size pixel of the mask
+    int mask_top;
+    int mask_right;
+    int mask_bottom;
+
+    std::vector<uint8_t> small;         // Downsampled luma (for Running)
+    std::vector<uint8_t> background;
+    std::vector<uint8_t> changed;       // 0xFF where changed, then eroded
+    std::vector<uint8_t> level_rows[2]; // Scratch rows for downsampling past the first level
+    bool have_background;
+
+    // Bidirectional: the downsampled luma of the window's frames, one after another
+    std::vector<uint8_t> window;
+    std::vector<int64_t> window_forward;
+    std::vector<int64_t> window_reverse;
+    std::vector<uint32_t> window_sequences;
+    int window_frames;
+    int64_t forward_most_changes;   // Over the segment, for ActivityScore::most_active
+
+    ActivitySegment segment;
+
+    uint8_t* window_frame(int index) { return window.data() + (size_t)index * width * height; }
+    void downsample(const uint8_t* y, int stride, uint8_t* out);
+    int64_t count_changes();
+    int64_t score_against(const uint8_t* frame, const uint8_t* base);
+    void record(int64_t changes, uint32_t sequence, ActivityScore* score, bool later_wins_ties = false);
+    void finish_window();
+};
+
+ActivityDetector::ActivityDetector(int full_width, int full_height, const ActivityOptions& options)
+    : options(options), full_width(full_width), full_height(full_height), have_background(false), window_frames(0), forward_most_changes(0) {
+    if (options.downsample_levels < 0 || options.downsample_levels > 4) {
+        throw std::runtime_error("ActivityDetector: downsample_levels must be 0 to 4");
+    }
+    scale = 1 << options.downsample_levels;
+    width = full_width / scale;
+    height = full_height / scale;
+    if (width < 2 || height < 2) {
+        throw std::runtime_error("ActivityDetector: frame is too small");
+    }
+    if (options.baseline == ActivityBaseline::Bidirectional && options.max_window_frames < 1) {
+        throw std::runtime_error("ActivityDetector: max_window_frames must be at least 1");
+    }
+    set_mask(0, 0, options.mask_width_divisor > 0 ? full_width / options.mask_width_divisor : 0, options.mask_height);
+
+    changed.resize((size_t)width * height);
+    if (options.baseline == ActivityBaseline::Bidirectional) {
+        window.resize(changed.size() * options.max_window_frames);
+        window_forward.resize(options.max_window_frames);
+        window_reverse.resize(options.max_window_frames);
+        window_sequences.resize(options.max_window_frames);
+    } else {
+        small.resize(changed.size());
+        background.resize(changed.size());
+    }
+    level_rows[0].resize((size_t)(full_width / 2) * (scale / 2));
+    level_rows[1].resize(level_rows[0].size());
+}
+
+// Each level averages 2x2 blocks, so a level's row comes from two rows of the level above it.
+//  Rather than keeping whole intermediate planes, each output row is built from the full size
+//  rows under it, through level_rows.
+void ActivityDetector::downsample(const uint8_t* y, int stride, uint8_t* small) {
+    int levels = options.downsample_levels;
+    if (levels == 0) {
+        for (int row = 0; row < height; row++) {
+            memcpy(small + (size_t)row * width, y + (size_t)row * stride, width);
+        }
+        return;
+    }
+    std::vector<uint8_t>& pair = level_rows[0];
+    std::vector<uint8_t>& next_pair = level_rows[1];
+    for (int row = 0; row < height; row++) {
+        uint8_t* out = small + (size_t)row * width;
+        if (levels == 1) {
+            const uint8_t* top = y + (size_t)(row * 2) * stride;
+            average_rows_2x2(top, top + stride, out, width * 2);
+            continue;
+        }
+        // Build 2^(levels - 1) rows of level 1 (half size), then halve them down to the one
+        //  output row. pair holds the current level's rows, one after another.
+        int level_row_count = 1 << (levels - 1);
+        int level_width = full_width / 2;
+        const uint8_t* top = y + (size_t)(row * scale) * stride;
+        for (int i = 0; i < level_row_count; i++) {
+            average_rows_2x2(top + (size_t)(i * 2) * stride, top + (size_t)(i * 2 + 1) * stride,
+                pair.data() + (size_t)i * level_width, level_width * 2);
+        }
+        for (int level = 2; level <= levels; level++) {
+            int next_width = level_width / 2;
+            level_row_count /= 2;
+            uint8_t* dst = level == levels ? out : next_pair.data();
+            for (int i = 0; i < level_row_count; i++) {
+                const uint8_t* a = pair.data() + (size_t)(i * 2) * level_width;
+                average_rows_2x2(a, a + level_width, dst + (size_t)i * next_width, next_width * 2);
+            }
+            if (level != levels) std::swap(pair, next_pair);
+            level_width = next_width;
+        }
+    }
+}
+
+void ActivityDetector::set_mask(int x, int y, int mask_width, int mask_height) {
+    mask_left = std::min(width, std::max(0, x) / scale);
+    mask_top = std::min(height, std::max(0, y) / scale);
+    mask_right = std::max(mask_left, std::min(width, (x + mask_width + scale - 1) / scale));
+    mask_bottom = std::max(mask_top, std::min(height, (y + mask_height + scale - 1) / scale));
+    if (mask_width <= 0 || mask_height <= 0) {
+        mask_right = mask_left;
+        mask_bottom = mask_top;
+    }
+}
+
+// changed = |small - background| > threshold ? 0xFF : 0. Then, unless updated is null, it gets the
+//  background moved toward small (it can be background). The update rounds up (it is repeated
+//  averaging), which leaves it at most a few levels off, well under the threshold.
+static void diff_and_update_background(const uint8_t* small, const uint8_t* background, uint8_t* updated, uint8_t* changed,
+                                       size_t count, int threshold, int halvings) {
+    size_t i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x16_t limit = vdupq_n_u8((uint8_t)threshold);
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t cur = vld1q_u8(small + i);
+        uint8x16_t back = vld1q_u8(background + i);
+        vst1q_u8(changed + i, vcgtq_u8(vabdq_u8(cur, back), limit));
+        if (!updated) continue;
+        for (int h = 0; h < halvings; h++) {
+            cur = vrhaddq_u8(cur, back);
+        }
+        vst1q_u8(updated + i, cur);
+    }
+#elif defined(__SSE2__)
+    __m128i limit = _mm_set1_epi8((char)threshold);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i*)(small + i));
+        __m128i back = _mm_loadu_si128((const __m128i*)(background + i));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(cur, back), _mm_subs_epu8(back, cur));
+        // diff > threshold, as there is no unsigned compare
+        __m128i over = _mm_subs_epu8(diff, limit);
+        _mm_storeu_si128((__m128i*)(changed + i), _mm_andnot_si128(_mm_cmpeq_epi8(over, zero), _mm_set1_epi8(-1)));
+        if (!updated) continue;
+        for (int h = 0; h < halvings; h++) {
+            cur = _mm_avg_epu8(cur, back);
+        }
+        _mm_storeu_si128((__m128i*)(updated + i), cur);
+    }
+#endif
+    for (; i < count; i++) {
+        int cur = small[i];
+        int back = background[i];
+        int diff = cur > back ? cur - back : back - cur;
+        changed[i] = diff > threshold ? 0xFF : 0;
+        if (!updated) continue;
+        for (int h = 0; h < halvings; h++) {
+            cur = (cur + back + 1) >> 1;
+        }
+        updated[i] = (uint8_t)cur;
+    }
+}
+
+// A 2x2 opening (erode, then dilate), counting the pixels that survive. Erosion anchors at the
+//  top left, so a pixel survives the dilation if any eroded pixel up or left of it (or itself) is set.
+int64_t ActivityDetector::count_changes() {
+    for (int row = mask_top; row < mask_bottom; row++) {
+        memset(changed.data() + (size_t)row * width + mask_left, 0, mask_right - mask_left);
+    }
+    // Erode in place, top down, as each row only reads itself and the row below
+    for (int row = 0; row < height; row++) {
+        uint8_t* line = changed.data() + (size_t)row * width;
+        if (row == height - 1) {
+            memset(line, 0, width);
+            break;
+        }
+        const uint8_t* below = line + width;
+        for (int x = 0; x < width - 1; x++) {
+            line[x] = line[x] & line[x + 1] & below[x] & below[x + 1];
+        }
+        line[width - 1] = 0;
+    }
+    int64_t count = 0;
+    for (int row = 0; row < height; row++) {
+        const uint8_t* line = changed.data() + (size_t)row * width;
+        const uint8_t* above = row > 0 ? line - width : line;
+        count += (line[0] | above[0]) & 1;
+        for (int x = 1; x < width; x++) {
+            count += (line[x] | line[x - 1] | above[x] | above[x - 1]) & 1;
+        }
+    }
+    return count * scale * scale;
+}
+
+int64_t ActivityDetector::score_against(const uint8_t* frame, const uint8_t* base) {
+    diff_and_update_background(frame, base, nullptr, changed.data(), changed.size(), options.pixel_threshold, 0);
+    return count_changes();
+}
+
+// Adds the frame's final score to the segment. Of equally active frames the first is the most
+//  active, or with later_wins_ties the last (activity.py's reverse pass finds that one first).
+void ActivityDetector::record(int64_t changes, uint32_t sequence, ActivityScore* score, bool later_wins_ties) {
+    if (changes > options.change_threshold
+        && (segment.most_active_index < 0 || changes > segment.most_active_changes
+            || (later_wins_ties && changes == segment.most_active_changes))) {
+        segment.most_active_index = (int)segment.changes.size();
+        segment.most_active_changes = changes;
+        segment.most_active_sequence = sequence;
+        if (score) score->most_active = true;
+    }
+    segment.changes.push_back(changes);
+}
+
+ActivityScore ActivityDetector::add_frame(const uint8_t* y, int stride, uint32_t sequence) {
+    ActivityScore score;
+    if (options.baseline == ActivityBaseline::Bidirectional) {
+        if (window_frames == options.max_window_frames) {
+            finish_window();
+        }
+        uint8_t* frame = window_frame(window_frames);
+        downsample(y, stride, frame);
+        // The first frame is the forward baseline, so it has no changes
+        score.changes = window_frames == 0 ? 0 : score_against(frame, window_frame(0));
+        window_forward[window_frames] = score.changes;
+        if (score.changes > options.change_threshold && score.changes > forward_most_changes) {
+            forward_most_changes = score.changes;
+            score.most_active = true;
+        }
+        window_sequences[window_frames] = sequence;
+        window_frames++;
+        return score;
+    }
+
+    downsample(y, stride, small.data());
+    if (!have_background) {
+        background = small;
+        have_background = true;
+    }
+    diff_and_update_background(small.data(), background.data(), background.data(), changed.data(), small.size(),
+        options.pixel_threshold, options.background_halvings);
+    score.changes = count_changes();
+    record(score.changes, sequence, &score);
+    return score;
+}
+
+// The reverse pass, against the window's last frame, then keep the direction with fewer total
+//  changes (the forward one on a tie, like activity.py)
+void ActivityDetector::finish_window() {
+    if (window_frames == 0) return;
+    const uint8_t* last = window_frame(window_frames - 1);
+    int64_t forward_total = 0;
+    int64_t reverse_total = 0;
+    for (int i = 0; i < window_frames; i++) {
+        window_reverse[i] = i == window_frames - 1 ? 0 : score_against(window_frame(i), last);
+        forward_total += window_forward[i];
+        reverse_total += window_reverse[i];
+    }
+    bool forward = forward_total <= reverse_total;
+    const std::vector<int64_t>& chosen = forward ? window_forward : window_reverse;
+    for (int i = 0; i < window_frames; i++) {
+        record(chosen[i], window_sequences[i], nullptr, !forward);
+    }
+    window_frames = 0;
+}
+
+ActivitySegment ActivityDetector::finish_segment() {
+    finish_window();
+    forward_most_changes = 0;
+    ActivitySegment finished = std::move(segment);
+    segment = ActivitySegment();
+    segment.changes.reserve(finished.changes.size());
+    return finished;
+}
@@ -0,0 +1,325 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <stdexcept>
+#include <cstring>
+
+#include "CameraFrameCapture.cpp"
+#include "ConvertCPU.cpp"
+#include "FrameBuffer.cpp"
+#include "RingQueue.cpp"
+
+class AsyncFrameDecoder;
+
+// A decoded I420 frame, still in the decoder's output buffer (no copy). The planes may be
+//  padded, so index them with the strides. Move-only, and the buffer goes back to the decoder
+//  when this is released or destroyed. Decoders only have a few output buffers, so release
+//  them promptly, or copy_to a pooled frame to hold on to one.
+class DecodedImage {
+public:
+    const uint8_t* planes[3] = {nullptr, nullptr, nullptr};  // Y, U, V
+    int strides[3] = {0, 0, 0};
+    int width = 0;
+    int height = 0;
+    uint32_t sequence = 0;      // From the submitted frame
+    int64_t timestamp_us = 0;
+
+    DecodedImage() {}
+    DecodedImage(AsyncFrameDecoder* owner, void* token) : owner(owner), token(token) {}
+    DecodedImage(const DecodedImage&) = delete;
+    DecodedImage& operator=(const DecodedImage&) = delete;
+    DecodedImage(DecodedImage&& other) noexcept { *this = std::move(other); }
+    DecodedImage& operator=(DecodedImage&& other) noexcept;
+    ~DecodedImage() { release(); }
+
+    void release();
+    explicit operator bool() const { return token != nullptr; }
+
+    // Copy into a packed frame of the same size
+    void copy_to(FrameBuffer& frame) const;
+
+private:
+    AsyncFrameDecoder* owner = nullptr;
+    void* token = nullptr;      // Whatever the decoder needs to recycle the buffer
+};
+
+// A decoder that keeps several frames in flight: submit() returns as soon as the frame is
+//  queued, and decoded frames come back from next_decoded() in submission order. This keeps
+//  hardware decoders busy while we capture the next frame and use the last one.
+class AsyncFrameDecoder {
+public:
+    virtual ~AsyncFrameDecoder() {}
+
+    // Queue a compressed frame. Blocks while max_in_flight() frames are in flight (submitted,
+    //  but not yet returned by next_decoded). The lease (or vector) is kept until the decoder
+    //  has read the frame, so a camera needs max_in_flight() + 2 buffers to keep capturing.
+    void submit(FrameLease&& frame);
+    void submit(std::vector<uint8_t>&& frame, uint32_t sequence = 0, int64_t timestamp_us = 0);
+    // The caller keeps the memory valid until the frame comes back from next_decoded
+    void submit(const FrameView& frame);
+
+    // The oldest decoded frame. Returns false if nothing completed within timeout_ms (-1 waits
+    //  forever). Throws if the decoder failed. Whatever image held is released first, so one
+    //  image can be reused across calls.
+    virtual bool next_decoded(DecodedImage& image, int timeout_ms = -1) = 0;
+
+    virtual int in_flight() = 0;
+    virtual int max_in_flight() const = 0;
+    // Frames that were submitted, but the decoder never returned (corrupt, usually)
+    virtual uint64_t dropped_frames() = 0;
+
+protected:
+    friend class DecodedImage;
+
+    struct PendingInput {
+        FrameLease lease;               // Either a leased capture buffer...
+        std::vector<uint8_t> owned;     // ...or bytes we own, or neither (the caller keeps the view valid)
+        FrameView view;
+    };
+    virtual void submit_input(PendingInput&& input) = 0;
+    virtual void release_output(void* token) = 0;
+};
+
+DecodedImage& DecodedImage::operator=(DecodedImage&& other) noexcept {
+    if (this != &other) {
+        release();
+        memcpy(planes, other.planes, sizeof(planes));
+        memcpy(strides, other.strides, sizeof(strides));
+        width = other.width;
+        height = other.height;
+        sequence = other.sequence;
+        timestamp_us = other.timestamp_us;
+        owner = other.owner;
+        token = other.token;
+        other.owner = nullptr;
+        other.token = nullptr;
+    }
+    return *this;
+}
+
+void DecodedImage::release() {
+    if (owner && token) {
+        owner->release_output(token);
+    }
+    owner = nullptr;
+    token = nullptr;
+}
+
+void DecodedImage::copy_to(FrameBuffer& frame) const {
+    if (frame.width != width || frame.height != height) {
+        throw std::runtime_error("Frame buffer size does not match the decoded image");
+    }
+    uint8_t* destination[3] = {frame.y(), frame.u(), frame.v()};
+    for (int p = 0; p < 3; p++) {
+        int plane_width = p ? width / 2 : width;
+        int plane_height = p ? height / 2 : height;
+        for (int row = 0; row < plane_height; row++) {
+            memcpy(destination[p] + (size_t)row * plane_width, planes[p] + (size_t)row * strides[p], plane_width);
+        }
+    }
+    frame.sequence = sequence;
+    frame.timestamp_us = timestamp_us;
+}
+
+void AsyncFrameDecoder::submit(FrameLease&& frame) {
+    PendingInput input;
+    input.view = frame.view();
+    input.lease = std::move(frame);
+    submit_input(std::move(input));
+}
+
+void AsyncFrameDecoder::submit(std::vector<uint8_t>&& frame, uint32_t sequence, int64_t timestamp_us) {
+    PendingInput input;
+    input.owned = std::move(frame);
+    input.view = FrameView(input.owned);
+    input.view.sequence = sequence;
+    input.view.timestamp_us = timestamp_us;
+    submit_input(std::move(input));
+}
+
+void AsyncFrameDecoder::submit(const FrameView& frame) {
+    PendingInput input;
+    input.view = frame;
+    submit_input(std::move(input));
+}
+
+// Decodes with libjpeg (or any FrameConverter) on one background thread, behaving like a
+//  hardware decoder (bounded in-flight frames, a fixed set of output buffers, optional extra
+//  latency). Lets us run the pipelining code, and anything built on AsyncFrameDecoder, on
+//  machines without MMAL, and pipelines backends that have no asynchronous API of their own.
+class CPUAsyncDecoder : public AsyncFrameDecoder {
+public:
+    // output_buffers <= 0 uses max_in_flight + 2. latency_ms is added to every frame.
+    //  converter defaults to MJPEGtoI420Converter, and is only used on the worker thread.
+    CPUAsyncDecoder(int width, int height, int max_in_flight = 3, int output_buffers = 0, int latency_ms = 0,
+                    std::unique_ptr<FrameConverter> converter = nullptr);
+    ~CPUAsyncDecoder();
+
+    bool next_decoded(DecodedImage& image, int timeout_ms = -1) override;
+    int in_flight() override;
+    int max_in_flight() const override { return in_flight_limit; }
+    uint64_t dropped_frames() override;
+
+protected:
+    void submit_input(PendingInput&& input) override;
+    void release_output(void* token) override;
+
+private:
+    int width;
+    int height;
+    int in_flight_limit;
+    int latency_ms;
+    std::unique_ptr<FrameConverter> converter;
+    FramePool output_pool;
+
+    std::mutex mutex;
+    std::condition_variable input_cv;    // Worker waits for input
+    std::condition_variable output_cv;   // next_decoded waits for output
+    std::condition_variable space_cv;    // submit waits for in-flight to drop
+    RingQueue<PendingInput> inputs;
+    RingQueue<FrameRef> outputs;         // Decoded (or failed, empty) frames in order
+    std::vector<FrameRef> lent;          // Frames held by DecodedImages, the token points at the slot
+    int submitted_in_flight;
+    uint64_t dropped;
+    bool stopping;
+    std::thread worker;
+
+    void worker_loop();
+};
+
+CPUAsyncDecoder::CPUAsyncDecoder(int width, int height, int max_in_flight, int output_buffers, int latency_ms,
+                                 std::unique_ptr<FrameConverter> converter)
+    : width(width), height(height), in_flight_limit(std::max(1, max_in_flight)), latency_ms(latency_ms),
+      converter(converter ? std::move(converter) : std::unique_ptr<FrameConverter>(new MJPEGtoI420Converter())),
+      output_pool(width, height, output_buffers > 0 ? output_buffers : in_flight_limit + 2),
+      inputs(in_flight_limit), outputs(in_flight_limit), lent(output_pool.frame_count()),
+      submitted_in_flight(0), dropped(0), stopping(false) {
+    worker = std::thread(&CPUAsyncDecoder::worker_loop, this);
+}
+
+CPUAsyncDecoder::~CPUAsyncDecoder() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    input_cv.notify_all();
+    space_cv.notify_all();
+    worker.join();
+}
+
+void CPUAsyncDecoder::submit_input(PendingInput&& input) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        space_cv.wait(lock, [this]() { return stopping || submitted_in_flight < in_flight_limit; });
+        if (stopping) {
+            throw std::runtime_error("Decoder is shutting down");
+        }
+        submitted_in_flight++;
+        inputs.push_back(std::move(input));
+    }
+    input_cv.notify_one();
+}
+
+bool CPUAsyncDecoder::next_decoded(DecodedImage& image, int timeout_ms) {
+    // Not under mutex, which release_output takes
+    image.release();
+    while (true) {
+        FrameRef frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto ready = [this]() { return !outputs.empty(); };
+            if (timeout_ms < 0) {
+                output_cv.wait(lock, ready);
+            } else if (!output_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready)) {
+                return false;
+            }
+            frame = std::move(outputs.front());
+            outputs.pop_front();
+            submitted_in_flight--;
+            if (!frame) {
+                // Failed to decode, like a hardware decoder we just never return it
+                dropped++;
+                space_cv.notify_one();
+                continue;
+            }
+
+            int slot = 0;
+            while (lent[slot]) slot++;
+            lent[slot] = std::move(frame);
+            FrameBuffer& buffer = *lent[slot];
+            image = DecodedImage(this, &lent[slot]);
+            image.planes[0] = buffer.y();
+            image.planes[1] = buffer.u();
+            image.planes[2] = buffer.v();
+            image.strides[0] = width;
+            image.strides[1] = width / 2;
+            image.strides[2] = width / 2;
+            image.width = width;
+            image.height = height;
+            image.sequence = buffer.sequence;
+            image.timestamp_us = buffer.timestamp_us;
+        }
+        space_cv.notify_one();
+        return true;
+    }
+}
+
+void CPUAsyncDecoder::release_output(void* token) {
+    FrameRef frame;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        frame = std::move(*(FrameRef*)token);
+    }
+}
+
+int CPUAsyncDecoder::in_flight() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return submitted_in_flight;
+}
+
+uint64_t CPUAsyncDecoder::dropped_frames() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped;
+}
+
+void CPUAsyncDecoder::worker_loop() {
+    while (true) {
+        PendingInput input;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            input_cv.wait(lock, [this]() { return stopping || !inputs.empty(); });
+            if (stopping) return;
+            input = std::move(inputs.front());
+            inputs.pop_front();
+        }
+
+        // Waits if the consumer is holding every output buffer, like the hardware would, but
+        //  not through the destructor
+        FrameRef frame;
+        while (!output_pool.try_acquire(frame, 100)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+        }
+        try {
+            converter->convert_frame_into(input.view, *frame);
+        } catch (const std::exception& ex) {
+            std::cerr << "CPUAsyncDecoder: " << ex.what() << std::endl;
+            frame.reset();
+        }
+        input.lease.release();
+        if (latency_ms > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            outputs.push_back(std::move(frame));
+        }
+        output_cv.notify_one();
+    }
+}
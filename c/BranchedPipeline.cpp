@@ -0,0 +1,201 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#include "AsyncDecoder.cpp"
+#include "FrameBuffer.cpp"
+#include "FrameScaler.cpp"
+#include "CameraPipeline.cpp"
+
+// One output of a camera: its size and frame rate, and where (and how) it is written
+struct OutputBranchOptions {
+    // 0 keeps the camera's size. Otherwise it is downscaled (never up), so keep the aspect ratio.
+    int width = 0;
+    int height = 0;
+    // 0 keeps every frame. Otherwise frames are dropped to get under this rate (by their timestamps).
+    int fps = 0;
+    CameraPipelineOptions pipeline;
+};
+
+// Parses --branch's "WIDTHxHEIGHT@FPS,folder[,encoder]" (e.g. 1920x1080@15,/media/video/output/).
+//  "full" keeps the camera's size, and the frame rate is optional. The branch is named after
+//  its WIDTHxHEIGHT@FPS, for log lines.
+OutputBranchOptions parse_output_branch(const std::string& spec, const CameraPipelineOptions& defaults) {
+    OutputBranchOptions branch;
+    branch.pipeline = defaults;
+    size_t comma = spec.find(',');
+    if (comma == std::string::npos) {
+        throw std::runtime_error("Branch " + spec + " has no output folder, expected WIDTHxHEIGHT@FPS,folder[,encoder]");
+    }
+    std::string format = spec.substr(0, comma);
+    branch.pipeline.name = format;
+    std::string rest = spec.substr(comma + 1);
+    comma = rest.find(',');
+    branch.pipeline.output_folder = rest.substr(0, comma);
+    if (comma != std::string::npos) branch.pipeline.encoder_config = rest.substr(comma + 1);
+
+    size_t at = format.find('@');
+    std::string size = format.substr(0, at);
+    if (at != std::string::npos) branch.fps = atoi(format.c_str() + at + 1);
+    if (size != "full") {
+        size_t x = size.find('x');
+        if (x == std::string::npos) {
+            throw std::runtime_error("Branch " + spec + " has no size, expected WIDTHxHEIGHT or full");
+        }
+        branch.width = atoi(size.c_str());
+        branch.height = atoi(size.c_str() + x + 1);
+    }
+    return branch;
+}
+
+// Keeps frames at no more than fps, by the gaps between their timestamps
+class FrameRateDecimator {
+public:
+    FrameRateDecimator(int fps) : interval_us(fps > 0 ? 1000000 / fps : 0), started(false), next_us(0) {}
+
+    bool take(int64_t timestamp_us) {
+        if (interval_us == 0) return true;
+        // Frames come a little early or late, so anything in the last quarter interval counts
+        if (started && timestamp_us < next_us - interval_us / 4) return false;
+        // Steady, unless we fell more than an interval behind (a gap in frames)
+        next_us = !started || timestamp_us - next_us > interval_us ? timestamp_us + interval_us : next_us + interval_us;
+        started = true;
+        return true;
+    }
+
+private:
+    int64_t interval_us;
+    bool started;
+    int64_t next_us;    // When the next frame is due
+};
+
+// Fans one camera's decoded frames out to several outputs, each with its own frame rate, size,
+//  encoder and output folder (spec.md: 4K@1fps and 1080p@15fps from one 4K camera), so one
+//  capture and decode feeds all of them. Each branch is a CameraPipeline (so it has its own
+//  activity, segments and previews).
+// Frames are copied out of the decoder once, into a pooled frame that full size branches share
+//  (by reference, see CameraPipeline::add_frame(FrameRef)), and downscaled branches scale from.
+//  If only downscaled branches take a frame, they read the decoder's planes instead, so it
+//  isn't copied at all. add_frame is called by one thread, in capture order.
+class BranchedPipeline {
+public:
+    BranchedPipeline(int width, int height, int fps, const std::vector<OutputBranchOptions>& branches);
+    BranchedPipeline(const BranchedPipeline&) = delete;
+    BranchedPipeline& operator=(const BranchedPipeline&) = delete;
+
+    // Releases the image as soon as every branch has read it
+    void add_frame(DecodedImage& image);
+    void add_frame(const FrameBuffer& frame);
+
+private:
+    struct Branch {
+        OutputBranchOptions options;
+        FrameRateDecimator decimator;
+        std::unique_ptr<FrameScaler> scaler;    // Null at full size
+        std::unique_ptr<FramePool> scaled_pool;
+        std::unique_ptr<CameraPipeline> pipeline;
+        bool take = false;                      // For the frame being added
+
+        Branch(const OutputBranchOptions& options) : options(options), decimator(options.fps) {}
+    };
+
+    int width;
+    int height;
+    std::vector<std::unique_ptr<Branch>> branches;
+    std::unique_ptr<FramePool> source_pool;     // Only if a branch is full size
+
+    template <class Image> void add(Image& image, const uint8_t* const planes[3], const int strides[3]);
+    static void copy_image(const DecodedImage& image, FrameBuffer& frame) { image.copy_to(frame); }
+    static void copy_image(const FrameBuffer& source, FrameBuffer& frame) { copy_frame_buffer(source, frame); }
+    static void release_image(DecodedImage& image) { image.release(); }
+    static void release_image(const FrameBuffer&) {}
+};
+
+BranchedPipeline::BranchedPipeline(int width, int height, int fps, const std::vector<OutputBranchOptions>& options)
+    : width(width), height(height) {
+    if (options.empty()) {
+        throw std::runtime_error("BranchedPipeline: no branches");
+    }
+    bool full_size = false;
+    for (auto& branch_options : options) {
+        std::unique_ptr<Branch> branch(new Branch(branch_options));
+        int branch_width = branch_options.width > 0 ? branch_options.width : width;
+        int branch_height = branch_options.height > 0 ? branch_options.height : height;
+        int branch_fps = branch_options.fps > 0 ? std::min(branch_options.fps, fps) : fps;
+        if (branch_width != width || branch_height != height) {
+            branch->scaler.reset(new FrameScaler(width, height, branch_width, branch_height));
+            // One being scaled into, one spare. The pipeline copies what it keeps, or encodes it
+            //  before returning.
+            branch->scaled_pool.reset(new FramePool(branch_width, branch_height, 2));
+        } else {
+            full_size = true;
+        }
+        std::cout << "Branch " << branch_width << "x" << branch_height << "@" << branch_fps << " to "
+                  << (branch_options.pipeline.output_folder.empty() ? "nowhere" : branch_options.pipeline.output_folder) << std::endl;
+        branch->pipeline.reset(new CameraPipeline(branch_width, branch_height, branch_fps, branch_options.pipeline));
+        branches.push_back(std::move(branch));
+    }
+    // Scaled branches read the frame before a full size one draws its timestamp into it
+    std::stable_partition(branches.begin(), branches.end(), [](const std::unique_ptr<Branch>& branch) { return branch->scaler != nullptr; });
+    if (full_size) source_pool.reset(new FramePool(width, height, 2));
+}
+
+void BranchedPipeline::add_frame(DecodedImage& image) {
+    add(image, image.planes, image.strides);
+}
+
+void BranchedPipeline::add_frame(const FrameBuffer& frame) {
+    const uint8_t* planes[3] = {frame.y(), frame.u(), frame.v()};
+    int strides[3] = {width, width / 2, width / 2};
+    add(frame, planes, strides);
+}
+
+template <class Image>
+void BranchedPipeline::add(Image& image, const uint8_t* const planes[3], const int strides[3]) {
+    if (image.width != width || image.height != height) {
+        throw std::runtime_error("BranchedPipeline: frame is " + std::to_string(image.width) + "x" + std::to_string(image.height)
+            + ", expected " + std::to_string(width) + "x" + std::to_string(height));
+    }
+    int full_size_takers = 0;
+    for (auto& branch : branches) {
+        branch->take = branch->decimator.take(image.timestamp_us);
+        if (branch->take && !branch->scaler) full_size_takers++;
+    }
+    // Full size branches share one copy, and then the decoder's buffer can go back
+    FrameRef source;
+    if (full_size_takers > 0) {
+        source = source_pool->acquire();
+        copy_image(image, *source);
+        release_image(image);
+    }
+
+    for (auto& branch : branches) {
+        if (!branch->take) continue;
+        if (branch->scaler) {
+            FrameRef scaled = branch->scaled_pool->acquire();
+            if (source) {
+                branch->scaler->scale(*source, *scaled);
+            } else {
+                branch->scaler->scale(planes, strides, *scaled);
+                scaled->sequence = image.sequence;
+                scaled->timestamp_us = image.timestamp_us;
+            }
+            branch->pipeline->add_frame(std::move(scaled));
+            continue;
+        }
+        // The last one gets the only reference, so it can draw into it
+        if (--full_size_takers == 0) {
+            branch->pipeline->add_frame(std::move(source));
+        } else {
+            branch->pipeline->add_frame(source);
+        }
+    }
+    release_image(image);
+}
@@ -1,6 +1,18 @@
+#pragma once
 #include <iostream>
 #include <vector>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <stdexcept>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <linux/videodev2.h>
@@ -8,37 +20,269 @@
 #include <cstring>
 #include <cstdlib>
 #include <sys/mman.h>
+#include <linux/dma-heap.h>
+
+#include "FrameView.cpp"
+#include "RingQueue.cpp"
+
+class FrameSource;
+
+// How frames get from the driver to the consumer
+enum class CapturePolicy {
+    // No capture thread. acquire_frame() dequeues on the caller's thread, so a slow consumer delays DQBUF.
+    Block,
+    // A capture thread keeps only the newest frame. Stale frames go straight back to the driver.
+    LatestFrame,
+    // A capture thread queues up to queue_limit frames in order. When full it stops dequeuing
+    //  (backpressure), so any loss happens in the driver, and shows up as a sequence gap.
+    BoundedQueue,
+};
+
+// Where the capture buffers live
+enum class CaptureMemory {
+    // Driver allocated, mmap'd into our process (V4L2_MEMORY_MMAP)
+    Mmap,
+    // As Mmap, but each buffer is also exported as a dmabuf fd (VIDIOC_EXPBUF), so other
+    //  devices, or other processes (see DmabufShare.cpp), can read frames without a copy
+    MmapExportDmabuf,
+    // We allocate page aligned memory, the driver writes into it (V4L2_MEMORY_USERPTR)
+    Userptr,
+    // The driver writes into dmabufs we give it (V4L2_MEMORY_DMABUF). Uses
+    //  USBCameraOptions::dmabuf_fds if set (e.g. buffers owned by the next stage),
+    //  otherwise allocates them from /dev/dma_heap/system.
+    Dmabuf,
+};
+
+struct USBCameraOptions {
+    int buffer_count = 4;  // The driver may adjust this, see USBCamera::buffer_total()
+    CaptureMemory memory = CaptureMemory::Mmap;
+    std::vector<int> dmabuf_fds;  // CaptureMemory::Dmabuf only, one per buffer, not owned
+
+    // With a capture thread, if the device fails (unplugged, or a USB glitch, which shows up as
+    //  ENODEV or EIO) or no frame comes for stall_frame_intervals frames, it is closed, and
+    //  reopened once it is back. Consumers just wait longer for the next frame. Otherwise the
+    //  failure is rethrown by acquire_frame.
+    bool reconnect = true;
+    int stall_frame_intervals = 15;
+    // Finds the device again, as it may come back as another node (see find_camera). Called
+    //  when reopening, the default reuses the original path.
+    std::function<std::string()> find_device;
+};
 
-class USBCamera {
+struct CaptureStats {
+    uint64_t captured = 0;        // Frames dequeued from the driver
+    uint64_t delivered = 0;       // Frames handed to the consumer
+    uint64_t dropped_stale = 0;   // Frames we dequeued, but replaced before the consumer took them
+    uint64_t dropped_driver = 0;  // Frames the driver skipped (gaps in the v4l2 sequence number)
+    int queue_depth = 0;          // Frames waiting for the consumer right now
+    int max_queue_depth = 0;
+    uint64_t reconnects = 0;      // Times the device was lost and reopened
+    double disconnected_ms = 0;   // Total time without a device, from losing it to streaming again
+};
+
+// Owns one dequeued V4L2 buffer (or, from a ReplaySource, one recorded frame). The frame data
+//  is read directly out of the mmap'd buffer (no copy), and the buffer is only given back to
+//  the driver (VIDIOC_QBUF) when the lease is released or destroyed. Move-only. Must not
+//  outlive the FrameSource it came from.
+class FrameLease {
 public:
-    USBCamera(const std::string& device, int width, int height, int fps, int pixel_format);
+    FrameLease() : source(nullptr), index(-1) {}
+    FrameLease(FrameLease&& other) noexcept;
+    FrameLease& operator=(FrameLease&& other) noexcept;
+    FrameLease(const FrameLease&) = delete;
+    FrameLease& operator=(const FrameLease&) = delete;
+    ~FrameLease() { release(); }
+
+    const FrameView& view() const { return frame; }
+    const uint8_t* data() const { return frame.data; }
+    size_t size() const { return frame.size; }
+    uint32_t sequence() const { return frame.sequence; }
+    int64_t timestamp_us() const { return frame.timestamp_us; }
+    int dmabuf_fd() const { return frame.dmabuf_fd; }  // -1 unless the camera uses MmapExportDmabuf or Dmabuf
+    int buffer_index() const { return index; }
+    explicit operator bool() const { return source != nullptr; }
+
+    // Re-queue the buffer early. Safe to call more than once.
+    void release();
+
+private:
+    friend class FrameSource;
+    FrameLease(FrameSource* source, int index, const FrameView& frame) : source(source), index(index), frame(frame) {}
+
+    FrameSource* source;
+    int index;
+    FrameView frame;
+};
+
+// Where frames come from: a camera (USBCamera), or a recording played back as one
+//  (ReplaySource.cpp), so the pipeline can be run and load tested without a camera
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    // Start capturing frames. Any policy other than Block starts a capture thread.
+    virtual void start(CapturePolicy policy = CapturePolicy::Block, int queue_limit = 2) = 0;
+    // Stop the capture thread (if any), wakes up anyone waiting in acquire_frame
+    virtual void stop() = 0;
+    // Get the next frame without copying it. With CapturePolicy::Block this throws if every
+    //  buffer the driver could write into is already leased out, as blocking would starve the
+    //  driver (and deadlock if the caller is the one holding the leases). With a capture
+    //  thread it waits for the thread to deliver a frame.
+    virtual FrameLease acquire_frame() = 0;
+    // Capture thread only. Returns false if no frame arrived within timeout_ms.
+    virtual bool try_acquire_frame(FrameLease& frame, int timeout_ms) = 0;
+
+    // Without a capture thread, recovery is up to the caller (CaptureManager.cpp). Closes the
+    //  device, and tries once to open it again, streaming if it was before. Returns false,
+    //  leaving it closed, if it isn't back yet. Requires no outstanding leases.
+    virtual bool reopen() = 0;
+
+    virtual CaptureStats stats() = 0;
+
+    virtual int outstanding_frames() const = 0;
+    // We always leave at least one buffer with the driver, otherwise it has nowhere to capture into
+    virtual int max_outstanding_frames() const = 0;
+    // The device node, or the recording's path
+    virtual const std::string& source_path() const = 0;
+    // Whether frames come at their own pace. A recording played as fast as possible doesn't,
+    //  so is only read when the consumer is ready for another frame.
+    virtual bool realtime() const { return true; }
+
+    // For polling ourselves (CaptureManager.cpp) instead of using a capture thread. Readable
+    //  when acquire_frame() won't block.
+    virtual int poll_fd() const = 0;
+    // An eventfd written to whenever a lease is released, so whoever polls poll_fd knows
+    //  when it can acquire again. Not owned. Set before leasing any frames.
+    virtual void set_release_fd(int event_fd) = 0;
+
+protected:
+    friend class FrameLease;
+    virtual void release_buffer(int index) = 0;
+    FrameLease make_lease(int index, const FrameView& frame) { return FrameLease(this, index, frame); }
+};
+
+class USBCamera : public FrameSource {
+public:
+    USBCamera(const std::string& device, int width, int height, int fps, int pixel_format, const USBCameraOptions& options = USBCameraOptions());
     ~USBCamera();
 
-    void start();  // Start capturing frames
-    std::vector<uint8_t> get_frame();  // Retrieve the latest frame
+    void start(CapturePolicy policy = CapturePolicy::Block, int queue_limit = 2) override;
+    void stop() override;
+    std::vector<uint8_t> get_frame();  // Retrieve the latest frame (copied, prefer acquire_frame)
+    FrameLease acquire_frame() override;
+    bool try_acquire_frame(FrameLease& frame, int timeout_ms) override;
+
+    // Finds the device with USBCameraOptions::find_device
+    bool reopen() override;
+    bool is_open() const { return fd != -1; }
+
+    CaptureStats stats() override;
+
+    int outstanding_frames() const override { return outstanding; }
+    int max_outstanding_frames() const override { return buffer_count - 1; }
+    int buffer_total() const { return buffer_count; }
+    CaptureMemory memory_mode() const { return options.memory; }
+    const std::string& source_path() const override { return device; }
+    const std::string& device_path() const { return device; }
+
+    int poll_fd() const override { return fd; }
+    int device_fd() const { return fd; }
+    void set_release_fd(int event_fd) override { release_fd = event_fd; }
+
+protected:
+    void release_buffer(int index) override;  // Called by FrameLease
 
 private:
+
     std::string device;    // Path to the video device (e.g., /dev/video0)
     int width;             // Frame width
     int height;            // Frame height
     int fps;               // Frames per second
     int fd;                // File descriptor for the camera device
     void** buffer_start;   // Array of pointers for the memory-mapped buffers
+    std::vector<size_t> buffer_length;  // Mapped length of each buffer (needed for munmap)
+    std::vector<bool> buffer_leased;    // Buffers currently held by a FrameLease
     int buffer_count;      // Number of requested buffers
     int pixel_format;
+    USBCameraOptions options;
+    std::vector<int> dmabuf_fds;        // Exported or imported dmabuf per buffer (-1 if none)
+    std::vector<bool> dmabuf_owned;     // Whether we close the fd, or the caller does
+
+    std::atomic<int> outstanding;  // Number of live leases
+    std::mutex buffer_mutex;       // Leases can be released from any thread
+
+    // Capture thread state, all guarded by queue_mutex
+    CapturePolicy policy;
+    int queue_limit;
+    std::thread capture_thread;
+    bool capturing;
+    std::string capture_error;     // Set if the capture thread died, rethrown by acquire_frame
+    RingQueue<FrameLease> ready_frames;
+    RingQueue<FrameLease> stale_frames;  // Capture thread only, swapped with ready_frames to drop them outside the lock
+    CaptureStats capture_stats;
+    int64_t last_sequence;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    int wake_fd;                   // eventfd, used to interrupt poll() on stop
+    int release_fd;                // See set_release_fd, -1 if none
+    bool streaming;                // Whether start() turned the stream on
 
     void init_device();   // Initialize the V4L2 device
     void close_device();  // Close the device
+    void init_buffers(size_t image_size);
+    void fill_buffer(struct v4l2_buffer& buf, int index);  // Set up buf for QBUF/DQBUF in our memory mode
+    FrameLease dequeue_frame();      // VIDIOC_DQBUF into a lease, no capacity check
+    void capture_loop();
+    // Capture thread only. Waits for the device to come back, false if stopped first.
+    bool recover(const std::string& reason);
+    bool try_reopen(std::string& error);
+    void stream_on();
+    bool has_capacity();  // Can the capture thread dequeue without starving the driver?
+    bool pop_frame(FrameLease& frame);  // Requires queue_mutex
 };
 
+FrameLease::FrameLease(FrameLease&& other) noexcept
+    : source(other.source), index(other.index), frame(other.frame) {
+    other.source = nullptr;
+    other.index = -1;
+}
+
+FrameLease& FrameLease::operator=(FrameLease&& other) noexcept {
+    if (this != &other) {
+        release();
+        source = other.source;
+        index = other.index;
+        frame = other.frame;
+        other.source = nullptr;
+        other.index = -1;
+    }
+    return *this;
+}
+
+void FrameLease::release() {
+    if (!source) return;
+    FrameSource* owner = source;
+    source = nullptr;
+    frame = FrameView();
+    owner->release_buffer(index);
+}
+
 // Constructor
-USBCamera::USBCamera(const std::string& device, int width, int height, int fps, int pixel_format)
-    : device(device), width(width), height(height), fps(fps), pixel_format(pixel_format), fd(-1), buffer_start(nullptr), buffer_count(0) {
-    init_device();
+USBCamera::USBCamera(const std::string& device, int width, int height, int fps, int pixel_format, const USBCameraOptions& options)
+    : device(device), width(width), height(height), fps(fps), fd(-1), buffer_start(nullptr), buffer_count(0), pixel_format(pixel_format), options(options), outstanding(0),
+      policy(CapturePolicy::Block), queue_limit(1), capturing(false), last_sequence(-1), wake_fd(-1), release_fd(-1), streaming(false) {
+    // The destructor won't run, so close whatever init_device got to (the fd, mapped or exported buffers)
+    try {
+        init_device();
+    } catch (...) {
+        close_device();
+        throw;
+    }
 }
 
 // Destructor
 USBCamera::~USBCamera() {
+    stop();
     close_device();
 }
 
@@ -118,38 +362,381 @@ void print_available_formats(int fd) {
 }
 
 // Start capturing frames
-void USBCamera::start() {
-    // No need for a capture thread; just set the device to streaming mode.
+void USBCamera::start(CapturePolicy policy, int queue_limit) {
+    stream_on();
+    // print_available_formats(fd);
+    // check_device_capabilities(fd);
+
+    this->policy = policy;
+    capture_error.clear();
+    last_sequence = -1;
+    this->queue_limit = policy == CapturePolicy::LatestFrame ? 1 : std::max(1, std::min(queue_limit, max_outstanding_frames()));
+    if (policy == CapturePolicy::Block) return;
+
+    // Allocated here, so capturing doesn't allocate per frame
+    ready_frames.reset(std::max(1, max_outstanding_frames()));
+    stale_frames.reset(std::max(1, max_outstanding_frames()));
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        throw std::runtime_error("Failed to create eventfd: " + std::string(strerror(errno)));
+    }
+    capturing = true;
+    capture_thread = std::thread(&USBCamera::capture_loop, this);
+}
+
+void USBCamera::stream_on() {
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if (ioctl(fd, VIDIOC_STREAMON, &type) == -1) {
         throw std::runtime_error("Failed to start video capture: " + std::string(strerror(errno)));
     }
-    // print_available_formats(fd);
-    // check_device_capabilities(fd);
+    streaming = true;
+}
+
+// Stop the capture thread, and give any frames nobody took back to the driver
+void USBCamera::stop() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        capturing = false;
+    }
+    queue_cv.notify_all();
+    if (wake_fd != -1) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {
+            std::cerr << "Failed to wake capture thread: " << strerror(errno) << std::endl;
+        }
+    }
+    if (capture_thread.joinable()) {
+        capture_thread.join();
+    }
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+
+    RingQueue<FrameLease> unclaimed;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        unclaimed.swap(ready_frames);
+        capture_stats.queue_depth = 0;
+    }
+    // Released outside queue_mutex, as release_buffer takes it
+    unclaimed.clear();
+}
+
+CaptureStats USBCamera::stats() {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return capture_stats;
+}
+
+bool USBCamera::has_capacity() {
+    return outstanding < max_outstanding_frames();
+}
+
+// Background thread, waits on poll() and moves frames from the driver into ready_frames
+void USBCamera::capture_loop() {
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fd;
+    fds[1].events = POLLIN;
+
+    // Frames should come every 1000 / fps ms, but give the camera a moment to get going
+    int stall_ms = std::max(1000, options.stall_frame_intervals * 1000 / std::max(1, fps));
+    auto last_frame_time = std::chrono::steady_clock::now();
+    // Stops capturing (rethrown by acquire_frame), or reconnects
+    auto lost_device = [&](const std::string& reason) {
+        if (!options.reconnect) {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            capture_error = reason;
+            return false;
+        }
+        if (!recover(reason)) return false;
+        fds[0].fd = fd;
+        last_frame_time = std::chrono::steady_clock::now();
+        return true;
+    };
+
+    while (true) {
+        // Stale frames we are replacing. Destroyed outside queue_mutex, as that requeues them.
+        RingQueue<FrameLease>& stale = stale_frames;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            // Wait until we can dequeue without starving the driver. For BoundedQueue this is
+            //  the backpressure, for LatestFrame we can always make room by dropping the stale frame.
+            auto can_dequeue = [this]() {
+                if (!capturing) return true;
+                if (policy == CapturePolicy::LatestFrame) return has_capacity() || !ready_frames.empty();
+                return has_capacity() && (int)ready_frames.size() < queue_limit;
+            };
+            if (!can_dequeue()) {
+                queue_cv.wait(lock, can_dequeue);
+                // The driver had nowhere to capture into, that isn't a stall
+                last_frame_time = std::chrono::steady_clock::now();
+            }
+            if (!capturing) break;
+            if (!has_capacity()) {
+                stale.swap(ready_frames);
+                capture_stats.dropped_stale += stale.size();
+                capture_stats.queue_depth = 0;
+            }
+        }
+        if (!stale.empty()) {
+            stale.clear();
+            continue;
+        }
+
+        int result = poll(fds, 2, 1000);
+        if (result == -1) {
+            if (errno == EINTR) continue;
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            capture_error = "Failed to poll video device: " + std::string(strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) break;
+        if (result == 0 || !(fds[0].revents & (POLLIN | POLLERR | POLLHUP))) {
+            double waited_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - last_frame_time).count();
+            if (waited_ms < stall_ms) continue;
+            if (!lost_device("No frame from " + device + " in " + std::to_string((int)waited_ms) + "ms")) break;
+            continue;
+        }
+
+        FrameLease frame;
+        try {
+            frame = dequeue_frame();
+        } catch (const std::exception& ex) {
+            if (!lost_device(ex.what())) break;
+            continue;
+        }
+        last_frame_time = std::chrono::steady_clock::now();
+
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            capture_stats.captured++;
+            if (last_sequence >= 0 && frame.sequence() > last_sequence + 1) {
+                capture_stats.dropped_driver += frame.sequence() - last_sequence - 1;
+            }
+            last_sequence = frame.sequence();
+
+            if (policy == CapturePolicy::LatestFrame) {
+                capture_stats.dropped_stale += ready_frames.size();
+                stale.swap(ready_frames);
+            }
+            ready_frames.push_back(std::move(frame));
+            capture_stats.queue_depth = ready_frames.size();
+            capture_stats.max_queue_depth = std::max(capture_stats.max_queue_depth, capture_stats.queue_depth);
+        }
+        queue_cv.notify_all();
+        stale.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        capturing = false;
+    }
+    queue_cv.notify_all();
+}
+
+// Closes the device and waits for it to come back (watching /dev, as it may be replugged), with
+//  the capture thread still running, so consumers just see a gap in frames
+bool USBCamera::recover(const std::string& reason) {
+    std::cerr << "Lost " << device << " (" << reason << "), reconnecting" << std::endl;
+    auto lost_time = std::chrono::steady_clock::now();
+
+    // Frames nobody took are from before the gap, and leases must be back before we unmap them
+    RingQueue<FrameLease> unclaimed;
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        unclaimed.swap(ready_frames);
+        capture_stats.queue_depth = 0;
+    }
+    unclaimed.clear();
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_cv.wait(lock, [this]() { return !capturing || outstanding == 0; });
+        if (!capturing) return false;
+    }
+
+    int watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd != -1 && inotify_add_watch(watch_fd, "/dev", IN_CREATE | IN_ATTRIB) == -1) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+    std::string error;
+    std::string last_error;
+    while (!try_reopen(error)) {
+        if (error != last_error) {
+            std::cerr << "Waiting for " << device << " to come back: " << error << std::endl;
+            last_error = error;
+        }
+        // udev creates the node, then fixes its permissions, so either can mean it's back. We
+        //  retry each second anyway, in case inotify isn't available, or we missed it.
+        struct pollfd fds[2];
+        fds[0].fd = wake_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = watch_fd;
+        fds[1].events = POLLIN;
+        poll(fds, watch_fd == -1 ? 1 : 2, 1000);
+        if (fds[0].revents & POLLIN) break;
+        if (watch_fd != -1 && (fds[1].revents & POLLIN)) {
+            char events[4096];
+            while (read(watch_fd, events, sizeof(events)) > 0) {}
+        }
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (!capturing) break;
+    }
+    if (watch_fd != -1) close(watch_fd);
+    if (fd == -1) return false;
+
+    double lost_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lost_time).count();
+    std::cerr << "Reconnected " << device << " after " << (int)lost_ms << "ms" << std::endl;
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    // The driver's sequence numbers restart
+    last_sequence = -1;
+    capture_stats.reconnects++;
+    capture_stats.disconnected_ms += lost_ms;
+    // The driver may give us a different number of buffers
+    ready_frames.reset(std::max(1, max_outstanding_frames()));
+    stale_frames.reset(std::max(1, max_outstanding_frames()));
+    return capturing;
+}
+
+bool USBCamera::try_reopen(std::string& error) {
+    bool was_streaming = streaming;
+    close_device();
+    streaming = false;
+    try {
+        if (options.find_device) device = options.find_device();
+        init_device();
+        if (was_streaming) stream_on();
+        return true;
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        close_device();
+        // So the next attempt streams too
+        streaming = was_streaming;
+        return false;
+    }
+}
+
+bool USBCamera::reopen() {
+    if (outstanding > 0) {
+        throw std::runtime_error("Can't reopen " + device + " with " + std::to_string(outstanding) + " frame leases outstanding");
+    }
+    std::string error;
+    if (try_reopen(error)) {
+        last_sequence = -1;
+        return true;
+    }
+    return false;
+}
+
+// Takes the oldest ready frame. Requires queue_mutex to be held.
+bool USBCamera::pop_frame(FrameLease& frame) {
+    if (ready_frames.empty()) {
+        if (!capture_error.empty()) throw std::runtime_error(capture_error);
+        if (!capturing) throw std::runtime_error("Capture is not running on " + device);
+        return false;
+    }
+    frame = std::move(ready_frames.front());
+    ready_frames.pop_front();
+    capture_stats.delivered++;
+    capture_stats.queue_depth = ready_frames.size();
+    return true;
+}
+
+bool USBCamera::try_acquire_frame(FrameLease& frame, int timeout_ms) {
+    if (policy == CapturePolicy::Block) {
+        throw std::runtime_error("try_acquire_frame requires a capture thread");
+    }
+    bool got = false;
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() { return !ready_frames.empty() || !capturing; });
+        got = pop_frame(frame);
+    }
+    // The capture thread may be waiting for room in the queue
+    queue_cv.notify_all();
+    return got;
 }
 
 // Retrieve the latest frame
 std::vector<uint8_t> USBCamera::get_frame() {
+    FrameLease lease = acquire_frame();
+    return std::vector<uint8_t>(lease.data(), lease.data() + lease.size());
+}
+
+// Get the next frame, handing out the mmap'd buffer directly
+FrameLease USBCamera::acquire_frame() {
+    if (policy != CapturePolicy::Block) {
+        FrameLease frame;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this]() { return !ready_frames.empty() || !capturing; });
+            pop_frame(frame);
+        }
+        queue_cv.notify_all();
+        return frame;
+    }
+
+    if (!has_capacity()) {
+        throw std::runtime_error("All capture buffers are leased out (" + std::to_string(outstanding) + "), release a frame before acquiring another");
+    }
+    return dequeue_frame();
+}
+
+// Dequeue a buffer from the driver and wrap it in a lease
+FrameLease USBCamera::dequeue_frame() {
     struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof(buf));
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    fill_buffer(buf, 0);
 
     // Dequeue a buffer (blocks until a frame is available)
     if (ioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
         throw std::runtime_error("Failed to dequeue buffer: " + std::string(strerror(errno)));
     }
-    
-    // Use the memory-mapped buffer pointer instead of buf.m.userptr
-    std::vector<uint8_t> frame_data(buf.bytesused);
-    memcpy(frame_data.data(), buffer_start[buf.index], buf.bytesused);  // Use buffer_start[buf.index]
 
-    // Requeue the buffer so it can be used again
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        buffer_leased[buf.index] = true;
+    }
+    outstanding++;
+
+    FrameView frame((const uint8_t*)buffer_start[buf.index], buf.bytesused);
+    frame.sequence = buf.sequence;
+    frame.timestamp_us = (int64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+    frame.dmabuf_fd = dmabuf_fds[buf.index];
+    return make_lease(buf.index, frame);
+}
+
+// Give a leased buffer back to the driver
+void USBCamera::release_buffer(int index) {
+    std::unique_lock<std::mutex> lock(buffer_mutex);
+    if (index < 0 || index >= buffer_count || !buffer_leased[index]) return;
+    buffer_leased[index] = false;
+    outstanding--;
+
+    // The device may already be closed if a lease outlived the stream
+    if (fd == -1) return;
+
+    struct v4l2_buffer buf;
+    fill_buffer(buf, index);
+
+    // Requeue the buffer so it can be used again. Usually called from a destructor, so we can't throw.
     if (ioctl(fd, VIDIOC_QBUF, &buf) == -1) {
-        throw std::runtime_error("Failed to queue buffer: " + std::string(strerror(errno)));
+        std::cerr << "Failed to queue buffer: " << strerror(errno) << std::endl;
+    }
+    lock.unlock();
+
+    // The capture thread may be waiting for a free buffer. Taking queue_mutex first ensures it
+    //  either sees the new count, or is already waiting and gets the notify.
+    { std::lock_guard<std::mutex> queue_lock(queue_mutex); }
+    queue_cv.notify_all();
+    if (release_fd != -1) {
+        uint64_t one = 1;
+        if (write(release_fd, &one, sizeof(one)) == -1) {
+            std::cerr << "Failed to signal buffer release: " << strerror(errno) << std::endl;
+        }
     }
-    
-    return frame_data;  // Return the captured frame data
 }
 
 
@@ -174,54 +761,178 @@ void USBCamera::init_device() {
         throw std::runtime_error("Failed to set video format: " + std::string(strerror(errno)));
     }
 
-    // Request 4 buffers for memory mapping
+    // The driver tells us how big a frame can be (for MJPEG this is a worst case)
+    init_buffers(fmt.fmt.pix.sizeimage);
+}
+
+static __u32 v4l2_memory_type(CaptureMemory memory) {
+    switch (memory) {
+        case CaptureMemory::Userptr: return V4L2_MEMORY_USERPTR;
+        case CaptureMemory::Dmabuf: return V4L2_MEMORY_DMABUF;
+        default: return V4L2_MEMORY_MMAP;
+    }
+}
+
+// Allocate (or import) the capture buffers, map them, and give them all to the driver
+void USBCamera::init_buffers(size_t image_size) {
+    if (options.buffer_count < 2) {
+        throw std::runtime_error("Need at least 2 capture buffers, got " + std::to_string(options.buffer_count));
+    }
+    if (options.memory == CaptureMemory::Dmabuf && !options.dmabuf_fds.empty() && (int)options.dmabuf_fds.size() != options.buffer_count) {
+        throw std::runtime_error("Expected " + std::to_string(options.buffer_count) + " dmabuf fds, got " + std::to_string(options.dmabuf_fds.size()));
+    }
+
     struct v4l2_requestbuffers req;
     memset(&req, 0, sizeof(req));
-    req.count = 4;  // Request 4 buffers
+    req.count = options.buffer_count;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    req.memory = v4l2_memory_type(options.memory);
 
     if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
         throw std::runtime_error("Failed to request buffers: " + std::string(strerror(errno)));
     }
+    // MMAP drivers may give us a different count, USERPTR/DMABUF must use exactly what we have
+    if (req.count < 2 || (options.memory != CaptureMemory::Mmap && options.memory != CaptureMemory::MmapExportDmabuf && (int)req.count != options.buffer_count)) {
+        throw std::runtime_error("Driver gave us " + std::to_string(req.count) + " buffers, wanted " + std::to_string(options.buffer_count));
+    }
 
     buffer_count = req.count;
-    buffer_start = new void*[buffer_count];  // Store pointers for each buffer
+    buffer_start = new void*[buffer_count]();  // Store pointers for each buffer
+    buffer_length.assign(buffer_count, 0);
+    buffer_leased.assign(buffer_count, false);
+    dmabuf_fds.assign(buffer_count, -1);
+    dmabuf_owned.assign(buffer_count, false);
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t aligned_size = (image_size + page_size - 1) / page_size * page_size;
+
+    int heap_fd = -1;
+    if (options.memory == CaptureMemory::Dmabuf && options.dmabuf_fds.empty()) {
+        heap_fd = open("/dev/dma_heap/system", O_RDWR | O_CLOEXEC);
+        if (heap_fd == -1) {
+            throw std::runtime_error("Failed to open /dev/dma_heap/system: " + std::string(strerror(errno)));
+        }
+    }
 
     // Queue the buffers for memory mapping (initial queue)
-    for (int i = 0; i < req.count; i++) {
-        struct v4l2_buffer buf;
-        memset(&buf, 0, sizeof(buf));
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
-
-        if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
-            throw std::runtime_error("Failed to query buffer: " + std::string(strerror(errno)));
-        }
+    for (int i = 0; i < buffer_count; i++) {
+        if (options.memory == CaptureMemory::Mmap || options.memory == CaptureMemory::MmapExportDmabuf) {
+            struct v4l2_buffer buf;
+            fill_buffer(buf, i);
+            if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
+                throw std::runtime_error("Failed to query buffer: " + std::string(strerror(errno)));
+            }
 
-        // Memory-map the buffers
-        buffer_start[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
-        if (buffer_start[i] == MAP_FAILED) {
-            throw std::runtime_error("Failed to mmap buffer: " + std::string(strerror(errno)));
+            // Memory-map the buffers
+            buffer_start[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+            if (buffer_start[i] == MAP_FAILED) {
+                buffer_start[i] = nullptr;
+                throw std::runtime_error("Failed to mmap buffer: " + std::string(strerror(errno)));
+            }
+            buffer_length[i] = buf.length;
+
+            if (options.memory == CaptureMemory::MmapExportDmabuf) {
+                struct v4l2_exportbuffer expbuf;
+                memset(&expbuf, 0, sizeof(expbuf));
+                expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                expbuf.index = i;
+                expbuf.flags = O_RDONLY | O_CLOEXEC;
+                if (ioctl(fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+                    throw std::runtime_error("Failed to export buffer as dmabuf: " + std::string(strerror(errno)));
+                }
+                dmabuf_fds[i] = expbuf.fd;
+                dmabuf_owned[i] = true;
+            }
+        } else if (options.memory == CaptureMemory::Userptr) {
+            void* memory = nullptr;
+            if (posix_memalign(&memory, page_size, aligned_size) != 0) {
+                throw std::runtime_error("Failed to allocate userptr buffer of " + std::to_string(aligned_size) + " bytes");
+            }
+            buffer_start[i] = memory;
+            buffer_length[i] = aligned_size;
+        } else {
+            if (heap_fd != -1) {
+                struct dma_heap_allocation_data alloc;
+                memset(&alloc, 0, sizeof(alloc));
+                alloc.len = aligned_size;
+                alloc.fd_flags = O_RDWR | O_CLOEXEC;
+                if (ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc) == -1) {
+                    close(heap_fd);
+                    throw std::runtime_error("Failed to allocate dmabuf: " + std::string(strerror(errno)));
+                }
+                dmabuf_fds[i] = alloc.fd;
+                dmabuf_owned[i] = true;
+                buffer_length[i] = aligned_size;
+            } else {
+                dmabuf_fds[i] = options.dmabuf_fds[i];
+                off_t size = lseek(dmabuf_fds[i], 0, SEEK_END);
+                if (size < (off_t)image_size) {
+                    throw std::runtime_error("dmabuf " + std::to_string(i) + " is too small for a frame (" + std::to_string(size) + " < " + std::to_string(image_size) + ")");
+                }
+                buffer_length[i] = size;
+            }
+            // So we can still read the frame on the CPU
+            buffer_start[i] = mmap(NULL, buffer_length[i], PROT_READ, MAP_SHARED, dmabuf_fds[i], 0);
+            if (buffer_start[i] == MAP_FAILED) {
+                buffer_start[i] = nullptr;
+                if (heap_fd != -1) close(heap_fd);
+                throw std::runtime_error("Failed to mmap dmabuf: " + std::string(strerror(errno)));
+            }
         }
 
         // Queue the buffer
+        struct v4l2_buffer buf;
+        fill_buffer(buf, i);
         if (ioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+            if (heap_fd != -1) close(heap_fd);
             throw std::runtime_error("Failed to queue buffer: " + std::string(strerror(errno)));
         }
     }
+    if (heap_fd != -1) close(heap_fd);
+}
+
+void USBCamera::fill_buffer(struct v4l2_buffer& buf, int index) {
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = v4l2_memory_type(options.memory);
+    buf.index = index;
+    // Only used when queueing, DQBUF fills these in
+    if (options.memory == CaptureMemory::Userptr && buffer_start) {
+        buf.m.userptr = (unsigned long)buffer_start[index];
+        buf.length = buffer_length[index];
+    } else if (options.memory == CaptureMemory::Dmabuf && !dmabuf_fds.empty()) {
+        buf.m.fd = dmabuf_fds[index];
+        buf.length = buffer_length[index];
+    }
 }
 
 // Close the device
 void USBCamera::close_device() {
+    if (outstanding > 0) {
+        std::cerr << "Closing " << device << " with " << outstanding << " frame leases still outstanding" << std::endl;
+    }
+    std::lock_guard<std::mutex> lock(buffer_mutex);
     if (fd != -1) {
-        for (int i = 0; i < buffer_count; i++) {
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        ioctl(fd, VIDIOC_STREAMOFF, &type);
+        // Buffers may not be set up, if init_device failed part way
+        for (int i = 0; buffer_start && i < buffer_count; i++) {
             if (buffer_start[i]) {
-                munmap(buffer_start[i], sizeof(buffer_start[i]));
+                if (options.memory == CaptureMemory::Userptr) {
+                    free(buffer_start[i]);
+                } else {
+                    munmap(buffer_start[i], buffer_length[i]);
+                }
+            }
+            if (dmabuf_owned[i]) {
+                close(dmabuf_fds[i]);
             }
         }
+        dmabuf_fds.clear();
+        dmabuf_owned.clear();
         delete[] buffer_start;
+        buffer_start = nullptr;
         close(fd);
+        fd = -1;
     }
 }
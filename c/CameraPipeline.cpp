@@ -0,0 +1,342 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <stdexcept>
+
+#include "AsyncDecoder.cpp"
+#include "FrameBuffer.cpp"
+#include "EncoderRegistry.cpp"
+#include "SegmentWriter.cpp"
+#include "ActivityDetector.cpp"
+#include "PreviewWriter.cpp"
+#include "TimestampOverlay.cpp"
+#include "LiveStream.cpp"
+
+struct CameraPipelineOptions {
+    // Empty to only score activity (nothing is encoded or written)
+    std::string output_folder;
+    std::string encoder_config = "auto";
+    ActivityOptions activity;
+    PrerollOptions preroll;
+    // Also write segments as fragmented MP4 (SegmentWriter::set_mp4_output)
+    bool mp4 = false;
+    // Drawn on what is written (segments and previews), not on what activity is scored on
+    TimestampOverlayOptions timestamp;
+    // Prefixed to log lines, so several cameras can be told apart
+    std::string name;
+    // Also sends what is encoded here (see LiveStreamServer), even without an output_folder.
+    //  Not owned, it has to outlive the pipeline.
+    LiveStream* live = nullptr;
+};
+
+// What happens to a camera's frames once they are decoded: activity scoring, encoding, and
+//  writing segments and previews into output_folder (on a writer thread, so a slow disk only
+//  backs up the encoder's NAL ring), and the live stream. add_frame is called by one thread,
+//  in capture order.
+class CameraPipeline {
+public:
+    CameraPipeline(int width, int height, int fps, const CameraPipelineOptions& options);
+    // Stops the encoder, and waits for the writer to write the last group
+    ~CameraPipeline();
+    CameraPipeline(const CameraPipeline&) = delete;
+    CameraPipeline& operator=(const CameraPipeline&) = delete;
+
+    // Releases the image (giving it back to the decoder) as soon as it is copied out. Frames
+    //  are timed (activity segments, the overlay, and segments) by their timestamp_us.
+    void add_frame(DecodedImage& image);
+    void add_frame(const FrameBuffer& frame);
+    // A pooled frame (e.g. from BranchedPipeline) is encoded as is, with the timestamp drawn
+    //  into it, instead of copied. Unless someone else holds it too, as they'd see the timestamp.
+    void add_frame(FrameRef frame);
+
+private:
+    // Each activity segment's score and first frame (its keyframe, for the keyframe index), and
+    //  its most active frame, to write previews of beside its 1x segment
+    struct PendingSegment {
+        double segment_start_time = 0;  // When the segment's first frame was captured
+        int64_t activity = 0;
+        FrameRef keyframe;
+        FrameRef preview;               // Empty if the segment had no activity (may be keyframe)
+        std::string metadata;
+    };
+
+    int width;
+    int height;
+    CameraPipelineOptions options;
+    std::string log_prefix;
+
+    // Scored per keyframe group, so each result lines up with a 1x segment
+    int activity_segment_frames;
+    ActivityDetector activity;
+    std::unique_ptr<TimestampOverlay> overlay;  // Null if there is no format
+
+    std::unique_ptr<FramePool> preview_pool;   // Before the FrameRefs, which must go first
+    std::mutex pending_mutex;
+    std::deque<PendingSegment> pending_segments;
+    FrameRef keyframe_frame;
+    FrameRef most_active_frame;
+    double segment_start_time;
+
+    std::unique_ptr<H264Encoder> encoder;
+    std::unique_ptr<FramePool> encode_pool;
+    std::thread writer_thread;
+
+    // For capture_time_ms, with timestamps that aren't CLOCK_MONOTONIC
+    bool have_clock_offset;
+    double clock_offset_ms;
+
+    // A frame's timestamp_us as wall_time_ms, when it was captured rather than when it got here
+    double capture_time_ms(int64_t timestamp_us);
+    // Activity, and the copies for previews
+    template <class Image> void score(const Image& image, double time_ms);
+    // Copies into an encoder frame, stamped with time_ms (what the writer times its NALs by)
+    template <class Image> void encode(Image& image, double time_ms);
+    // Copies into our frame, with the timestamp
+    template <class Image> void copy_frame(const Image& image, FrameBuffer& frame);
+    void write_loop();
+    static void copy_image(const DecodedImage& image, FrameBuffer& frame) { image.copy_to(frame); }
+    static void copy_image(const FrameBuffer& source, FrameBuffer& frame) { copy_frame_buffer(source, frame); }
+    static void release_image(DecodedImage& image) { image.release(); }
+    static void release_image(const FrameBuffer&) {}
+};
+
+CameraPipeline::CameraPipeline(int width, int height, int fps, const CameraPipelineOptions& options)
+    : width(width), height(height), options(options),
+      log_prefix(options.name.empty() ? "" : options.name + ": "),
+      activity_segment_frames(H264EncoderOptions().keyframe_interval),
+      activity(width, height, [&]() {
+          ActivityOptions activity_options = options.activity;
+          activity_options.max_window_frames = H264EncoderOptions().keyframe_interval;
+          return activity_options;
+      }()),
+      segment_start_time(0), have_clock_offset(false), clock_offset_ms(0) {
+    if (!options.timestamp.format.empty()) {
+        overlay.reset(new TimestampOverlay(width, height, options.timestamp));
+        // Saved video is scored by activity.py with the timestamp masked, so mask it here too
+        const OverlayBounds& box = overlay->bounds();
+        activity.set_mask(box.x, box.y, box.width, box.height);
+    }
+    if (options.output_folder.empty() && !options.live) return;
+    H264EncoderOptions encoder_options;
+    encoder_options.width = width;
+    encoder_options.height = height;
+    encoder_options.fps = fps;
+    encoder = create_h264_encoder(options.encoder_config, encoder_options);
+    encode_pool.reset(new FramePool(width, height, 2));
+    if (!options.output_folder.empty()) {
+        // The keyframe and candidate being scored, and a couple of segments waiting to be written
+        preview_pool.reset(new FramePool(width, height, 6));
+    }
+    writer_thread = std::thread(&CameraPipeline::write_loop, this);
+}
+
+CameraPipeline::~CameraPipeline() {
+    if (writer_thread.joinable()) {
+        encoder->shutdown();
+        writer_thread.join();
+    }
+}
+
+template <class Image>
+void CameraPipeline::copy_frame(const Image& image, FrameBuffer& frame) {
+    copy_image(image, frame);
+    if (overlay) overlay->draw(frame);
+}
+
+// V4L2 stamps frames with CLOCK_MONOTONIC (steady_clock), so their age is how long ago they were
+//  captured. Others (e.g. ReplaySource's, from its files) are kept in step with the wall clock
+//  from their first frame, and again if they get ahead of it or too far behind.
+double CameraPipeline::capture_time_ms(int64_t timestamp_us) {
+    double now = wall_time_ms();
+    if (timestamp_us <= 0) return now;
+    int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    const int64_t max_age_us = 10000000;
+    if (now_us - timestamp_us >= 0 && now_us - timestamp_us < max_age_us) {
+        return now - (now_us - timestamp_us) / 1000.0;
+    }
+    double time_ms = timestamp_us / 1000.0 + clock_offset_ms;
+    if (!have_clock_offset || time_ms > now || time_ms < now - max_age_us / 1000.0) {
+        have_clock_offset = true;
+        clock_offset_ms = now - timestamp_us / 1000.0;
+        time_ms = now;
+    }
+    return time_ms;
+}
+
+void CameraPipeline::add_frame(DecodedImage& image) {
+    double time_ms = capture_time_ms(image.timestamp_us);
+    score(image, time_ms);
+    encode(image, time_ms);
+    // encode gave it back once it was copied, unless there's no encoder
+    image.release();
+}
+
+void CameraPipeline::add_frame(const FrameBuffer& frame) {
+    double time_ms = capture_time_ms(frame.timestamp_us);
+    score(frame, time_ms);
+    encode(frame, time_ms);
+}
+
+template <class Image>
+void CameraPipeline::score(const Image& image, double time_ms) {
+    if (overlay && overlay->update(time_ms)) {
+        const OverlayBounds& box = overlay->bounds();
+        activity.set_mask(box.x, box.y, box.width, box.height);
+    }
+    if (activity.segment_frames() == 0) {
+        segment_start_time = time_ms;
+        // If every frame is taken (the writer is behind), this segment just has no thumbnail
+        keyframe_frame = FrameRef();
+        if (preview_pool && preview_pool->try_acquire(keyframe_frame, 0)) {
+            copy_frame(image, *keyframe_frame);
+        }
+    }
+    ActivityScore score = activity.add_frame(image);
+    if (score.most_active && preview_pool) {
+        // If every frame is taken (the writer is behind), this segment just has no preview
+        most_active_frame = FrameRef();
+        if (preview_pool->try_acquire(most_active_frame, 0)) {
+            copy_frame(image, *most_active_frame);
+        }
+    }
+    if (activity.segment_frames() >= activity_segment_frames) {
+        ActivitySegment segment = activity.finish_segment();
+        std::cout << log_prefix << "Activity " << (segment.has_activity() ? "in" : "none in") << " segment ending at frame "
+                  << image.sequence << ", most changes " << segment.most_active_changes;
+        if (encoder) std::cout << ", " << encoder->dropped_frames() << " frames dropped by the encoder";
+        std::cout << std::endl;
+        if (preview_pool) {
+            PendingSegment pending;
+            pending.segment_start_time = segment_start_time;
+            pending.activity = segment.has_activity() ? segment.most_active_changes : 0;
+            if (segment.has_activity()) {
+                // Only the forward pass's pick was kept, so when Bidirectional's reverse pass wins
+                //  (something changed early on, that's gone by the last frame) the segment's
+                //  first frame shows it best
+                if (most_active_frame && most_active_frame->sequence == segment.most_active_sequence) {
+                    pending.preview = std::move(most_active_frame);
+                } else if (keyframe_frame || most_active_frame) {
+                    pending.preview = keyframe_frame ? keyframe_frame : std::move(most_active_frame);
+                    std::cout << log_prefix << "Most active frame " << segment.most_active_sequence << " wasn't kept, previewing frame "
+                              << pending.preview->sequence << " instead" << std::endl;
+                } else {
+                    std::cout << log_prefix << "No preview for the segment ending at frame " << image.sequence
+                              << ", every preview frame was taken (the writer is behind)" << std::endl;
+                }
+            }
+            pending.keyframe = std::move(keyframe_frame);
+            if (pending.preview) {
+                // What activity.py wrote to .metadata
+                pending.metadata = "{\"changes\":" + std::to_string(segment.most_active_changes) + ",\"allChanges\":[";
+                for (size_t i = 0; i < segment.changes.size(); i++) {
+                    pending.metadata += (i ? "," : "") + std::to_string(segment.changes[i]);
+                }
+                pending.metadata += "]}";
+            }
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending_segments.push_back(std::move(pending));
+        }
+        keyframe_frame = FrameRef();
+        most_active_frame = FrameRef();
+    }
+}
+
+template <class Image>
+void CameraPipeline::encode(Image& image, double time_ms) {
+    if (!encoder) return;
+    // Decoder buffers are few, so copy out and give it back before encoding
+    FrameRef encode_frame = encode_pool->acquire();
+    copy_frame(image, *encode_frame);
+    release_image(image);
+    encode_frame->timestamp_us = (int64_t)(time_ms * 1000);
+    encoder->add_frame(*encode_frame);
+}
+
+void CameraPipeline::add_frame(FrameRef frame) {
+    double time_ms = capture_time_ms(frame->timestamp_us);
+    score(*frame, time_ms);
+    if (!encoder) return;
+    bool shared = frame.use_count() > 1;
+    if (overlay) {
+        if (shared) {
+            encode((const FrameBuffer&)*frame, time_ms);
+            return;
+        }
+        overlay->draw(*frame);
+    }
+    // The encoder only reads the stamp in add_frame, so the others holding it (the pipelines
+    //  after us, on this thread) get theirs back after
+    int64_t timestamp_us = frame->timestamp_us;
+    frame->timestamp_us = (int64_t)(time_ms * 1000);
+    encoder->add_frame(*frame);
+    if (shared) frame->timestamp_us = timestamp_us;
+}
+
+void CameraPipeline::write_loop() {
+    std::vector<uint8_t> nal;
+    // The capture time (as wall_time_ms) encode stamped the frame with, 0 for parameter sets
+    int64_t timestamp_us = 0;
+    if (options.output_folder.empty()) {
+        while (encoder->try_get_next_nal(nal, -1, &timestamp_us)) {
+            options.live->add_nals(nal, timestamp_us > 0 ? timestamp_us / 1000.0 : wall_time_ms());
+        }
+        return;
+    }
+    SegmentWriter writer(options.output_folder, default_speed_groups, options.preroll);
+    writer.set_mp4_output(options.mp4);
+    PreviewWriter preview_writer(width, height);
+    // A segment's keyframe is encoded at (or just before) its segment starts, so it goes
+    //  with the first keyframe group starting at or after that
+    PendingSegment current;
+    double current_start_time = 0;
+    writer.set_group_callback([&](const VideoKey& group, SegmentGroupInfo& info) {
+        current = PendingSegment();
+        current_start_time = group.start_time;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            // Segments older than the group before this one had their group dropped
+            double stale_time = group.start_time - (group.end_time - group.start_time);
+            while (!pending_segments.empty() && pending_segments.front().segment_start_time < stale_time) {
+                pending_segments.pop_front();
+            }
+            if (pending_segments.empty() || pending_segments.front().segment_start_time > group.start_time) return;
+            current = std::move(pending_segments.front());
+            pending_segments.pop_front();
+        }
+        info.activity = current.activity;
+        if (!current.keyframe) return;
+        try {
+            preview_writer.encode_preview(*current.keyframe, 200, info.keyframe_jpeg);
+        } catch (const std::exception& ex) {
+            std::cerr << log_prefix << "Failed to encode keyframe thumbnail: " << ex.what() << std::endl;
+        }
+        current.keyframe = FrameRef();
+    });
+    writer.set_segment_callback([&](int speed, const std::string& path, const VideoKey& key) {
+        // Held preroll groups are written just before the group they precede
+        if (speed != 1 || !current.preview || key.start_time != current_start_time) return;
+        try {
+            preview_writer.write(*current.preview, path, current.metadata);
+        } catch (const std::exception& ex) {
+            std::cerr << log_prefix << "Failed to write previews for " << path << ": " << ex.what() << std::endl;
+        }
+        current.preview = FrameRef();
+    });
+    while (encoder->try_get_next_nal(nal, -1, &timestamp_us)) {
+        double time_ms = timestamp_us > 0 ? timestamp_us / 1000.0 : wall_time_ms();
+        // Before the disk, which can be slow
+        if (options.live) options.live->add_nals(nal, time_ms);
+        writer.add_nals(nal, time_ms);
+    }
+    writer.flush(wall_time_ms());
+    if (writer.skipped_groups() > 0) {
+        std::cout << log_prefix << "Skipped writing " << writer.skipped_groups() << " static 1x segments ("
+                  << writer.skipped_bytes() << " bytes)" << std::endl;
+    }
+}
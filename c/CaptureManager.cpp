@@ -0,0 +1,541 @@
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "CameraFrameCapture.cpp"
+#include "DecodePool.cpp"
+#include "FrameBuffer.cpp"
+
+// A V4L2 capture device, and what identifies it across reboots and replugging. Device nodes
+//  come and go (spec.md: /dev/video0 disappearing, leaving /dev/video10, which isn't the
+//  webcam), but bus_info (the USB port) and the USB serial number don't change.
+struct CameraInfo {
+    std::string path;       // /dev/videoN
+    std::string driver;     // e.g. uvcvideo, vivid
+    std::string card;       // The camera's name
+    std::string bus_info;   // e.g. usb-0000:01:00.0-1.2, platform:vivid-000
+    std::string serial;     // The USB device's serial number, empty if it has none
+};
+
+static std::string read_trimmed_file(const std::string& path) {
+    std::ifstream file(path);
+    std::string text;
+    std::getline(file, text);
+    while (!text.empty() && (text.back() == '\n' || text.back() == '\r' || text.back() == ' ')) {
+        text.pop_back();
+    }
+    return text;
+}
+
+// Every video node that can capture, in node order. UVC cameras also have metadata nodes,
+//  which are left out.
+std::vector<CameraInfo> list_cameras() {
+    std::vector<CameraInfo> cameras;
+    DIR* dir = opendir("/dev");
+    if (!dir) return cameras;
+    std::vector<int> numbers;
+    while (struct dirent* entry = readdir(dir)) {
+        const char* name = entry->d_name;
+        if (strncmp(name, "video", 5) != 0 || !name[5]) continue;
+        char* end = nullptr;
+        long number = strtol(name + 5, &end, 10);
+        if (*end) continue;
+        numbers.push_back((int)number);
+    }
+    closedir(dir);
+    std::sort(numbers.begin(), numbers.end());
+
+    for (int number : numbers) {
+        CameraInfo info;
+        info.path = "/dev/video" + std::to_string(number);
+        int fd = open(info.path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) continue;
+        struct v4l2_capability cap;
+        memset(&cap, 0, sizeof(cap));
+        bool ok = ioctl(fd, VIDIOC_QUERYCAP, &cap) == 0;
+        close(fd);
+        if (!ok) continue;
+        // device_caps is this node, capabilities is the whole device
+        uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+        if (!(caps & V4L2_CAP_VIDEO_CAPTURE)) continue;
+        info.driver = (const char*)cap.driver;
+        info.card = (const char*)cap.card;
+        info.bus_info = (const char*)cap.bus_info;
+        // device is the USB interface, its parent is the USB device
+        info.serial = read_trimmed_file("/sys/class/video4linux/video" + std::to_string(number) + "/device/../serial");
+        cameras.push_back(info);
+    }
+    return cameras;
+}
+
+// Finds a camera by spec, and returns its device node. The spec is a path (used as is), or
+//  bus=<bus_info>, serial=<serial> or card=<card>, or a bare value matching any of those.
+//  If several cameras match, the first one is used.
+std::string find_camera(const std::string& spec) {
+    if (!spec.empty() && spec[0] == '/') return spec;
+    std::string field;
+    std::string value = spec;
+    size_t equals = spec.find('=');
+    if (equals != std::string::npos) {
+        field = spec.substr(0, equals);
+        value = spec.substr(equals + 1);
+        if (field != "bus" && field != "serial" && field != "card") {
+            throw std::runtime_error("Unknown camera field " + field + " in " + spec + ", expected bus, serial or card");
+        }
+    }
+    std::vector<CameraInfo> cameras = list_cameras();
+    for (auto& camera : cameras) {
+        if ((field.empty() || field == "bus") && camera.bus_info == value) return camera.path;
+        if ((field.empty() || field == "serial") && !camera.serial.empty() && camera.serial == value) return camera.path;
+        if ((field.empty() || field == "card") && camera.card == value) return camera.path;
+    }
+    std::string found;
+    for (auto& camera : cameras) {
+        found += "\n  " + camera.path + " bus=" + camera.bus_info + " serial=" + camera.serial + " card=" + camera.card;
+    }
+    throw std::runtime_error("No camera matches " + spec + (found.empty() ? ", there are no cameras" : ", found:" + found));
+}
+
+struct CaptureManagerOptions {
+    // Decode threads shared by every camera, <= 0 uses every core
+    int decode_threads = 0;
+    // Frames each camera can have decoding, or decoded and waiting for its on_frame
+    int in_flight_per_camera = 2;
+    // Log each camera's delivered frame rate and drops this often, 0 to not
+    int stats_interval_ms = 0;
+};
+
+// Captures from several cameras in one process. One thread polls every camera (epoll), an
+//  MJPEGDecodePool (a stream per camera) is shared between them, and each camera's frames go
+//  to its own on_frame callback, in capture order, on a thread per camera (so one camera's
+//  slow encoder doesn't hold up the others).
+//
+// The decoders take the cameras in turn, one frame each, so a camera running at a higher
+//  frame rate can't starve the rest. Like CapturePolicy::LatestFrame, each camera keeps only
+//  its newest undecoded frame (MJPEGDecodePool::submit_latest): if the decoders fall behind,
+//  cameras drop stale frames, rather than everything falling further behind.
+//
+// A camera that fails or stalls (see USBCameraOptions::reconnect) is closed, and reopened once
+//  it is back, while the others keep capturing. Its on_frame just sees a gap in frames.
+//
+// Any FrameSource can be added, so recordings (ReplaySource.cpp) can stand in for cameras to
+//  find how many a machine can handle. Sources that aren't realtime (a replay as fast as
+//  possible) aren't dropped from, they are only read once their last frame was taken.
+class CaptureManager {
+public:
+    CaptureManager(const CaptureManagerOptions& options = CaptureManagerOptions());
+    ~CaptureManager();
+    CaptureManager(const CaptureManager&) = delete;
+    CaptureManager& operator=(const CaptureManager&) = delete;
+
+    // Opens the camera spec finds (see find_camera), in MJPEG. on_frame gets each decoded
+    //  frame, which is only valid during the call. Call before run. Returns the camera's index.
+    int add_camera(const std::string& spec, int width, int height, int fps,
+                   std::function<void(const FrameBuffer& frame)> on_frame, const std::string& name = "");
+    // Any other source of MJPEG frames, of width x height. Never considered stalled.
+    int add_source(std::unique_ptr<FrameSource> source, int width, int height,
+                   std::function<void(const FrameBuffer& frame)> on_frame, const std::string& name = "");
+
+    // Captures on this thread, until stop() is called, or a camera or on_frame fails (which throws)
+    void run();
+    // Any thread
+    void stop();
+
+    int camera_count() const { return cameras.size(); }
+    const std::string& camera_path(int camera) const { return cameras[camera]->path; }
+    CaptureStats stats(int camera);
+
+private:
+    struct Camera {
+        int index;
+        std::string name;
+        std::string path;
+        std::unique_ptr<FrameSource> source;
+        int stream;                     // In decode_pool
+        std::function<void(const FrameBuffer& frame)> on_frame;
+        // Capture thread only
+        bool armed = false;             // Whether epoll is waiting on it
+        bool lost = false;              // Closed, waiting for it to come back
+        int stall_ms = 0;               // 0 never stalls
+        std::chrono::steady_clock::time_point last_frame_time;
+        std::chrono::steady_clock::time_point lost_time;
+        std::chrono::steady_clock::time_point last_reopen_time;
+
+        // Guarded by the manager's mutex
+        uint64_t dropped_stale = 0;     // Replaced while waiting for a decoder
+        uint64_t reconnects = 0;
+        double disconnected_ms = 0;
+        std::atomic<uint64_t> delivered{0};    // Given to on_frame
+        uint64_t logged_delivered = 0;  // Capture thread only, at the last stats log
+        std::thread consumer;
+    };
+
+    CaptureManagerOptions options;
+    MJPEGDecodePool decode_pool;
+    std::vector<std::unique_ptr<Camera>> cameras;
+    int epoll_fd;
+    int wake_fd;        // stop()
+    int release_fd;     // Any camera released a lease, see FrameSource::set_release_fd
+    int watch_fd;       // inotify on /dev, for lost cameras coming back. -1 if unavailable.
+
+    std::mutex mutex;
+    std::string error;                  // The first failure, rethrown by run
+
+    void set_armed(Camera& camera, bool armed);
+    void capture_frame(Camera& camera);
+    void lose_camera(Camera& camera, const std::string& reason);
+    void try_reopen(Camera& camera);
+    void log_stats(double elapsed_ms);
+    void frame_taken(Camera& camera);
+    void consumer_loop(Camera& camera);
+    void fail(const std::string& message);
+    void shutdown();
+};
+
+CaptureManager::CaptureManager(const CaptureManagerOptions& options)
+    : options(options), decode_pool(options.decode_threads), epoll_fd(-1), wake_fd(-1), release_fd(-1), watch_fd(-1) {
+    this->options.in_flight_per_camera = std::max(1, options.in_flight_per_camera);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    release_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wake_fd == -1 || release_fd == -1) {
+        std::string message = strerror(errno);
+        shutdown();
+        throw std::runtime_error("Failed to create capture manager: " + message);
+    }
+    // Cameras are tagged with their index + 3, so 0 to 2 are free for these
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+    event.data.u64 = 1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, release_fd, &event);
+    // udev creates the node, then fixes its permissions, so either can mean a camera is back.
+    //  Without inotify, lost cameras are still retried every second.
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd != -1 && inotify_add_watch(watch_fd, "/dev", IN_CREATE | IN_ATTRIB) != -1) {
+        event.data.u64 = 2;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch_fd, &event);
+    }
+
+    // Cameras are streams in the order they're added, so stream == index
+    decode_pool.set_started_callback([this](int stream) { frame_taken(*cameras[stream]); });
+}
+
+CaptureManager::~CaptureManager() {
+    shutdown();
+}
+
+void CaptureManager::shutdown() {
+    // Joins the decoders, and gives back the leases they hadn't taken before the cameras close
+    decode_pool.stop();
+    for (auto& camera : cameras) {
+        if (camera->consumer.joinable()) camera->consumer.join();
+    }
+    cameras.clear();
+    for (int* fd : {&epoll_fd, &wake_fd, &release_fd, &watch_fd}) {
+        if (*fd != -1) close(*fd);
+        *fd = -1;
+    }
+}
+
+int CaptureManager::add_camera(const std::string& spec, int width, int height, int fps,
+                               std::function<void(const FrameBuffer& frame)> on_frame, const std::string& name) {
+    std::string path = find_camera(spec);
+    // Frames stay leased while they wait for, or are in, a decoder, and the driver needs spare buffers
+    USBCameraOptions camera_options;
+    camera_options.buffer_count = options.in_flight_per_camera + 3;
+    camera_options.find_device = [spec]() { return find_camera(spec); };
+    std::unique_ptr<FrameSource> camera(new USBCamera(path, width, height, fps, V4L2_PIX_FMT_MJPEG, camera_options));
+    std::cout << "Opened " << (name.empty() ? path : name) << " (" << path << ")" << std::endl;
+
+    int index = add_source(std::move(camera), width, height, std::move(on_frame), name);
+    cameras[index]->stall_ms = std::max(1000, camera_options.stall_frame_intervals * 1000 / std::max(1, fps));
+    return index;
+}
+
+int CaptureManager::add_source(std::unique_ptr<FrameSource> source, int width, int height,
+                               std::function<void(const FrameBuffer& frame)> on_frame, const std::string& name) {
+    std::unique_ptr<Camera> camera(new Camera());
+    camera->index = cameras.size();
+    camera->path = source->source_path();
+    camera->name = name.empty() ? camera->path : name;
+    camera->on_frame = std::move(on_frame);
+    // One frame being handed to on_frame
+    camera->stream = decode_pool.add_stream(width, height, options.in_flight_per_camera, 1);
+    camera->source = std::move(source);
+    camera->source->set_release_fd(release_fd);
+
+    cameras.push_back(std::move(camera));
+    Camera& added = *cameras.back();
+    added.consumer = std::thread(&CaptureManager::consumer_loop, this, std::ref(added));
+    return added.index;
+}
+
+CaptureStats CaptureManager::stats(int index) {
+    Camera& camera = *cameras[index];
+    CaptureStats stats = camera.source->stats();
+    stats.delivered = camera.delivered;
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.dropped_stale += camera.dropped_stale;
+    stats.reconnects += camera.reconnects;
+    stats.disconnected_ms += camera.disconnected_ms;
+    return stats;
+}
+
+void CaptureManager::stop() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        std::cerr << "Failed to wake capture manager: " << strerror(errno) << std::endl;
+    }
+}
+
+void CaptureManager::fail(const std::string& message) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error.empty()) error = message;
+    }
+    stop();
+}
+
+void CaptureManager::set_armed(Camera& camera, bool armed) {
+    if (camera.armed == armed) return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = armed ? (uint32_t)EPOLLIN : 0u;
+    event.data.u64 = camera.index + 3;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, camera.source->poll_fd(), &event) == -1) {
+        throw std::runtime_error("Failed to poll " + camera.path + ": " + strerror(errno));
+    }
+    camera.armed = armed;
+}
+
+// Called when the camera is readable
+void CaptureManager::capture_frame(Camera& camera) {
+    FrameSource& device = *camera.source;
+    // Every buffer we can take is waiting for, or in, a decoder. Stop polling until one is
+    //  released, or the device stays readable and we spin.
+    if (device.outstanding_frames() >= device.max_outstanding_frames()) {
+        set_armed(camera, false);
+        return;
+    }
+    if (!device.realtime()) {
+        // Nothing is lost by waiting, so wait for a decoder to take the last frame (see frame_taken)
+        if (decode_pool.has_waiting(camera.stream)) {
+            set_armed(camera, false);
+            return;
+        }
+    }
+    FrameLease frame = device.acquire_frame();
+    camera.last_frame_time = std::chrono::steady_clock::now();
+    if (decode_pool.submit_latest(camera.stream, std::move(frame))) {
+        std::lock_guard<std::mutex> lock(mutex);
+        camera.dropped_stale++;
+    }
+}
+
+// Stops polling the camera, and closes it once its leases are back (try_reopen)
+void CaptureManager::lose_camera(Camera& camera, const std::string& reason) {
+    std::cerr << "Lost " << camera.name << " (" << reason << "), reconnecting" << std::endl;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, camera.source->poll_fd(), nullptr);
+    camera.armed = false;
+    camera.lost = true;
+    camera.lost_time = std::chrono::steady_clock::now();
+    camera.last_reopen_time = std::chrono::steady_clock::time_point();
+    // From before the gap
+    decode_pool.drop_waiting(camera.stream);
+}
+
+void CaptureManager::try_reopen(Camera& camera) {
+    // The decoders still have frames from before it was lost, which we can't unmap
+    if (camera.source->outstanding_frames() > 0) return;
+    camera.last_reopen_time = std::chrono::steady_clock::now();
+    if (!camera.source->reopen()) return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.data.u64 = camera.index + 3;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, camera.source->poll_fd(), &event) == -1) {
+        throw std::runtime_error("Failed to poll " + camera.path + ": " + strerror(errno));
+    }
+    camera.path = camera.source->source_path();
+    camera.lost = false;
+    camera.last_frame_time = std::chrono::steady_clock::now();
+    set_armed(camera, true);
+
+    double lost_ms = std::chrono::duration<double, std::milli>(camera.last_frame_time - camera.lost_time).count();
+    std::cerr << "Reconnected " << camera.name << " (" << camera.path << ") after " << (int)lost_ms << "ms" << std::endl;
+    std::lock_guard<std::mutex> lock(mutex);
+    camera.reconnects++;
+    camera.disconnected_ms += lost_ms;
+}
+
+void CaptureManager::run() {
+    for (auto& camera : cameras) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.data.u64 = camera->index + 3;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, camera->source->poll_fd(), &event) == -1) {
+            throw std::runtime_error("Failed to poll " + camera->path + ": " + strerror(errno));
+        }
+        camera->source->start(CapturePolicy::Block);
+        camera->last_frame_time = std::chrono::steady_clock::now();
+        set_armed(*camera, true);
+    }
+
+    std::vector<struct epoll_event> events(cameras.size() + 3);
+    auto last_stats_time = std::chrono::steady_clock::now();
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error.empty()) break;
+        }
+        int count = epoll_wait(epoll_fd, events.data(), events.size(), 1000);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            fail("Failed to wait for cameras: " + std::string(strerror(errno)));
+            break;
+        }
+        bool woken = false;
+        bool devices_changed = false;
+        for (int i = 0; i < count; i++) {
+            uint64_t tag = events[i].data.u64;
+            if (tag == 0) {
+                woken = true;
+            } else if (tag == 2) {
+                char changes[4096];
+                while (read(watch_fd, changes, sizeof(changes)) > 0) {}
+                devices_changed = true;
+            } else if (tag == 1) {
+                uint64_t value;
+                if (read(release_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                    fail("Failed to read release event: " + std::string(strerror(errno)));
+                }
+                for (auto& camera : cameras) {
+                    if (!camera->armed && !camera->lost && camera->source->outstanding_frames() < camera->source->max_outstanding_frames()) {
+                        camera->last_frame_time = std::chrono::steady_clock::now();
+                        set_armed(*camera, true);
+                    }
+                }
+            } else {
+                Camera& camera = *cameras[tag - 3];
+                // Already dropped earlier in this batch
+                if (camera.lost) continue;
+                // Unplugged, or a USB glitch. V4L2 also reports EPOLLERR when no buffers are
+                //  queued, but we always leave the driver one.
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    lose_camera(camera, "device error");
+                    continue;
+                }
+                try {
+                    capture_frame(camera);
+                } catch (const std::exception& ex) {
+                    lose_camera(camera, ex.what());
+                }
+            }
+        }
+        if (woken) break;
+
+        // Stalled cameras are reopened like failed ones, and lost ones retried when /dev
+        //  changes, or every second
+        auto now = std::chrono::steady_clock::now();
+        for (auto& camera : cameras) {
+            if (camera->lost) {
+                if (devices_changed || now - camera->last_reopen_time >= std::chrono::seconds(1)) {
+                    try {
+                        try_reopen(*camera);
+                    } catch (const std::exception& ex) {
+                        fail(camera->name + ": " + ex.what());
+                    }
+                }
+                continue;
+            }
+            // Not polling it (no buffers to dequeue into) isn't a stall
+            if (!camera->armed || camera->stall_ms == 0) continue;
+            double waited_ms = std::chrono::duration<double, std::milli>(now - camera->last_frame_time).count();
+            if (waited_ms >= camera->stall_ms) {
+                lose_camera(*camera, "no frame in " + std::to_string((int)waited_ms) + "ms");
+            }
+        }
+
+        double stats_elapsed_ms = std::chrono::duration<double, std::milli>(now - last_stats_time).count();
+        if (options.stats_interval_ms > 0 && stats_elapsed_ms >= options.stats_interval_ms) {
+            log_stats(stats_elapsed_ms);
+            last_stats_time = now;
+        }
+    }
+
+    std::string message;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        message = error;
+    }
+    if (!message.empty()) throw std::runtime_error(message);
+}
+
+void CaptureManager::log_stats(double elapsed_ms) {
+    double total_fps = 0;
+    for (auto& camera : cameras) {
+        uint64_t delivered = camera->delivered;
+        double fps = (delivered - camera->logged_delivered) * 1000 / elapsed_ms;
+        camera->logged_delivered = delivered;
+        total_fps += fps;
+        CaptureStats camera_stats = stats(camera->index);
+        std::cout << camera->name << ": " << (int)(fps * 10) / 10.0 << " fps, delivered " << delivered
+                  << ", dropped " << camera_stats.dropped_stale << " stale, " << camera_stats.dropped_driver << " by driver" << std::endl;
+    }
+    std::cout << "All " << cameras.size() << " cameras: " << (int)(total_fps * 10) / 10.0 << " fps" << std::endl;
+}
+
+// On a decoder's thread, as it starts on one of the camera's frames
+void CaptureManager::frame_taken(Camera& camera) {
+    if (!camera.source->realtime()) {
+        // The capture thread waits for us to take its frame before reading the next
+        uint64_t one = 1;
+        if (write(release_fd, &one, sizeof(one)) == -1) {
+            std::cerr << "Failed to signal taken frame: " << strerror(errno) << std::endl;
+        }
+    }
+}
+
+void CaptureManager::consumer_loop(Camera& camera) {
+    while (true) {
+        DecodedFrame frame;
+        try {
+            // false once the pool is stopped
+            if (!decode_pool.get_next(camera.stream, frame)) return;
+        } catch (const std::exception& ex) {
+            // A corrupt frame (usually a USB hiccup), the next one will be fine
+            std::cerr << camera.name << ": " << ex.what() << std::endl;
+            continue;
+        }
+        try {
+            camera.on_frame(*frame.i420);
+            camera.delivered++;
+        } catch (const std::exception& ex) {
+            fail(camera.name + ": " + ex.what());
+            return;
+        }
+    }
+}
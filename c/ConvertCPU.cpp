@@ -1,75 +1,606 @@
+#pragma once
 #include <iostream>
 #include <vector>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <csetjmp>
 #include <jpeglib.h>
 #include <stdexcept>
 
-class MJPEGtoI420Converter {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "FrameView.cpp"
+#include "FrameBuffer.cpp"
+#include "FrameConverter.cpp"
+
+// libjpeg's default error handler calls exit(), which would take the whole capture process
+//  down over one corrupt frame. This one jumps back to the setjmp in the caller instead, which
+//  then throws. No C++ objects with destructors may live between the setjmp and libjpeg.
+struct JpegErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void jpeg_error_exit_jump(j_common_ptr cinfo) {
+    JpegErrorManager* err = (JpegErrorManager*)cinfo->err;
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jump, 1);
+}
+
+static struct jpeg_error_mgr* jpeg_throwing_error(JpegErrorManager* err) {
+    jpeg_std_error(&err->pub);
+    err->pub.error_exit = jpeg_error_exit_jump;
+    err->message[0] = 0;
+    return &err->pub;
+}
+
+// One libjpeg decompressor, decoding into I420 planes. Not thread safe, each thread needs its own.
+class JpegI420Decoder {
+public:
+    JpegI420Decoder();
+    ~JpegI420Decoder();
+
+    // Decode a width x height JPEG into the given Y/U/V planes (each packed, with width and
+    //  width / 2 strides). The planes may point into the middle of a bigger image.
+    void decode(const uint8_t* data, size_t size, int width, int height, uint8_t* const planes[3]);
+
+    // What MJPEGtoI420Converter needs to know to split a frame at its restart markers
+    struct SliceLayout {
+        int restart_interval;   // In MCUs, 0 if the frame has no restart markers
+        int mcu_width;          // In pixels
+        int mcu_height;
+    };
+    // Reads just the header. Returns false if the frame can't be decoded as independent strips
+    //  (progressive, multiple scans, no restart markers, or a layout we'd use the RGB path for).
+    bool read_slice_layout(const uint8_t* data, size_t size, SliceLayout& layout);
+
+    // false forces the old decode to RGB and convert path (for comparing the two, e.g. in bench.cpp)
+    void set_raw_decode(bool enabled) { raw_decode = enabled; }
+
+private:
+    bool raw_decode = true;
+
+    // Reused across frames, creating a decompressor allocates its memory pools every time
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+
+    // Row buffers for MCU rows that don't land directly in the output (padding, resampling)
+    std::vector<uint8_t> scratch;
+
+    bool can_decode_raw();
+    void jpeg_raw_to_i420(uint8_t* const planes[3]);
+    void jpeg_to_i420(j_decompress_ptr cinfo, uint8_t* const planes[3]);
+};
+
+class MJPEGtoI420Converter : public FrameConverter {
 public:
-    MJPEGtoI420Converter();
+    // With slice_threads > 1, frames with restart markers (most UVC cameras emit them) are
+    //  split into strips of MCU rows, which are decoded in parallel. This cuts the latency of
+    //  each frame, unlike MJPEGDecodePool, which only improves throughput.
+    MJPEGtoI420Converter(int slice_threads = 1);
     ~MJPEGtoI420Converter();
 
     // Converts MJPEG buffer to I420 (YUV420) format
-    std::vector<uint8_t> convert_frame(const std::vector<uint8_t>& mjpeg_buffer, int width, int height);
+    std::vector<uint8_t> convert_frame(const FrameView& mjpeg_buffer, int width, int height);
+    // Same, but into a pooled frame (the JPEG must match its size), so nothing is allocated per frame
+    void convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) override;
+
+    std::string name() const override { return "cpu"; }
+
+    uint64_t sliced_frame_count() const { return sliced_frames; }
+
+    // false decodes to RGB and converts, like we used to (this also disables slicing)
+    void set_raw_decode(bool enabled) { decoder.set_raw_decode(enabled); }
 
 private:
-    void jpeg_to_i420(j_decompress_ptr cinfo, uint8_t* yuv_buffer);
+    JpegI420Decoder decoder;
+
+    // One standalone JPEG per strip of MCU rows, rebuilt every frame (the buffers are reused)
+    struct Strip {
+        int first_row;
+        int rows;
+        std::vector<uint8_t> jpeg;
+        std::string error;
+    };
+    std::vector<Strip> strips;
+    int strip_count;
+    std::vector<size_t> restart_offsets;  // Offset of each RSTn marker in the current frame
+    std::vector<int> strip_cuts;          // MCU row each strip starts at, plus the end
+
+    // Strip i + 1 is decoded by slice_workers[i], strip 0 by the calling thread
+    std::vector<std::thread> slice_workers;
+    std::mutex slice_mutex;
+    std::condition_variable slice_start_cv;
+    std::condition_variable slice_done_cv;
+    uint64_t slice_generation;
+    int slices_pending;
+    bool slice_stop;
+    int slice_width;
+    int slice_height;
+    uint8_t* slice_output;
+    uint64_t sliced_frames;
+
+    void decode_into(const FrameView& mjpeg_buffer, int width, int height, uint8_t* i420_buffer);
+    bool plan_strips(const FrameView& mjpeg_buffer, int width, int height);
+    void decode_strip(JpegI420Decoder& strip_decoder, Strip& strip);
+    void slice_worker(int index);
 };
 
-MJPEGtoI420Converter::MJPEGtoI420Converter() {
-    // Constructor (can initialize libjpeg settings if needed)
+JpegI420Decoder::JpegI420Decoder() {
+    cinfo.err = jpeg_throwing_error(&jerr);
+    jpeg_create_decompress(&cinfo);
 }
 
-MJPEGtoI420Converter::~MJPEGtoI420Converter() {
-    // Destructor (clean up if necessary)
+JpegI420Decoder::~JpegI420Decoder() {
+    jpeg_destroy_decompress(&cinfo);
 }
 
-// Convert MJPEG buffer to I420
-std::vector<uint8_t> MJPEGtoI420Converter::convert_frame(const std::vector<uint8_t>& mjpeg_buffer, int width, int height) {
-    // Prepare the JPEG decompression object
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
+void JpegI420Decoder::decode(const uint8_t* data, size_t size, int width, int height, uint8_t* const planes[3]) {
+    // libjpeg errors (corrupt frames) land here
+    if (setjmp(jerr.jump)) {
+        jpeg_abort_decompress(&cinfo);
+        throw std::runtime_error("Failed to decode MJPEG frame: " + std::string(jerr.message));
+    }
 
     // Specify data source (MJPEG buffer)
-    jpeg_mem_src(&cinfo, mjpeg_buffer.data(), mjpeg_buffer.size());
+    jpeg_mem_src(&cinfo, data, size);
 
-    // Read header to get image info
+    // Read header to get image info. This also resets all the output parameters to their defaults.
     if (jpeg_read_header(&cinfo, TRUE) != 1) {
-        jpeg_destroy_decompress(&cinfo);
+        jpeg_abort_decompress(&cinfo);
         throw std::runtime_error("Failed to read MJPEG header");
     }
 
-    // Start decompression
-    jpeg_start_decompress(&cinfo);
-
     // Ensure dimensions match
-    if (cinfo.output_width != width || cinfo.output_height != height) {
-        jpeg_destroy_decompress(&cinfo);
+    if ((int)cinfo.image_width != width || (int)cinfo.image_height != height) {
+        jpeg_abort_decompress(&cinfo);
         throw std::runtime_error("MJPEG dimensions do not match expected size");
     }
 
+    // The JPEG is already YCbCr, so if the layout is one we can resample cheaply, skip the RGB round trip
+    bool raw = can_decode_raw();
+    if (raw) {
+        cinfo.raw_data_out = TRUE;
+        cinfo.out_color_space = cinfo.jpeg_color_space;
+        cinfo.do_fancy_upsampling = FALSE;
+    } else {
+        cinfo.out_color_space = JCS_RGB;
+    }
+
+    jpeg_start_decompress(&cinfo);
+    try {
+        if (raw) {
+            jpeg_raw_to_i420(planes);
+        } else {
+            jpeg_to_i420(&cinfo, planes);
+        }
+    } catch (...) {
+        // Leave cinfo reusable for the next frame
+        jpeg_abort_decompress(&cinfo);
+        throw;
+    }
+    jpeg_finish_decompress(&cinfo);
+}
+
+bool JpegI420Decoder::read_slice_layout(const uint8_t* data, size_t size, SliceLayout& layout) {
+    if (setjmp(jerr.jump)) {
+        jpeg_abort_decompress(&cinfo);
+        return false;
+    }
+    jpeg_mem_src(&cinfo, data, size);
+    if (jpeg_read_header(&cinfo, TRUE) != 1) {
+        jpeg_abort_decompress(&cinfo);
+        return false;
+    }
+    // Only a single interleaved baseline scan has every MCU row in one run of entropy data
+    bool ok = !cinfo.progressive_mode && cinfo.comps_in_scan == cinfo.num_components && can_decode_raw();
+    layout.restart_interval = cinfo.restart_interval;
+    layout.mcu_width = cinfo.num_components == 1 ? DCTSIZE : cinfo.max_h_samp_factor * DCTSIZE;
+    layout.mcu_height = cinfo.num_components == 1 ? DCTSIZE : cinfo.max_v_samp_factor * DCTSIZE;
+    jpeg_abort_decompress(&cinfo);
+    return ok && layout.restart_interval > 0;
+}
+
+// Whether jpeg_raw_to_i420 handles this sampling layout (grayscale, 4:2:0, 4:2:2, 4:4:4)
+bool JpegI420Decoder::can_decode_raw() {
+    if (!raw_decode) return false;
+    if (cinfo.num_components == 1 && cinfo.jpeg_color_space == JCS_GRAYSCALE) {
+        return cinfo.comp_info[0].h_samp_factor == 1 && cinfo.comp_info[0].v_samp_factor == 1;
+    }
+    if (cinfo.num_components != 3 || cinfo.jpeg_color_space != JCS_YCbCr) return false;
+
+    jpeg_component_info* comp = cinfo.comp_info;
+    int h = comp[0].h_samp_factor;
+    int v = comp[0].v_samp_factor;
+    if (h > 2 || v > 2) return false;
+    for (int c = 1; c < 3; c++) {
+        if (comp[c].h_samp_factor != 1 || comp[c].v_samp_factor != 1) return false;
+    }
+    // Luma must never be below chroma resolution
+    return h >= 1 && v >= 1;
+}
+
+MJPEGtoI420Converter::MJPEGtoI420Converter(int slice_threads)
+    : strip_count(0), slice_generation(0), slices_pending(0), slice_stop(false),
+      slice_width(0), slice_height(0), slice_output(nullptr), sliced_frames(0) {
+    for (int i = 1; i < slice_threads; i++) {
+        slice_workers.emplace_back(&MJPEGtoI420Converter::slice_worker, this, i - 1);
+    }
+    strips.resize(std::max(1, slice_threads));
+}
+
+MJPEGtoI420Converter::~MJPEGtoI420Converter() {
+    {
+        std::lock_guard<std::mutex> lock(slice_mutex);
+        slice_stop = true;
+    }
+    slice_start_cv.notify_all();
+    for (auto& worker : slice_workers) {
+        worker.join();
+    }
+}
+
+// Convert MJPEG buffer to I420
+std::vector<uint8_t> MJPEGtoI420Converter::convert_frame(const FrameView& mjpeg_buffer, int width, int height) {
     // Allocate space for the I420 buffer
     std::vector<uint8_t> i420_buffer(width * height * 3 / 2);  // YUV420: Y + (U/2 + V/2)
+    decode_into(mjpeg_buffer, width, height, i420_buffer.data());
+    return i420_buffer;
+}
 
-    // Convert the JPEG to I420 format
-    jpeg_to_i420(&cinfo, i420_buffer.data());
+void MJPEGtoI420Converter::convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) {
+    decode_into(mjpeg_buffer, frame.width, frame.height, frame.data);
+    frame.sequence = mjpeg_buffer.sequence;
+    frame.timestamp_us = mjpeg_buffer.timestamp_us;
+}
 
-    // Finish decompression
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+void MJPEGtoI420Converter::decode_into(const FrameView& mjpeg_buffer, int width, int height, uint8_t* i420_buffer) {
+    if (!slice_workers.empty() && plan_strips(mjpeg_buffer, width, height)) {
+        {
+            std::lock_guard<std::mutex> lock(slice_mutex);
+            slice_width = width;
+            slice_height = height;
+            slice_output = i420_buffer;
+            slices_pending = strip_count - 1;
+            slice_generation++;
+        }
+        slice_start_cv.notify_all();
 
-    return i420_buffer;
+        decode_strip(decoder, strips[0]);
+
+        std::unique_lock<std::mutex> lock(slice_mutex);
+        slice_done_cv.wait(lock, [this]() { return slices_pending == 0; });
+        for (int i = 0; i < strip_count; i++) {
+            if (!strips[i].error.empty()) {
+                throw std::runtime_error(strips[i].error);
+            }
+        }
+        sliced_frames++;
+        return;
+    }
+
+    uint8_t* planes[3];
+    planes[0] = i420_buffer;
+    planes[1] = i420_buffer + width * height;
+    planes[2] = planes[1] + (width / 2) * (height / 2);
+    decoder.decode(mjpeg_buffer.data, mjpeg_buffer.size, width, height, planes);
+}
+
+static int greatest_common_divisor(int a, int b) {
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Splits the frame at restart markers into strips of whole MCU rows. Each strip becomes a
+//  standalone JPEG: the original headers with the height patched, the strip's entropy data
+//  with its RSTn markers renumbered from RST0, and an EOI. The DC predictors reset at every
+//  restart marker, so each strip decodes on its own. Returns false (decode the whole frame
+//  normally) if the frame has no usable restart markers.
+bool MJPEGtoI420Converter::plan_strips(const FrameView& frame, int width, int height) {
+    const uint8_t* data = frame.data;
+    size_t size = frame.size;
+
+    JpegI420Decoder::SliceLayout layout;
+    if (!decoder.read_slice_layout(data, size, layout)) return false;
+
+    // Find where the height is stored, and where the entropy coded data starts
+    size_t height_offset = 0;
+    size_t scan_start = 0;
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        uint8_t marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        size_t length = (data[pos + 2] << 8) | data[pos + 3];
+        if (marker == 0xC0 || marker == 0xC1) {
+            height_offset = pos + 5;
+        }
+        if (marker == 0xDA) {
+            scan_start = pos + 2 + length;
+            break;
+        }
+        pos += 2 + length;
+    }
+    if (!height_offset || !scan_start || scan_start > size) return false;
+
+    // Find every restart marker. 0xFF00 is a stuffed 0xFF byte, 0xFFFF is fill.
+    restart_offsets.clear();
+    size_t scan_end = size;
+    pos = scan_start;
+    while (pos + 1 < size) {
+        const uint8_t* next = (const uint8_t*)memchr(data + pos, 0xFF, size - pos - 1);
+        if (!next) break;
+        size_t offset = next - data;
+        uint8_t marker = data[offset + 1];
+        if (marker == 0x00 || marker == 0xFF) {
+            pos = offset + 1;
+        } else if (marker >= 0xD0 && marker <= 0xD7) {
+            restart_offsets.push_back(offset);
+            pos = offset + 2;
+        } else if (marker == 0xD9) {
+            scan_end = offset;
+            break;
+        } else {
+            // Another marker (DNL, a second scan), not something we can split
+            return false;
+        }
+    }
+
+    int mcus_per_row = (width + layout.mcu_width - 1) / layout.mcu_width;
+    int mcu_rows = (height + layout.mcu_height - 1) / layout.mcu_height;
+    int interval = layout.restart_interval;
+    int interval_count = (mcus_per_row * mcu_rows + interval - 1) / interval;
+    if ((int)restart_offsets.size() != interval_count - 1) return false;
+
+    // We can only cut where a restart interval starts at the beginning of an MCU row
+    int row_step = interval / greatest_common_divisor(mcus_per_row, interval);
+    int wanted = strips.size();
+    std::vector<int>& cuts = strip_cuts;
+    cuts.clear();
+    cuts.push_back(0);
+    for (int i = 1; i < wanted; i++) {
+        int target = (int)((double)i * mcu_rows / wanted / row_step + 0.5) * row_step;
+        if (target > cuts.back() && target < mcu_rows) {
+            cuts.push_back(target);
+        }
+    }
+    cuts.push_back(mcu_rows);
+    strip_count = cuts.size() - 1;
+    if (strip_count < 2) return false;
+
+    for (int s = 0; s < strip_count; s++) {
+        Strip& strip = strips[s];
+        int first_interval = cuts[s] * mcus_per_row / interval;
+        // The last interval of the frame may be partial
+        int end_interval = s == strip_count - 1 ? interval_count : cuts[s + 1] * mcus_per_row / interval;
+        size_t entropy_start = first_interval == 0 ? scan_start : restart_offsets[first_interval - 1] + 2;
+        size_t entropy_end = s == strip_count - 1 ? scan_end : restart_offsets[end_interval - 1];
+
+        strip.first_row = cuts[s] * layout.mcu_height;
+        strip.rows = std::min(cuts[s + 1] * layout.mcu_height, height) - strip.first_row;
+        strip.error.clear();
+
+        strip.jpeg.clear();
+        strip.jpeg.insert(strip.jpeg.end(), data, data + scan_start);
+        strip.jpeg[height_offset] = strip.rows >> 8;
+        strip.jpeg[height_offset + 1] = strip.rows & 0xFF;
+        strip.jpeg.insert(strip.jpeg.end(), data + entropy_start, data + entropy_end);
+        // libjpeg expects the first marker of a scan to be RST0
+        for (int k = first_interval; k < end_interval - 1; k++) {
+            strip.jpeg[scan_start + (restart_offsets[k] - entropy_start) + 1] = 0xD0 + (k - first_interval) % 8;
+        }
+        strip.jpeg.push_back(0xFF);
+        strip.jpeg.push_back(0xD9);
+    }
+    return true;
+}
+
+void MJPEGtoI420Converter::decode_strip(JpegI420Decoder& strip_decoder, Strip& strip) {
+    int width = slice_width;
+    int height = slice_height;
+    uint8_t* planes[3];
+    planes[0] = slice_output + (size_t)strip.first_row * width;
+    planes[1] = slice_output + (size_t)width * height + (size_t)(strip.first_row / 2) * (width / 2);
+    planes[2] = planes[1] + (size_t)(width / 2) * (height / 2);
+    try {
+        strip_decoder.decode(strip.jpeg.data(), strip.jpeg.size(), width, strip.rows, planes);
+    } catch (const std::exception& ex) {
+        strip.error = ex.what();
+    }
+}
+
+void MJPEGtoI420Converter::slice_worker(int index) {
+    JpegI420Decoder strip_decoder;
+    uint64_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(slice_mutex);
+            slice_start_cv.wait(lock, [&]() { return slice_stop || slice_generation != seen_generation; });
+            if (slice_stop) return;
+            seen_generation = slice_generation;
+            // Fewer strips than threads this frame
+            if (index + 1 >= strip_count) continue;
+        }
+        decode_strip(strip_decoder, strips[index + 1]);
+        {
+            std::lock_guard<std::mutex> lock(slice_mutex);
+            slices_pending--;
+        }
+        slice_done_cv.notify_all();
+    }
+}
+
+// dst[i] = (a[i] + b[i] + 1) / 2
+static void average_rows(const uint8_t* a, const uint8_t* b, uint8_t* dst, int width) {
+    int x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 16 <= width; x += 16) {
+        vst1q_u8(dst + x, vrhaddq_u8(vld1q_u8(a + x), vld1q_u8(b + x)));
+    }
+#elif defined(__SSE2__)
+    for (; x + 16 <= width; x += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_avg_epu8(va, vb));
+    }
+#endif
+    for (; x < width; x++) {
+        dst[x] = (a[x] + b[x] + 1) >> 1;
+    }
+}
+
+// Halves both dimensions, dst has width / 2 entries. Rounds the same way as average_rows
+//  applied twice (vertical, then horizontal), which is what the SIMD paths do.
+static void average_rows_2x2(const uint8_t* a, const uint8_t* b, uint8_t* dst, int width) {
+    int x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x2_t va = vld2q_u8(a + x);
+        uint8x16x2_t vb = vld2q_u8(b + x);
+        uint8x16_t even = vrhaddq_u8(va.val[0], vb.val[0]);
+        uint8x16_t odd = vrhaddq_u8(va.val[1], vb.val[1]);
+        vst1q_u8(dst + x / 2, vrhaddq_u8(even, odd));
+    }
+#elif defined(__SSE2__)
+    const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+    for (; x + 32 <= width; x += 32) {
+        __m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x)));
+        __m128i v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(a + x + 16)), _mm_loadu_si128((const __m128i*)(b + x + 16)));
+        __m128i even = _mm_packus_epi16(_mm_and_si128(v0, low_bytes), _mm_and_si128(v1, low_bytes));
+        __m128i odd = _mm_packus_epi16(_mm_srli_epi16(v0, 8), _mm_srli_epi16(v1, 8));
+        _mm_storeu_si128((__m128i*)(dst + x / 2), _mm_avg_epu8(even, odd));
+    }
+#endif
+    for (; x + 1 < width; x += 2) {
+        int even = (a[x] + b[x] + 1) >> 1;
+        int odd = (a[x + 1] + b[x + 1] + 1) >> 1;
+        dst[x / 2] = (even + odd + 1) >> 1;
+    }
+}
+
+// Decode straight from the JPEG's YCbCr planes (jpeg_read_raw_data) into I420. Rows go
+//  directly into the output planes when the MCU layout lines up with them (the common case,
+//  ex, 1920 and 1280 widths), and are only copied/resampled through scratch rows otherwise.
+void JpegI420Decoder::jpeg_raw_to_i420(uint8_t* const planes[3]) {
+    int width = cinfo.output_width;
+    int height = cinfo.output_height;
+    int chroma_width = width / 2;
+    int chroma_height = height / 2;
+
+    bool grayscale = cinfo.num_components == 1;
+    if (grayscale) {
+        for (int r = 0; r < chroma_height; r++) {
+            memset(planes[1] + (size_t)r * chroma_width, 128, chroma_width);
+            memset(planes[2] + (size_t)r * chroma_width, 128, chroma_width);
+        }
+    }
+
+    int max_v = cinfo.max_v_samp_factor;
+    int max_h = cinfo.max_h_samp_factor;
+    int lines_per_imcu = max_v * DCTSIZE;
+
+    // Output plane geometry per component
+    int plane_width[3] = { width, chroma_width, chroma_width };
+    int plane_height[3] = { height, chroma_height, chroma_height };
+
+    // Rows per iMCU, and the padded row width, libjpeg writes for each component
+    int comp_rows[3];
+    int comp_stride[3];
+    // How many decoded rows/columns make one output row/column (1 = direct, 2 = average pairs)
+    int v_ratio[3];
+    int h_ratio[3];
+    size_t scratch_needed = 0;
+    for (int c = 0; c < cinfo.num_components; c++) {
+        jpeg_component_info* comp = &cinfo.comp_info[c];
+        comp_rows[c] = comp->v_samp_factor * DCTSIZE;
+        comp_stride[c] = comp->width_in_blocks * DCTSIZE;
+        // Luma is never resampled, chroma has to end up at half of the luma resolution
+        v_ratio[c] = c == 0 ? 1 : 2 * comp->v_samp_factor / max_v;
+        h_ratio[c] = c == 0 ? 1 : 2 * comp->h_samp_factor / max_h;
+        scratch_needed += (size_t)comp_rows[c] * comp_stride[c];
+    }
+    if (scratch.size() < scratch_needed) {
+        scratch.resize(scratch_needed);
+    }
+
+    JSAMPROW row_pointers[3][2 * DCTSIZE * 2];
+    JSAMPARRAY component_rows[3];
+    uint8_t* scratch_rows[3];
+    size_t scratch_offset = 0;
+    for (int c = 0; c < cinfo.num_components; c++) {
+        component_rows[c] = row_pointers[c];
+        scratch_rows[c] = scratch.data() + scratch_offset;
+        scratch_offset += (size_t)comp_rows[c] * comp_stride[c];
+    }
+
+    int imcu_row = 0;
+    while (cinfo.output_scanline < cinfo.output_height) {
+        // Where each decoded row goes. Rows that map 1:1 onto the output, with no padding, are
+        //  written in place. Everything else goes to scratch and is fixed up after.
+        bool direct[3];
+        for (int c = 0; c < cinfo.num_components; c++) {
+            int first_row = imcu_row * comp_rows[c] / v_ratio[c];
+            direct[c] = v_ratio[c] == 1 && h_ratio[c] == 1 && comp_stride[c] == plane_width[c]
+                && first_row + comp_rows[c] <= plane_height[c];
+            for (int r = 0; r < comp_rows[c]; r++) {
+                row_pointers[c][r] = direct[c]
+                    ? planes[c] + (size_t)(first_row + r) * plane_width[c]
+                    : scratch_rows[c] + (size_t)r * comp_stride[c];
+            }
+        }
+
+        if (jpeg_read_raw_data(&cinfo, component_rows, lines_per_imcu) == 0) {
+            throw std::runtime_error("Failed to read raw MJPEG data");
+        }
+
+        for (int c = 0; c < cinfo.num_components; c++) {
+            if (direct[c]) continue;
+            int first_row = imcu_row * comp_rows[c] / v_ratio[c];
+            int out_rows = comp_rows[c] / v_ratio[c];
+            for (int r = 0; r < out_rows && first_row + r < plane_height[c]; r++) {
+                uint8_t* dst = planes[c] + (size_t)(first_row + r) * plane_width[c];
+                const uint8_t* src0 = scratch_rows[c] + (size_t)(r * v_ratio[c]) * comp_stride[c];
+                if (v_ratio[c] == 1 && h_ratio[c] == 1) {
+                    memcpy(dst, src0, plane_width[c]);
+                } else if (h_ratio[c] == 1) {
+                    // 4:2:2, two chroma rows per output row
+                    average_rows(src0, src0 + comp_stride[c], dst, plane_width[c]);
+                } else {
+                    // 4:4:4, 2x2 chroma samples per output sample
+                    const uint8_t* src1 = v_ratio[c] == 2 ? src0 + comp_stride[c] : src0;
+                    average_rows_2x2(src0, src1, dst, plane_width[c] * 2);
+                }
+            }
+        }
+        imcu_row++;
+    }
 }
 
-// Helper function to convert JPEG to I420 format
-void MJPEGtoI420Converter::jpeg_to_i420(j_decompress_ptr cinfo, uint8_t* yuv_buffer) {
+// Fallback for sampling layouts jpeg_raw_to_i420 doesn't handle. Has libjpeg convert to RGB,
+//  and converts each pixel back to YUV.
+void JpegI420Decoder::jpeg_to_i420(j_decompress_ptr cinfo, uint8_t* const planes[3]) {
     int width = cinfo->output_width;
     int height = cinfo->output_height;
 
-    uint8_t* y_plane = yuv_buffer;                         // Y plane (full resolution)
-    uint8_t* u_plane = yuv_buffer + width * height;        // U plane (half resolution)
-    uint8_t* v_plane = u_plane + (width * height) / 4;     // V plane (half resolution)
+    uint8_t* y_plane = planes[0];     // Y plane (full resolution)
+    uint8_t* u_plane = planes[1];     // U plane (half resolution)
+    uint8_t* v_plane = planes[2];     // V plane (half resolution)
 
     // Allocate a buffer to hold one scanline of the image
     JSAMPARRAY buffer = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE, width * cinfo->output_components, 1);
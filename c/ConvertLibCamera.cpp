@@ -1,14 +1,23 @@
+#pragma once
 #include <libcamera/libcamera.h>
 #include <iostream>
 #include <vector>
 #include <memory>
 
-class MJPEGtoI420ConverterLibcamera {
+#include "FrameView.cpp"
+#include "FrameBuffer.cpp"
+#include "FrameConverter.cpp"
+
+class MJPEGtoI420ConverterLibcamera : public FrameConverter {
 public:
     MJPEGtoI420ConverterLibcamera(int width, int height);
     ~MJPEGtoI420ConverterLibcamera();
 
-    std::vector<uint8_t> convert_frame(const std::vector<uint8_t>& mjpeg_buffer);
+    std::vector<uint8_t> convert_frame(const FrameView& mjpeg_buffer);
+    // Not implemented yet, so throws (and the registry's probe skips this backend)
+    void convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) override;
+
+    std::string name() const override { return "libcamera"; }
 
 private:
     std::shared_ptr<libcamera::CameraManager> camera_manager;
@@ -70,7 +79,7 @@ void MJPEGtoI420ConverterLibcamera::init_camera() {
 
 
 // Convert MJPEG frame buffer to I420 (dummy implementation for now)
-std::vector<uint8_t> MJPEGtoI420ConverterLibcamera::convert_frame(const std::vector<uint8_t>& mjpeg_buffer) {
+std::vector<uint8_t> MJPEGtoI420ConverterLibcamera::convert_frame(const FrameView& mjpeg_buffer) {
     // You would implement MJPEG to I420 conversion logic here, likely using libjpeg or libcamera for the actual conversion
     std::vector<uint8_t> i420_frame(width * height * 3 / 2);  // Placeholder for I420 frame size
     // Actual conversion from MJPEG to I420 should happen here
@@ -90,3 +99,7 @@ void MJPEGtoI420ConverterLibcamera::cleanup_camera() {
         camera_manager.reset();
     }
 }
+
+void MJPEGtoI420ConverterLibcamera::convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) {
+    throw std::runtime_error("libcamera MJPEG conversion is not implemented");
+}
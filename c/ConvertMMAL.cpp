@@ -1,5 +1,10 @@
+#pragma once
 #include <iostream>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <mmal.h>
 #include <mmal_logging.h>
 #include <mmal_util.h>
@@ -7,46 +12,98 @@
 #include <mmal_parameters_video.h>
 #include <bcm_host.h>
 
+#include "FrameView.cpp"
+#include "FrameBuffer.cpp"
+#include "FrameConverter.cpp"
+#include "AsyncDecoder.cpp"
+
 
 #define CHECK_STATUS(status, msg) \
     if (status != MMAL_SUCCESS) { \
         throw std::runtime_error(std::string(msg) + ": " + mmal_status_to_string(status)); \
     }
 
-class MJPEGtoI420ConverterMMAL {
+// Hardware MJPEG decoding (vc.ril.image_decode), with several frames in flight.
+//
+// Input buffer headers carry no payload of their own, they point straight at the submitted
+//  frame (the capture buffer), which is kept leased until the input callback hands the header
+//  back. Decoded frames are handed out in the output port's own buffers (DecodedImage), and
+//  go back to the port when released. Both pools are sized from the formats the ports
+//  negotiate, and the output is re-sized if the decoder sends MMAL_EVENT_FORMAT_CHANGED.
+class MMALAsyncDecoder : public AsyncFrameDecoder {
 public:
-    MJPEGtoI420ConverterMMAL(int width, int height);
-    ~MJPEGtoI420ConverterMMAL();
+    // output_buffers <= 0 uses max_in_flight + 2, so two decoded frames can be held
+    MMALAsyncDecoder(int width, int height, int max_in_flight = 3, int output_buffers = 0);
+    ~MMALAsyncDecoder();
 
-    // Convert MJPEG frame buffer to I420
-    std::vector<uint8_t> convert_frame(const std::vector<uint8_t>& mjpeg_buffer);
+    bool next_decoded(DecodedImage& image, int timeout_ms = -1) override;
+    int in_flight() override;
+    int max_in_flight() const override { return in_flight_limit; }
+    uint64_t dropped_frames() override;
+
+protected:
+    void submit_input(PendingInput&& input) override;
+    void release_output(void* token) override;
 
 private:
     MMAL_COMPONENT_T *decoder;
     MMAL_POOL_T *input_pool;
     MMAL_POOL_T *output_pool;
-    MMAL_QUEUE_T *queue;
+    MMAL_QUEUE_T *decoded;          // Output buffers (and events) from the callback, in order
     int width;
     int height;
+    int in_flight_limit;
+    int output_buffer_count;
+
+    // One per input header (header->user_data points at it), holds the frame until the input callback
+    std::vector<PendingInput> input_slots;
+
+    // Submission order goes in pts, so decoded frames can be matched to their metadata even
+    //  when the decoder drops one. Indexed by order % in_flight_limit.
+    struct FrameInfo {
+        uint32_t sequence;
+        int64_t timestamp_us;
+    };
+    std::vector<FrameInfo> frame_info;
+
+    std::mutex mutex;
+    std::condition_variable space_cv;
+    uint64_t next_submit;
+    uint64_t next_deliver;
+    uint64_t dropped;
+    int lent_outputs;               // Output buffers held by DecodedImages
+    std::atomic<int> error_status;  // Set by the control callback
 
     void init_mmal();
     void cleanup_mmal();
+    void create_output_pool();
+    void send_output_buffers();
+    void handle_format_changed(MMAL_BUFFER_HEADER_T *event);
     static void input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
     static void output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
     static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);  // Event callback for the control port
 };
 
-MJPEGtoI420ConverterMMAL::MJPEGtoI420ConverterMMAL(int width, int height)
-    : width(width), height(height), decoder(nullptr), input_pool(nullptr), output_pool(nullptr), queue(nullptr) {
+MMALAsyncDecoder::MMALAsyncDecoder(int width, int height, int max_in_flight, int output_buffers)
+    : decoder(nullptr), input_pool(nullptr), output_pool(nullptr), decoded(nullptr),
+      width(width), height(height), in_flight_limit(std::max(1, max_in_flight)),
+      output_buffer_count(output_buffers > 0 ? output_buffers : in_flight_limit + 2),
+      input_slots(in_flight_limit), frame_info(in_flight_limit),
+      next_submit(0), next_deliver(0), dropped(0), lent_outputs(0), error_status(MMAL_SUCCESS) {
     bcm_host_init();
-    init_mmal();
+    try {
+        init_mmal();
+    } catch (...) {
+        cleanup_mmal();
+        throw;
+    }
 }
 
-MJPEGtoI420ConverterMMAL::~MJPEGtoI420ConverterMMAL() {
+MMALAsyncDecoder::~MMALAsyncDecoder() {
     cleanup_mmal();
 }
 
-void MJPEGtoI420ConverterMMAL::init_mmal() {
+void MMALAsyncDecoder::init_mmal() {
     MMAL_STATUS_T status;
 
     // Create MJPEG decoder component
@@ -58,34 +115,11 @@ void MJPEGtoI420ConverterMMAL::init_mmal() {
     status = mmal_port_enable(decoder->control, control_callback);
     CHECK_STATUS(status, "Failed to enable control port");
 
-    // mmal_port_parameter_set_boolean(decoder->output[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-    //status = mmal_port_parameter_set_boolean(decoder->output[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-    //CHECK_STATUS(status, "Failed to set immutable input");
-
-    // Do we have to set camera control?
-    /*
-        MMAL_PARAMETER_CAMERA_CONFIG_T cam_config = {{MMAL_PARAMETER_CAMERA_CONFIG,sizeof(cam_config)},
-        .max_stills_w =      width,
-        .max_stills_h =      height,
-        .stills_yuv422 =     0,
-        .one_shot_stills =   0,
-        .max_preview_video_w = width,
-        .max_preview_video_h = height,
-        .num_preview_video_frames = 3,
-        .stills_capture_circular_buffer_height = 0,
-        .fast_preview_resume = 0,
-        .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
-        };
-
-      mmal_port_parameter_set(camera->control, &cam_config.hdr);
-    */
-
     MMAL_PORT_T *input_port = decoder->input[0];
     MMAL_PORT_T *output_port = decoder->output[0];
 
     // Configure input port for MJPEG
     MMAL_ES_FORMAT_T *input_format = input_port->format;
-    // input_format->type = MMAL_ES_TYPE_VIDEO;
     // I assume MJPEG allows you to writes parts of JPEGs and it will figure it out. BUT,
     //  for single JPEGs, it seems to block (maybe it is waiting for another image?)
     // input_format->encoding = MMAL_ENCODING_MJPEG;
@@ -93,8 +127,6 @@ void MJPEGtoI420ConverterMMAL::init_mmal() {
     input_format->encoding = MMAL_ENCODING_JPEG;
     input_format->es->video.width = 0;
     input_format->es->video.height = 0;
-    // input_format->es->video.crop.width = 0;
-    // input_format->es->video.crop.height = 0;
     input_format->es->video.frame_rate.num = 0;
     input_format->es->video.frame_rate.den = 1;
     input_format->es->video.par.num = 1;
@@ -113,49 +145,25 @@ void MJPEGtoI420ConverterMMAL::init_mmal() {
     output_format->es->video.crop.width = width;
     output_format->es->video.crop.height = height;
 
-    // if(output_port->format != output_port->priv->core->format_ptr_copy) {
-    //     std::cout << "output_port->format != output_port->priv->core->format_ptr_copy" << std::endl;
-    // }
-    std::cout << "output_port->format->es->video.width: " << output_port->format->es->video.width << std::endl;
-    std::cout << "output_port->format->es->video.height: " << output_port->format->es->video.height << std::endl;
-    //std::cout << "private width: " << output_port->priv->core->format_ptr_copy->es->video.width << std::endl;
-
     status = mmal_port_format_commit(output_port);
     CHECK_STATUS(status, "Failed to configure output port");
 
-    std::cout << "output_port->format->encoding: " << output_port->format->encoding << std::endl;
-    std::cout << "bitrate: " << output_port->format->bitrate << std::endl;
-    
-    std::cout << "output_port->format->es->video.width: " << output_port->format->es->video.width << std::endl;
-    std::cout << "output_port->format->es->video.height: " << output_port->format->es->video.height << std::endl;
-    std::cout << "output_port->format->es->video.crop.width: " << output_port->format->es->video.crop.width << std::endl;
-    std::cout << "output_port->format->es->video.crop.height: " << output_port->format->es->video.crop.height << std::endl;
-    std::cout << "output_port->format->es->video.crop.x: " << output_port->format->es->video.crop.x << std::endl;
-    std::cout << "output_port->format->es->video.crop.y: " << output_port->format->es->video.crop.y << std::endl;
-
-    // Configure buffer numbers and sizes
-    input_port->buffer_num = input_port->buffer_num_recommended;
-    // NOTE: The recommended buffer sizes seem to be too small for MJPEG, and result in errors.
-    input_port->buffer_size = 1920 * 1080 * 4;
-    output_port->buffer_num = 3;
-    output_port->buffer_size = 1920 * 1080 * 4;
-    std::cout << "input_port->buffer_num: " << input_port->buffer_num << std::endl;
-    std::cout << "input_port->buffer_size: " << input_port->buffer_size << std::endl;
-    std::cout << "output_port->buffer_num: " << output_port->buffer_num << std::endl;
-    std::cout << "output_port->buffer_size: " << output_port->buffer_size << std::endl;
-
-    // Create input and output buffer pools
-    input_pool = mmal_port_pool_create(input_port, input_port->buffer_num, input_port->buffer_size);
+    // The input headers point at the submitted frames, so they need no payload of their own
+    input_port->buffer_num = std::max((uint32_t)in_flight_limit, input_port->buffer_num_min);
+    input_port->buffer_size = std::max(input_port->buffer_size_recommended, input_port->buffer_size_min);
+    input_pool = mmal_port_pool_create(input_port, input_port->buffer_num, 0);
     if (!input_pool) throw std::runtime_error("Failed to create input buffer pool");
+    input_slots.resize(input_pool->headers_num);
+    for (uint32_t i = 0; i < input_pool->headers_num; i++) {
+        input_pool->header[i]->user_data = &input_slots[i];
+    }
 
-    output_pool = mmal_port_pool_create(output_port, output_port->buffer_num, output_port->buffer_size);
-    if (!output_pool) throw std::runtime_error("Failed to create output buffer pool");
+    create_output_pool();
 
-    // Create a queue for decoded frames
-    queue = mmal_queue_create();
-    if (!queue) throw std::runtime_error("Failed to create queue");
+    // Decoded frames are queued by the output callback, and taken by next_decoded
+    decoded = mmal_queue_create();
+    if (!decoded) throw std::runtime_error("Failed to create queue");
 
-    // Store queue in user data for callback access
     input_port->userdata = (struct MMAL_PORT_USERDATA_T *)this;
     output_port->userdata = (struct MMAL_PORT_USERDATA_T *)this;
 
@@ -166,138 +174,286 @@ void MJPEGtoI420ConverterMMAL::init_mmal() {
     status = mmal_port_enable(output_port, output_callback);
     CHECK_STATUS(status, "Failed to enable output port");
 
-    // Pre-fill output port with buffers from the output pool
-    MMAL_BUFFER_HEADER_T *output_buffer;
-    while ((output_buffer = mmal_queue_get(output_pool->queue)) != nullptr) {
-        status = mmal_port_send_buffer(output_port, output_buffer);
-        CHECK_STATUS(status, "Failed to pre-fill output buffer pool");
-    }
+    send_output_buffers();
 
     // Enable the MJPEG decoder component
     status = mmal_component_enable(decoder);
     CHECK_STATUS(status, "Failed to enable decoder component");
 }
 
-void MJPEGtoI420ConverterMMAL::cleanup_mmal() {
+// Size the output buffers for what the port actually negotiated (stride and height are
+//  aligned up), instead of a fixed worst case
+void MMALAsyncDecoder::create_output_pool() {
+    MMAL_PORT_T *output_port = decoder->output[0];
+    uint32_t frame_bytes = output_port->format->es->video.width * output_port->format->es->video.height * 3 / 2;
+    output_port->buffer_num = std::max((uint32_t)output_buffer_count, output_port->buffer_num_min);
+    output_port->buffer_size = std::max(std::max(output_port->buffer_size_recommended, output_port->buffer_size_min), frame_bytes);
+    output_pool = mmal_port_pool_create(output_port, output_port->buffer_num, output_port->buffer_size);
+    if (!output_pool) throw std::runtime_error("Failed to create output buffer pool");
+}
+
+void MMALAsyncDecoder::cleanup_mmal() {
+    if (decoder) {
+        if (decoder->input[0]->is_enabled) mmal_port_disable(decoder->input[0]);
+        if (decoder->output[0]->is_enabled) mmal_port_disable(decoder->output[0]);
+        if (decoder->control->is_enabled) mmal_port_disable(decoder->control);
+    }
+    // Anything decoded but never taken goes back to its pool before the pool is destroyed
+    if (decoded) {
+        MMAL_BUFFER_HEADER_T *buffer;
+        while ((buffer = mmal_queue_get(decoded)) != nullptr) {
+            mmal_buffer_header_release(buffer);
+        }
+        mmal_queue_destroy(decoded);
+    }
     if (output_pool) mmal_port_pool_destroy(decoder->output[0], output_pool);
     if (input_pool) mmal_port_pool_destroy(decoder->input[0], input_pool);
-    if (queue) mmal_queue_destroy(queue);
     if (decoder) {
         mmal_component_disable(decoder);
         mmal_component_destroy(decoder);
     }
+    decoded = nullptr;
+    output_pool = nullptr;
+    input_pool = nullptr;
+    decoder = nullptr;
+}
+
+// Give every free output buffer to the decoder
+void MMALAsyncDecoder::send_output_buffers() {
+    MMAL_PORT_T *output_port = decoder->output[0];
+    MMAL_BUFFER_HEADER_T *buffer;
+    while ((buffer = mmal_queue_get(output_pool->queue)) != nullptr) {
+        MMAL_STATUS_T status = mmal_port_send_buffer(output_port, buffer);
+        if (status != MMAL_SUCCESS) {
+            mmal_buffer_header_release(buffer);
+            CHECK_STATUS(status, "Failed to send output buffer");
+        }
+    }
 }
 
 // Control port callback function for handling events
-void MJPEGtoI420ConverterMMAL::control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+void MMALAsyncDecoder::control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
     if (buffer->cmd == MMAL_EVENT_ERROR) {
-        // Extract and log the specific error code from the buffer's data
         MMAL_STATUS_T error_status = *(MMAL_STATUS_T *)buffer->data;
-        std::cerr << "MMAL Error Event Received. Error code: " 
+        std::cerr << "MMAL Error Event Received. Error code: "
                   << mmal_status_to_string(error_status) << " (" << error_status << ")" << std::endl;
+        ((MMALAsyncDecoder *)port->userdata)->error_status = error_status;
     }
     mmal_buffer_header_release(buffer);
 }
 
-
-// Input buffer callback function
-void MJPEGtoI420ConverterMMAL::input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
-    if(buffer->cmd) {
-        std::cout << "input_callback cmd" << std::endl;
+// The decoder has read the frame, so the capture buffer can go back to the camera
+void MMALAsyncDecoder::input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    PendingInput *input = (PendingInput *)buffer->user_data;
+    if (input) {
+        input->lease.release();
+        input->owned.clear();
+        input->view = FrameView();
     }
-    if (buffer->cmd == MMAL_EVENT_ERROR) {
-        // Extract and log the specific error code from the buffer's data
-        MMAL_STATUS_T error_status = *(MMAL_STATUS_T *)buffer->data;
-        std::cerr << "MMAL Error Event Received. Error code: " 
-                  << mmal_status_to_string(error_status) << " (" << error_status << ")" << std::endl;
+    mmal_buffer_header_release(buffer);
+}
+
+// Runs on the MMAL thread, so just queue it (events too, they are handled in order on the consumer's thread)
+void MMALAsyncDecoder::output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    mmal_queue_put(((MMALAsyncDecoder *)port->userdata)->decoded, buffer);
+}
+
+void MMALAsyncDecoder::submit_input(PendingInput&& input) {
+    uint64_t order;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        space_cv.wait(lock, [this]() { return (int)(next_submit - next_deliver) < in_flight_limit; });
+        order = next_submit++;
+        frame_info[order % in_flight_limit] = {input.view.sequence, input.view.timestamp_us};
     }
-    std::cout << "input_callback " << buffer->length << std::endl;
 
-    mmal_buffer_header_release(buffer);
+    // A header is free once the decoder has read its last frame
+    MMAL_BUFFER_HEADER_T *buffer = mmal_queue_wait(input_pool->queue);
+    if (!buffer) throw std::runtime_error("Failed to get input buffer from pool");
+    PendingInput *slot = (PendingInput *)buffer->user_data;
+    *slot = std::move(input);
+
+    mmal_buffer_header_reset(buffer);
+    buffer->data = (uint8_t *)slot->view.data;
+    buffer->alloc_size = slot->view.size;
+    buffer->length = slot->view.size;
+    buffer->offset = 0;
+    buffer->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+    buffer->pts = buffer->dts = order;
+
+    MMAL_STATUS_T status = mmal_port_send_buffer(decoder->input[0], buffer);
+    if (status != MMAL_SUCCESS) {
+        *slot = PendingInput();
+        mmal_buffer_header_release(buffer);
+        CHECK_STATUS(status, "Failed to send buffer to input port");
+    }
 }
 
-// Output buffer callback function
-void MJPEGtoI420ConverterMMAL::output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
-    if (buffer->cmd == MMAL_EVENT_ERROR) {
-        // Extract and log the specific error code from the buffer's data
-        MMAL_STATUS_T error_status = *(MMAL_STATUS_T *)buffer->data;
-        std::cerr << "MMAL Error Event Received. Error code: " 
-                  << mmal_status_to_string(error_status) << " (" << error_status << ")" << std::endl;
+void MMALAsyncDecoder::handle_format_changed(MMAL_BUFFER_HEADER_T *event_buffer) {
+    MMAL_EVENT_FORMAT_CHANGED_T *event = mmal_event_format_changed_get(event_buffer);
+    if (!event) {
+        mmal_buffer_header_release(event_buffer);
+        return;
+    }
+    if (event->format->es->video.crop.width != width || event->format->es->video.crop.height != height) {
+        std::string size = std::to_string(event->format->es->video.crop.width) + "x" + std::to_string(event->format->es->video.crop.height);
+        mmal_buffer_header_release(event_buffer);
+        throw std::runtime_error("MJPEG frames are " + size + ", expected " + std::to_string(width) + "x" + std::to_string(height));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (lent_outputs > 0) {
+            mmal_buffer_header_release(event_buffer);
+            throw std::runtime_error("Decoder output format changed while decoded frames were still held");
+        }
     }
 
-    std::cout << "output_callback " << buffer->length << std::endl;
-    // // Log bytes
-    // for (int i = 0; i < buffer->length; i++) {
-    //     auto val = (int)buffer->data[i];
-    //     // If it's a char, log it
-    //     if (val >= 32 && val <= 126) {
-    //         std::cout << (char)val;
-    //     } else {
-    //         std::cout << val << " ";
-    //     }
-    // }
-    // std::cout << std::endl;
+    // Re-create the output pool for the new stride/padding
+    MMAL_PORT_T *output_port = decoder->output[0];
+    MMAL_STATUS_T status = mmal_port_disable(output_port);
+    CHECK_STATUS(status, "Failed to disable output port");
+    mmal_format_full_copy(output_port->format, event->format);
+    mmal_buffer_header_release(event_buffer);
+    status = mmal_port_format_commit(output_port);
+    CHECK_STATUS(status, "Failed to commit changed output format");
 
-    mmal_buffer_header_release(buffer);
-    MMAL_QUEUE_T *queue = ((MJPEGtoI420ConverterMMAL *)port->userdata)->queue;
-    mmal_queue_put(queue, buffer);
-}
+    // Buffers still in our queue belong to the old pool
+    MMAL_BUFFER_HEADER_T *buffer;
+    while ((buffer = mmal_queue_get(decoded)) != nullptr) {
+        mmal_buffer_header_release(buffer);
+    }
+    mmal_port_pool_destroy(output_port, output_pool);
+    output_pool = nullptr;
+    create_output_pool();
 
-// Convert MJPEG to I420 using MMAL hardware acceleration
-std::vector<uint8_t> MJPEGtoI420ConverterMMAL::convert_frame(const std::vector<uint8_t>& mjpeg_buffer) {
-    MMAL_STATUS_T status;
+    status = mmal_port_enable(output_port, output_callback);
+    CHECK_STATUS(status, "Failed to re-enable output port");
+    send_output_buffers();
+}
 
-    MMAL_PORT_T *input_port = decoder->input[0];
+bool MMALAsyncDecoder::next_decoded(DecodedImage& image, int timeout_ms) {
+    // Not under mutex, which release_output takes (and the buffer may be one the decoder needs)
+    image.release();
     MMAL_PORT_T *output_port = decoder->output[0];
+    while (true) {
+        if (error_status != MMAL_SUCCESS) {
+            throw std::runtime_error(std::string("MMAL decoder failed: ") + mmal_status_to_string(error_status));
+        }
+        MMAL_BUFFER_HEADER_T *buffer = timeout_ms < 0 ? mmal_queue_wait(decoded) : mmal_queue_timedwait(decoded, timeout_ms);
+        if (!buffer) return false;
 
-    // Get input buffer from input pool
-    MMAL_BUFFER_HEADER_T *input_buffer = mmal_queue_get(input_pool->queue);
-    if (!input_buffer) throw std::runtime_error("Failed to get input buffer from pool");
-
-    // Copy MJPEG data to input buffer
-    mmal_buffer_header_mem_lock(input_buffer);
-    memcpy(input_buffer->data, mjpeg_buffer.data(), mjpeg_buffer.size());
-    std::cout << "mjpeg_buffer.size(): " << mjpeg_buffer.size() << std::endl;
-
-    input_buffer->length = mjpeg_buffer.size();
-    input_buffer->offset = 0;
-    input_buffer->flags = 0;
-    input_buffer->pts = input_buffer->dts = MMAL_TIME_UNKNOWN;
-
-    std::cout << "input_buffer->length: " << input_buffer->length << std::endl;
-    // Send buffer to input port
-    status = mmal_port_send_buffer(input_port, input_buffer);
-    CHECK_STATUS(status, "Failed to send buffer to input port");
-    std::cout << "sent buffer to input port" << std::endl;
-
-
-    // Wait for output buffer from the output port
-    MMAL_BUFFER_HEADER_T *output_buffer = mmal_queue_wait(queue);
-    if (!output_buffer) throw std::runtime_error("Failed to retrieve output buffer");
-    std::cout << "output_buffer->length == " << output_buffer->length << std::endl;
-    std::cout << "extra buffers " << mmal_queue_length(queue) << std::endl;
-
-    if (output_buffer->cmd) {
-        std::cout << "output_buffer->cmd == " << std::endl;
-        if (output_buffer->cmd == MMAL_EVENT_FORMAT_CHANGED) {
-            std::cout << "output_buffer->cmd == MMAL_EVENT_FORMAT_CHANGED" << std::endl;
-            MMAL_EVENT_FORMAT_CHANGED_T *event = mmal_event_format_changed_get(output_buffer);
-            if(event) {
-                auto newformat = event->format;
-                std::cout << "newformat->es->video.width: " << newformat->es->video.width << std::endl;
+        if (buffer->cmd == MMAL_EVENT_FORMAT_CHANGED) {
+            handle_format_changed(buffer);
+            continue;
+        }
+        if (buffer->cmd || buffer->length == 0) {
+            // Some other event, or an empty buffer (flush)
+            mmal_buffer_header_release(buffer);
+            send_output_buffers();
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // If the decoder didn't carry pts through, assume nothing was dropped
+            uint64_t order = buffer->pts == MMAL_TIME_UNKNOWN ? next_deliver : (uint64_t)buffer->pts;
+            // Frames are decoded in order, so anything before this one was dropped
+            if (order >= next_deliver) {
+                dropped += order - next_deliver;
+                next_deliver = order + 1;
             }
+            lent_outputs++;
+            FrameInfo& info = frame_info[order % in_flight_limit];
+            image = DecodedImage(this, buffer);
+            image.sequence = info.sequence;
+            image.timestamp_us = info.timestamp_us;
         }
+        space_cv.notify_all();
+
+        // The decoder pads its planes to the port's (aligned) width and height
+        int stride = output_port->format->es->video.width;
+        int padded_height = output_port->format->es->video.height;
+        mmal_buffer_header_mem_lock(buffer);
+        image.planes[0] = buffer->data + buffer->offset;
+        image.planes[1] = image.planes[0] + stride * padded_height;
+        image.planes[2] = image.planes[1] + (stride / 2) * (padded_height / 2);
+        image.strides[0] = stride;
+        image.strides[1] = stride / 2;
+        image.strides[2] = stride / 2;
+        image.width = width;
+        image.height = height;
+        return true;
     }
-    
+}
 
-    // Copy decoded I420 data from output buffer
-    std::vector<uint8_t> i420_frame(output_buffer->length);
-    mmal_buffer_header_mem_lock(output_buffer);
-    memcpy(i420_frame.data(), output_buffer->data, output_buffer->length);
-    mmal_buffer_header_mem_unlock(output_buffer);
+void MMALAsyncDecoder::release_output(void* token) {
+    MMAL_BUFFER_HEADER_T *buffer = (MMAL_BUFFER_HEADER_T *)token;
+    mmal_buffer_header_mem_unlock(buffer);
+    mmal_buffer_header_release(buffer);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        lent_outputs--;
+    }
+    send_output_buffers();
+}
 
-    // Release the output buffer back to the pool
-    mmal_buffer_header_release(output_buffer);
+int MMALAsyncDecoder::in_flight() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return next_submit - next_deliver;
+}
 
-    return i420_frame;
+uint64_t MMALAsyncDecoder::dropped_frames() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped;
+}
+
+// The one-frame-at-a-time interface, on top of MMALAsyncDecoder
+class MJPEGtoI420ConverterMMAL : public FrameConverter {
+public:
+    MJPEGtoI420ConverterMMAL(int width, int height);
+
+    // Convert MJPEG frame buffer to I420
+    std::vector<uint8_t> convert_frame(const FrameView& mjpeg_buffer);
+    // Same, but into a pooled frame of the size we were created with
+    void convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) override;
+
+    std::string name() const override { return "mmal"; }
+
+private:
+    int width;
+    int height;
+    MMALAsyncDecoder decoder;
+    uint32_t submitted;     // Tags our frames in place of their sequence, see convert_frame_into
+};
+
+MJPEGtoI420ConverterMMAL::MJPEGtoI420ConverterMMAL(int width, int height)
+    : width(width), height(height), decoder(width, height, 2), submitted(0) {
+}
+
+// Convert MJPEG to I420 using MMAL hardware acceleration
+std::vector<uint8_t> MJPEGtoI420ConverterMMAL::convert_frame(const FrameView& mjpeg_buffer) {
+    FramePool pool(width, height, 1);
+    FrameRef frame = pool.acquire();
+    convert_frame_into(mjpeg_buffer, *frame);
+    return std::vector<uint8_t>(frame->data, frame->data + frame->size);
+}
+
+void MJPEGtoI420ConverterMMAL::convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) {
+    // The decoder gets a copy, as a frame that times out is still in the decoder after we
+    //  return (and mjpeg_buffer may be gone). It comes out of a later call, so frames are tagged
+    //  with our own count, and ones from earlier calls skipped. Two may be in flight, so if the
+    //  decoder silently drops a frame, the next one still gets through.
+    uint32_t tag = ++submitted;
+    decoder.submit(std::vector<uint8_t>(mjpeg_buffer.data, mjpeg_buffer.data + mjpeg_buffer.size), tag, mjpeg_buffer.timestamp_us);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1000);
+    DecodedImage image;
+    while (true) {
+        int remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining_ms <= 0 || !decoder.next_decoded(image, remaining_ms)) {
+            throw std::runtime_error("Timed out waiting for the MMAL decoder");
+        }
+        if (image.sequence == tag) break;
+    }
+    image.copy_to(frame);
+    frame.sequence = mjpeg_buffer.sequence;
 }
@@ -1,15 +1,23 @@
+#pragma once
 #include <vector>
 #include <IL/OMX_Core.h>
 #include <IL/OMX_Component.h>
 #include <iostream>
 #include <cstring>
 
-class MJPEGtoI420ConverterOMX {
+#include "FrameView.cpp"
+#include "FrameBuffer.cpp"
+#include "FrameConverter.cpp"
+
+class MJPEGtoI420ConverterOMX : public FrameConverter {
 public:
     MJPEGtoI420ConverterOMX(int width, int height);
     ~MJPEGtoI420ConverterOMX();
 
-    std::vector<uint8_t> convert_frame(const std::vector<uint8_t>& mjpeg_buffer);
+    std::vector<uint8_t> convert_frame(const FrameView& mjpeg_buffer);
+    void convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) override;
+
+    std::string name() const override { return "omx"; }
 
 private:
     OMX_HANDLETYPE decoder;
@@ -21,7 +29,7 @@ private:
     void init_omx();
     void cleanup_omx();
     void configure_decoder();
-    void feed_input_buffer(const std::vector<uint8_t>& mjpeg_buffer);
+    void feed_input_buffer(const FrameView& mjpeg_buffer);
     std::vector<uint8_t> retrieve_output_buffer();
 };
 
@@ -90,10 +98,10 @@ void MJPEGtoI420ConverterOMX::configure_decoder() {
 }
 
 // Feed the MJPEG buffer to the decoder's input port
-void MJPEGtoI420ConverterOMX::feed_input_buffer(const std::vector<uint8_t>& mjpeg_buffer) {
+void MJPEGtoI420ConverterOMX::feed_input_buffer(const FrameView& mjpeg_buffer) {
     // Copy the MJPEG buffer data to the input buffer
-    std::memcpy(input_buffer->pBuffer, mjpeg_buffer.data(), mjpeg_buffer.size());
-    input_buffer->nFilledLen = mjpeg_buffer.size();
+    std::memcpy(input_buffer->pBuffer, mjpeg_buffer.data, mjpeg_buffer.size);
+    input_buffer->nFilledLen = mjpeg_buffer.size;
 
     // Send the buffer to the input port
     OMX_EmptyThisBuffer(decoder, input_buffer);
@@ -112,7 +120,17 @@ std::vector<uint8_t> MJPEGtoI420ConverterOMX::retrieve_output_buffer() {
 }
 
 // Convert MJPEG to I420 using OMX
-std::vector<uint8_t> MJPEGtoI420ConverterOMX::convert_frame(const std::vector<uint8_t>& mjpeg_buffer) {
+std::vector<uint8_t> MJPEGtoI420ConverterOMX::convert_frame(const FrameView& mjpeg_buffer) {
     feed_input_buffer(mjpeg_buffer);
     return retrieve_output_buffer();
 }
+
+void MJPEGtoI420ConverterOMX::convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) {
+    std::vector<uint8_t> i420_frame = convert_frame(mjpeg_buffer);
+    if (i420_frame.size() < frame.size) {
+        throw std::runtime_error("OMX decoder returned " + std::to_string(i420_frame.size()) + " bytes, expected " + std::to_string(frame.size));
+    }
+    memcpy(frame.data, i420_frame.data(), frame.size);
+    frame.sequence = mjpeg_buffer.sequence;
+    frame.timestamp_us = mjpeg_buffer.timestamp_us;
+}
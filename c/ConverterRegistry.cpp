@@ -0,0 +1,218 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+
+#include "FrameConverter.cpp"
+#include "FrameBuffer.cpp"
+#include "ConvertCPU.cpp"
+#include "AsyncDecoder.cpp"
+#include "DecodePool.cpp"
+
+// Hardware backends only exist on some machines, build.sh defines the ones to compile in
+#ifdef CAMERA_HAVE_MMAL
+#include "ConvertMMAL.cpp"
+#endif
+#ifdef CAMERA_HAVE_OMX
+#include "ConvertOMX.cpp"
+#endif
+#ifdef CAMERA_HAVE_LIBCAMERA
+#include "ConvertLibCamera.cpp"
+#endif
+
+struct ConverterBackend {
+    std::string name;
+    std::function<std::unique_ptr<FrameConverter>(int width, int height)> create;
+    // Optional, a natively pipelined decoder. Otherwise create_async_decoder runs create() on a thread.
+    std::function<std::unique_ptr<AsyncFrameDecoder>(int width, int height, int max_in_flight)> create_async;
+};
+
+// Every compiled-in backend, hardware first
+std::vector<ConverterBackend> converter_backends() {
+    std::vector<ConverterBackend> backends;
+#ifdef CAMERA_HAVE_MMAL
+    backends.push_back({"mmal",
+        [](int width, int height) { return std::unique_ptr<FrameConverter>(new MJPEGtoI420ConverterMMAL(width, height)); },
+        [](int width, int height, int max_in_flight) { return std::unique_ptr<AsyncFrameDecoder>(new MMALAsyncDecoder(width, height, max_in_flight)); }});
+#endif
+#ifdef CAMERA_HAVE_OMX
+    backends.push_back({"omx",
+        [](int width, int height) { return std::unique_ptr<FrameConverter>(new MJPEGtoI420ConverterOMX(width, height)); },
+        nullptr});
+#endif
+#ifdef CAMERA_HAVE_LIBCAMERA
+    backends.push_back({"libcamera",
+        [](int width, int height) { return std::unique_ptr<FrameConverter>(new MJPEGtoI420ConverterLibcamera(width, height)); },
+        nullptr});
+#endif
+    // Split frames with restart markers across every core, or pipelined, a frame per core
+    backends.push_back({"cpu",
+        [](int, int) { return std::unique_ptr<FrameConverter>(new MJPEGtoI420Converter(std::max(1u, std::thread::hardware_concurrency()))); },
+        [](int width, int height, int max_in_flight) { return std::unique_ptr<AsyncFrameDecoder>(new MJPEGPoolDecoder(width, height, max_in_flight)); }});
+    return backends;
+}
+
+// A pipelined decoder for backend: its own, if it has one, or its FrameConverter on a
+//  background thread
+std::unique_ptr<AsyncFrameDecoder> create_async_decoder(const ConverterBackend& backend, int width, int height, int max_in_flight) {
+    if (backend.create_async) {
+        return backend.create_async(width, height, max_in_flight);
+    }
+    return std::unique_ptr<AsyncFrameDecoder>(new CPUAsyncDecoder(width, height, max_in_flight, 0, 0, backend.create(width, height)));
+}
+
+// Decode the probe frame a few times, and return frames per second (0 if it failed)
+static double probe_converter(FrameConverter& converter, const FrameView& probe_frame, FrameBuffer& frame) {
+    const int max_frames = 10;
+    const double max_seconds = 1.0;
+    try {
+        // The first frame warms up caches and lazily created hardware state
+        converter.convert_frame_into(probe_frame, frame);
+        auto start = std::chrono::steady_clock::now();
+        int frames = 0;
+        double seconds = 0;
+        while (frames < max_frames && seconds < max_seconds) {
+            converter.convert_frame_into(probe_frame, frame);
+            frames++;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        return seconds > 0 ? frames / seconds : 1e9;
+    } catch (const std::exception& ex) {
+        std::cout << "Converter " << converter.name() << " failed the probe: " << ex.what() << std::endl;
+        return 0;
+    }
+}
+
+// Like probe_converter, but decoding the way main does, with max_in_flight frames queued, so
+//  frames per second is the decoder's throughput rather than one frame's latency
+static double probe_async_decoder(AsyncFrameDecoder& decoder, const std::string& name, const FrameView& probe_frame) {
+    const int max_frames = std::max(10, decoder.max_in_flight() * 3);
+    const double max_seconds = 1.0;
+    const int timeout_ms = 2000;
+    try {
+        DecodedImage image;
+        decoder.submit(probe_frame);
+        if (!decoder.next_decoded(image, timeout_ms)) {
+            throw std::runtime_error("timed out");
+        }
+        auto start = std::chrono::steady_clock::now();
+        int submitted = 0;
+        int frames = 0;
+        double seconds = 0;
+        // Stops submitting at the limits, but every frame in flight is waited for and counted
+        while (frames < submitted || (submitted < max_frames && seconds < max_seconds)) {
+            while (submitted - frames < decoder.max_in_flight() && submitted < max_frames && seconds < max_seconds) {
+                decoder.submit(probe_frame);
+                submitted++;
+            }
+            if (!decoder.next_decoded(image, timeout_ms)) {
+                throw std::runtime_error("timed out after " + std::to_string(frames) + " frames");
+            }
+            frames++;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        return seconds > 0 ? frames / seconds : 1e9;
+    } catch (const std::exception& ex) {
+        std::cout << "Converter " << name << " failed the probe: " << ex.what() << std::endl;
+        return 0;
+    }
+}
+
+// Picks a backend, and returns its name.
+//  config is "auto", a backend name, or a comma separated list of names to choose from. If
+//  probe_frame is given (an MJPEG frame of width x height), each candidate that initializes
+//  decodes it a few times and the fastest wins. Otherwise the first candidate that
+//  initializes wins. If none of the configured backends work, every other backend is tried,
+//  so a hardware backend failing on this machine falls back instead of failing to start.
+//  With max_in_flight > 0 candidates are the decoders create_async_decoder makes, with that
+//  many frames in flight (as they'll be used), otherwise their FrameConverters.
+std::string choose_converter_backend(const std::string& config, int width, int height, const FrameView& probe_frame = FrameView(),
+                                     int max_in_flight = 0) {
+    std::vector<ConverterBackend> backends = converter_backends();
+
+    std::vector<std::string> wanted;
+    if (config != "auto" && !config.empty()) {
+        size_t start = 0;
+        while (start <= config.size()) {
+            size_t end = config.find(',', start);
+            if (end == std::string::npos) end = config.size();
+            std::string name = config.substr(start, end - start);
+            bool known = false;
+            for (auto& backend : backends) {
+                if (backend.name == name) known = true;
+            }
+            if (known) {
+                wanted.push_back(name);
+            } else {
+                std::cout << "Converter " << name << " is not compiled in" << std::endl;
+            }
+            start = end + 1;
+        }
+    }
+
+    FramePool probe_pool(width, height, 1);
+    FrameRef probe_output = probe_pool.acquire();
+
+    // The configured backends first, then (as the fallback) everything else
+    for (int pass = 0; pass < 2; pass++) {
+        std::string best;
+        double best_fps = 0;
+        for (auto& backend : backends) {
+            bool configured = wanted.empty() || std::find(wanted.begin(), wanted.end(), backend.name) != wanted.end();
+            if (configured != (pass == 0)) continue;
+
+            std::unique_ptr<FrameConverter> converter;
+            std::unique_ptr<AsyncFrameDecoder> decoder;
+            try {
+                if (max_in_flight > 0) {
+                    decoder = create_async_decoder(backend, width, height, max_in_flight);
+                } else {
+                    converter = backend.create(width, height);
+                }
+            } catch (const std::exception& ex) {
+                std::cout << "Converter " << backend.name << " is unavailable: " << ex.what() << std::endl;
+                continue;
+            }
+            if (!probe_frame.data) {
+                return backend.name;
+            }
+            double fps = decoder ? probe_async_decoder(*decoder, backend.name, probe_frame)
+                : probe_converter(*converter, probe_frame, *probe_output);
+            if (fps > 0) {
+                std::cout << "Converter " << backend.name << ": " << fps << " fps" << std::endl;
+            }
+            if (fps > best_fps) {
+                best = backend.name;
+                best_fps = fps;
+            }
+        }
+        if (!best.empty()) return best;
+        if (wanted.empty()) break;
+        if (pass == 0) {
+            std::cout << "No configured converter works, falling back to the others" << std::endl;
+        }
+    }
+    throw std::runtime_error("No MJPEG converter backend works on this machine");
+}
+
+std::unique_ptr<FrameConverter> create_converter(const std::string& config, int width, int height, const FrameView& probe_frame = FrameView()) {
+    std::string name = choose_converter_backend(config, width, height, probe_frame);
+    for (auto& backend : converter_backends()) {
+        if (backend.name == name) return backend.create(width, height);
+    }
+    throw std::runtime_error("Unknown converter " + name);
+}
+
+// The named backend's pipelined decoder
+std::unique_ptr<AsyncFrameDecoder> create_async_decoder(const std::string& name, int width, int height, int max_in_flight) {
+    for (auto& backend : converter_backends()) {
+        if (backend.name == name) return create_async_decoder(backend, width, height, max_in_flight);
+    }
+    throw std::runtime_error("Unknown converter " + name);
+}
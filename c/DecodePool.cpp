@@ -0,0 +1,407 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+#include <stdexcept>
+
+#include "CameraFrameCapture.cpp"
+#include "ConvertCPU.cpp"
+#include "FrameBuffer.cpp"
+#include "RingQueue.cpp"
+#include "AsyncDecoder.cpp"
+
+// A compressed frame for the pool: a leased capture buffer, bytes we own, or neither (the
+//  caller keeps the view's memory valid until the frame comes out of get_next)
+struct DecodeInput {
+    FrameLease lease;
+    std::vector<uint8_t> owned;
+    FrameView view;
+};
+
+struct DecodedFrame {
+    uint64_t order = 0;         // Submission order in its stream, frames come out in this order
+    uint32_t sequence = 0;      // Copied from the input frame
+    int64_t timestamp_us = 0;
+    FrameRef i420;              // From the stream's FramePool, drop it promptly so workers can reuse it
+};
+
+// Decodes MJPEG frames on several threads (one libjpeg context per worker). MJPEG frames are
+//  independent, so throughput scales with cores, at the cost of up to max_in_flight frames of
+//  latency. Frames belong to streams (a camera each), and each stream's frames come back in
+//  the order they were submitted, through its own reorder buffer. Workers take the streams in
+//  turn, one frame each, so a camera with a higher frame rate can't starve the rest.
+//
+// A submitted FrameLease stays out of the driver until its frame is decoded, so a camera
+//  needs at least max_in_flight + 2 buffers (USBCameraOptions::buffer_count) to keep capturing.
+//
+// Each stream's output frames come from a FramePool of max_in_flight + held_frames frames. If
+//  its consumer holds more than held_frames DecodedFrames at once, workers wait for one to be
+//  dropped (but still stop when asked to).
+class MJPEGDecodePool {
+public:
+    // threads <= 0 uses every core
+    MJPEGDecodePool(int threads = 0);
+    ~MJPEGDecodePool();
+    MJPEGDecodePool(const MJPEGDecodePool&) = delete;
+    MJPEGDecodePool& operator=(const MJPEGDecodePool&) = delete;
+
+    // Returns the stream's index, they are numbered from 0 in the order they are added
+    int add_stream(int width, int height, int max_in_flight, int held_frames = 2);
+
+    // Queue a frame. Blocks while the stream has max_in_flight frames queued, decoding, or
+    //  decoded but not yet taken by get_next.
+    void submit(int stream, DecodeInput&& input);
+    void submit(int stream, FrameLease&& frame);
+    // Like CapturePolicy::LatestFrame, never blocks: the stream keeps only its newest frame no
+    //  worker has started on. Returns true if that replaced (dropped) an older one.
+    bool submit_latest(int stream, FrameLease&& frame);
+    // Whether the stream has a frame no worker has started on
+    bool has_waiting(int stream);
+    // Drops the frames no worker has started on (from before a camera was lost, say)
+    void drop_waiting(int stream);
+    // Called on the worker's thread as it starts on a stream's frame. Set before submitting.
+    void set_started_callback(std::function<void(int stream)> callback) { started_callback = std::move(callback); }
+
+    // The stream's next frame in submission order. Returns false if it isn't decoded within
+    //  timeout_ms (-1 waits forever), or once stop() was called. Throws if that frame failed to
+    //  decode (the next call moves on to the frame after it).
+    bool get_next(int stream, DecodedFrame& frame, int timeout_ms = -1);
+
+    // Drops everything queued, wakes up get_next and submit, and joins the workers
+    void stop();
+
+    int thread_count() const { return workers.size(); }
+    int in_flight(int stream);
+    int max_in_flight(int stream) { return streams[stream]->max_in_flight; }
+
+private:
+    struct Result {
+        bool ready = false;
+        DecodedFrame frame;
+        std::string error;
+    };
+    struct Stream {
+        int index;
+        int max_in_flight;
+        std::unique_ptr<FramePool> frame_pool;
+        // Guarded by the pool's mutex. Both hold at most max_in_flight entries, allocated up front.
+        RingQueue<DecodeInput> queued;  // Not started yet
+        std::vector<Result> results;    // The reorder buffer, the result for order is at order % max_in_flight
+        uint64_t next_start = 0;        // Order of the next frame a worker starts on
+        uint64_t next_deliver = 0;      // Order of the next frame get_next returns
+        std::condition_variable results_cv;
+    };
+
+    std::vector<std::unique_ptr<Stream>> streams;
+    std::vector<std::thread> workers;
+    std::function<void(int stream)> started_callback;
+
+    std::mutex mutex;
+    std::condition_variable jobs_cv;     // Workers wait for a frame
+    std::condition_variable space_cv;    // submit waits for a stream's in-flight count to drop
+    size_t next_stream;                  // Where workers start looking, for round robin
+    bool stopping;
+
+    bool take_job(Stream*& stream, DecodeInput& input, uint64_t& order);   // Requires mutex
+    void worker_loop();
+};
+
+MJPEGDecodePool::MJPEGDecodePool(int threads) : next_stream(0), stopping(false) {
+    threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(&MJPEGDecodePool::worker_loop, this);
+    }
+}
+
+MJPEGDecodePool::~MJPEGDecodePool() {
+    stop();
+}
+
+void MJPEGDecodePool::stop() {
+    // Leases go back outside the mutex
+    std::vector<DecodeInput> abandoned;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (auto& stream : streams) {
+            while (!stream->queued.empty()) {
+                abandoned.push_back(std::move(stream->queued.front()));
+                stream->queued.pop_front();
+            }
+        }
+    }
+    jobs_cv.notify_all();
+    space_cv.notify_all();
+    for (auto& stream : streams) {
+        stream->results_cv.notify_all();
+    }
+    for (auto& worker : workers) {
+        if (worker.joinable()) worker.join();
+    }
+}
+
+int MJPEGDecodePool::add_stream(int width, int height, int max_in_flight, int held_frames) {
+    std::unique_ptr<Stream> stream(new Stream());
+    stream->max_in_flight = std::max(1, max_in_flight);
+    stream->frame_pool.reset(new FramePool(width, height, stream->max_in_flight + std::max(0, held_frames)));
+    stream->queued.reset(stream->max_in_flight);
+    stream->results.resize(stream->max_in_flight);
+    std::lock_guard<std::mutex> lock(mutex);
+    stream->index = streams.size();
+    streams.push_back(std::move(stream));
+    return streams.back()->index;
+}
+
+int MJPEGDecodePool::in_flight(int index) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stream& stream = *streams[index];
+    return stream.queued.size() + (stream.next_start - stream.next_deliver);
+}
+
+void MJPEGDecodePool::submit(int index, FrameLease&& frame) {
+    DecodeInput input;
+    input.view = frame.view();
+    input.lease = std::move(frame);
+    submit(index, std::move(input));
+}
+
+void MJPEGDecodePool::submit(int index, DecodeInput&& input) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        Stream& stream = *streams[index];
+        space_cv.wait(lock, [&]() {
+            return stopping || stream.queued.size() + (stream.next_start - stream.next_deliver) < (size_t)stream.max_in_flight;
+        });
+        if (stopping) {
+            throw std::runtime_error("Decode pool is stopped");
+        }
+        stream.queued.push_back(std::move(input));
+    }
+    jobs_cv.notify_one();
+}
+
+bool MJPEGDecodePool::submit_latest(int index, FrameLease&& frame) {
+    DecodeInput input;
+    input.view = frame.view();
+    input.lease = std::move(frame);
+    DecodeInput stale;
+    bool replaced = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) {
+            throw std::runtime_error("Decode pool is stopped");
+        }
+        Stream& stream = *streams[index];
+        if (!stream.queued.empty()) {
+            stale = std::move(stream.queued.front());
+            stream.queued.pop_front();
+            replaced = true;
+        }
+        stream.queued.push_back(std::move(input));
+    }
+    jobs_cv.notify_one();
+    // stale is released here, outside the mutex
+    return replaced;
+}
+
+bool MJPEGDecodePool::has_waiting(int index) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !streams[index]->queued.empty();
+}
+
+void MJPEGDecodePool::drop_waiting(int index) {
+    std::vector<DecodeInput> dropped;
+    std::lock_guard<std::mutex> lock(mutex);
+    Stream& stream = *streams[index];
+    while (!stream.queued.empty()) {
+        dropped.push_back(std::move(stream.queued.front()));
+        stream.queued.pop_front();
+    }
+    // dropped is declared first, so it is released after the mutex
+}
+
+bool MJPEGDecodePool::get_next(int index, DecodedFrame& frame, int timeout_ms) {
+    Result result;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        Stream& stream = *streams[index];
+        Result& next = stream.results[stream.next_deliver % stream.max_in_flight];
+        auto ready = [&]() { return stopping || next.ready; };
+        if (timeout_ms < 0) {
+            stream.results_cv.wait(lock, ready);
+        } else {
+            stream.results_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+        }
+        if (stopping || !next.ready) return false;
+        result = std::move(next);
+        next = Result();
+        stream.next_deliver++;
+    }
+    // There is room for another of this stream's frames
+    space_cv.notify_all();
+    jobs_cv.notify_one();
+
+    if (!result.error.empty()) {
+        throw std::runtime_error("Failed to decode frame " + std::to_string(result.frame.order) + ": " + result.error);
+    }
+    frame = std::move(result.frame);
+    return true;
+}
+
+// The next stream (round robin) with a frame queued and room in its reorder buffer. Requires mutex.
+bool MJPEGDecodePool::take_job(Stream*& stream, DecodeInput& input, uint64_t& order) {
+    for (size_t i = 0; i < streams.size(); i++) {
+        Stream& candidate = *streams[(next_stream + i) % streams.size()];
+        if (candidate.queued.empty()) continue;
+        if (candidate.next_start - candidate.next_deliver >= (uint64_t)candidate.max_in_flight) continue;
+        next_stream = (next_stream + i + 1) % streams.size();
+        stream = &candidate;
+        input = std::move(candidate.queued.front());
+        candidate.queued.pop_front();
+        order = candidate.next_start++;
+        return true;
+    }
+    return false;
+}
+
+void MJPEGDecodePool::worker_loop() {
+    // Each worker owns its decoder, libjpeg contexts can't be shared between threads
+    MJPEGtoI420Converter converter;
+
+    while (true) {
+        Stream* stream = nullptr;
+        DecodeInput input;
+        uint64_t order = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobs_cv.wait(lock, [&]() { return stopping || take_job(stream, input, order); });
+            if (stopping) return;
+        }
+        if (started_callback) started_callback(stream->index);
+
+        Result result;
+        result.frame.order = order;
+        result.frame.sequence = input.view.sequence;
+        result.frame.timestamp_us = input.view.timestamp_us;
+        try {
+            // Waits if the consumer holds every output frame, but not through stop()
+            while (!stream->frame_pool->try_acquire(result.frame.i420, 100)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) return;
+            }
+            converter.convert_frame_into(input.view, *result.frame.i420);
+        } catch (const std::exception& ex) {
+            result.error = ex.what();
+        }
+        // Give the capture buffer back as soon as we're done with it
+        input.lease.release();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            result.ready = true;
+            stream->results[order % stream->max_in_flight] = std::move(result);
+        }
+        stream->results_cv.notify_all();
+    }
+}
+
+// The pool, with one stream, as an AsyncFrameDecoder, so the cpu backend decodes a single
+//  camera's frames on every core (see create_async_decoder)
+class MJPEGPoolDecoder : public AsyncFrameDecoder {
+public:
+    // threads <= 0 uses every core. output_buffers are the DecodedImages the caller can hold.
+    MJPEGPoolDecoder(int width, int height, int max_in_flight, int threads = 0, int output_buffers = 2);
+    ~MJPEGPoolDecoder();
+
+    bool next_decoded(DecodedImage& image, int timeout_ms = -1) override;
+    int in_flight() override { return pool.in_flight(stream); }
+    int max_in_flight() const override { return in_flight_limit; }
+    uint64_t dropped_frames() override;
+    int thread_count() const { return pool.thread_count(); }
+
+protected:
+    void submit_input(PendingInput&& input) override;
+    void release_output(void* token) override;
+
+private:
+    int width;
+    int height;
+    int in_flight_limit;
+    MJPEGDecodePool pool;
+    int stream;
+    std::mutex mutex;
+    std::vector<FrameRef> lent;     // Frames held by DecodedImages, the token points at the slot
+    uint64_t dropped;
+};
+
+MJPEGPoolDecoder::MJPEGPoolDecoder(int width, int height, int max_in_flight, int threads, int output_buffers)
+    : width(width), height(height), in_flight_limit(std::max(1, max_in_flight)), pool(threads),
+      stream(pool.add_stream(width, height, in_flight_limit, std::max(1, output_buffers))),
+      lent(std::max(1, output_buffers)), dropped(0) {}
+
+MJPEGPoolDecoder::~MJPEGPoolDecoder() {
+    pool.stop();
+}
+
+void MJPEGPoolDecoder::submit_input(PendingInput&& input) {
+    DecodeInput decode;
+    decode.lease = std::move(input.lease);
+    decode.owned = std::move(input.owned);
+    decode.view = input.view;
+    pool.submit(stream, std::move(decode));
+}
+
+bool MJPEGPoolDecoder::next_decoded(DecodedImage& image, int timeout_ms) {
+    // Not under mutex, which release_output takes, and its buffer may be one the pool needs
+    image.release();
+    DecodedFrame frame;
+    while (true) {
+        try {
+            if (!pool.get_next(stream, frame, timeout_ms)) return false;
+            break;
+        } catch (const std::exception& ex) {
+            // Like a hardware decoder, a corrupt frame just never comes back
+            std::cerr << "MJPEGPoolDecoder: " << ex.what() << std::endl;
+            std::lock_guard<std::mutex> lock(mutex);
+            dropped++;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t slot = 0;
+    while (slot < lent.size() && lent[slot]) slot++;
+    if (slot == lent.size()) {
+        throw std::runtime_error("MJPEGPoolDecoder: every output buffer is held, release a DecodedImage first");
+    }
+    lent[slot] = std::move(frame.i420);
+    FrameBuffer& buffer = *lent[slot];
+    image = DecodedImage(this, &lent[slot]);
+    image.planes[0] = buffer.y();
+    image.planes[1] = buffer.u();
+    image.planes[2] = buffer.v();
+    image.strides[0] = width;
+    image.strides[1] = width / 2;
+    image.strides[2] = width / 2;
+    image.width = width;
+    image.height = height;
+    image.sequence = frame.sequence;
+    image.timestamp_us = frame.timestamp_us;
+    return true;
+}
+
+void MJPEGPoolDecoder::release_output(void* token) {
+    FrameRef frame;
+    std::lock_guard<std::mutex> lock(mutex);
+    frame = std::move(*(FrameRef*)token);
+    // frame is declared first, so it goes back to the pool after the mutex
+}
+
+uint64_t MJPEGPoolDecoder::dropped_frames() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped;
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "CameraFrameCapture.cpp"
+
+// Passes captured frames to another process over a Unix socket, by sending the dmabuf fd
+//  (SCM_RIGHTS) instead of the frame bytes. The camera must use CaptureMemory::MmapExportDmabuf
+//  or CaptureMemory::Dmabuf.
+//
+// Protocol: the sender sends a SharedFrameHeader + fd per frame, and must keep the FrameLease
+//  alive until the receiver sends back the buffer index (send_frame_release), as the driver
+//  would otherwise overwrite the buffer while it is still being read.
+
+struct SharedFrameHeader {
+    uint32_t index;         // Capture buffer index, echoed back on release
+    uint32_t size;          // Bytes used in the buffer
+    uint32_t sequence;
+    uint32_t reserved;
+    int64_t timestamp_us;
+};
+
+// A frame received from another process. The fd is owned by the receiver, close_shared_frame
+//  unmaps and closes it.
+struct SharedFrame {
+    SharedFrameHeader header;
+    int fd = -1;
+    const uint8_t* data = nullptr;
+    size_t mapped_size = 0;
+
+    FrameView view() const {
+        FrameView frame(data, header.size);
+        frame.sequence = header.sequence;
+        frame.timestamp_us = header.timestamp_us;
+        frame.dmabuf_fd = fd;
+        return frame;
+    }
+};
+
+// Send the frame's dmabuf fd, and its metadata
+void send_shared_frame(int socket_fd, const FrameLease& frame) {
+    if (frame.dmabuf_fd() == -1) {
+        throw std::runtime_error("Frame has no dmabuf fd, the camera must export dmabufs to share frames");
+    }
+    SharedFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.index = frame.buffer_index();
+    header.size = frame.size();
+    header.sequence = frame.sequence();
+    header.timestamp_us = frame.timestamp_us();
+
+    struct iovec iov;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    int fd = frame.dmabuf_fd();
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(socket_fd, &msg, MSG_NOSIGNAL) != sizeof(header)) {
+        throw std::runtime_error("Failed to send shared frame: " + std::string(strerror(errno)));
+    }
+}
+
+// Receive a frame sent with send_shared_frame, and map it read-only. Returns false if the
+//  sender closed the socket.
+bool receive_shared_frame(int socket_fd, SharedFrame& frame) {
+    struct iovec iov;
+    iov.iov_base = &frame.header;
+    iov.iov_len = sizeof(frame.header);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (received == 0) return false;
+    if (received != sizeof(frame.header)) {
+        throw std::runtime_error("Failed to receive shared frame: " + std::string(received < 0 ? strerror(errno) : "short read"));
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        throw std::runtime_error("Shared frame arrived without a dmabuf fd");
+    }
+    memcpy(&frame.fd, CMSG_DATA(cmsg), sizeof(int));
+
+    frame.mapped_size = frame.header.size;
+    void* data = mmap(NULL, frame.mapped_size, PROT_READ, MAP_SHARED, frame.fd, 0);
+    if (data == MAP_FAILED) {
+        close(frame.fd);
+        frame.fd = -1;
+        throw std::runtime_error("Failed to mmap shared frame: " + std::string(strerror(errno)));
+    }
+    frame.data = (const uint8_t*)data;
+    return true;
+}
+
+void close_shared_frame(SharedFrame& frame) {
+    if (frame.data) munmap((void*)frame.data, frame.mapped_size);
+    if (frame.fd != -1) close(frame.fd);
+    frame.data = nullptr;
+    frame.fd = -1;
+}
+
+// Receiver side, tells the sender it may re-queue the buffer
+void send_frame_release(int socket_fd, uint32_t index) {
+    if (send(socket_fd, &index, sizeof(index), MSG_NOSIGNAL) != sizeof(index)) {
+        throw std::runtime_error("Failed to send frame release: " + std::string(strerror(errno)));
+    }
+}
+
+// Sender side, returns the buffer index the receiver is done with, or -1 if the socket closed
+int receive_frame_release(int socket_fd) {
+    uint32_t index;
+    ssize_t received = recv(socket_fd, &index, sizeof(index), MSG_WAITALL);
+    if (received == 0) return -1;
+    if (received != sizeof(index)) {
+        throw std::runtime_error("Failed to receive frame release: " + std::string(received < 0 ? strerror(errno) : "short read"));
+    }
+    return index;
+}
@@ -0,0 +1,246 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <stdexcept>
+#include <mmal.h>
+#include <mmal_logging.h>
+#include <mmal_util.h>
+#include <mmal_util_params.h>
+#include <mmal_parameters_video.h>
+#include <bcm_host.h>
+
+#include "H264Encoder.cpp"
+
+// The Pi's (up to the Pi 4) hardware encoder, vc.ril.video_encode. Bitrate only, it has no
+//  constant quality mode, and ignores tune, preset and threads.
+class H264EncoderMMAL : public H264Encoder {
+public:
+    H264EncoderMMAL(const H264EncoderOptions& options);
+    ~H264EncoderMMAL();
+
+    std::string name() const override { return "mmal"; }
+    void add_frame(const FrameBuffer& frame) override;
+
+private:
+    MMAL_COMPONENT_T *encoder;
+    MMAL_POOL_T *input_pool;
+    MMAL_POOL_T *output_pool;
+    MMAL_PORT_T *input_port;
+    MMAL_PORT_T *output_port;
+
+    // The slot the output callback is filling, across buffers until the end of a frame
+    std::vector<uint8_t>* pending_nal;
+
+    void send_output_buffers();
+
+    static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+    static void input_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+};
+
+// Constructor: Initialize MMAL and the encoder
+H264EncoderMMAL::H264EncoderMMAL(const H264EncoderOptions& options)
+    : H264Encoder(options), encoder(nullptr), input_pool(nullptr), output_pool(nullptr),
+      pending_nal(nullptr) {
+
+    // What command.txt gave v4l2h264enc, when no bitrate is set
+    int video_bitrate = options.bitrate > 0 ? options.bitrate : 5000000;
+
+    bcm_host_init();
+
+    MMAL_STATUS_T status = mmal_component_create("vc.ril.video_encode", &encoder);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to create encoder component");
+    }
+
+    // Enable the encoder component control port
+    status = mmal_port_enable(encoder->control, nullptr);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to enable encoder control port");
+    }
+
+    input_port = encoder->input[0];
+    output_port = encoder->output[0];
+
+    // Configure the encoder input port (I420 raw frames)
+    MMAL_ES_FORMAT_T *input_format = input_port->format;
+    input_format->type = MMAL_ES_TYPE_VIDEO;
+    input_format->encoding = MMAL_ENCODING_I420;
+    input_format->es->video.width = VCOS_ALIGN_UP(video_width, 32);
+    input_format->es->video.height = VCOS_ALIGN_UP(video_height, 16);
+    input_format->es->video.crop.width = video_width;
+    input_format->es->video.crop.height = video_height;
+    input_format->es->video.frame_rate.num = options.fps;
+    input_format->es->video.frame_rate.den = 1;
+
+    status = mmal_port_format_commit(input_port);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to commit input port format");
+    }
+
+    // Configure the encoder output port (H.264 encoded video)
+    MMAL_ES_FORMAT_T *output_format = output_port->format;
+    output_format->type = MMAL_ES_TYPE_VIDEO;
+    output_format->encoding = MMAL_ENCODING_H264;
+    output_format->bitrate = video_bitrate;
+    output_format->es->video.width = video_width;
+    output_format->es->video.height = video_height;
+    output_format->es->video.frame_rate.num = options.fps;
+    output_format->es->video.frame_rate.den = 1;
+
+    status = mmal_port_format_commit(output_port);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to commit output port format");
+    }
+
+    // Set H.264 profile and level
+    MMAL_PARAMETER_VIDEO_PROFILE_T param = {{MMAL_PARAMETER_PROFILE, sizeof(param)}, MMAL_VIDEO_PROFILE_H264_HIGH, MMAL_VIDEO_LEVEL_H264_4};
+    status = mmal_port_parameter_set(output_port, &param.hdr);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to set H.264 profile");
+    }
+
+    if (options.keyframe_interval > 0) {
+        status = mmal_port_parameter_set_uint32(output_port, MMAL_PARAMETER_INTRAPERIOD, options.keyframe_interval);
+        if (status != MMAL_SUCCESS) {
+            throw std::runtime_error("Failed to set keyframe interval");
+        }
+    }
+    // SPS and PPS before every keyframe, so each segment can be decoded on its own
+    status = mmal_port_parameter_set_boolean(output_port, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, MMAL_TRUE);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to enable inline headers");
+    }
+
+    // Input buffers we copy frames into
+    input_port->buffer_num = input_port->buffer_num_recommended;
+    input_port->buffer_size = input_port->buffer_size_recommended;
+    input_pool = mmal_port_pool_create(input_port, input_port->buffer_num, input_port->buffer_size);
+    if (!input_pool) {
+        throw std::runtime_error("Failed to create input buffer pool");
+    }
+    input_port->userdata = (struct MMAL_PORT_USERDATA_T *)this;
+    status = mmal_port_enable(input_port, input_buffer_callback);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to enable input port");
+    }
+
+    // Enable output port
+    output_pool = mmal_port_pool_create(output_port, output_port->buffer_num, output_port->buffer_size);
+    output_port->userdata = (struct MMAL_PORT_USERDATA_T *)this;
+
+    status = mmal_port_enable(output_port, encoder_buffer_callback);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to enable output port");
+    }
+
+    // Enable encoder component
+    status = mmal_component_enable(encoder);
+    if (status != MMAL_SUCCESS) {
+        throw std::runtime_error("Failed to enable encoder component");
+    }
+
+    // From here on the output callback sends each buffer back as soon as it has copied it out
+    send_output_buffers();
+}
+
+// Destructor: Clean up MMAL resources
+H264EncoderMMAL::~H264EncoderMMAL() {
+    // Unblocks the output callback if it is waiting for space, and get_next_nal callers
+    shutdown();
+
+    mmal_port_disable(output_port);
+    mmal_port_disable(input_port);
+    mmal_component_disable(encoder);
+    if (output_pool) mmal_port_pool_destroy(output_port, output_pool);
+    if (input_pool) mmal_port_pool_destroy(input_port, input_pool);
+    mmal_component_destroy(encoder);
+}
+
+void H264EncoderMMAL::add_frame(const FrameBuffer& frame) {
+    if (frame.width != video_width || frame.height != video_height) {
+        throw std::runtime_error("Frame size does not match the encoder");
+    }
+
+    // Feed the raw buffer to the encoder's input port
+    MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(input_pool->queue);
+    if (buffer) {
+        // The input port wants width aligned to 32 and height to 16, our frames are packed
+        int stride = input_port->format->es->video.width;
+        int padded_height = input_port->format->es->video.height;
+        mmal_buffer_header_mem_lock(buffer);
+        uint8_t* planes[3];
+        planes[0] = buffer->data;
+        planes[1] = planes[0] + stride * padded_height;
+        planes[2] = planes[1] + (stride / 2) * (padded_height / 2);
+        const uint8_t* source_planes[3] = {frame.y(), frame.u(), frame.v()};
+        for (int p = 0; p < 3; p++) {
+            int plane_width = p ? video_width / 2 : video_width;
+            int plane_height = p ? video_height / 2 : video_height;
+            int plane_stride = p ? stride / 2 : stride;
+            for (int row = 0; row < plane_height; row++) {
+                memcpy(planes[p] + row * plane_stride, source_planes[p] + row * plane_width, plane_width);
+            }
+        }
+        buffer->length = stride * padded_height * 3 / 2;
+        buffer->offset = 0;
+        buffer->pts = frame.timestamp_us;
+        mmal_buffer_header_mem_unlock(buffer);
+
+        MMAL_STATUS_T status = mmal_port_send_buffer(input_port, buffer);
+        if (status != MMAL_SUCCESS) {
+            throw std::runtime_error("Failed to send buffer to input port");
+        }
+    } else {
+        // Every input buffer is still with the encoder (it's behind, or the NAL reader is)
+        dropped++;
+    }
+}
+
+// Give the encoder every output buffer it doesn't have
+void H264EncoderMMAL::send_output_buffers() {
+    MMAL_BUFFER_HEADER_T *buffer;
+    while ((buffer = mmal_queue_get(output_pool->queue)) != nullptr) {
+        MMAL_STATUS_T status = mmal_port_send_buffer(output_port, buffer);
+        if (status != MMAL_SUCCESS) {
+            std::cerr << "Failed to send buffer to output port" << std::endl;
+            mmal_buffer_header_release(buffer);
+            break;
+        }
+    }
+}
+
+// Encoder buffer callback, on MMAL's thread. A NAL bigger than a buffer arrives over several,
+//  so they are collected in one ring slot until the end of the frame (or SPS/PPS config).
+void H264EncoderMMAL::encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    H264EncoderMMAL *encoder = (H264EncoderMMAL *)port->userdata;
+
+    if (buffer->cmd == 0 && buffer->length > 0) {
+        if (!encoder->pending_nal) {
+            // Waits while the reader is a full ring behind, which in turn makes the encoder
+            //  stop taking input, so add_frame drops frames instead of us dropping NALs
+            encoder->pending_nal = encoder->nal_ring.begin_write();
+        }
+        if (encoder->pending_nal) {
+            mmal_buffer_header_mem_lock(buffer);
+            encoder->pending_nal->insert(encoder->pending_nal->end(), buffer->data + buffer->offset, buffer->data + buffer->offset + buffer->length);
+            mmal_buffer_header_mem_unlock(buffer);
+            if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+                // The pts add_frame gave the frame, config buffers have none
+                encoder->nal_ring.commit_write(buffer->pts != MMAL_TIME_UNKNOWN ? buffer->pts : 0);
+                encoder->pending_nal = nullptr;
+            }
+        }
+    }
+
+    mmal_buffer_header_release(buffer);
+    if (port->is_enabled && !encoder->nal_ring.is_closed()) {
+        encoder->send_output_buffers();
+    }
+}
+// Input buffer callback, the encoder is done reading the frame
+void H264EncoderMMAL::input_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    mmal_buffer_header_release(buffer);
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <x264.h>
+
+#include "H264Encoder.cpp"
+
+// Software encoding with libx264, for machines without a hardware encoder (our x86 replay
+//  servers, the Pi 5). Encodes on the calling thread, which x264 splits across its own threads.
+class H264EncoderX264 : public H264Encoder {
+public:
+    H264EncoderX264(const H264EncoderOptions& options);
+    ~H264EncoderX264();
+
+    std::string name() const override { return "x264"; }
+    void add_frame(const FrameBuffer& frame) override;
+    void flush() override;
+
+private:
+    x264_t* encoder;
+    int64_t frame_count;
+    // Our pts are frame counts (x264 wants them increasing, camera timestamps can repeat), so
+    //  the frames' timestamp_us are kept here, at pts % size, for as long as x264 can hold them
+    std::vector<int64_t> frame_timestamps;
+
+    void push_nals(x264_nal_t* nals, int nal_count, const x264_picture_t& output);
+};
+
+H264EncoderX264::H264EncoderX264(const H264EncoderOptions& options)
+    : H264Encoder(options), encoder(nullptr), frame_count(0) {
+    x264_param_t param;
+    // zerolatency turns off B-frames, lookahead and frame threads (it uses sliced threads instead)
+    const char* preset = options.preset.empty() ? (options.tune == H264Tune::ZeroLatency ? "veryfast" : "medium") : options.preset.c_str();
+    const char* tune = options.tune == H264Tune::ZeroLatency ? "zerolatency" : nullptr;
+    if (x264_param_default_preset(&param, preset, tune) < 0) {
+        throw std::runtime_error("Unknown x264 preset " + std::string(preset));
+    }
+
+    param.i_log_level = X264_LOG_WARNING;
+    param.i_threads = options.threads > 0 ? options.threads : X264_THREADS_AUTO;
+    param.i_width = video_width;
+    param.i_height = video_height;
+    param.i_csp = X264_CSP_I420;
+    param.i_fps_num = options.fps;
+    param.i_fps_den = 1;
+    // Rate control from the frame rate, not timestamps, camera timestamps can jitter or repeat
+    param.b_vfr_input = 0;
+    if (options.keyframe_interval > 0) {
+        param.i_keyint_max = options.keyframe_interval;
+    }
+    // Keyframes only every keyframe_interval frames (our segments are split at them), with no
+    //  extra ones at scene cuts, and closed GOPs, so each segment decodes on its own
+    param.i_scenecut_threshold = 0;
+    param.b_open_gop = 0;
+    // Annex B, with SPS and PPS before every keyframe, like the hardware encoder
+    param.b_repeat_headers = 1;
+    param.b_annexb = 1;
+
+    if (options.bitrate > 0) {
+        param.rc.i_rc_method = X264_RC_ABR;
+        param.rc.i_bitrate = options.bitrate / 1000;
+        // Cap the peaks at the bitrate over a second, so live streams don't stall
+        param.rc.i_vbv_max_bitrate = options.bitrate / 1000;
+        param.rc.i_vbv_buffer_size = options.bitrate / 1000;
+    } else {
+        param.rc.i_rc_method = X264_RC_CRF;
+        param.rc.f_rf_constant = options.crf;
+    }
+
+    if (x264_param_apply_profile(&param, "high") < 0) {
+        throw std::runtime_error("Failed to apply x264 profile");
+    }
+    encoder = x264_encoder_open(&param);
+    if (!encoder) {
+        throw std::runtime_error("Failed to open x264 encoder");
+    }
+    frame_timestamps.resize(x264_encoder_maximum_delayed_frames(encoder) + 1);
+}
+
+H264EncoderX264::~H264EncoderX264() {
+    if (encoder) {
+        x264_encoder_close(encoder);
+    }
+}
+
+void H264EncoderX264::add_frame(const FrameBuffer& frame) {
+    if (frame.width != video_width || frame.height != video_height) {
+        throw std::runtime_error("Frame size does not match the encoder");
+    }
+
+    // x264 copies the planes into its own frames, so it can read the pooled frame directly
+    x264_picture_t picture;
+    x264_picture_init(&picture);
+    picture.img.i_csp = X264_CSP_I420;
+    picture.img.i_plane = 3;
+    picture.img.plane[0] = (uint8_t*)frame.y();
+    picture.img.plane[1] = (uint8_t*)frame.u();
+    picture.img.plane[2] = (uint8_t*)frame.v();
+    picture.img.i_stride[0] = video_width;
+    picture.img.i_stride[1] = video_width / 2;
+    picture.img.i_stride[2] = video_width / 2;
+    picture.i_pts = frame_count++;
+    frame_timestamps[picture.i_pts % frame_timestamps.size()] = frame.timestamp_us;
+
+    x264_picture_t output;
+    x264_nal_t* nals = nullptr;
+    int nal_count = 0;
+    if (x264_encoder_encode(encoder, &nals, &nal_count, &picture, &output) < 0) {
+        throw std::runtime_error("x264 failed to encode a frame");
+    }
+    push_nals(nals, nal_count, output);
+}
+
+void H264EncoderX264::flush() {
+    while (x264_encoder_delayed_frames(encoder) > 0) {
+        x264_picture_t output;
+        x264_nal_t* nals = nullptr;
+        int nal_count = 0;
+        if (x264_encoder_encode(encoder, &nals, &nal_count, nullptr, &output) < 0) {
+            throw std::runtime_error("x264 failed to flush");
+        }
+        push_nals(nals, nal_count, output);
+    }
+}
+
+// x264 writes a frame's NALs one after another in one buffer, so they go in as one read, and
+//  a frame's slices (one per thread, with sliced threads) are never split across reads.
+//  output is the picture they encode, which has the pts it went in with.
+void H264EncoderX264::push_nals(x264_nal_t* nals, int nal_count, const x264_picture_t& output) {
+    if (nal_count == 0) return;
+    uint8_t* end = nals[nal_count - 1].p_payload + nals[nal_count - 1].i_payload;
+    push_nal(nals[0].p_payload, end - nals[0].p_payload, frame_timestamps[output.i_pts % frame_timestamps.size()]);
+}
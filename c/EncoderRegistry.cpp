@@ -0,0 +1,77 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+
+#include "H264Encoder.cpp"
+
+// Like the converters, build.sh defines the backends to compile in
+#ifdef CAMERA_HAVE_MMAL
+#include "EncodeMMAL.cpp"
+#endif
+#ifdef CAMERA_HAVE_X264
+#include "EncodeX264.cpp"
+#endif
+
+struct EncoderBackend {
+    std::string name;
+    std::function<std::unique_ptr<H264Encoder>(const H264EncoderOptions& options)> create;
+};
+
+// Every compiled-in encoder, hardware first
+std::vector<EncoderBackend> encoder_backends() {
+    std::vector<EncoderBackend> backends;
+#ifdef CAMERA_HAVE_MMAL
+    backends.push_back({"mmal",
+        [](const H264EncoderOptions& options) { return std::unique_ptr<H264Encoder>(new H264EncoderMMAL(options)); }});
+#endif
+#ifdef CAMERA_HAVE_X264
+    backends.push_back({"x264",
+        [](const H264EncoderOptions& options) { return std::unique_ptr<H264Encoder>(new H264EncoderX264(options)); }});
+#endif
+    return backends;
+}
+
+// config is "auto", a backend name, or a comma separated list of names. The first one that
+//  initializes wins ("auto" tries every backend, hardware first), so a Pi 5, which has the
+//  MMAL libraries but no hardware encoder, falls back to x264.
+std::unique_ptr<H264Encoder> create_h264_encoder(const std::string& config, const H264EncoderOptions& options) {
+    std::vector<EncoderBackend> backends = encoder_backends();
+
+    std::vector<std::string> wanted;
+    if (config == "auto" || config.empty()) {
+        for (auto& backend : backends) {
+            wanted.push_back(backend.name);
+        }
+    } else {
+        size_t start = 0;
+        while (start <= config.size()) {
+            size_t end = config.find(',', start);
+            if (end == std::string::npos) end = config.size();
+            wanted.push_back(config.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+    for (auto& name : wanted) {
+        bool known = false;
+        for (auto& backend : backends) {
+            if (backend.name != name) continue;
+            known = true;
+            try {
+                std::unique_ptr<H264Encoder> encoder = backend.create(options);
+                std::cout << "Using encoder " << backend.name << std::endl;
+                return encoder;
+            } catch (const std::exception& ex) {
+                std::cout << "Encoder " << backend.name << " is unavailable: " << ex.what() << std::endl;
+            }
+        }
+        if (!known) {
+            std::cout << "Encoder " << name << " is not compiled in" << std::endl;
+        }
+    }
+    throw std::runtime_error("No H.264 encoder backend works on this machine");
+}
@@ -0,0 +1,196 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <stdexcept>
+#include <string>
+
+class FramePool;
+
+// One decoded I420 frame, owned by a FramePool. Packed planes (Y, then U, then V) with strides
+//  of width and width / 2, the start is 64 byte aligned for SIMD. Only reachable through a FrameRef.
+struct FrameBuffer {
+    int width = 0;
+    int height = 0;
+    uint8_t* data = nullptr;
+    size_t size = 0;            // width * height * 3 / 2
+    uint32_t sequence = 0;      // Copied from the source frame by the converter
+    int64_t timestamp_us = 0;
+
+    uint8_t* y() const { return data; }
+    uint8_t* u() const { return data + (size_t)width * height; }
+    uint8_t* v() const { return u() + (size_t)(width / 2) * (height / 2); }
+
+private:
+    friend class FramePool;
+    friend class FrameRef;
+    FramePool* pool = nullptr;
+    std::atomic<int> refs{0};
+};
+
+// Copies the pixels, sequence and timestamp into a frame of the same size
+inline void copy_frame_buffer(const FrameBuffer& source, FrameBuffer& frame) {
+    if (frame.width != source.width || frame.height != source.height) {
+        throw std::runtime_error("Frame buffer size does not match the source frame");
+    }
+    memcpy(frame.data, source.data, source.size);
+    frame.sequence = source.sequence;
+    frame.timestamp_us = source.timestamp_us;
+}
+
+// A reference counted handle to a pooled frame. Copies share the frame (an encoder and a
+//  preview writer can both hold it), and when the last one goes away the frame goes back
+//  to the pool. Copying only touches an atomic counter, never the heap.
+class FrameRef {
+public:
+    FrameRef() : frame(nullptr) {}
+    FrameRef(const FrameRef& other) : frame(other.frame) {
+        if (frame) frame->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    FrameRef(FrameRef&& other) noexcept : frame(other.frame) { other.frame = nullptr; }
+    FrameRef& operator=(const FrameRef& other) {
+        if (this != &other) {
+            FrameRef copy(other);
+            std::swap(frame, copy.frame);
+        }
+        return *this;
+    }
+    FrameRef& operator=(FrameRef&& other) noexcept {
+        if (this != &other) {
+            reset();
+            frame = other.frame;
+            other.frame = nullptr;
+        }
+        return *this;
+    }
+    ~FrameRef() { reset(); }
+
+    void reset();
+
+    FrameBuffer* get() const { return frame; }
+    FrameBuffer& operator*() const { return *frame; }
+    FrameBuffer* operator->() const { return frame; }
+    explicit operator bool() const { return frame != nullptr; }
+    int use_count() const { return frame ? frame->refs.load(std::memory_order_relaxed) : 0; }
+
+private:
+    friend class FramePool;
+    explicit FrameRef(FrameBuffer* frame) : frame(frame) {}
+    FrameBuffer* frame;
+};
+
+// A fixed number of same sized I420 frames, allocated up front, so steady state capture and
+//  encoding never allocate. The pool must outlive every FrameRef taken from it.
+class FramePool {
+public:
+    FramePool(int width, int height, int count);
+    ~FramePool();
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // Blocks until a frame is free. Holding every frame and then calling this deadlocks,
+    //  so size the pool for everything that can hold a frame at once.
+    FrameRef acquire();
+    // Returns false if no frame was freed within timeout_ms
+    bool try_acquire(FrameRef& frame, int timeout_ms);
+
+    int width() const { return frame_width; }
+    int height() const { return frame_height; }
+    size_t frame_size() const { return (size_t)frame_width * frame_height * 3 / 2; }
+    int frame_count() const { return frames.size(); }
+    int free_count();
+
+private:
+    friend class FrameRef;
+    int frame_width;
+    int frame_height;
+    std::vector<FrameBuffer*> frames;
+    std::vector<FrameBuffer*> free_frames;  // Reserved for every frame, so recycling never allocates
+    std::mutex mutex;
+    std::condition_variable free_cv;
+
+    FrameRef take_free();  // Requires mutex
+    void recycle(FrameBuffer* frame);
+};
+
+void FrameRef::reset() {
+    if (frame && frame->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        frame->pool->recycle(frame);
+    }
+    frame = nullptr;
+}
+
+FramePool::FramePool(int width, int height, int count)
+    : frame_width(width), frame_height(height) {
+    if (width <= 0 || height <= 0 || width % 2 || height % 2) {
+        throw std::runtime_error("I420 frames need a positive, even size, not " + std::to_string(width) + "x" + std::to_string(height));
+    }
+    size_t size = frame_size();
+    // aligned_alloc wants a multiple of the alignment
+    size_t allocation = (size + 63) / 64 * 64;
+    frames.reserve(count);
+    free_frames.reserve(count);
+    for (int i = 0; i < count; i++) {
+        FrameBuffer* frame = new FrameBuffer();
+        frame->width = width;
+        frame->height = height;
+        frame->size = size;
+        frame->pool = this;
+        frame->data = (uint8_t*)aligned_alloc(64, allocation);
+        if (!frame->data) {
+            delete frame;
+            throw std::runtime_error("Failed to allocate frame pool of " + std::to_string(count) + " frames");
+        }
+        frames.push_back(frame);
+        free_frames.push_back(frame);
+    }
+}
+
+FramePool::~FramePool() {
+    for (FrameBuffer* frame : frames) {
+        free(frame->data);
+        delete frame;
+    }
+}
+
+FrameRef FramePool::take_free() {
+    FrameBuffer* frame = free_frames.back();
+    free_frames.pop_back();
+    frame->refs.store(1, std::memory_order_relaxed);
+    frame->sequence = 0;
+    frame->timestamp_us = 0;
+    return FrameRef(frame);
+}
+
+FrameRef FramePool::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    free_cv.wait(lock, [this]() { return !free_frames.empty(); });
+    return take_free();
+}
+
+bool FramePool::try_acquire(FrameRef& frame, int timeout_ms) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!free_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() { return !free_frames.empty(); })) {
+        return false;
+    }
+    frame = take_free();
+    return true;
+}
+
+int FramePool::free_count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return free_frames.size();
+}
+
+void FramePool::recycle(FrameBuffer* frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_frames.push_back(frame);
+    }
+    free_cv.notify_one();
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <string>
+
+#include "FrameView.cpp"
+#include "FrameBuffer.cpp"
+
+// What every MJPEG to I420 backend implements, so the backend can be picked at runtime
+//  (see ConverterRegistry.cpp) instead of by editing includes.
+class FrameConverter {
+public:
+    virtual ~FrameConverter() {}
+
+    // Short name, as used in --decoder=
+    virtual std::string name() const = 0;
+
+    // Decode one frame into a pooled frame. Throws if the frame can't be decoded, or isn't
+    //  the frame's size.
+    virtual void convert_frame_into(const FrameView& mjpeg_buffer, FrameBuffer& frame) = 0;
+};
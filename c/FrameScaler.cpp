@@ -0,0 +1,256 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "FrameBuffer.cpp"
+// average_rows_2x2
+#include "ConvertCPU.cpp"
+
+// Downscales I420 frames to I420 with an area filter (each output pixel is the average of the
+//  source pixels it covers, like cv2.INTER_AREA), for output branches at a smaller size than
+//  the camera (e.g. 1080p from a 4K camera). Halves with the decoder's SIMD 2x2 average while
+//  the result is still at least the output size, so 4K to 1080p is one pass, straight into the
+//  output. Whatever reduction is left (under 2x) is a separable filter, vertically 16 pixels at
+//  a time, then horizontally. At ratios that aren't a power of two that is a little softer than
+//  a true area filter (a halved pixel is split, not the source pixels under it), which is worth
+//  the fewer taps. Not thread safe (it has scratch rows).
+class FrameScaler {
+public:
+    FrameScaler(int source_width, int source_height, int width, int height);
+
+    // planes and strides are the source's Y, U and V, of the source size
+    void scale(const uint8_t* const planes[3], const int strides[3], FrameBuffer& frame);
+    void scale(const FrameBuffer& source, FrameBuffer& frame);
+
+    int width() const { return output_width; }
+    int height() const { return output_height; }
+
+private:
+    struct Plane {
+        int width = 0;
+        int height = 0;
+        std::vector<uint8_t> data;  // Packed, stride is width
+    };
+    // The source pixels each output pixel (column or row) covers, with weights summing to 256.
+    //  Every output has the same number of taps (padded with zero weights), so the loops over
+    //  them unroll.
+    struct Taps {
+        int count = 0;
+        std::vector<int> first;
+        std::vector<uint16_t> weights;  // count per output
+    };
+
+    int source_width;
+    int source_height;
+    int output_width;
+    int output_height;
+    // Halved levels, level i is 2^(i + 1) smaller than the source. If the last halving lands on
+    //  the output size it goes straight into the output, and isn't kept here.
+    std::vector<Plane> levels[3];
+    int halvings;
+    bool filter;                        // An area filter from the last level to the output
+    Taps column_taps[2];                // Luma, and chroma (both chroma planes)
+    Taps row_taps[2];
+    std::vector<uint8_t> filter_row;    // One vertically filtered source row, and count padding
+    std::vector<const uint8_t*> tap_rows;
+
+    static Taps area_taps(int source_size, int size);
+    void area_filter(const uint8_t* source, int source_width, int source_stride, int source_height, uint8_t* dest, int dest_width, int dest_height,
+                     const Taps& columns, const Taps& rows);
+};
+
+// dst[x] = sum(rows[k][x] * weights[k]) / 256, weights sum to 256, so the sum fits in 16 bits
+static void weighted_rows(const uint8_t* const* rows, const uint16_t* weights, int count, uint8_t* dst, int width) {
+    int x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x + 16 <= width; x += 16) {
+        uint16x8_t low = vdupq_n_u16(128);
+        uint16x8_t high = low;
+        for (int k = 0; k < count; k++) {
+            uint8x16_t pixels = vld1q_u8(rows[k] + x);
+            low = vmlaq_n_u16(low, vmovl_u8(vget_low_u8(pixels)), weights[k]);
+            high = vmlaq_n_u16(high, vmovl_u8(vget_high_u8(pixels)), weights[k]);
+        }
+        vst1q_u8(dst + x, vcombine_u8(vshrn_n_u16(low, 8), vshrn_n_u16(high, 8)));
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    for (; x + 16 <= width; x += 16) {
+        __m128i low = round;
+        __m128i high = round;
+        for (int k = 0; k < count; k++) {
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(rows[k] + x));
+            __m128i weight = _mm_set1_epi16((short)weights[k]);
+            low = _mm_add_epi16(low, _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), weight));
+            high = _mm_add_epi16(high, _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), weight));
+        }
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+    }
+#endif
+    for (; x < width; x++) {
+        uint32_t sum = 128;
+        for (int k = 0; k < count; k++) {
+            sum += rows[k][x] * weights[k];
+        }
+        dst[x] = (uint8_t)(sum >> 8);
+    }
+}
+
+// dst[x] = sum(row[first[x] + k] * weights[x * count + k]) / 256. Called with a constant count
+//  where it can be, so the taps unroll.
+static inline void weighted_columns(const uint8_t* row, const int* first, const uint16_t* weights, int count, uint8_t* dst, int width) {
+    for (int x = 0; x < width; x++) {
+        const uint8_t* in = row + first[x];
+        uint32_t sum = 128;
+        for (int k = 0; k < count; k++) {
+            sum += in[k] * weights[k];
+        }
+        dst[x] = (uint8_t)(sum >> 8);
+        weights += count;
+    }
+}
+
+// Output pixel i covers source [i * scale, (i + 1) * scale), each source pixel weighted by how much of it is covered
+FrameScaler::Taps FrameScaler::area_taps(int source_size, int size) {
+    Taps taps;
+    double scale = (double)source_size / size;
+    auto last_tap = [&](int i) { return std::min(source_size - 1, (int)ceil(std::min((double)source_size, (i + 1) * scale)) - 1); };
+    for (int i = 0; i < size; i++) {
+        taps.count = std::max(taps.count, last_tap(i) - (int)(i * scale) + 1);
+    }
+    for (int i = 0; i < size; i++) {
+        double start = i * scale;
+        double end = std::min((double)source_size, (i + 1) * scale);
+        int first = (int)start;
+        int last = last_tap(i);
+        taps.first.push_back(first);
+        size_t offset = taps.weights.size();
+        taps.weights.resize(offset + taps.count, 0);
+        int total = 0;
+        size_t largest = offset;
+        for (int k = first; k <= last; k++) {
+            double covered = std::min(end, (double)k + 1) - std::max(start, (double)k);
+            int weight = (int)(covered / scale * 256 + 0.5);
+            size_t tap = offset + (k - first);
+            taps.weights[tap] = (uint16_t)weight;
+            if (weight > taps.weights[largest]) largest = tap;
+            total += weight;
+        }
+        // The rounding goes to the pixel that is covered most
+        taps.weights[largest] += 256 - total;
+    }
+    return taps;
+}
+
+FrameScaler::FrameScaler(int source_width, int source_height, int width, int height)
+    : source_width(source_width), source_height(source_height), output_width(width), output_height(height), halvings(0) {
+    if (source_width < 2 || source_height < 2 || width < 2 || height < 2 || (source_width | source_height | width | height) & 1) {
+        throw std::runtime_error("FrameScaler: sizes must be even");
+    }
+    if (width > source_width || height > source_height) {
+        throw std::runtime_error("FrameScaler: can't scale " + std::to_string(source_width) + "x" + std::to_string(source_height)
+            + " up to " + std::to_string(width) + "x" + std::to_string(height));
+    }
+    // Halving needs even chroma planes
+    int level_width = source_width;
+    int level_height = source_height;
+    while (level_width % 4 == 0 && level_height % 4 == 0 && level_width / 2 >= width && level_height / 2 >= height) {
+        level_width /= 2;
+        level_height /= 2;
+        halvings++;
+    }
+    filter = level_width != width || level_height != height;
+    int kept = filter ? halvings : halvings - 1;
+    for (int level = 0; level < kept; level++) {
+        for (int i = 0; i < 3; i++) {
+            Plane plane;
+            plane.width = (source_width >> (level + 1)) / (i ? 2 : 1);
+            plane.height = (source_height >> (level + 1)) / (i ? 2 : 1);
+            plane.data.resize((size_t)plane.width * plane.height);
+            levels[i].push_back(std::move(plane));
+        }
+    }
+    if (filter) {
+        for (int i = 0; i < 2; i++) {
+            int divisor = i ? 2 : 1;
+            column_taps[i] = area_taps(level_width / divisor, width / divisor);
+            row_taps[i] = area_taps(level_height / divisor, height / divisor);
+        }
+        filter_row.resize(level_width + column_taps[0].count);
+    }
+}
+
+void FrameScaler::area_filter(const uint8_t* source, int source_width, int source_stride, int source_height, uint8_t* dest, int dest_width, int dest_height,
+                              const Taps& columns, const Taps& rows) {
+    // Padding taps (zero weight) can read past the last column, filter_row has room for them
+    tap_rows.resize(rows.count);
+    for (int y = 0; y < dest_height; y++) {
+        for (int k = 0; k < rows.count; k++) {
+            tap_rows[k] = source + (size_t)std::min(rows.first[y] + k, source_height - 1) * source_stride;
+        }
+        weighted_rows(tap_rows.data(), rows.weights.data() + (size_t)y * rows.count, rows.count, filter_row.data(), source_width);
+        uint8_t* out = dest + (size_t)y * dest_width;
+        const int* first = columns.first.data();
+        const uint16_t* weights = columns.weights.data();
+        switch (columns.count) {
+        case 2: weighted_columns(filter_row.data(), first, weights, 2, out, dest_width); break;
+        case 3: weighted_columns(filter_row.data(), first, weights, 3, out, dest_width); break;
+        default: weighted_columns(filter_row.data(), first, weights, columns.count, out, dest_width); break;
+        }
+    }
+}
+
+void FrameScaler::scale(const uint8_t* const planes[3], const int strides[3], FrameBuffer& frame) {
+    if (frame.width != output_width || frame.height != output_height) {
+        throw std::runtime_error("FrameScaler: output frame is " + std::to_string(frame.width) + "x" + std::to_string(frame.height)
+            + ", expected " + std::to_string(output_width) + "x" + std::to_string(output_height));
+    }
+    uint8_t* const outputs[3] = {frame.y(), frame.u(), frame.v()};
+    for (int i = 0; i < 3; i++) {
+        const uint8_t* source = planes[i];
+        int stride = strides[i];
+        int width = i ? source_width / 2 : source_width;
+        int height = i ? source_height / 2 : source_height;
+        for (int level = 0; level < halvings; level++) {
+            bool last = level == halvings - 1;
+            uint8_t* dest = last && !filter ? outputs[i] : levels[i][level].data.data();
+            int dest_width = width / 2;
+            for (int row = 0; row < height / 2; row++) {
+                const uint8_t* top = source + (size_t)(row * 2) * stride;
+                average_rows_2x2(top, top + stride, dest + (size_t)row * dest_width, width);
+            }
+            source = dest;
+            stride = dest_width;
+            width /= 2;
+            height /= 2;
+        }
+        if (filter) {
+            int dest_width = i ? output_width / 2 : output_width;
+            int dest_height = i ? output_height / 2 : output_height;
+            area_filter(source, width, stride, height, outputs[i], dest_width, dest_height, column_taps[i ? 1 : 0], row_taps[i ? 1 : 0]);
+        }
+    }
+}
+
+void FrameScaler::scale(const FrameBuffer& source, FrameBuffer& frame) {
+    if (source.width != source_width || source.height != source_height) {
+        throw std::runtime_error("FrameScaler: source frame size does not match");
+    }
+    const uint8_t* planes[3] = {source.y(), source.u(), source.v()};
+    int strides[3] = {source_width, source_width / 2, source_width / 2};
+    scale(planes, strides, frame);
+    frame.sequence = source.sequence;
+    frame.timestamp_us = source.timestamp_us;
+}
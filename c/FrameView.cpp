@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// A read-only view of one compressed (or raw) frame. It does NOT own the memory, so it is only
+//  valid while whatever it points into (a FrameLease, a std::vector, an mmap'd file) is alive.
+struct FrameView {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    uint32_t sequence = 0;      // Driver frame counter (gaps mean the driver dropped frames)
+    int64_t timestamp_us = 0;   // Capture time, in the clock the driver uses (usually CLOCK_MONOTONIC)
+    int dmabuf_fd = -1;         // If the memory is also a dmabuf, for stages that can import it without a copy
+
+    FrameView() {}
+    FrameView(const uint8_t* data, size_t size) : data(data), size(size) {}
+    // Implicit, so existing callers holding a std::vector still work
+    FrameView(const std::vector<uint8_t>& buffer) : data(buffer.data()), size(buffer.size()) {}
+};
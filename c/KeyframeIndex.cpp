@@ -0,0 +1,169 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A sidecar index of the keyframes SegmentWriter writes into a folder of a faster speed (30x and
+//  up), so a viewer can find the keyframe for a time with one lookup in a mapped file, instead
+//  of listing the folder and parsing segment files. Two files in each time folder:
+//  - keyframes.index: a KeyframeIndexHeader, then fixed size KeyframeIndexEntry records, in
+//      the order they were written (so sorted by time). Little endian.
+//  - keyframes.jpegs: small JPEGs of the keyframes, one after another, that entries point into
+// Segment files are renamed as they are appended to, so entries name them by segmentTime
+//  (encodeVideoKeyPrefix is stable). Segments are deleted by limit.ts without updating the
+//  index, so a reader has to handle missing files.
+
+static const char KEYFRAME_INDEX_NAME[] = "keyframes.index";
+static const char KEYFRAME_JPEGS_NAME[] = "keyframes.jpegs";
+static const char KEYFRAME_INDEX_MAGIC[8] = {'K', 'F', 'I', 'N', 'D', 'E', 'X', '1'};
+
+struct KeyframeIndexHeader {
+    char magic[8];
+    uint32_t version;       // 1
+    uint32_t entry_size;    // sizeof(KeyframeIndexEntry), so fields can be added at the end
+};
+
+struct KeyframeIndexEntry {
+    double time;            // The keyframe's startTime, in milliseconds since the epoch
+    double segment_time;    // segmentTime of the segment file it is in
+    uint32_t offset;        // Of the keyframe's SPS in the segment file (length prefixed NALs)
+    uint32_t size;          // Of the SPS, PPS and keyframe, with their length prefixes
+    int64_t activity;       // Changed pixels (ActivitySegment::most_active_changes), -1 if unknown
+    uint32_t jpeg_offset;   // In keyframes.jpegs
+    uint32_t jpeg_size;     // 0 if there is no JPEG
+};
+static_assert(sizeof(KeyframeIndexHeader) == 16, "KeyframeIndexHeader must match the file layout");
+static_assert(sizeof(KeyframeIndexEntry) == 40, "KeyframeIndexEntry must match the file layout");
+
+// Appends one entry (and its JPEG, if any) to the index files in folder
+void append_keyframe_index(const std::string& folder, KeyframeIndexEntry entry, const uint8_t* jpeg, size_t jpeg_size) {
+    auto open_append = [](const std::string& path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+        }
+        return fd;
+    };
+    auto write_all = [](int fd, const void* data, size_t size, const std::string& path) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        while (size > 0) {
+            ssize_t count = write(fd, bytes, size);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                std::string error = strerror(errno);
+                close(fd);
+                throw std::runtime_error("Failed to write " + path + ": " + error);
+            }
+            bytes += count;
+            size -= count;
+        }
+    };
+
+    entry.jpeg_offset = 0;
+    entry.jpeg_size = 0;
+    if (jpeg && jpeg_size > 0) {
+        std::string path = folder + KEYFRAME_JPEGS_NAME;
+        int fd = open_append(path);
+        off_t end = lseek(fd, 0, SEEK_END);
+        write_all(fd, jpeg, jpeg_size, path);
+        close(fd);
+        entry.jpeg_offset = (uint32_t)end;
+        entry.jpeg_size = (uint32_t)jpeg_size;
+    }
+
+    // Not appended blindly: a partly written last entry (we were killed mid write) is cut off
+    //  first, or every entry after it would be misaligned
+    std::string path = folder + KEYFRAME_INDEX_NAME;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    off_t end = lseek(fd, 0, SEEK_END);
+    off_t aligned = end < (off_t)sizeof(KeyframeIndexHeader) ? 0
+        : end - (end - (off_t)sizeof(KeyframeIndexHeader)) % (off_t)sizeof(KeyframeIndexEntry);
+    if (aligned != end && (ftruncate(fd, aligned) != 0 || lseek(fd, aligned, SEEK_SET) != aligned)) {
+        std::string error = strerror(errno);
+        close(fd);
+        throw std::runtime_error("Failed to truncate " + path + ": " + error);
+    }
+    if (aligned == 0) {
+        KeyframeIndexHeader header;
+        memcpy(header.magic, KEYFRAME_INDEX_MAGIC, sizeof(header.magic));
+        header.version = 1;
+        header.entry_size = sizeof(KeyframeIndexEntry);
+        write_all(fd, &header, sizeof(header), path);
+    }
+    write_all(fd, &entry, sizeof(entry), path);
+    close(fd);
+}
+
+// A read only mapping of one folder's keyframes.index
+class KeyframeIndex {
+public:
+    // Throws if the file is missing or isn't an index
+    KeyframeIndex(const std::string& folder);
+    ~KeyframeIndex();
+    KeyframeIndex(const KeyframeIndex&) = delete;
+    KeyframeIndex& operator=(const KeyframeIndex&) = delete;
+
+    size_t size() const { return count; }
+    const KeyframeIndexEntry& operator[](size_t index) const { return entries[index]; }
+    // The last keyframe at or before time, or the first one if time is before them all.
+    //  nullptr if the index is empty.
+    const KeyframeIndexEntry* find(double time) const;
+
+private:
+    void* mapping;
+    size_t mapping_size;
+    const KeyframeIndexEntry* entries;
+    size_t count;
+};
+
+KeyframeIndex::KeyframeIndex(const std::string& folder) : mapping(nullptr), mapping_size(0), entries(nullptr), count(0) {
+    std::string path = folder + KEYFRAME_INDEX_NAME;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(KeyframeIndexHeader)) {
+        close(fd);
+        throw std::runtime_error(path + " is too small to be a keyframe index");
+    }
+    mapping_size = info.st_size;
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        throw std::runtime_error("Failed to map " + path + ": " + strerror(errno));
+    }
+    const KeyframeIndexHeader* header = (const KeyframeIndexHeader*)mapping;
+    if (memcmp(header->magic, KEYFRAME_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->entry_size != sizeof(KeyframeIndexEntry)) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        throw std::runtime_error(path + " isn't a version 1 keyframe index");
+    }
+    entries = (const KeyframeIndexEntry*)((const uint8_t*)mapping + sizeof(KeyframeIndexHeader));
+    // A partly written last entry (we were killed mid write) is ignored, until the next append
+    //  cuts it off
+    count = (mapping_size - sizeof(KeyframeIndexHeader)) / sizeof(KeyframeIndexEntry);
+}
+
+KeyframeIndex::~KeyframeIndex() {
+    if (mapping) munmap(mapping, mapping_size);
+}
+
+const KeyframeIndexEntry* KeyframeIndex::find(double time) const {
+    if (count == 0) return nullptr;
+    const KeyframeIndexEntry* after = std::upper_bound(entries, entries + count, time,
+        [](double value, const KeyframeIndexEntry& entry) { return value < entry.time; });
+    return after == entries ? entries : after - 1;
+}
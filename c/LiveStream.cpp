@@ -0,0 +1,751 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "Nal.cpp"
+#include "NalRing.cpp"
+
+struct LiveStreamOptions {
+    // "address:port" or just "port" (on every address). Port 0 picks a free one (see port()).
+    std::string listen = "8090";
+    int max_clients = 64;
+    // Access units kept per stream, so new clients can start at the latest keyframe (and slow
+    //  ones have a little room), at least a keyframe interval. Buffers move between the ring
+    //  and the handoff, so each ends up keyframe sized (this many, plus handoff_units).
+    size_t ring_units = 45;
+    // Access units waiting for the server thread, per stream. When it is this far behind, the
+    //  encoder's side drops them instead of waiting.
+    size_t handoff_units = 16;
+    // Clients further behind than this skip ahead to the latest keyframe
+    double max_lag_ms = 500;
+    // Small, so a slow client's backlog stays with us (where it can be skipped), not in the kernel
+    int send_buffer_bytes = 256 << 10;
+    // Log clients coming and going
+    bool log_clients = true;
+};
+
+class LiveStreamServer;
+
+// One camera's encoded video, for LiveStreamServer to send to whoever is watching. add_nals is
+//  called by one thread (CameraPipeline's writer), and never waits for the server or clients.
+class LiveStream {
+public:
+    // Annex B data from H264Encoder::try_get_next_nal, of a frame captured at time_ms (in
+    //  wall_time_ms's clock). Reads are collected until one ends a frame, then handed to the
+    //  server as one access unit, at its frame's time.
+    void add_nals(const uint8_t* data, size_t size, double time_ms);
+    void add_nals(const std::vector<uint8_t>& data, double time_ms) { add_nals(data.data(), data.size(), time_ms); }
+
+    const std::string& name() const { return stream_name; }
+    // Access units dropped because the server thread was a whole handoff behind
+    uint64_t dropped_units() const { return dropped.load(); }
+
+private:
+    friend class LiveStreamServer;
+    LiveStream(const std::string& name, size_t handoff_units, int notify_fd);
+
+    // At the start of each handoff slot, then the access unit's Annex B data
+    struct UnitHeader {
+        double time_ms;
+        bool keyframe;
+        bool after_gap;     // Units before it were dropped, so it (until a keyframe) can't be decoded
+    };
+
+    std::string stream_name;
+    NalRing handoff;
+    int notify_fd;          // The server's eventfd
+
+    std::vector<uint8_t>* pending;  // The slot being filled, until the unit's frame arrives
+    bool pending_keyframe;
+    bool dropping;                  // No slot for the unit being received
+    bool gap;
+    std::vector<NalSpan> split_scratch;
+    std::atomic<uint64_t> dropped;
+};
+
+LiveStream::LiveStream(const std::string& name, size_t handoff_units, int notify_fd)
+    : stream_name(name), handoff(handoff_units, 64 << 10), notify_fd(notify_fd), pending(nullptr),
+      pending_keyframe(false), dropping(false), gap(false), dropped(0) {
+}
+
+void LiveStream::add_nals(const uint8_t* data, size_t size, double time_ms) {
+    if (!pending && !dropping) {
+        pending = handoff.begin_write(0);
+        if (pending) {
+            pending->resize(sizeof(UnitHeader));
+            pending_keyframe = false;
+        } else {
+            dropping = true;
+        }
+    }
+    bool ends_frame = false;
+    split_scratch.clear();
+    split_annexb(data, size, split_scratch);
+    for (auto& nal : split_scratch) {
+        if (identify_nal(nal) == NalType::Keyframe) pending_keyframe = true;
+        if (nal_is_frame(nal)) ends_frame = true;
+    }
+    if (pending) pending->insert(pending->end(), data, data + size);
+    if (!ends_frame) return;
+
+    if (!pending) {
+        dropped++;
+        dropping = false;
+        gap = true;
+        return;
+    }
+    UnitHeader header = {time_ms, pending_keyframe, gap};
+    memcpy(pending->data(), &header, sizeof(header));
+    handoff.commit_write();
+    pending = nullptr;
+    gap = false;
+    uint64_t value = 1;
+    if (write(notify_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        std::cerr << "Failed to wake live stream server: " << strerror(errno) << std::endl;
+    }
+}
+
+// Streams H.264 to browsers as it is encoded, instead of after a segment file is written and
+//  moved (spec.md: "Lower latency live stream"). On its own thread, with one epoll loop:
+//  GET /live/NAME.h264 is the raw Annex B stream (Connection: close, no framing)
+//  GET /live/NAME with a WebSocket upgrade is one binary message per access unit (a frame,
+//   with the SPS and PPS in front of keyframes), for WebCodecs or jmuxer
+//  GET /live is the stream names, as JSON
+// Each stream keeps its recent access units in a ring that every client reads from, with
+//  writev straight from the ring (one send buffer for everyone, nothing copied per client).
+//  Clients start at the latest keyframe (so the first picture doesn't wait for the next one,
+//  the player should show frames as they decode), and a client that falls behind (max_lag_ms,
+//  or out of the ring) skips ahead to the latest keyframe.
+class LiveStreamServer {
+public:
+    // Listens straight away (throws if it can't), but doesn't accept until start()
+    LiveStreamServer(const LiveStreamOptions& options = LiveStreamOptions());
+    ~LiveStreamServer();
+    LiveStreamServer(const LiveStreamServer&) = delete;
+    LiveStreamServer& operator=(const LiveStreamServer&) = delete;
+
+    // Before start(). The stream is owned by the server, so it has to outlive whoever feeds it.
+    LiveStream* add_stream(const std::string& name);
+    void start();
+    void stop();
+
+    int port() const { return listen_port; }
+    size_t client_count() const { return clients_connected.load(); }
+
+private:
+    struct Unit {
+        std::vector<uint8_t> data;      // UnitHeader, then the access unit
+        double time_ms = 0;
+        bool keyframe = false;
+    };
+    struct Client;
+    struct Stream {
+        std::unique_ptr<LiveStream> source;
+        std::vector<Unit> units;        // Unit n is units[n % size]
+        uint64_t unit_count = 0;
+        uint64_t latest_keyframe = 0;
+        bool has_keyframe = false;
+        std::vector<uint8_t> scratch;   // Swapped with the handoff, then into units
+        std::vector<Client*> clients;
+    };
+    struct Client {
+        int fd = -1;
+        Stream* stream = nullptr;       // Once it asked for one
+        bool websocket = false;
+        bool blocked = false;           // The socket is full, until EPOLLOUT
+        bool close_after_response = false;
+        std::string request;
+        std::string response;           // HTTP response headers (or a whole response)
+        size_t response_sent = 0;
+        // The next unit to send, and how much of it (with its WebSocket header) is sent
+        uint64_t position = 0;
+        size_t offset = 0;
+        bool need_keyframe = true;
+        uint64_t resync_from = 0;       // The keyframe it waits for is at or after this
+        // The rest of a unit that left the ring while it was half sent (rare, so copied)
+        std::vector<uint8_t> held;
+        size_t held_sent = 0;
+        std::vector<uint8_t> received;  // WebSocket frames from the browser, which we ignore
+        uint64_t sent_units = 0;
+        uint64_t skipped_units = 0;     // To catch up, after it started
+    };
+
+    LiveStreamOptions options;
+    int listen_fd;
+    int listen_port;
+    int epoll_fd;
+    int wake_fd;            // stop()
+    int data_fd;            // LiveStream::add_nals
+    std::vector<std::unique_ptr<Stream>> streams;
+    std::vector<std::unique_ptr<Client>> clients;
+    std::atomic<size_t> clients_connected;
+    std::atomic<bool> stopping;
+    std::thread thread;
+
+    void run();
+    void accept_clients();
+    void read_client(Client& client);
+    void handle_request(Client& client);
+    void take_units(Stream& stream);
+    bool next_unit(Client& client);
+    void send_client(Client& client);
+    void close_client(Client& client);
+    void close_fds();
+};
+
+// SHA-1, only for the WebSocket handshake's Sec-WebSocket-Accept
+static void sha1(const uint8_t* data, size_t size, uint8_t digest[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::vector<uint8_t> message(data, data + size);
+    message.push_back(0x80);
+    while (message.size() % 64 != 56) message.push_back(0);
+    uint64_t bits = (uint64_t)size * 8;
+    for (int i = 7; i >= 0; i--) message.push_back((uint8_t)(bits >> (i * 8)));
+    auto rotate = [](uint32_t value, int bits) { return (value << bits) | (value >> (32 - bits)); };
+    for (size_t chunk = 0; chunk < message.size(); chunk += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const uint8_t* p = &message[chunk + i * 4];
+            w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+        for (int i = 16; i < 80; i++) w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t next = rotate(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rotate(b, 30); b = a; a = next;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) digest[i] = (uint8_t)(h[i / 4] >> (24 - (i % 4) * 8));
+}
+
+static std::string base64(const uint8_t* data, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t value = (uint32_t)data[i] << 16;
+        if (i + 1 < size) value |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < size) value |= data[i + 2];
+        out += alphabet[(value >> 18) & 63];
+        out += alphabet[(value >> 12) & 63];
+        out += i + 1 < size ? alphabet[(value >> 6) & 63] : '=';
+        out += i + 2 < size ? alphabet[value & 63] : '=';
+    }
+    return out;
+}
+
+// The value of a request header, matched case insensitively, or "" if it isn't there
+static std::string http_header(const std::string& request, const std::string& name) {
+    size_t line = request.find("\r\n");
+    while (line != std::string::npos && line + 2 < request.size()) {
+        size_t start = line + 2;
+        size_t end = request.find("\r\n", start);
+        if (end == std::string::npos) end = request.size();
+        size_t colon = request.find(':', start);
+        if (colon < end && colon - start == name.size() && strncasecmp(request.c_str() + start, name.c_str(), name.size()) == 0) {
+            size_t value = request.find_first_not_of(' ', colon + 1);
+            return value < end ? request.substr(value, end - value) : "";
+        }
+        line = end;
+    }
+    return "";
+}
+
+// A server to client WebSocket frame header (final, binary, unmasked) for size bytes. Returns its length.
+static size_t websocket_header(uint64_t size, uint8_t header[10]) {
+    header[0] = 0x82;
+    if (size < 126) {
+        header[1] = (uint8_t)size;
+        return 2;
+    }
+    if (size < 65536) {
+        header[1] = 126;
+        header[2] = (uint8_t)(size >> 8);
+        header[3] = (uint8_t)size;
+        return 4;
+    }
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) header[2 + i] = (uint8_t)(size >> (56 - i * 8));
+    return 10;
+}
+
+LiveStreamServer::LiveStreamServer(const LiveStreamOptions& options)
+    : options(options), listen_fd(-1), listen_port(0), epoll_fd(-1), wake_fd(-1), data_fd(-1),
+      clients_connected(0), stopping(false) {
+    this->options.ring_units = std::max<size_t>(2, options.ring_units);
+    std::string host;
+    std::string port = options.listen;
+    size_t colon = port.rfind(':');
+    if (colon != std::string::npos) {
+        host = port.substr(0, colon);
+        port = port.substr(colon + 1);
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* addresses = nullptr;
+    int status = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses);
+    if (status != 0) {
+        throw std::runtime_error("Failed to resolve live stream address " + options.listen + ": " + gai_strerror(status));
+    }
+    std::string message = "no addresses";
+    for (struct addrinfo* address = addresses; address && listen_fd == -1; address = address->ai_next) {
+        listen_fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+        if (listen_fd == -1) {
+            message = strerror(errno);
+            continue;
+        }
+        int on = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(listen_fd, address->ai_addr, address->ai_addrlen) == -1 || listen(listen_fd, 16) == -1) {
+            message = strerror(errno);
+            close(listen_fd);
+            listen_fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (listen_fd == -1) {
+        throw std::runtime_error("Failed to listen on " + options.listen + ": " + message);
+    }
+    struct sockaddr_storage bound;
+    socklen_t bound_size = sizeof(bound);
+    getsockname(listen_fd, (struct sockaddr*)&bound, &bound_size);
+    listen_port = ntohs(bound.ss_family == AF_INET6 ? ((struct sockaddr_in6*)&bound)->sin6_port : ((struct sockaddr_in*)&bound)->sin_port);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wake_fd == -1 || data_fd == -1) {
+        message = strerror(errno);
+        close_fds();
+        throw std::runtime_error("Failed to create live stream server: " + message);
+    }
+    // Clients are tagged with their pointer, so 0 to 2 are free for these
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+    event.data.u64 = 1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data_fd, &event);
+    event.data.u64 = 2;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+}
+
+LiveStreamServer::~LiveStreamServer() {
+    stop();
+    for (auto& client : clients) {
+        close(client->fd);
+    }
+    close_fds();
+}
+
+void LiveStreamServer::close_fds() {
+    for (int* fd : {&epoll_fd, &wake_fd, &data_fd, &listen_fd}) {
+        if (*fd != -1) close(*fd);
+        *fd = -1;
+    }
+}
+
+LiveStream* LiveStreamServer::add_stream(const std::string& name) {
+    if (thread.joinable()) {
+        throw std::runtime_error("Live streams have to be added before the server starts");
+    }
+    for (auto& stream : streams) {
+        if (stream->source->name() == name) {
+            throw std::runtime_error("There is already a live stream called " + name);
+        }
+    }
+    std::unique_ptr<Stream> stream(new Stream());
+    stream->source.reset(new LiveStream(name, options.handoff_units, data_fd));
+    stream->units.resize(options.ring_units);
+    streams.push_back(std::move(stream));
+    return streams.back()->source.get();
+}
+
+void LiveStreamServer::start() {
+    if (!thread.joinable()) {
+        thread = std::thread(&LiveStreamServer::run, this);
+    }
+}
+
+void LiveStreamServer::stop() {
+    if (!thread.joinable()) return;
+    stopping = true;
+    uint64_t value = 1;
+    if (write(wake_fd, &value, sizeof(value)) == -1) {
+        std::cerr << "Failed to wake live stream server: " << strerror(errno) << std::endl;
+    }
+    thread.join();
+}
+
+void LiveStreamServer::run() {
+    std::vector<struct epoll_event> events(64);
+    while (!stopping) {
+        int count = epoll_wait(epoll_fd, events.data(), events.size(), 1000);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            std::cerr << "Live stream server failed to wait: " << strerror(errno) << std::endl;
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            uint64_t tag = events[i].data.u64;
+            if (tag == 0) {
+                return;
+            } else if (tag == 1) {
+                uint64_t value;
+                while (read(data_fd, &value, sizeof(value)) > 0) {}
+                for (auto& stream : streams) {
+                    take_units(*stream);
+                }
+            } else if (tag == 2) {
+                accept_clients();
+            } else {
+                Client& client = *(Client*)events[i].data.ptr;
+                if (events[i].events & EPOLLOUT) client.blocked = false;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_client(client);
+                if (client.fd != -1 && !client.blocked) send_client(client);
+            }
+        }
+        // Closed clients are only freed here, after every event that might point at them
+        for (size_t i = 0; i < clients.size();) {
+            if (clients[i]->fd == -1) {
+                clients[i] = std::move(clients.back());
+                clients.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+}
+
+void LiveStreamServer::accept_clients() {
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                std::cerr << "Failed to accept a live stream client: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+        if ((int)clients.size() >= options.max_clients) {
+            close(fd);
+            continue;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (options.send_buffer_bytes > 0) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.send_buffer_bytes, sizeof(options.send_buffer_bytes));
+        }
+        std::unique_ptr<Client> client(new Client());
+        client->fd = fd;
+        // Edge triggered, so a client that is waiting for video doesn't keep waking us for EPOLLOUT
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = client.get();
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            std::cerr << "Failed to poll a live stream client: " << strerror(errno) << std::endl;
+            close(fd);
+            continue;
+        }
+        clients.push_back(std::move(client));
+        clients_connected++;
+    }
+}
+
+void LiveStreamServer::read_client(Client& client) {
+    char buffer[4096];
+    while (client.fd != -1) {
+        ssize_t count = read(client.fd, buffer, sizeof(buffer));
+        if (count == 0 || (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close_client(client);
+            return;
+        }
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (!client.stream && client.response.empty()) {
+            client.request.append(buffer, count);
+            if (client.request.find("\r\n\r\n") != std::string::npos) {
+                handle_request(client);
+            } else if (client.request.size() > 8192) {
+                close_client(client);
+            }
+        } else if (client.websocket) {
+            // Browsers only send us a close (or pongs), so the frames are skipped, and a close closes
+            client.received.insert(client.received.end(), buffer, buffer + count);
+            size_t position = 0;
+            while (client.received.size() - position >= 2) {
+                const uint8_t* frame = client.received.data() + position;
+                uint64_t length = frame[1] & 0x7F;
+                size_t header = 2;
+                if (length == 126) header = 4;
+                if (length == 127) header = 10;
+                if (frame[1] & 0x80) header += 4;
+                if (client.received.size() - position < header) break;
+                if (length >= 126) {
+                    size_t bytes = length == 126 ? 2 : 8;
+                    length = 0;
+                    for (size_t i = 0; i < bytes; i++) length = (length << 8) | frame[2 + i];
+                }
+                if ((frame[0] & 0x0F) == 8 || length > (64 << 10)) {
+                    close_client(client);
+                    return;
+                }
+                if (client.received.size() - position - header < length) break;
+                position += header + length;
+            }
+            client.received.erase(client.received.begin(), client.received.begin() + position);
+        }
+    }
+}
+
+void LiveStreamServer::handle_request(Client& client) {
+    std::string method = client.request.substr(0, client.request.find(' '));
+    size_t path_start = method.size() + 1;
+    std::string path = client.request.substr(path_start, client.request.find(' ', path_start) - path_start);
+    path = path.substr(0, path.find('?'));
+    const char* cors = "Access-Control-Allow-Origin: *\r\nCache-Control: no-store\r\n";
+    client.close_after_response = true;
+
+    if (method != "GET") {
+        client.response = "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        return;
+    }
+    if (path == "/live" || path == "/live/") {
+        std::string body = "[";
+        for (size_t i = 0; i < streams.size(); i++) {
+            body += (i ? ",\"" : "\"") + streams[i]->source->name() + "\"";
+        }
+        body += "]";
+        client.response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n" + std::string(cors)
+            + "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        return;
+    }
+    std::string name = path.rfind("/live/", 0) == 0 ? path.substr(strlen("/live/")) : "";
+    bool raw = name.size() > 5 && name.compare(name.size() - 5, 5, ".h264") == 0;
+    if (raw) name.resize(name.size() - 5);
+    Stream* stream = nullptr;
+    for (auto& candidate : streams) {
+        if (candidate->source->name() == name) stream = candidate.get();
+    }
+    std::string key = http_header(client.request, "Sec-WebSocket-Key");
+    if (!stream || (!raw && key.empty())) {
+        std::string body = stream ? "Expected a WebSocket, or " + path + ".h264\n" : "No live stream at " + path + "\n";
+        client.response = std::string(stream ? "HTTP/1.1 400 Bad Request" : "HTTP/1.1 404 Not Found") + "\r\nContent-Type: text/plain\r\n"
+            + cors + "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        return;
+    }
+
+    client.close_after_response = false;
+    client.stream = stream;
+    client.websocket = !raw;
+    if (raw) {
+        client.response = "HTTP/1.1 200 OK\r\nContent-Type: video/h264\r\n" + std::string(cors) + "Connection: close\r\n\r\n";
+    } else {
+        std::string accept_key = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        uint8_t digest[20];
+        sha1((const uint8_t*)accept_key.data(), accept_key.size(), digest);
+        client.response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: "
+            + base64(digest, sizeof(digest)) + "\r\n\r\n";
+    }
+    // From the latest keyframe, if the ring still has it
+    uint64_t oldest = stream->unit_count > stream->units.size() ? stream->unit_count - stream->units.size() : 0;
+    client.position = stream->has_keyframe && stream->latest_keyframe >= oldest ? stream->latest_keyframe : stream->unit_count;
+    client.need_keyframe = true;
+    stream->clients.push_back(&client);
+    if (!options.log_clients) return;
+    std::cout << "Live stream " << name << " has a " << (raw ? "raw" : "WebSocket") << " client (" << stream->clients.size() << " watching)" << std::endl;
+}
+
+// Moves what the encoder's side handed over into the ring. Nothing is copied, the handoff's
+//  slot and the ring's oldest unit trade buffers.
+void LiveStreamServer::take_units(Stream& stream) {
+    while (stream.source->handoff.pop(stream.scratch, 0)) {
+        if (stream.scratch.size() < sizeof(LiveStream::UnitHeader)) continue;
+        LiveStream::UnitHeader header;
+        memcpy(&header, stream.scratch.data(), sizeof(header));
+        uint64_t sequence = stream.unit_count;
+        Unit& unit = stream.units[sequence % stream.units.size()];
+        // Someone halfway through the unit we're replacing keeps the rest of it
+        if (sequence >= stream.units.size()) {
+            uint64_t evicted = sequence - stream.units.size();
+            for (Client* client : stream.clients) {
+                if (client->position != evicted || client->offset == 0 || !client->held.empty()) continue;
+                uint8_t header_bytes[10];
+                size_t header_size = client->websocket ? websocket_header(unit.data.size() - sizeof(LiveStream::UnitHeader), header_bytes) : 0;
+                client->held.clear();
+                if (client->offset < header_size) {
+                    client->held.insert(client->held.end(), header_bytes + client->offset, header_bytes + header_size);
+                }
+                size_t data_offset = sizeof(LiveStream::UnitHeader) + (client->offset > header_size ? client->offset - header_size : 0);
+                client->held.insert(client->held.end(), unit.data.begin() + data_offset, unit.data.end());
+                client->held_sent = 0;
+                client->offset = 0;
+            }
+        }
+        unit.data.swap(stream.scratch);
+        unit.time_ms = header.time_ms;
+        unit.keyframe = header.keyframe;
+        stream.unit_count++;
+        if (unit.keyframe) {
+            stream.latest_keyframe = sequence;
+            stream.has_keyframe = true;
+        }
+        if (header.after_gap) {
+            // Everyone has to start again from a keyframe after the gap
+            for (Client* client : stream.clients) {
+                client->need_keyframe = true;
+                client->resync_from = sequence;
+            }
+        }
+    }
+    for (Client* client : stream.clients) {
+        if (!client->blocked) send_client(*client);
+    }
+}
+
+// Points the client at the next unit to start sending (skipping ahead if it is behind), and
+//  returns whether there is one yet
+bool LiveStreamServer::next_unit(Client& client) {
+    Stream& stream = *client.stream;
+    uint64_t oldest = stream.unit_count > stream.units.size() ? stream.unit_count - stream.units.size() : 0;
+    uint64_t start = client.position;
+    if (client.position < stream.unit_count && stream.has_keyframe && stream.latest_keyframe > client.position) {
+        const Unit& newest = stream.units[(stream.unit_count - 1) % stream.units.size()];
+        const Unit& next = stream.units[client.position % stream.units.size()];
+        if (client.position < oldest || newest.time_ms - next.time_ms > options.max_lag_ms) {
+            client.position = stream.latest_keyframe;
+        }
+    }
+    if (client.position < oldest) {
+        // No keyframe since it fell out of the ring, so wait for the next one
+        client.position = stream.unit_count;
+        client.need_keyframe = true;
+    }
+    if (client.need_keyframe) {
+        client.position = std::max(client.position, client.resync_from);
+        while (client.position < stream.unit_count && !stream.units[client.position % stream.units.size()].keyframe) {
+            client.position++;
+        }
+        if (client.position < stream.unit_count) client.need_keyframe = false;
+    }
+    if (client.position > start && client.sent_units > 0) {
+        client.skipped_units += client.position - start;
+    }
+    return client.position < stream.unit_count;
+}
+
+void LiveStreamServer::send_client(Client& client) {
+    const int max_units = 16;
+    while (client.fd != -1) {
+        struct iovec iov[2 * max_units + 2];
+        uint8_t headers[max_units][10];
+        size_t sizes[max_units];    // Of each unit, with its WebSocket header
+        int iov_count = 0;
+        int unit_count = 0;
+        if (client.response_sent < client.response.size()) {
+            iov[iov_count++] = {(void*)(client.response.data() + client.response_sent), client.response.size() - client.response_sent};
+        }
+        if (!client.held.empty()) {
+            iov[iov_count++] = {client.held.data() + client.held_sent, client.held.size() - client.held_sent};
+        } else if (client.stream && (client.offset > 0 || next_unit(client))) {
+            Stream& stream = *client.stream;
+            for (uint64_t position = client.position; position < stream.unit_count && unit_count < max_units; position++) {
+                const std::vector<uint8_t>& data = stream.units[position % stream.units.size()].data;
+                size_t data_size = data.size() - sizeof(LiveStream::UnitHeader);
+                size_t header_size = client.websocket ? websocket_header(data_size, headers[unit_count]) : 0;
+                size_t offset = unit_count == 0 ? client.offset : 0;
+                if (offset < header_size) {
+                    iov[iov_count++] = {headers[unit_count] + offset, header_size - offset};
+                }
+                size_t data_offset = offset > header_size ? offset - header_size : 0;
+                iov[iov_count++] = {(void*)(data.data() + sizeof(LiveStream::UnitHeader) + data_offset), data_size - data_offset};
+                sizes[unit_count++] = header_size + data_size;
+            }
+        }
+        if (iov_count == 0) {
+            if (client.close_after_response) close_client(client);
+            return;
+        }
+
+        ssize_t sent = writev(client.fd, iov, iov_count);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client.blocked = true;
+            } else {
+                close_client(client);
+            }
+            return;
+        }
+        size_t remaining = sent;
+        size_t response_part = std::min(remaining, client.response.size() - client.response_sent);
+        client.response_sent += response_part;
+        remaining -= response_part;
+        if (!client.held.empty()) {
+            size_t held_part = std::min(remaining, client.held.size() - client.held_sent);
+            client.held_sent += held_part;
+            if (client.held_sent == client.held.size()) {
+                client.held.clear();
+                client.position++;
+                client.sent_units++;
+            }
+            continue;
+        }
+        for (int i = 0; i < unit_count && remaining > 0; i++) {
+            size_t unit_remaining = sizes[i] - client.offset;
+            if (remaining >= unit_remaining) {
+                remaining -= unit_remaining;
+                client.position++;
+                client.sent_units++;
+                client.offset = 0;
+            } else {
+                client.offset += remaining;
+                remaining = 0;
+            }
+        }
+    }
+}
+
+void LiveStreamServer::close_client(Client& client) {
+    if (client.fd == -1) return;
+    if (client.stream) {
+        std::vector<Client*>& watching = client.stream->clients;
+        watching.erase(std::remove(watching.begin(), watching.end(), &client), watching.end());
+        if (options.log_clients) std::cout << "Live stream " << client.stream->source->name() << " lost a client (" << watching.size() << " watching"
+                  << (client.skipped_units ? ", it skipped " + std::to_string(client.skipped_units) + " frames to catch up" : "") << ")" << std::endl;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client.fd, nullptr);
+    close(client.fd);
+    client.fd = -1;
+    clients_connected--;
+}
@@ -0,0 +1,554 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#include "Nal.cpp"
+
+// Fragmented MP4 (ISO BMFF) from our length prefixed NALs, so browsers can play segment files
+//  directly, instead of H264toMP4 (mp4-typescript) converting them on every read. A file is an
+//  init segment (ftyp and moov, from the SPS and PPS), then a moof and mdat per keyframe group.
+//  The mdat holds the NALs exactly as our .nal files do (length prefixed, with the SPS and PPS
+//  in band before each keyframe), so a fragment is just a small header in front of them.
+
+// Sample times are in 90kHz ticks, like RTP
+static const uint32_t MP4_TIMESCALE = 90000;
+
+// One picture (all its slices, and any parameter sets before it), in decode order
+struct Mp4Sample {
+    size_t offset = 0;      // Into the fragment's data
+    size_t size = 0;
+    double time_ms = 0;     // Decode time, from the start of the file
+};
+
+// What we need from an SPS to describe the track and to find the picture order of slices
+struct H264SpsInfo {
+    int profile = 0;
+    int width = 0;
+    int height = 0;
+    int chroma_format = 1;
+    int bit_depth_luma = 8;
+    int bit_depth_chroma = 8;
+    bool separate_colour_plane = false;
+    int log2_max_frame_num = 4;
+    int poc_type = 0;
+    int log2_max_poc_lsb = 4;
+    bool frame_mbs_only = true;
+};
+
+// Reads exp-golomb coded fields from a NAL, skipping emulation prevention bytes as it goes.
+//  Reading past the end gives zeros and sets overrun.
+class H264BitReader {
+public:
+    H264BitReader(const uint8_t* data, size_t size) : data(data), size(size), pos(0), bit(0), zeros(0), overrun(false) {}
+
+    uint32_t bits(int count) {
+        uint32_t value = 0;
+        for (int i = 0; i < count; i++) value = (value << 1) | next_bit();
+        return value;
+    }
+    uint32_t ue() {
+        int leading = 0;
+        while (next_bit() == 0) {
+            if (++leading > 31) { overrun = true; return 0; }
+        }
+        return ((1u << leading) - 1) + bits(leading);
+    }
+    int32_t se() {
+        uint32_t value = ue();
+        return value & 1 ? (int32_t)((value + 1) / 2) : -(int32_t)(value / 2);
+    }
+    bool failed() const { return overrun; }
+
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    int bit;
+    int zeros;      // Zero bytes just read, 00 00 03 means the 03 is padding
+    bool overrun;
+
+    uint32_t next_bit() {
+        if (bit == 0) {
+            if (pos < size && zeros >= 2 && data[pos] == 3) {
+                pos++;
+                zeros = 0;
+            }
+            if (pos >= size) {
+                overrun = true;
+                return 0;
+            }
+            zeros = data[pos] == 0 ? zeros + 1 : 0;
+        }
+        uint32_t value = (data[pos] >> (7 - bit)) & 1;
+        if (++bit == 8) {
+            bit = 0;
+            pos++;
+        }
+        return value;
+    }
+};
+
+static void skip_scaling_list(H264BitReader& reader, int size) {
+    int last_scale = 8;
+    int next_scale = 8;
+    for (int i = 0; i < size; i++) {
+        if (next_scale != 0) next_scale = (last_scale + reader.se() + 256) % 256;
+        last_scale = next_scale == 0 ? last_scale : next_scale;
+    }
+}
+
+// seq_parameter_set_data (H.264 7.3.2.1.1). Returns false if it's cut short or isn't an SPS.
+bool parse_sps(const NalSpan& sps, H264SpsInfo& info) {
+    if (identify_nal(sps) != NalType::Sps || sps.size < 4) return false;
+    H264BitReader reader(sps.data + 1, sps.size - 1);
+    info = H264SpsInfo();
+    info.profile = reader.bits(8);
+    reader.bits(16);    // Constraint flags and level
+    reader.ue();        // seq_parameter_set_id
+    switch (info.profile) {
+        case 100: case 110: case 122: case 244: case 44: case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135: {
+            info.chroma_format = reader.ue();
+            if (info.chroma_format == 3) info.separate_colour_plane = reader.bits(1);
+            info.bit_depth_luma = reader.ue() + 8;
+            info.bit_depth_chroma = reader.ue() + 8;
+            reader.bits(1);     // qpprime_y_zero_transform_bypass_flag
+            if (reader.bits(1)) {
+                int lists = info.chroma_format != 3 ? 8 : 12;
+                for (int i = 0; i < lists; i++) {
+                    if (reader.bits(1)) skip_scaling_list(reader, i < 6 ? 16 : 64);
+                }
+            }
+            break;
+        }
+    }
+    info.log2_max_frame_num = reader.ue() + 4;
+    info.poc_type = reader.ue();
+    if (info.poc_type == 0) {
+        info.log2_max_poc_lsb = reader.ue() + 4;
+    } else if (info.poc_type == 1) {
+        reader.bits(1);
+        reader.se();
+        reader.se();
+        uint32_t cycle = reader.ue();
+        for (uint32_t i = 0; i < cycle && !reader.failed(); i++) reader.se();
+    }
+    reader.ue();        // max_num_ref_frames
+    reader.bits(1);     // gaps_in_frame_num_value_allowed_flag
+    int width_mbs = reader.ue() + 1;
+    int height_map_units = reader.ue() + 1;
+    info.frame_mbs_only = reader.bits(1);
+    if (!info.frame_mbs_only) reader.bits(1);
+    reader.bits(1);     // direct_8x8_inference_flag
+    int crop[4] = {0, 0, 0, 0};
+    if (reader.bits(1)) {
+        for (int& value : crop) value = reader.ue();
+    }
+    if (reader.failed()) return false;
+
+    // Crop units are chroma samples, and field pairs for interlaced
+    int chroma = info.separate_colour_plane ? 0 : info.chroma_format;
+    int crop_x = chroma == 1 || chroma == 2 ? 2 : 1;
+    int crop_y = (chroma == 1 ? 2 : 1) * (info.frame_mbs_only ? 1 : 2);
+    info.width = width_mbs * 16 - (crop[0] + crop[1]) * crop_x;
+    info.height = (info.frame_mbs_only ? 1 : 2) * height_map_units * 16 - (crop[2] + crop[3]) * crop_y;
+    return info.width > 0 && info.height > 0 && info.log2_max_frame_num <= 16 && info.log2_max_poc_lsb <= 16;
+}
+
+// Writes boxes into a buffer, patching each box's size when it's closed
+class Mp4BoxWriter {
+public:
+    Mp4BoxWriter(std::vector<uint8_t>& out) : out(out) {}
+
+    void open(const char* type) {
+        starts.push_back(out.size());
+        u32(0);
+        out.insert(out.end(), type, type + 4);
+    }
+    void open_full(const char* type, uint8_t version, uint32_t flags) {
+        open(type);
+        u32((uint32_t)version << 24 | flags);
+    }
+    void close() {
+        size_t start = starts.back();
+        starts.pop_back();
+        put_u32(start, out.size() - start);
+    }
+    void u8(uint8_t value) { out.push_back(value); }
+    void u16(uint16_t value) { u8(value >> 8); u8(value); }
+    void u32(uint32_t value) { u16(value >> 16); u16(value); }
+    void u64(uint64_t value) { u32(value >> 32); u32(value); }
+    void zeros(size_t count) { out.insert(out.end(), count, 0); }
+    void bytes(const uint8_t* data, size_t size) { out.insert(out.end(), data, data + size); }
+    void fourcc(const char* type) { out.insert(out.end(), type, type + 4); }
+    // The identity matrix, in tkhd and mvhd
+    void matrix() {
+        static const uint32_t values[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+        for (uint32_t value : values) u32(value);
+    }
+    size_t position() const { return out.size(); }
+    void put_u32(size_t offset, uint32_t value) {
+        out[offset] = value >> 24;
+        out[offset + 1] = value >> 16;
+        out[offset + 2] = value >> 8;
+        out[offset + 3] = value;
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    std::vector<size_t> starts;
+};
+
+// Splits length prefixed NALs (one of our segment files, or a group as SegmentWriter writes it)
+//  into one sample per picture. Parameter sets (and anything else) go with the picture after
+//  them. Appends to samples, with their times left 0. Returns false if the data is truncated.
+bool split_mp4_samples(const uint8_t* data, size_t size, std::vector<Mp4Sample>& samples) {
+    std::vector<NalSpan> nals;
+    bool complete = split_length_prefixed(data, size, nals);
+    size_t sample_start = 0;
+    bool has_picture = false;
+    for (auto& nal : nals) {
+        size_t nal_start = nal.data - 4 - data;
+        if (nal_is_frame(nal) && nal_starts_picture(nal)) {
+            if (has_picture) {
+                Mp4Sample sample;
+                sample.offset = sample_start;
+                sample.size = nal_start - sample_start;
+                samples.push_back(sample);
+                sample_start = nal_start;
+            }
+            has_picture = true;
+        } else if (!nal_is_frame(nal) && has_picture && nal_start > sample_start) {
+            // The next picture's parameter sets, close this one at them
+            Mp4Sample sample;
+            sample.offset = sample_start;
+            sample.size = nal_start - sample_start;
+            samples.push_back(sample);
+            sample_start = nal_start;
+            has_picture = false;
+        }
+    }
+    size_t end = nals.empty() ? 0 : nals.back().data + nals.back().size - data;
+    if (has_picture) {
+        Mp4Sample sample;
+        sample.offset = sample_start;
+        sample.size = end - sample_start;
+        samples.push_back(sample);
+    }
+    return complete;
+}
+
+class Mp4Muxer {
+public:
+    // From the stream's SPS and PPS, builds the init segment. Returns false (keeping the previous
+    //  one) if the SPS can't be parsed. Cheap to call for every keyframe, it only rebuilds when
+    //  the parameter sets change.
+    bool set_parameter_sets(const NalSpan& sps, const NalSpan& pps);
+    bool ready() const { return !init.empty(); }
+    // ftyp and moov, what every file starts with
+    const std::vector<uint8_t>& init_segment() const { return init; }
+    int width() const { return sps_info.width; }
+    int height() const { return sps_info.height; }
+
+    // Appends a moof and the mdat's header, for samples in data. The caller writes data from the
+    //  first sample to the end of the last right after it, so the NALs aren't copied. Sample times are decode times in milliseconds from the
+    //  start of the file, end_ms is when the last one stops showing. sequence counts fragments in
+    //  the file, from 1. The first sample should be a keyframe.
+    void append_fragment(uint32_t sequence, const std::vector<Mp4Sample>& samples, double end_ms,
+                         const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+private:
+    std::vector<uint8_t> sps;
+    std::vector<uint8_t> pps;
+    H264SpsInfo sps_info;
+    std::vector<uint8_t> init;
+
+    // Per sample, reused between fragments
+    struct SampleInfo {
+        uint32_t duration;
+        int32_t composition_offset;
+        uint32_t flags;
+        bool keyframe;
+        int64_t poc;
+        int64_t decode_ticks;
+    };
+    std::vector<SampleInfo> infos;
+    std::vector<size_t> display_order;
+
+    void build_init();
+    bool read_slice(const uint8_t* data, size_t size, SampleInfo& info, int64_t& previous_msb, int64_t& previous_lsb);
+};
+
+bool Mp4Muxer::set_parameter_sets(const NalSpan& new_sps, const NalSpan& new_pps) {
+    if (ready() && new_sps.size == sps.size() && new_pps.size == pps.size()
+        && memcmp(new_sps.data, sps.data(), sps.size()) == 0 && memcmp(new_pps.data, pps.data(), pps.size()) == 0) {
+        return true;
+    }
+    H264SpsInfo info;
+    if (identify_nal(new_pps) != NalType::Pps || !parse_sps(new_sps, info)) return false;
+    sps.assign(new_sps.data, new_sps.data + new_sps.size);
+    pps.assign(new_pps.data, new_pps.data + new_pps.size);
+    sps_info = info;
+    build_init();
+    return true;
+}
+
+void Mp4Muxer::build_init() {
+    init.clear();
+    Mp4BoxWriter box(init);
+    box.open("ftyp");
+    box.fourcc("isom");
+    box.u32(0x200);
+    // iso6 for signed composition offsets (trun version 1)
+    for (const char* brand : {"isom", "iso6", "avc1", "mp41"}) box.fourcc(brand);
+    box.close();
+
+    box.open("moov");
+    box.open_full("mvhd", 0, 0);
+    box.zeros(8);           // Creation and modification times
+    box.u32(1000);          // Timescale
+    box.u32(0);             // Duration, unknown as we're fragmented
+    box.u32(0x00010000);    // Rate 1.0
+    box.u16(0x0100);        // Volume 1.0
+    box.zeros(10);
+    box.matrix();
+    box.zeros(24);
+    box.u32(2);             // Next track id
+    box.close();
+
+    box.open("trak");
+    box.open_full("tkhd", 0, 3);    // Enabled, in the movie
+    box.zeros(8);
+    box.u32(1);             // Track id
+    box.zeros(4);
+    box.u32(0);             // Duration
+    box.zeros(8);
+    box.u16(0);             // Layer
+    box.u16(0);             // Alternate group
+    box.u16(0);             // Volume, none for video
+    box.zeros(2);
+    box.matrix();
+    box.u32((uint32_t)sps_info.width << 16);
+    box.u32((uint32_t)sps_info.height << 16);
+    box.close();
+
+    box.open("mdia");
+    box.open_full("mdhd", 0, 0);
+    box.zeros(8);
+    box.u32(MP4_TIMESCALE);
+    box.u32(0);
+    box.u16(0x55C4);        // "und"
+    box.u16(0);
+    box.close();
+    box.open_full("hdlr", 0, 0);
+    box.u32(0);
+    box.fourcc("vide");
+    box.zeros(12);
+    const char name[] = "VideoHandler";
+    box.bytes((const uint8_t*)name, sizeof(name));
+    box.close();
+
+    box.open("minf");
+    box.open_full("vmhd", 0, 1);
+    box.zeros(8);           // Graphics mode and opcolor
+    box.close();
+    box.open("dinf");
+    box.open_full("dref", 0, 0);
+    box.u32(1);
+    box.open_full("url ", 0, 1);    // The data is in this file
+    box.close();
+    box.close();
+    box.close();
+
+    box.open("stbl");
+    box.open_full("stsd", 0, 0);
+    box.u32(1);
+    box.open("avc1");
+    box.zeros(6);
+    box.u16(1);             // Data reference index
+    box.zeros(16);
+    box.u16(sps_info.width);
+    box.u16(sps_info.height);
+    box.u32(0x00480000);    // 72 dpi
+    box.u32(0x00480000);
+    box.zeros(4);
+    box.u16(1);             // Frames per sample
+    box.zeros(32);          // Compressor name
+    box.u16(0x0018);        // Depth
+    box.u16(0xFFFF);
+    box.open("avcC");
+    box.u8(1);
+    box.u8(sps[1]);         // Profile, compatibility and level, straight from the SPS
+    box.u8(sps[2]);
+    box.u8(sps[3]);
+    box.u8(0xFC | 3);       // 4 byte lengths
+    box.u8(0xE0 | 1);
+    box.u16(sps.size());
+    box.bytes(sps.data(), sps.size());
+    box.u8(1);
+    box.u16(pps.size());
+    box.bytes(pps.data(), pps.size());
+    if (sps_info.profile == 100 || sps_info.profile == 110 || sps_info.profile == 122 || sps_info.profile == 144) {
+        box.u8(0xFC | sps_info.chroma_format);
+        box.u8(0xF8 | (sps_info.bit_depth_luma - 8));
+        box.u8(0xF8 | (sps_info.bit_depth_chroma - 8));
+        box.u8(0);
+    }
+    box.close();
+    box.close();
+    box.close();
+    // Empty sample tables, the samples are in the fragments
+    for (const char* table : {"stts", "stsc", "stco"}) {
+        box.open_full(table, 0, 0);
+        box.u32(0);
+        box.close();
+    }
+    box.open_full("stsz", 0, 0);
+    box.u32(0);
+    box.u32(0);
+    box.close();
+    box.close();    // stbl
+    box.close();    // minf
+    box.close();    // mdia
+    box.close();    // trak
+
+    box.open("mvex");
+    box.open_full("trex", 0, 0);
+    box.u32(1);             // Track id
+    box.u32(1);             // Sample description index
+    box.zeros(12);          // Default duration, size and flags, every fragment sets its own
+    box.close();
+    box.close();
+    box.close();    // moov
+}
+
+// Finds the sample's first slice, and reads whether it's a keyframe and its picture order count
+//  (H.264 8.2.1.1, for pic_order_cnt_type 0). The other types are always in decode order.
+bool Mp4Muxer::read_slice(const uint8_t* data, size_t size, SampleInfo& info, int64_t& previous_msb, int64_t& previous_lsb) {
+    std::vector<NalSpan> nals;
+    split_length_prefixed(data, size, nals);
+    for (auto& nal : nals) {
+        if (!nal_is_frame(nal)) continue;
+        info.keyframe = identify_nal(nal) == NalType::Keyframe;
+        if (info.keyframe) {
+            previous_msb = 0;
+            previous_lsb = 0;
+        }
+        if (sps_info.poc_type != 0) return true;
+
+        H264BitReader reader(nal.data + 1, nal.size - 1);
+        reader.ue();        // first_mb_in_slice
+        reader.ue();        // slice_type
+        reader.ue();        // pic_parameter_set_id
+        if (sps_info.separate_colour_plane) reader.bits(2);
+        reader.bits(sps_info.log2_max_frame_num);
+        if (!sps_info.frame_mbs_only && reader.bits(1)) reader.bits(1);
+        if (info.keyframe) reader.ue();     // idr_pic_id
+        int64_t lsb = reader.bits(sps_info.log2_max_poc_lsb);
+        if (reader.failed()) return false;
+
+        int64_t max_lsb = (int64_t)1 << sps_info.log2_max_poc_lsb;
+        int64_t msb = previous_msb;
+        if (lsb < previous_lsb && previous_lsb - lsb >= max_lsb / 2) {
+            msb += max_lsb;
+        } else if (lsb > previous_lsb && lsb - previous_lsb > max_lsb / 2) {
+            msb -= max_lsb;
+        }
+        info.poc = msb + lsb;
+        // Only reference pictures (nal_ref_idc != 0) carry the count forward
+        if (nal.data[0] & 0x60) {
+            previous_msb = msb;
+            previous_lsb = lsb;
+        }
+        return true;
+    }
+    return false;
+}
+
+void Mp4Muxer::append_fragment(uint32_t sequence, const std::vector<Mp4Sample>& samples, double end_ms,
+                               const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+    if (!ready()) {
+        throw std::runtime_error("Mp4Muxer: no SPS and PPS");
+    }
+    if (samples.empty()) {
+        throw std::runtime_error("Mp4Muxer: no samples in fragment");
+    }
+    // Decode times, kept increasing even if the clock steps back, and durations between them
+    infos.resize(samples.size());
+    int64_t previous_msb = 0;
+    int64_t previous_lsb = 0;
+    bool reordered = false;
+    for (size_t i = 0; i < samples.size(); i++) {
+        SampleInfo& info = infos[i];
+        info.keyframe = false;
+        info.poc = i;
+        if (samples[i].offset + samples[i].size > size) {
+            throw std::runtime_error("Mp4Muxer: sample outside the fragment's data");
+        }
+        read_slice(data + samples[i].offset, samples[i].size, info, previous_msb, previous_lsb);
+        if (i > 0 && info.poc < infos[i - 1].poc) reordered = true;
+        info.decode_ticks = std::max<int64_t>(0, llround(samples[i].time_ms * (MP4_TIMESCALE / 1000.0)));
+        if (i > 0) info.decode_ticks = std::max(info.decode_ticks, infos[i - 1].decode_ticks + 1);
+    }
+    int64_t end_ticks = std::max<int64_t>(llround(end_ms * (MP4_TIMESCALE / 1000.0)), infos.back().decode_ticks + 1);
+    for (size_t i = 0; i < infos.size(); i++) {
+        int64_t next = i + 1 < infos.size() ? infos[i + 1].decode_ticks : end_ticks;
+        infos[i].duration = (uint32_t)std::min<int64_t>(next - infos[i].decode_ticks, UINT32_MAX);
+        infos[i].composition_offset = 0;
+        // Keyframes depend on nothing, other pictures aren't sync samples
+        infos[i].flags = infos[i].keyframe ? 0x02000000 : 0x01010000;
+    }
+    // With B-frames pictures are shown in picture order count order, at the decode times (so
+    //  the nth shown picture shows at the nth decode time)
+    if (reordered) {
+        display_order.resize(infos.size());
+        for (size_t i = 0; i < infos.size(); i++) display_order[i] = i;
+        std::stable_sort(display_order.begin(), display_order.end(), [this](size_t a, size_t b) { return infos[a].poc < infos[b].poc; });
+        for (size_t i = 0; i < infos.size(); i++) {
+            SampleInfo& info = infos[display_order[i]];
+            info.composition_offset = (int32_t)(infos[i].decode_ticks - info.decode_ticks);
+        }
+    }
+
+    size_t moof_start = out.size();
+    Mp4BoxWriter box(out);
+    box.open("moof");
+    box.open_full("mfhd", 0, 0);
+    box.u32(sequence);
+    box.close();
+    box.open("traf");
+    box.open_full("tfhd", 0, 0x020000);     // Offsets are from the moof
+    box.u32(1);
+    box.close();
+    box.open_full("tfdt", 1, 0);
+    box.u64(infos[0].decode_ticks);
+    box.close();
+    // Data offset, and per sample durations, sizes and flags (and composition offsets)
+    box.open_full("trun", reordered ? 1 : 0, 0x000701 | (reordered ? 0x000800 : 0));
+    box.u32(infos.size());
+    size_t data_offset_position = box.position();
+    box.u32(0);
+    for (size_t i = 0; i < infos.size(); i++) {
+        box.u32(infos[i].duration);
+        box.u32(samples[i].size);
+        box.u32(infos[i].flags);
+        if (reordered) box.u32((uint32_t)infos[i].composition_offset);
+    }
+    box.close();
+    box.close();    // traf
+    box.close();    // moof
+
+    // The samples are back to back, from the first one's offset
+    size_t mdat_size = samples.back().offset + samples.back().size - samples[0].offset + 8;
+    if (mdat_size > UINT32_MAX) {
+        throw std::runtime_error("Mp4Muxer: fragment is over 4GB");
+    }
+    box.put_u32(data_offset_position, out.size() - moof_start + 8);
+    box.u32(mdat_size);
+    box.fourcc("mdat");
+}
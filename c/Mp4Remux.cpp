@@ -0,0 +1,135 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Nal.cpp"
+#include "Mp4Muxer.cpp"
+#include "SegmentWriter.cpp"
+
+// The speed of a segment from its folder, the last "<N>x" in its path (1x/..., 60x/...), 1 if none
+int segment_speed_from_path(const std::string& path) {
+    int speed = 1;
+    size_t start = 0;
+    while (start < path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) end = path.size();
+        if (end - start >= 2 && path[end - 1] == 'x'
+            && strspn(path.c_str() + start, "0123456789") == end - start - 1) {
+            speed = std::max(1, atoi(path.c_str() + start));
+        }
+        start = end + 1;
+    }
+    return speed;
+}
+
+static bool sample_is_keyframe(const uint8_t* data, const Mp4Sample& sample) {
+    std::vector<NalSpan> nals;
+    split_length_prefixed(data + sample.offset, sample.size, nals);
+    for (auto& nal : nals) {
+        if (nal_is_frame(nal)) return identify_nal(nal) == NalType::Keyframe;
+    }
+    return false;
+}
+
+// Writes a segment file (.nal) as fragmented MP4, like SegmentWriter::set_mp4_output does as it
+//  writes, for segments from before that (or from gst and emitFrames). The files don't have
+//  their frames' times, so they are spread evenly from startTime to endTime, as
+//  VideoManager.ts does, and divided by speed. A fragment per keyframe. Written to a temporary
+//  file and renamed, so readers never see half of it.
+void remux_segment_file(const std::string& nal_path, const std::string& mp4_path, int speed) {
+    size_t slash = nal_path.rfind('/');
+    VideoKey key;
+    if (!parse_video_key(slash == std::string::npos ? nal_path : nal_path.substr(slash + 1), key)) {
+        throw std::runtime_error(nal_path + " isn't a segment file");
+    }
+
+    std::vector<uint8_t> data;
+    int fd = open(nal_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open " + nal_path + ": " + strerror(errno));
+    }
+    struct stat info;
+    fstat(fd, &info);
+    data.resize(info.st_size);
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t count = read(fd, data.data() + done, data.size() - done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+        done += count;
+    }
+    close(fd);
+    data.resize(done);
+
+    // The first parameter sets describe the track, the rest stay in band
+    std::vector<NalSpan> nals;
+    split_length_prefixed(data.data(), data.size(), nals);
+    NalSpan sps;
+    NalSpan pps;
+    for (auto& nal : nals) {
+        if (!sps.data && identify_nal(nal) == NalType::Sps) sps = nal;
+        if (!pps.data && identify_nal(nal) == NalType::Pps) pps = nal;
+    }
+    Mp4Muxer muxer;
+    if (!sps.data || !pps.data || !muxer.set_parameter_sets(sps, pps)) {
+        throw std::runtime_error(nal_path + " has no usable SPS and PPS");
+    }
+    std::vector<Mp4Sample> samples;
+    if (!split_mp4_samples(data.data(), data.size(), samples)) {
+        std::cerr << nal_path << " is truncated, remuxing the NALs before that" << std::endl;
+    }
+    if (samples.empty()) {
+        throw std::runtime_error(nal_path + " has no frames");
+    }
+    double duration = (key.end_time - key.start_time) / speed;
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i].time_ms = duration * i / samples.size();
+    }
+
+    std::vector<uint8_t> mp4 = muxer.init_segment();
+    std::vector<Mp4Sample> fragment;
+    uint32_t sequence = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        fragment.push_back(samples[i]);
+        bool last = i + 1 == samples.size() || sample_is_keyframe(data.data(), samples[i + 1]);
+        if (!last) continue;
+        double end_ms = i + 1 < samples.size() ? samples[i + 1].time_ms : duration;
+        muxer.append_fragment(++sequence, fragment, end_ms, data.data(), data.size(), mp4);
+        mp4.insert(mp4.end(), data.begin() + fragment.front().offset, data.begin() + fragment.back().offset + fragment.back().size);
+        fragment.clear();
+    }
+
+    std::string temp_path = mp4_path + ".tmp";
+    fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open " + temp_path + ": " + strerror(errno));
+    }
+    done = 0;
+    while (done < mp4.size()) {
+        ssize_t count = write(fd, mp4.data() + done, mp4.size() - done);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            std::string error = strerror(errno);
+            close(fd);
+            unlink(temp_path.c_str());
+            throw std::runtime_error("Failed to write " + temp_path + ": " + error);
+        }
+        done += count;
+    }
+    close(fd);
+    if (rename(temp_path.c_str(), mp4_path.c_str()) != 0) {
+        std::string error = strerror(errno);
+        unlink(temp_path.c_str());
+        throw std::runtime_error("Failed to rename " + temp_path + ": " + error);
+    }
+}
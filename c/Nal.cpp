@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// H.264 NAL unit helpers, matching what the TypeScript side does with mp4-typescript
+//  (SplitAnnexBVideo, IdentifyNal) and src/videoBase.ts (joinNALs, splitNALs).
+
+// One NAL unit, without its start code or length prefix. Points into someone else's buffer.
+struct NalSpan {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+enum class NalType {
+    Sps,        // 7
+    Pps,        // 8
+    Keyframe,   // 5 (IDR slice)
+    Frame,      // 1 (non-IDR slice)
+    Other,
+};
+
+NalType identify_nal(const NalSpan& nal) {
+    if (nal.size == 0) return NalType::Other;
+    switch (nal.data[0] & 0x1F) {
+        case 7: return NalType::Sps;
+        case 8: return NalType::Pps;
+        case 5: return NalType::Keyframe;
+        case 1: return NalType::Frame;
+        default: return NalType::Other;
+    }
+}
+
+bool nal_is_frame(const NalSpan& nal) {
+    NalType type = identify_nal(nal);
+    return type == NalType::Frame || type == NalType::Keyframe;
+}
+
+// Whether a slice starts a new picture (first_mb_in_slice == 0, which is ue(v) "1"). Encoders
+//  using sliced threads split every frame into several slice NALs, and only the first starts it.
+bool nal_starts_picture(const NalSpan& nal) {
+    return nal.size >= 2 && (nal.data[1] & 0x80);
+}
+
+// Split an Annex B byte stream (00 00 01 or 00 00 00 01 start codes) into NAL units. Appends
+//  to nals, so the caller can reuse the vector. Anything before the first start code is ignored.
+void split_annexb(const uint8_t* data, size_t size, std::vector<NalSpan>& nals) {
+    const uint8_t* end = data + size;
+    const uint8_t* nal_start = nullptr;
+    const uint8_t* pos = data;
+    while (pos + 3 <= end) {
+        // Start codes begin with two zero bytes, so find the next zero, then check around it
+        const uint8_t* zero = (const uint8_t*)memchr(pos, 0, end - pos - 2);
+        if (!zero) break;
+        if (zero[1] == 0 && zero[2] == 1) {
+            if (nal_start) {
+                // A 4 byte start code's leading zero belongs to the start code, not the NAL
+                const uint8_t* nal_end = zero;
+                if (nal_end > nal_start && nal_end[-1] == 0) nal_end--;
+                nals.push_back({nal_start, (size_t)(nal_end - nal_start)});
+            }
+            nal_start = zero + 3;
+            pos = nal_start;
+        } else {
+            pos = zero + 1;
+        }
+    }
+    if (nal_start && nal_start < end) {
+        nals.push_back({nal_start, (size_t)(end - nal_start)});
+    }
+}
+
+// joinNALs, each NAL prefixed by its length as a 4 byte big endian integer. Appends to out.
+void append_length_prefixed(const NalSpan& nal, std::vector<uint8_t>& out) {
+    uint8_t length[4] = {
+        (uint8_t)(nal.size >> 24), (uint8_t)(nal.size >> 16), (uint8_t)(nal.size >> 8), (uint8_t)nal.size,
+    };
+    out.insert(out.end(), length, length + 4);
+    out.insert(out.end(), nal.data, nal.data + nal.size);
+}
+
+// splitNALs, the reverse of append_length_prefixed. Stops at a truncated NAL, returns false if there was one.
+bool split_length_prefixed(const uint8_t* data, size_t size, std::vector<NalSpan>& nals) {
+    size_t pos = 0;
+    while (pos + 4 <= size) {
+        size_t length = ((size_t)data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+        pos += 4;
+        if (length > size - pos) return false;
+        nals.push_back({data + pos, length});
+        pos += length;
+    }
+    return pos == size;
+}
@@ -0,0 +1,150 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <stdexcept>
+
+// Single producer, single consumer queue of encoded NAL units, from an encoder's output
+//  callback to whoever writes them out. Each slot is a vector that keeps its capacity, and pop
+//  swaps the caller's vector with the slot, so once the slots have grown to the biggest
+//  keyframe nothing is allocated or copied on either side.
+// Lock-free while there is data (for the consumer) or space (for the producer). The mutex and
+//  condition variables are only used to sleep when there isn't, so nobody spins.
+// Each NAL carries the timestamp_us of the frame it encodes (0 if it has none, like an SPS
+//  from some encoders), as NALs can come out long after their frame went in.
+class NalRing {
+public:
+    // slot_capacity is reserved up front in every slot
+    NalRing(size_t slot_count, size_t slot_capacity);
+
+    // Producer: an empty slot to fill, waiting up to timeout_ms (-1 forever) while the ring is
+    //  full. nullptr on a timeout, or once closed. The slot is only visible to the consumer
+    //  after commit_write.
+    std::vector<uint8_t>* begin_write(int timeout_ms = -1);
+    void commit_write(int64_t timestamp_us = 0);
+    // begin_write, copy, commit_write. Returns false (dropping the NAL) once closed.
+    bool push(const uint8_t* data, size_t size, int64_t timestamp_us = 0);
+
+    // Consumer: swaps the oldest NAL into nal (whose old buffer goes back into the ring), and
+    //  its timestamp into timestamp_us if given. timeout_ms -1 waits forever, 0 doesn't wait.
+    //  Returns false on a timeout, or when the ring is closed and empty.
+    bool pop(std::vector<uint8_t>& nal, int timeout_ms = -1, int64_t* timestamp_us = nullptr);
+
+    // Wakes everyone waiting. pop still returns what was queued, then false.
+    void close();
+    bool is_closed() const { return closed.load(); }
+
+    size_t size() const { return head.load() - tail.load(); }
+    size_t capacity() const { return slots.size(); }
+
+private:
+    std::vector<std::vector<uint8_t>> slots;
+    std::vector<int64_t> slot_timestamps;
+
+    // Counts of NALs written and read, the slot is the count modulo the slot count. On their own
+    //  cache lines, so the producer and consumer cores don't fight over them.
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+
+    std::atomic<bool> closed;
+    std::atomic<bool> consumer_waiting;
+    std::atomic<bool> producer_waiting;
+    std::mutex wait_mutex;
+    std::condition_variable data_cv;
+    std::condition_variable space_cv;
+
+    void wake(std::atomic<bool>& waiting, std::condition_variable& cv);
+};
+
+NalRing::NalRing(size_t slot_count, size_t slot_capacity)
+    : slots(std::max<size_t>(1, slot_count)), slot_timestamps(slots.size()), head(0), tail(0), closed(false),
+      consumer_waiting(false), producer_waiting(false) {
+    for (auto& slot : slots) {
+        slot.reserve(slot_capacity);
+    }
+}
+
+// The waiter sets its flag, then checks the condition under the mutex. We changed the condition
+//  (head or tail) before checking the flag. Both are sequentially consistent, so either the
+//  waiter sees our change and doesn't sleep, or we see its flag and notify under the mutex.
+void NalRing::wake(std::atomic<bool>& waiting, std::condition_variable& cv) {
+    if (waiting.load()) {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        cv.notify_all();
+    }
+}
+
+std::vector<uint8_t>* NalRing::begin_write(int timeout_ms) {
+    uint64_t position = head.load(std::memory_order_relaxed);
+    if (position - tail.load() >= slots.size() && !closed.load()) {
+        if (timeout_ms == 0) return nullptr;
+        std::unique_lock<std::mutex> lock(wait_mutex);
+        producer_waiting.store(true);
+        auto ready = [&]() { return position - tail.load() < slots.size() || closed.load(); };
+        if (timeout_ms < 0) {
+            space_cv.wait(lock, ready);
+        } else {
+            space_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+        }
+        producer_waiting.store(false);
+        if (position - tail.load() >= slots.size() && !closed.load()) return nullptr;
+    }
+    if (closed.load()) {
+        return nullptr;
+    }
+    std::vector<uint8_t>* slot = &slots[position % slots.size()];
+    slot->clear();
+    return slot;
+}
+
+void NalRing::commit_write(int64_t timestamp_us) {
+    uint64_t position = head.load(std::memory_order_relaxed);
+    slot_timestamps[position % slots.size()] = timestamp_us;
+    head.store(position + 1);
+    wake(consumer_waiting, data_cv);
+}
+
+bool NalRing::push(const uint8_t* data, size_t size, int64_t timestamp_us) {
+    std::vector<uint8_t>* slot = begin_write();
+    if (!slot) return false;
+    slot->insert(slot->end(), data, data + size);
+    commit_write(timestamp_us);
+    return true;
+}
+
+bool NalRing::pop(std::vector<uint8_t>& nal, int timeout_ms, int64_t* timestamp_us) {
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    if (head.load() == position) {
+        if (timeout_ms == 0 || closed.load()) return false;
+        std::unique_lock<std::mutex> lock(wait_mutex);
+        consumer_waiting.store(true);
+        auto ready = [&]() { return head.load() != position || closed.load(); };
+        if (timeout_ms < 0) {
+            data_cv.wait(lock, ready);
+        } else {
+            data_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+        }
+        consumer_waiting.store(false);
+        // Whatever was committed before close is still delivered
+        if (head.load() == position) return false;
+    }
+    nal.swap(slots[position % slots.size()]);
+    if (timestamp_us) *timestamp_us = slot_timestamps[position % slots.size()];
+    tail.store(position + 1);
+    wake(producer_waiting, space_cv);
+    return true;
+}
+
+void NalRing::close() {
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        closed.store(true);
+    }
+    data_cv.notify_all();
+    space_cv.notify_all();
+}
@@ -0,0 +1,429 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csetjmp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+#include <jpeglib.h>
+
+#include "FrameBuffer.cpp"
+// JpegErrorManager, average_rows_2x2
+#include "ConvertCPU.cpp"
+
+// Writes the preview JPEGs activity.py wrote with cv2.resize and cv2.imwrite, beside a video
+//  file: "<video path>   size2=full.jpeg", and the same for each preview width (jpegSuffixes in
+//  src/constants.ts), each with a ".metadata" file beside it. src/thumbnail.ts reads them.
+// The smaller sizes come from a pyramid, each level a 2x2 box filter of the one above it (with
+//  the same SIMD averaging the decoder uses). Each width is then area filtered from the smallest
+//  level at least as big as it, so it is never more than a 2x reduction.
+// The planes go to libjpeg as raw YCbCr (no color conversion), and the compressor is reused.
+//  Not thread safe.
+
+// src/constants.ts jpegSuffixes, besides full
+static const std::vector<int> default_preview_widths = {400, 200, 100};
+
+class PreviewWriter {
+public:
+    PreviewWriter(int width, int height, int quality = 85, const std::vector<int>& widths = default_preview_widths);
+    ~PreviewWriter();
+    PreviewWriter(const PreviewWriter&) = delete;
+    PreviewWriter& operator=(const PreviewWriter&) = delete;
+
+    // Writes every size. metadata is the JSON for the .metadata files, which aren't written if it is empty.
+    void write(const FrameBuffer& frame, const std::string& video_path, const std::string& metadata = "");
+    // Just one of the preview widths, into memory (replacing what jpeg had)
+    void encode_preview(const FrameBuffer& frame, int preview_width, std::vector<uint8_t>& jpeg);
+
+private:
+    // A packed I420 image, padded to whole MCUs (16x16 luma) by repeating the last column and row,
+    //  as libjpeg's raw data input reads the padding
+    struct Plane {
+        int width = 0;
+        int height = 0;
+        int stride = 0;
+        std::vector<uint8_t> data;
+    };
+    struct Image {
+        int width = 0;
+        int height = 0;
+        Plane planes[3];
+    };
+    // One output column (or row) of an area filter: up to 3 source pixels, as the reduction is under 2x
+    struct AreaTap {
+        int first;
+        uint16_t weights[3];    // Sum to 1 << 14
+    };
+    struct Output {
+        int width;
+        std::string suffix;
+        int level;              // The pyramid level it is filtered from, 0 is the frame itself
+        Image image;
+        std::vector<AreaTap> column_taps[3];
+        std::vector<AreaTap> row_taps[3];
+    };
+
+    int width;
+    int height;
+    int quality;
+    // Level 0 is a copy of the frame, only made when the frame's planes can't be used as they
+    //  are (not whole MCUs wide, or a preview is filtered straight from it)
+    bool copy_frame;
+    std::vector<Image> levels;
+    std::vector<Output> outputs;
+    std::vector<uint16_t> filter_rows;  // One horizontally filtered row per source row
+    // The frame being written, or its copy in level 0
+    const uint8_t* frame_planes[3];
+    int frame_strides[3];
+
+    struct jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    std::vector<JSAMPROW> row_pointers[3];
+
+    static void allocate(Image& image, int width, int height);
+    static void pad(Plane& plane);
+    static std::vector<AreaTap> area_taps(int source_size, double source_extent, int size);
+    void area_filter(const Plane& source, Plane& dest, const std::vector<AreaTap>& column_taps, const std::vector<AreaTap>& row_taps);
+    void build_levels(const FrameBuffer& frame, int levels_needed);
+    void render(Output& output);
+    // Into file, or if it is null, into memory. name is for errors.
+    void encode(const uint8_t* const planes[3], const int strides[3], int width, int height, int padded_height,
+                FILE* file, std::vector<uint8_t>* memory, const std::string& name);
+    void encode_file(const uint8_t* const planes[3], const int strides[3], int width, int height, int padded_height, const std::string& path);
+    static void write_text(const std::string& path, const std::string& text);
+};
+
+void PreviewWriter::allocate(Image& image, int width, int height) {
+    image.width = width;
+    image.height = height;
+    int padded_width = (width + 15) & ~15;
+    int padded_height = (height + 15) & ~15;
+    for (int i = 0; i < 3; i++) {
+        Plane& plane = image.planes[i];
+        plane.width = i == 0 ? width : (width + 1) / 2;
+        plane.height = i == 0 ? height : (height + 1) / 2;
+        plane.stride = i == 0 ? padded_width : padded_width / 2;
+        // The area filter reads up to 2 pixels past the end of a row
+        plane.data.resize((size_t)plane.stride * (i == 0 ? padded_height : padded_height / 2) + 2);
+    }
+}
+
+void PreviewWriter::pad(Plane& plane) {
+    for (int row = 0; row < plane.height; row++) {
+        uint8_t* line = plane.data.data() + (size_t)row * plane.stride;
+        memset(line + plane.width, line[plane.width - 1], plane.stride - plane.width);
+    }
+    size_t padded_rows = plane.data.size() / plane.stride;  // Ignoring the 2 spare bytes
+    const uint8_t* last = plane.data.data() + (size_t)(plane.height - 1) * plane.stride;
+    for (size_t row = plane.height; row < padded_rows; row++) {
+        memcpy(plane.data.data() + row * plane.stride, last, plane.stride);
+    }
+}
+
+// Output pixel i covers source [i * scale, (i + 1) * scale), and each source pixel is weighted
+//  by how much of it is covered, like cv2.INTER_AREA. source_extent is the size the level would
+//  have without rounding down as it was halved (e.g. 67.5 rows for 1080 / 16), so the preview
+//  covers the same area as the frame, with the missing part taken from the last pixel.
+std::vector<PreviewWriter::AreaTap> PreviewWriter::area_taps(int source_size, double source_extent, int size) {
+    std::vector<AreaTap> taps(size);
+    double scale = source_extent / size;
+    for (int i = 0; i < size; i++) {
+        double start = i * scale;
+        double end = (i + 1) * scale;
+        AreaTap& tap = taps[i];
+        tap.first = std::min((int)start, source_size - 1);
+        int total = 0;
+        for (int k = 0; k < 3; k++) {
+            double low = std::max(start, (double)(tap.first + k));
+            double high = std::min(end, (double)(tap.first + k + 1));
+            int weight = high > low && tap.first + k < source_size ? (int)((high - low) / scale * (1 << 14) + 0.5) : 0;
+            tap.weights[k] = (uint16_t)weight;
+            total += weight;
+        }
+        // Whatever is past the last pixel, and the rounding, goes to the last pixel in range
+        int last = std::min(2, source_size - 1 - tap.first);
+        tap.weights[last] += (1 << 14) - total;
+    }
+    return taps;
+}
+
+PreviewWriter::PreviewWriter(int width, int height, int quality, const std::vector<int>& widths)
+    : width(width), height(height), quality(quality) {
+    if (width < 2 || height < 2 || (width & 1) || (height & 1)) {
+        throw std::runtime_error("PreviewWriter: frame size must be even");
+    }
+
+    // Halve while the next level is still at least as big as the smallest preview
+    int largest = 0;
+    int smallest = width;
+    for (int preview_width : widths) {
+        if (preview_width >= width) {
+            throw std::runtime_error("PreviewWriter: preview width " + std::to_string(preview_width) + " isn't smaller than the frame");
+        }
+        largest = std::max(largest, preview_width);
+        smallest = std::min(smallest, preview_width);
+    }
+    levels.resize(1);
+    allocate(levels[0], width, height);
+    for (int level_width = width / 2, level_height = height / 2; level_width >= smallest && level_width >= 2;
+         level_width /= 2, level_height /= 2) {
+        levels.emplace_back();
+        allocate(levels.back(), level_width, std::max(1, level_height));
+    }
+
+    copy_frame = width % 16 != 0;
+    for (int preview_width : widths) {
+        Output output;
+        output.width = preview_width;
+        output.suffix = "   size2=" + std::to_string(preview_width) + ".jpeg";
+        // Like activity.py's int((width / fullWidth) * fullHeight)
+        int preview_height = std::max(2, (int)((double)preview_width / width * height));
+        output.level = 0;
+        for (size_t i = 0; i < levels.size(); i++) {
+            if (levels[i].width >= preview_width) output.level = (int)i;
+        }
+        if (output.level == 0) copy_frame = true;
+        allocate(output.image, preview_width, preview_height);
+        const Image& source = levels[output.level];
+        for (int i = 0; i < 3; i++) {
+            // The frame's plane size, halved once per level
+            double extent_scale = (double)(1 << output.level) * (i == 0 ? 1 : 2);
+            output.column_taps[i] = area_taps(source.planes[i].width, width / extent_scale, output.image.planes[i].width);
+            output.row_taps[i] = area_taps(source.planes[i].height, height / extent_scale, output.image.planes[i].height);
+        }
+        outputs.push_back(std::move(output));
+    }
+    if (!copy_frame) {
+        // Keep its sizes, for the first level's edges, but not its memory
+        for (auto& plane : levels[0].planes) {
+            std::vector<uint8_t>().swap(plane.data);
+        }
+    }
+    filter_rows.resize((size_t)height * std::max(1, largest));
+
+    cinfo.err = jpeg_throwing_error(&jerr);
+    if (setjmp(jerr.jump)) {
+        throw std::runtime_error(std::string("PreviewWriter: ") + jerr.message);
+    }
+    jpeg_create_compress(&cinfo);
+}
+
+PreviewWriter::~PreviewWriter() {
+    jpeg_destroy_compress(&cinfo);
+}
+
+// Horizontally into filter_rows, then vertically into dest
+void PreviewWriter::area_filter(const Plane& source, Plane& dest, const std::vector<AreaTap>& column_taps, const std::vector<AreaTap>& row_taps) {
+    int dest_width = dest.width;
+    for (int row = 0; row < source.height; row++) {
+        const uint8_t* in = source.data.data() + (size_t)row * source.stride;
+        uint16_t* out = filter_rows.data() + (size_t)row * dest_width;
+        for (int x = 0; x < dest_width; x++) {
+            const AreaTap& tap = column_taps[x];
+            const uint8_t* p = in + tap.first;
+            // Reads up to 2 past the last pixel (with a zero weight). Kept in 8.6 fixed point.
+            uint32_t sum = p[0] * tap.weights[0] + p[1] * tap.weights[1] + p[2] * tap.weights[2];
+            out[x] = (uint16_t)((sum + (1 << 7)) >> 8);
+        }
+    }
+    for (int y = 0; y < dest.height; y++) {
+        const AreaTap& tap = row_taps[y];
+        const uint16_t* rows[3];
+        for (int k = 0; k < 3; k++) {
+            rows[k] = filter_rows.data() + (size_t)std::min(tap.first + k, source.height - 1) * dest_width;
+        }
+        uint8_t* out = dest.data.data() + (size_t)y * dest.stride;
+        for (int x = 0; x < dest_width; x++) {
+            uint32_t sum = rows[0][x] * tap.weights[0] + rows[1][x] * tap.weights[1] + rows[2][x] * tap.weights[2];
+            out[x] = (uint8_t)std::min<uint32_t>(255, (sum + (1 << 19)) >> 20);
+        }
+    }
+    pad(dest);
+}
+
+// Copies the frame to level 0 if needed, then halves it down to levels_needed
+void PreviewWriter::build_levels(const FrameBuffer& frame, int levels_needed) {
+    if (frame.width != width || frame.height != height) {
+        throw std::runtime_error("PreviewWriter: frame is " + std::to_string(frame.width) + "x" + std::to_string(frame.height)
+            + ", expected " + std::to_string(width) + "x" + std::to_string(height));
+    }
+    frame_planes[0] = frame.y();
+    frame_planes[1] = frame.u();
+    frame_planes[2] = frame.v();
+    frame_strides[0] = width;
+    frame_strides[1] = width / 2;
+    frame_strides[2] = width / 2;
+    if (copy_frame) {
+        for (int i = 0; i < 3; i++) {
+            Plane& plane = levels[0].planes[i];
+            for (int row = 0; row < plane.height; row++) {
+                memcpy(plane.data.data() + (size_t)row * plane.stride, frame_planes[i] + (size_t)row * frame_strides[i], plane.width);
+            }
+            pad(plane);
+            frame_planes[i] = plane.data.data();
+            frame_strides[i] = plane.stride;
+        }
+    }
+
+    for (int index = 1; index <= levels_needed; index++) {
+        for (int i = 0; i < 3; i++) {
+            Plane& plane = levels[index].planes[i];
+            const uint8_t* source = frame_planes[i];
+            int source_stride = frame_strides[i];
+            int source_height = levels[0].planes[i].height;
+            if (index > 1) {
+                const Plane& above = levels[index - 1].planes[i];
+                source = above.data.data();
+                source_stride = above.stride;
+                source_height = above.height;
+            }
+            for (int row = 0; row < plane.height; row++) {
+                const uint8_t* top = source + (size_t)(row * 2) * source_stride;
+                // An odd height repeats the last row
+                const uint8_t* bottom = row * 2 + 1 < source_height ? top + source_stride : top;
+                average_rows_2x2(top, bottom, plane.data.data() + (size_t)row * plane.stride, plane.width * 2);
+            }
+            pad(plane);
+        }
+    }
+}
+
+void PreviewWriter::render(Output& output) {
+    const Image& source = levels[output.level];
+    for (int i = 0; i < 3; i++) {
+        area_filter(source.planes[i], output.image.planes[i], output.column_taps[i], output.row_taps[i]);
+    }
+}
+
+void PreviewWriter::write(const FrameBuffer& frame, const std::string& video_path, const std::string& metadata) {
+    int levels_needed = 0;
+    for (auto& output : outputs) {
+        levels_needed = std::max(levels_needed, output.level);
+    }
+    build_levels(frame, levels_needed);
+
+    // Rows past the bottom just repeat the last row, so the full size doesn't need padding
+    std::string path = video_path + "   size2=full.jpeg";
+    encode_file(frame_planes, frame_strides, width, height, height, path);
+    if (!metadata.empty()) write_text(path + ".metadata", metadata);
+
+    for (auto& output : outputs) {
+        render(output);
+        Image& image = output.image;
+        const uint8_t* planes[3] = {image.planes[0].data.data(), image.planes[1].data.data(), image.planes[2].data.data()};
+        int strides[3] = {image.planes[0].stride, image.planes[1].stride, image.planes[2].stride};
+        path = video_path + output.suffix;
+        encode_file(planes, strides, image.width, image.height, (image.height + 15) & ~15, path);
+        if (!metadata.empty()) write_text(path + ".metadata", metadata);
+    }
+}
+
+void PreviewWriter::encode_preview(const FrameBuffer& frame, int preview_width, std::vector<uint8_t>& jpeg) {
+    for (auto& output : outputs) {
+        if (output.width != preview_width) continue;
+        build_levels(frame, output.level);
+        render(output);
+        Image& image = output.image;
+        const uint8_t* planes[3] = {image.planes[0].data.data(), image.planes[1].data.data(), image.planes[2].data.data()};
+        int strides[3] = {image.planes[0].stride, image.planes[1].stride, image.planes[2].stride};
+        encode(planes, strides, image.width, image.height, (image.height + 15) & ~15, nullptr, &jpeg, output.suffix);
+        return;
+    }
+    throw std::runtime_error("PreviewWriter: no " + std::to_string(preview_width) + " wide preview");
+}
+
+// Writes to a temporary file, then renames it, so src/thumbnail.ts never reads half a JPEG
+void PreviewWriter::encode_file(const uint8_t* const planes[3], const int strides[3], int image_width, int image_height,
+                                int padded_height, const std::string& path) {
+    std::string temp_path = path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Failed to open " + temp_path + ": " + strerror(errno));
+    }
+    try {
+        encode(planes, strides, image_width, image_height, padded_height, file, nullptr, path);
+    } catch (...) {
+        fclose(file);
+        unlink(temp_path.c_str());
+        throw;
+    }
+    bool failed = ferror(file) != 0;
+    if (fclose(file) != 0 || failed) {
+        unlink(temp_path.c_str());
+        throw std::runtime_error("Failed to write " + temp_path);
+    }
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Failed to rename " + temp_path + ": " + strerror(errno));
+    }
+}
+
+// padded_height is the number of luma rows that can be read (rows past height repeat the last)
+void PreviewWriter::encode(const uint8_t* const planes[3], const int strides[3], int image_width, int image_height,
+                           int padded_height, FILE* file, std::vector<uint8_t>* memory, const std::string& name) {
+    // Row pointers for each MCU row, up to 16 luma and 8 chroma rows past the image
+    int mcu_rows = (image_height + 15) / 16;
+    for (int i = 0; i < 3; i++) {
+        int rows = mcu_rows * (i == 0 ? 16 : 8);
+        int available = i == 0 ? padded_height : (padded_height + 1) / 2;
+        row_pointers[i].resize(rows);
+        for (int row = 0; row < rows; row++) {
+            row_pointers[i][row] = (JSAMPROW)(planes[i] + (size_t)std::min(row, available - 1) * strides[i]);
+        }
+    }
+
+    // jpeg_mem_dest's buffer, which libjpeg allocates (and grows) with malloc
+    unsigned char* buffer = nullptr;
+    unsigned long buffer_size = 0;
+    if (setjmp(jerr.jump)) {
+        jpeg_abort_compress(&cinfo);
+        free(buffer);
+        throw std::runtime_error(std::string("Failed to encode ") + name + ": " + jerr.message);
+    }
+    if (file) {
+        jpeg_stdio_dest(&cinfo, file);
+    } else {
+        jpeg_mem_dest(&cinfo, &buffer, &buffer_size);
+    }
+    cinfo.image_width = image_width;
+    cinfo.image_height = image_height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.raw_data_in = TRUE;
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 2;
+    cinfo.comp_info[1].h_samp_factor = 1;
+    cinfo.comp_info[1].v_samp_factor = 1;
+    cinfo.comp_info[2].h_samp_factor = 1;
+    cinfo.comp_info[2].v_samp_factor = 1;
+    jpeg_start_compress(&cinfo, TRUE);
+    for (int mcu_row = 0; mcu_row < mcu_rows; mcu_row++) {
+        JSAMPARRAY rows[3] = {
+            row_pointers[0].data() + mcu_row * 16,
+            row_pointers[1].data() + mcu_row * 8,
+            row_pointers[2].data() + mcu_row * 8,
+        };
+        jpeg_write_raw_data(&cinfo, rows, 16);
+    }
+    jpeg_finish_compress(&cinfo);
+
+    if (memory) {
+        memory->assign(buffer, buffer + buffer_size);
+        free(buffer);
+    }
+}
+
+void PreviewWriter::write_text(const std::string& path, const std::string& text) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    size_t written = fwrite(text.data(), 1, text.size(), file);
+    if (fclose(file) != 0 || written != text.size()) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
@@ -0,0 +1,456 @@
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <jpeglib.h>
+
+#include "CameraFrameCapture.cpp"
+#include "ConvertCPU.cpp"
+
+// Reads the size out of a JPEG's header, false if it isn't a JPEG
+bool jpeg_dimensions(const FrameView& jpeg, int& width, int& height) {
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_throwing_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    bool ok = false;
+    if (!setjmp(jerr.jump)) {
+        jpeg_mem_src(&cinfo, jpeg.data, jpeg.size);
+        if (jpeg_read_header(&cinfo, TRUE) == JPEG_HEADER_OK) {
+            width = cinfo.image_width;
+            height = cinfo.image_height;
+            ok = true;
+        }
+    }
+    jpeg_destroy_decompress(&cinfo);
+    return ok;
+}
+
+struct ReplayOptions {
+    // 1 plays at the recorded rate, 4 at four times that, and 0 as fast as the consumer takes frames
+    double speed = 1;
+    // Start again at the end, otherwise acquire_frame throws once every frame was played
+    bool loop = true;
+    // Used for the timestamps if the recording has none
+    int fps = 30;
+    // Like USBCameraOptions::buffer_count, how many frames can be leased at once (plus one)
+    int buffer_count = 4;
+};
+
+// Plays back a recorded MJPEG stream as if it was a camera, for running and load testing the
+//  pipeline on any machine (several ReplaySources on one recording make several cameras).
+//  Recordings are mmap'd, and leases point straight into them. A recording is one of:
+//  - A folder of .jpg/.jpeg frames (e.g. gst's multifilesink frame%d.jpeg, see spec.md), in
+//      natural name order. The file times are the timestamps.
+//  - A file of concatenated JPEGs (an MJPEG stream saved to disk)
+// Either can have timestamps in <path>.timestamps (one per line, in microseconds), otherwise
+//  frames are ReplayOptions::fps apart.
+//
+// Frames are due at their timestamps (scaled by speed), and acquire_frame waits for the next
+//  one. With CapturePolicy::LatestFrame, frames that are already overdue are skipped (as
+//  dropped_stale), like a camera's capture thread replacing frames the consumer didn't take.
+//  Otherwise every frame is played, late if the consumer is slow.
+class ReplaySource : public FrameSource {
+public:
+    ReplaySource(const std::string& path, const ReplayOptions& options = ReplayOptions());
+    // Frames in memory (which must outlive us), with timestamps in microseconds (or empty)
+    ReplaySource(const std::string& name, const std::vector<FrameView>& frames, const std::vector<int64_t>& timestamps_us,
+                 const ReplayOptions& options = ReplayOptions());
+    ~ReplaySource();
+    ReplaySource(const ReplaySource&) = delete;
+    ReplaySource& operator=(const ReplaySource&) = delete;
+
+    void start(CapturePolicy policy = CapturePolicy::Block, int queue_limit = 2) override;
+    void stop() override;
+    FrameLease acquire_frame() override;
+    bool try_acquire_frame(FrameLease& frame, int timeout_ms) override;
+    // Nothing to lose, so only false once a replay that doesn't loop is finished
+    bool reopen() override { return next_frame < frames.size() || options.loop; }
+
+    CaptureStats stats() override;
+
+    int outstanding_frames() const override { return outstanding; }
+    int max_outstanding_frames() const override { return options.buffer_count - 1; }
+    const std::string& source_path() const override { return path; }
+    bool realtime() const override { return options.speed > 0; }
+
+    int poll_fd() const override { return timer_fd; }
+    void set_release_fd(int event_fd) override { release_fd = event_fd; }
+
+    int width() const { return frame_width; }
+    int height() const { return frame_height; }
+    size_t frame_count() const { return frames.size(); }
+
+protected:
+    void release_buffer(int index) override;
+
+private:
+    struct Mapping {
+        void* data;
+        size_t size;
+    };
+
+    std::string path;
+    ReplayOptions options;
+    std::vector<Mapping> mappings;
+    std::vector<FrameView> frames;
+    std::vector<int64_t> timestamps_us;  // Per frame, from the first frame
+    int64_t loop_duration_us;            // The first frame of the next loop is this far after the first of this one
+    int frame_width;
+    int frame_height;
+
+    CapturePolicy policy;
+    bool started;
+    int timer_fd;       // Armed for the next frame's due time
+    int wake_fd;        // stop()
+    int release_fd;
+    std::atomic<int> outstanding;
+
+    // Caller's thread (one at a time)
+    size_t next_frame;
+    uint64_t loops;
+    uint32_t sequence;
+    std::chrono::steady_clock::time_point start_time;
+
+    std::mutex stats_mutex;
+    CaptureStats capture_stats;
+
+    void load_folder();
+    void load_stream();
+    void load_timestamps();
+    void init();
+    std::chrono::steady_clock::time_point due_time(size_t frame, uint64_t loop) const;
+    void arm_timer();
+    // Waits until the next frame is due, false if timeout_ms passed first (-1 waits forever)
+    bool wait_for_frame(int timeout_ms);
+    FrameLease take_frame();
+};
+
+ReplaySource::ReplaySource(const std::string& path, const ReplayOptions& options)
+    : path(path), options(options), loop_duration_us(0), frame_width(0), frame_height(0),
+      policy(CapturePolicy::Block), started(false), timer_fd(-1), wake_fd(-1), release_fd(-1), outstanding(0),
+      next_frame(0), loops(0), sequence(0) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        throw std::runtime_error("Failed to stat " + path + ": " + strerror(errno));
+    }
+    try {
+        if (S_ISDIR(info.st_mode)) {
+            load_folder();
+        } else {
+            load_stream();
+        }
+        load_timestamps();
+        init();
+    } catch (...) {
+        for (auto& mapping : mappings) munmap(mapping.data, mapping.size);
+        throw;
+    }
+    std::cout << "Replaying " << frames.size() << " frames (" << frame_width << "x" << frame_height << ", "
+              << loop_duration_us / 1000 << "ms) from " << path << std::endl;
+}
+
+ReplaySource::ReplaySource(const std::string& name, const std::vector<FrameView>& frames, const std::vector<int64_t>& timestamps_us,
+                           const ReplayOptions& options)
+    : path(name), options(options), frames(frames), timestamps_us(timestamps_us), loop_duration_us(0), frame_width(0), frame_height(0),
+      policy(CapturePolicy::Block), started(false), timer_fd(-1), wake_fd(-1), release_fd(-1), outstanding(0),
+      next_frame(0), loops(0), sequence(0) {
+    init();
+}
+
+ReplaySource::~ReplaySource() {
+    if (outstanding > 0) {
+        std::cerr << "Closing " << path << " with " << outstanding << " frame leases still outstanding" << std::endl;
+    }
+    if (timer_fd != -1) close(timer_fd);
+    if (wake_fd != -1) close(wake_fd);
+    for (auto& mapping : mappings) munmap(mapping.data, mapping.size);
+}
+
+void ReplaySource::load_folder() {
+    std::vector<std::string> names;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        size_t dot = name.rfind('.');
+        std::string extension = dot == std::string::npos ? "" : name.substr(dot);
+        if (extension == ".jpg" || extension == ".jpeg") names.push_back(name);
+    }
+    closedir(dir);
+    // frame9 before frame10
+    std::sort(names.begin(), names.end(), [](const std::string& a, const std::string& b) {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    });
+
+    std::string folder = path.back() == '/' ? path : path + "/";
+    for (auto& name : names) {
+        std::string file_path = folder + name;
+        int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open " + file_path + ": " + strerror(errno));
+        }
+        struct stat info;
+        fstat(fd, &info);
+        if (info.st_size == 0) {
+            close(fd);
+            continue;
+        }
+        void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Failed to map " + file_path + ": " + strerror(errno));
+        }
+        mappings.push_back({data, (size_t)info.st_size});
+        frames.push_back(FrameView((const uint8_t*)data, info.st_size));
+        // Written as each frame was captured
+        timestamps_us.push_back((int64_t)info.st_mtim.tv_sec * 1000000 + info.st_mtim.tv_nsec / 1000);
+    }
+}
+
+void ReplaySource::load_stream() {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    struct stat info;
+    fstat(fd, &info);
+    if (info.st_size < 4) {
+        close(fd);
+        throw std::runtime_error(path + " is too small to be a recording");
+    }
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Failed to map " + path + ": " + strerror(errno));
+    }
+    mappings.push_back({data, (size_t)info.st_size});
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t size = info.st_size;
+    if (bytes[0] != 0xFF || bytes[1] != 0xD8) {
+        // Our segments (SegmentWriter.cpp) are H.264, which we have no decoder for
+        throw std::runtime_error(path + " isn't an MJPEG recording (concatenated JPEGs)");
+    }
+    // Split at each SOI that follows an EOI
+    size_t start = 0;
+    for (size_t i = 2; i + 2 < size; i++) {
+        if (bytes[i - 2] == 0xFF && bytes[i - 1] == 0xD9 && bytes[i] == 0xFF && bytes[i + 1] == 0xD8) {
+            frames.push_back(FrameView(bytes + start, i - start));
+            start = i;
+        }
+    }
+    frames.push_back(FrameView(bytes + start, size - start));
+}
+
+// <path>.timestamps replaces whatever timestamps we found
+void ReplaySource::load_timestamps() {
+    std::string timestamps_path = (path.back() == '/' ? path.substr(0, path.size() - 1) : path) + ".timestamps";
+    std::ifstream file(timestamps_path);
+    if (!file) return;
+    std::vector<int64_t> loaded;
+    int64_t value;
+    while (file >> value) loaded.push_back(value);
+    if (loaded.size() != frames.size()) {
+        throw std::runtime_error(timestamps_path + " has " + std::to_string(loaded.size()) + " timestamps, for "
+            + std::to_string(frames.size()) + " frames");
+    }
+    timestamps_us = std::move(loaded);
+}
+
+void ReplaySource::init() {
+    if (frames.empty()) {
+        throw std::runtime_error("No frames in " + path);
+    }
+    if (!jpeg_dimensions(frames[0], frame_width, frame_height)) {
+        throw std::runtime_error(path + " isn't an MJPEG recording, its first frame isn't a JPEG");
+    }
+    if (options.buffer_count < 2) {
+        throw std::runtime_error("Need at least 2 replay buffers, got " + std::to_string(options.buffer_count));
+    }
+    int64_t frame_us = 1000000 / std::max(1, options.fps);
+    // Timestamps from file times can be out of order (or equal), or all about the same (a copied
+    //  folder gets the copy's times), so only trust increasing ones under 1000 fps
+    bool increasing = timestamps_us.size() == frames.size();
+    for (size_t i = 1; increasing && i < timestamps_us.size(); i++) {
+        increasing = timestamps_us[i] > timestamps_us[i - 1];
+    }
+    if (increasing && frames.size() > 1 && timestamps_us.back() - timestamps_us[0] < (int64_t)(frames.size() - 1) * 1000) {
+        increasing = false;
+    }
+    if (!increasing) {
+        timestamps_us.resize(frames.size());
+        for (size_t i = 0; i < frames.size(); i++) timestamps_us[i] = i * frame_us;
+    }
+    int64_t first = timestamps_us[0];
+    for (auto& timestamp : timestamps_us) timestamp -= first;
+    // The last frame lasts as long as the average frame
+    int64_t last_frame_us = frames.size() > 1 ? timestamps_us.back() / (int64_t)(frames.size() - 1) : frame_us;
+    loop_duration_us = timestamps_us.back() + last_frame_us;
+    for (size_t i = 0; i < frames.size(); i++) {
+        frames[i].sequence = 0;
+        frames[i].timestamp_us = timestamps_us[i];
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (timer_fd == -1 || wake_fd == -1) {
+        throw std::runtime_error("Failed to create replay timer: " + std::string(strerror(errno)));
+    }
+}
+
+void ReplaySource::start(CapturePolicy policy, int) {
+    this->policy = policy;
+    started = true;
+    next_frame = 0;
+    loops = 0;
+    start_time = std::chrono::steady_clock::now();
+    arm_timer();
+}
+
+void ReplaySource::stop() {
+    started = false;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        std::cerr << "Failed to wake replay: " << strerror(errno) << std::endl;
+    }
+}
+
+CaptureStats ReplaySource::stats() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return capture_stats;
+}
+
+std::chrono::steady_clock::time_point ReplaySource::due_time(size_t frame, uint64_t loop) const {
+    if (options.speed <= 0) return start_time;
+    double due_us = (loop * loop_duration_us + timestamps_us[frame]) / options.speed;
+    return start_time + std::chrono::microseconds((int64_t)due_us);
+}
+
+// timerfd uses CLOCK_MONOTONIC, which steady_clock is on Linux
+void ReplaySource::arm_timer() {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    int64_t due_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(due_time(next_frame, loops).time_since_epoch()).count();
+    // 0 would disarm it, and anything in the past fires straight away
+    due_ns = std::max<int64_t>(due_ns, 1);
+    spec.it_value.tv_sec = due_ns / 1000000000;
+    spec.it_value.tv_nsec = due_ns % 1000000000;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+        throw std::runtime_error("Failed to arm replay timer: " + std::string(strerror(errno)));
+    }
+}
+
+bool ReplaySource::wait_for_frame(int timeout_ms) {
+    if (!started) {
+        throw std::runtime_error("Replay of " + path + " is not running");
+    }
+    if (!options.loop && next_frame >= frames.size()) {
+        throw std::runtime_error("Replay of " + path + " finished");
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto due = due_time(next_frame, loops);
+    if (due <= now) return true;
+    struct pollfd fds[2];
+    fds[0].fd = timer_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fd;
+    fds[1].events = POLLIN;
+    int wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1;
+    if (timeout_ms >= 0) wait_ms = std::min(wait_ms, timeout_ms);
+    while (poll(fds, 2, wait_ms) == -1 && errno == EINTR) {}
+    if (!started) {
+        throw std::runtime_error("Replay of " + path + " is not running");
+    }
+    return due_time(next_frame, loops) <= std::chrono::steady_clock::now();
+}
+
+FrameLease ReplaySource::take_frame() {
+    if (outstanding >= max_outstanding_frames()) {
+        throw std::runtime_error("All replay buffers are leased out (" + std::to_string((int)outstanding) + "), release a frame before acquiring another");
+    }
+    uint64_t skipped = 0;
+    if (policy == CapturePolicy::LatestFrame && options.speed > 0) {
+        // Skip to the newest frame that is due
+        auto now = std::chrono::steady_clock::now();
+        while (true) {
+            size_t after = next_frame + 1;
+            uint64_t after_loops = loops;
+            if (after == frames.size()) {
+                if (!options.loop) break;
+                after = 0;
+                after_loops++;
+            }
+            if (due_time(after, after_loops) > now) break;
+            next_frame = after;
+            loops = after_loops;
+            skipped++;
+        }
+    }
+
+    int index = next_frame;
+    FrameView frame = frames[index];
+    frame.sequence = sequence;
+    frame.timestamp_us = loops * loop_duration_us + timestamps_us[index];
+    // Skipped frames show up as gaps in the sequence, like frames a driver drops
+    sequence += skipped + 1;
+    next_frame++;
+    if (next_frame == frames.size() && options.loop) {
+        next_frame = 0;
+        loops++;
+    }
+    if (next_frame < frames.size()) {
+        // Clears the old expiration, so poll_fd is only readable when this one is due
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+            throw std::runtime_error("Failed to read replay timer: " + std::string(strerror(errno)));
+        }
+        arm_timer();
+    }
+    outstanding++;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        capture_stats.captured += skipped + 1;
+        capture_stats.dropped_stale += skipped;
+        capture_stats.delivered++;
+    }
+    return make_lease(index, frame);
+}
+
+FrameLease ReplaySource::acquire_frame() {
+    while (!wait_for_frame(-1)) {}
+    return take_frame();
+}
+
+bool ReplaySource::try_acquire_frame(FrameLease& frame, int timeout_ms) {
+    if (!wait_for_frame(timeout_ms)) return false;
+    frame = take_frame();
+    return true;
+}
+
+void ReplaySource::release_buffer(int) {
+    outstanding--;
+    if (release_fd != -1) {
+        uint64_t one = 1;
+        if (write(release_fd, &one, sizeof(one)) == -1) {
+            std::cerr << "Failed to signal buffer release: " << strerror(errno) << std::endl;
+        }
+    }
+}
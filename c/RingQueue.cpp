@@ -0,0 +1,61 @@
+#pragma once
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <string>
+
+// A FIFO with a fixed capacity. The slots are allocated once (reset), so pushing and popping
+//  never touch the heap, unlike std::deque, which allocates and frees blocks as it cycles.
+// Not thread safe, callers guard it with their own mutex.
+template<typename T>
+class RingQueue {
+public:
+    RingQueue(size_t capacity = 0) : items(capacity), head(0), count(0) {}
+
+    // Drops everything queued, and (re)allocates the slots
+    void reset(size_t capacity) {
+        std::vector<T> fresh(capacity);
+        items.swap(fresh);
+        head = 0;
+        count = 0;
+    }
+
+    bool empty() const { return count == 0; }
+    bool full() const { return count == items.size(); }
+    size_t size() const { return count; }
+    size_t capacity() const { return items.size(); }
+
+    T& front() { return items[head]; }
+    T& back() { return items[(head + count - 1) % items.size()]; }
+
+    void push_back(T&& item) {
+        if (full()) {
+            throw std::runtime_error("RingQueue is full (capacity " + std::to_string(items.size()) + ")");
+        }
+        items[(head + count) % items.size()] = std::move(item);
+        count++;
+    }
+
+    // The slot is reset to T(), so whatever it held (a lease, a buffer reference) is released now,
+    //  not when the slot is next overwritten
+    void pop_front() {
+        items[head] = T();
+        head = (head + 1) % items.size();
+        count--;
+    }
+
+    void clear() {
+        while (!empty()) pop_front();
+    }
+
+    void swap(RingQueue& other) {
+        items.swap(other.items);
+        std::swap(head, other.head);
+        std::swap(count, other.count);
+    }
+
+private:
+    std::vector<T> items;
+    size_t head;
+    size_t count;
+};
@@ -0,0 +1,686 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <deque>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "Nal.cpp"
+#include "KeyframeIndex.cpp"
+#include "Mp4Muxer.cpp"
+
+// Writes encoded video straight into the speed folders the web UI reads, doing what
+//  emitFrames (src/frameEmitHelpers.ts) does for each gst frames_*.nal file, but as NALs come
+//  out of the encoder, so we don't write everything twice.
+//  - 1x gets every keyframe group (SPS, PPS, keyframe, frames) as its own segment file
+//  - Faster speeds get one keyframe per TARGET_FRAMES_PER_SEGMENT of their playback time,
+//      appended to the file for their segmentTime, which is renamed to update its key, and
+//      listed in the folder's keyframe index (KeyframeIndex.cpp)
+// Each segment can also be written as fragmented MP4 (Mp4Muxer.cpp), beside its .nal file.
+// 1x can be held in memory (PrerollOptions), and only written around activity, instead of
+//  writing everything and having deleteStaticVideo1x (src/activity.ts) delete it later.
+// File and folder names match encodeVideoKey (src/videoHelpers.ts) and getTimeFolder. Keep
+//  them in sync!
+
+// src/constants.ts speedGroups
+static const std::vector<int> default_speed_groups = {1, 30, 30 * 10, 30 * 60, 60 * 60 * 4, 60 * 60 * 24, 60 * 60 * 24 * 14};
+
+static const int TARGET_FRAMES_PER_SEGMENT = 30;
+static const double BASE_ASSUMED_FRAME_TIME = 1000.0 / 30;
+static const double PLAYBACK_TIME_PER_FOLDER = 100 * 1000;
+// Longer between frames than this, and the camera was lost (and reconnected, see
+//  USBCameraOptions::reconnect), so the group ends where its frames stopped
+static const double MAX_FRAME_GAP_MS = 2000;
+
+// Milliseconds since the epoch, what the TypeScript side uses for times
+double wall_time_ms() {
+    return std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Like JavaScript's String(number): the fewest decimals that parse back to the same value
+std::string format_js_number(double value) {
+    char buffer[64];
+    for (int decimals = 0; decimals <= 17; decimals++) {
+        snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+        if (strtod(buffer, nullptr) == value) break;
+    }
+    return buffer;
+}
+
+struct VideoKey {
+    double segment_time = 0;
+    double start_time = 0;
+    double end_time = 0;
+    int64_t frames = 0;
+    int64_t size = 0;
+};
+
+// encodeVideoKey
+std::string encode_video_key(const VideoKey& key) {
+    return "segment segmentTime=" + format_js_number(key.segment_time)
+        + "   startTime=" + format_js_number(key.start_time)
+        + "   endTime=" + format_js_number(key.end_time)
+        + "   frames=" + std::to_string(key.frames)
+        + "   size=" + std::to_string(key.size) + ".nal";
+}
+
+// The fragmented MP4 copy of a segment file, the same key with .mp4 instead of .nal
+std::string mp4_segment_path(const std::string& path) {
+    return path.substr(0, path.size() - 4) + ".mp4";
+}
+
+// encodeVideoKeyPrefix
+std::string encode_video_key_prefix(double segment_time) {
+    return "segment segmentTime=" + format_js_number(segment_time);
+}
+
+// parseVideoKey, on just the file name. Returns false if it isn't a segment file.
+bool parse_video_key(const std::string& name, VideoKey& key) {
+    if (name.compare(0, 8, "segment ") != 0 || name.size() < 12 || name.compare(name.size() - 4, 4, ".nal") != 0) {
+        return false;
+    }
+    std::string fields = name.substr(8, name.size() - 12);
+    int found = 0;
+    size_t start = 0;
+    while (start <= fields.size()) {
+        size_t end = fields.find("   ", start);
+        if (end == std::string::npos) end = fields.size();
+        std::string field = fields.substr(start, end - start);
+        size_t equals = field.find('=');
+        if (equals != std::string::npos) {
+            std::string name = field.substr(0, equals);
+            double value = strtod(field.c_str() + equals + 1, nullptr);
+            if (name == "segmentTime") { key.segment_time = value; found++; }
+            else if (name == "startTime") { key.start_time = value; found++; }
+            else if (name == "endTime") { key.end_time = value; found++; }
+            else if (name == "frames") { key.frames = (int64_t)value; found++; }
+            else if (name == "size") { key.size = (int64_t)value; found++; }
+        }
+        start = end + 3;
+    }
+    return found == 5;
+}
+
+// getSegmentDuration
+double segment_duration(int speed) {
+    return TARGET_FRAMES_PER_SEGMENT * BASE_ASSUMED_FRAME_TIME * speed;
+}
+
+// getSegmentTime
+double segment_time(int speed, double time) {
+    double duration = segment_duration(speed);
+    return floor(time / duration) * duration;
+}
+
+// getTimeFolder, ex, "1/7/0/0/1/2/" (without the trailing zero digits)
+std::string time_folder(double time, int speed) {
+    double per_folder = PLAYBACK_TIME_PER_FOLDER * speed;
+    int64_t rounded = (int64_t)((ceil(time / per_folder) + 1) * per_folder);
+    std::string digits = std::to_string(rounded);
+    std::string folder;
+    for (char digit : digits) {
+        folder += digit;
+        folder += '/';
+    }
+    while (folder.size() >= 3 && folder.compare(folder.size() - 3, 3, "/0/") == 0) {
+        folder.resize(folder.size() - 2);
+    }
+    return folder;
+}
+
+// mkdir -p
+static void make_directories(const std::string& path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        std::string parent = path.substr(0, slash);
+        if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Failed to create " + parent + ": " + strerror(errno));
+        }
+    }
+}
+
+// What the caller knows about a keyframe group, for the keyframe index and the preroll
+struct SegmentGroupInfo {
+    int64_t activity = -1;      // -1 if unknown, which is written as if it was active
+    // A small JPEG of the keyframe, empty for none. Only needs to last until the group is written.
+    std::vector<uint8_t> keyframe_jpeg;
+};
+
+// Which 1x groups are written. Faster speeds are always written, as they are a small fraction of
+//  the writes, and are what the UI shows of quiet times.
+struct PrerollOptions {
+    // Otherwise every group is written
+    bool only_activity = false;
+    // Groups ending within preroll_ms before an active group are written with it, and groups
+    //  starting within postroll_ms after one are written as they come
+    double preroll_ms = 5000;
+    double postroll_ms = 10000;
+    // If the preroll doesn't fit, the oldest groups are dropped
+    size_t max_bytes = 64 << 20;
+};
+
+class SegmentWriter {
+public:
+    // output_folder is videoFolder in frameEmitHelpers.ts
+    SegmentWriter(const std::string& output_folder = "/media/video/output/", const std::vector<int>& speed_groups = default_speed_groups,
+                  const PrerollOptions& preroll_options = PrerollOptions());
+
+    // Annex B data (one or more NALs, e.g. from H264Encoder::get_next_nal) of a frame captured
+    //  at time_ms (in wall_time_ms's clock, out of order with B-frames, as they come in decode
+    //  order). Each keyframe group is written when the next keyframe arrives, and its time is
+    //  from its keyframe to the next one.
+    void add_nals(const uint8_t* data, size_t size, double time_ms);
+    void add_nals(const std::vector<uint8_t>& data, double time_ms) { add_nals(data.data(), data.size(), time_ms); }
+
+    // Write the group in progress (at shutdown), as if the next keyframe came at end_time_ms.
+    //  Otherwise the last group is dropped, as it has no end time (like fix.ts skipping the file
+    //  gst is still writing).
+    void flush(double end_time_ms);
+
+    // Called (on the thread calling add_nals) after each write, with the file's new path. Faster
+    //  speeds call it again each time their file is appended to and renamed. 1x groups held
+    //  for the preroll are written (and called back for) when an active group comes, just
+    //  before it.
+    void set_segment_callback(std::function<void(int speed, const std::string& path, const VideoKey& key)> callback) {
+        segment_callback = std::move(callback);
+    }
+
+    // Called (on the thread calling add_nals) as each keyframe group is about to be written,
+    //  with its times and frame count (and segment_time and size left 0)
+    void set_group_callback(std::function<void(const VideoKey& group, SegmentGroupInfo& info)> callback) {
+        group_callback = std::move(callback);
+    }
+
+    // Also write every segment file as fragmented MP4, a .mp4 with the same key beside the .nal,
+    //  which browsers can play directly. 1x files are an init segment and one fragment, faster
+    //  speeds get a fragment for each keyframe appended. This writes the video twice.
+    void set_mp4_output(bool enabled) { mp4_output = enabled; }
+
+    uint64_t segments_written() const { return written_segments; }
+    uint64_t bytes_written() const { return written_bytes; }
+    // Groups we couldn't write (no SPS/PPS yet, or the write failed)
+    uint64_t dropped_groups() const { return dropped; }
+    // Gaps in the frames (a lost camera), which ended their group early
+    uint64_t frame_gaps() const { return gaps; }
+    // 1x groups that weren't near activity, so were never written
+    uint64_t skipped_groups() const { return skipped; }
+    uint64_t skipped_bytes() const { return skipped_byte_count; }
+
+private:
+    std::string output_folder;
+    std::vector<int> speeds;
+
+    // The latest parameter sets, copied, as the encoder reuses its buffers
+    std::vector<uint8_t> sps;
+    std::vector<uint8_t> pps;
+
+    // The keyframe group in progress: the keyframe's slices, then the frames' slices (like
+    //  splitNalsIntoMinimumGroups, everything else is left out)
+    struct GroupNal {
+        size_t offset;      // Into group_data
+        size_t size;
+    };
+    std::vector<uint8_t> group_data;
+    std::vector<GroupNal> group_nals;
+    size_t keyframe_nal_count;
+    int group_frames;
+    std::vector<double> group_picture_times;
+    double group_start_time;
+    double last_picture_time;
+    bool in_group;
+
+    // The segment file each speed last wrote to, so we only search the folder once per segment
+    struct OpenSegment {
+        std::string path;   // Empty if none
+        VideoKey key;
+    };
+    std::vector<OpenSegment> open_segments;
+
+    std::function<void(int speed, const std::string& path, const VideoKey& key)> segment_callback;
+    std::function<void(const VideoKey& group, SegmentGroupInfo& info)> group_callback;
+    SegmentGroupInfo group_info;
+
+    std::vector<NalSpan> split_scratch;
+    std::vector<uint8_t> write_buffer;
+
+    // The .mp4 written before write_buffer's NALs: the init segment for a new file, then the
+    //  fragment's moof and mdat header
+    bool mp4_output;
+    Mp4Muxer mp4_muxer;
+    std::vector<Mp4Sample> mp4_samples;
+    std::vector<uint8_t> mp4_header;
+
+    // 1x groups waiting to find out if activity follows them, oldest first. Their buffers are
+    //  reused, so once the ring is full, holding a group doesn't allocate.
+    PrerollOptions preroll_options;
+    struct HeldGroup {
+        VideoKey key;
+        std::vector<uint8_t> data;  // Length prefixed, as written
+        std::vector<uint8_t> mp4_header;
+    };
+    std::deque<HeldGroup> held_groups;
+    std::vector<std::vector<uint8_t>> spare_buffers;
+    size_t held_bytes;
+    double postroll_end_time;       // 1x groups starting before this are written
+
+    uint64_t written_segments;
+    uint64_t written_bytes;
+    uint64_t dropped;
+    uint64_t skipped;
+    uint64_t skipped_byte_count;
+    uint64_t gaps;
+
+    void add_nal(const NalSpan& nal, double time_ms);
+    void emit_group(double end_time_ms);
+    void emit_speed(size_t speed_index, double start_time, double end_time);
+    void build_mp4(int speed, double file_start_time, double end_time, uint32_t sequence, bool new_file);
+    void write_mp4(const std::string& path);
+    void emit_1x(const VideoKey& key);
+    void write_1x(const VideoKey& key);
+    void hold_group(const VideoKey& key);
+    void drop_held_group();
+    bool find_segment(const std::string& folder, double segment_time, OpenSegment& segment);
+    // Appends header (if any) then write_buffer. Returns the offset it was written at.
+    uint64_t append_file(const std::string& path, const std::vector<uint8_t>* header = nullptr);
+};
+
+SegmentWriter::SegmentWriter(const std::string& output_folder, const std::vector<int>& speed_groups,
+                             const PrerollOptions& preroll_options)
+    : output_folder(output_folder), speeds(speed_groups), keyframe_nal_count(0), group_frames(0),
+      group_start_time(0), last_picture_time(0), in_group(false), open_segments(speed_groups.size()),
+      mp4_output(false), preroll_options(preroll_options), held_bytes(0), postroll_end_time(0),
+      written_segments(0), written_bytes(0), dropped(0), skipped(0), skipped_byte_count(0), gaps(0) {
+    if (this->output_folder.empty() || this->output_folder.back() != '/') {
+        this->output_folder += '/';
+    }
+}
+
+void SegmentWriter::add_nals(const uint8_t* data, size_t size, double time_ms) {
+    split_scratch.clear();
+    split_annexb(data, size, split_scratch);
+    for (auto& nal : split_scratch) {
+        add_nal(nal, time_ms);
+    }
+}
+
+void SegmentWriter::add_nal(const NalSpan& nal, double time_ms) {
+    NalType type = identify_nal(nal);
+    if (type == NalType::Sps) {
+        sps.assign(nal.data, nal.data + nal.size);
+        return;
+    }
+    if (type == NalType::Pps) {
+        pps.assign(nal.data, nal.data + nal.size);
+        return;
+    }
+    if (type != NalType::Keyframe && type != NalType::Frame) {
+        return;
+    }
+
+    bool new_picture = nal_starts_picture(nal);
+    // So no segment spans the gap. The frames after it (until the next keyframe) refer to ones
+    //  before it, so they're dropped.
+    if (new_picture && in_group && time_ms - last_picture_time > MAX_FRAME_GAP_MS) {
+        double frame_time = group_frames > 1 ? (last_picture_time - group_start_time) / (group_frames - 1) : BASE_ASSUMED_FRAME_TIME;
+        std::cerr << "SegmentWriter: " << (int)(time_ms - last_picture_time) << "ms gap in frames, ending the group early" << std::endl;
+        emit_group(last_picture_time + frame_time);
+        in_group = false;
+        gaps++;
+    }
+    if (type == NalType::Keyframe && new_picture) {
+        if (in_group) {
+            emit_group(time_ms);
+        }
+        in_group = true;
+        group_data.clear();
+        group_nals.clear();
+        keyframe_nal_count = 0;
+        group_frames = 0;
+        group_picture_times.clear();
+        group_start_time = time_ms;
+        last_picture_time = time_ms;
+    }
+    // Frames before the first keyframe can't be decoded
+    if (!in_group) return;
+
+    if (new_picture) {
+        group_frames++;
+        group_picture_times.push_back(time_ms);
+        last_picture_time = std::max(last_picture_time, time_ms);
+    }
+    if (type == NalType::Keyframe && group_frames == 1) keyframe_nal_count++;
+    group_nals.push_back({group_data.size(), nal.size});
+    group_data.insert(group_data.end(), nal.data, nal.data + nal.size);
+}
+
+void SegmentWriter::flush(double end_time_ms) {
+    if (in_group) {
+        emit_group(end_time_ms);
+        in_group = false;
+    }
+}
+
+void SegmentWriter::emit_group(double end_time_ms) {
+    if (sps.empty() || pps.empty()) {
+        std::cerr << "SegmentWriter: no SPS/PPS before the keyframe, dropping " << group_frames << " frames" << std::endl;
+        dropped++;
+        return;
+    }
+    if (group_frames == 0) return;
+    group_info.activity = -1;
+    group_info.keyframe_jpeg.clear();
+    if (group_callback) {
+        VideoKey group;
+        group.start_time = group_start_time;
+        group.end_time = end_time_ms;
+        group.frames = group_frames;
+        group_callback(group, group_info);
+    }
+    for (size_t i = 0; i < speeds.size(); i++) {
+        try {
+            emit_speed(i, group_start_time, end_time_ms);
+        } catch (const std::exception& ex) {
+            // Like fix.ts, drop this group for this speed and carry on
+            std::cerr << "SegmentWriter: failed to write " << speeds[i] << "x: " << ex.what() << std::endl;
+            dropped++;
+        }
+    }
+}
+
+void SegmentWriter::emit_speed(size_t speed_index, double start_time, double end_time) {
+    int speed = speeds[speed_index];
+    double time_per_frame = (end_time - start_time) / group_frames;
+    std::string folder = output_folder + std::to_string(speed) + "x/" + time_folder(start_time, speed);
+
+    // The nals we write, and their size without the length prefixes (what size= counts)
+    write_buffer.clear();
+    int64_t group_size = 0;
+    NalSpan parameter_sets[2] = {{sps.data(), sps.size()}, {pps.data(), pps.size()}};
+    for (auto& nal : parameter_sets) {
+        append_length_prefixed(nal, write_buffer);
+        group_size += nal.size;
+    }
+    // Faster speeds only get the keyframe (getSingleFrame)
+    size_t nal_count = speed == 1 ? group_nals.size() : keyframe_nal_count;
+    for (size_t i = 0; i < nal_count; i++) {
+        append_length_prefixed({group_data.data() + group_nals[i].offset, group_nals[i].size}, write_buffer);
+        group_size += group_nals[i].size;
+    }
+
+    if (speed == 1) {
+        VideoKey key;
+        key.segment_time = start_time;
+        key.start_time = start_time;
+        key.end_time = end_time;
+        key.frames = group_frames;
+        key.size = group_size;
+        if (mp4_output) build_mp4(speed, start_time, end_time, 1, true);
+        emit_1x(key);
+        return;
+    }
+
+    VideoKey key;
+    key.segment_time = segment_time(speed, start_time);
+    key.start_time = start_time;
+    key.end_time = start_time + time_per_frame;
+    key.frames = 1;
+    key.size = group_size;
+
+    OpenSegment& segment = open_segments[speed_index];
+    bool same_segment = !segment.path.empty() && segment.key.segment_time == key.segment_time
+        && segment.path.compare(0, folder.size(), folder) == 0 && segment.path.find('/', folder.size()) == std::string::npos;
+    if (!same_segment) {
+        segment.path.clear();
+        find_segment(folder, key.segment_time, segment);
+    }
+
+    std::string path;
+    uint64_t offset = 0;
+    if (!segment.path.empty()) {
+        // Add the frame a bit early, so we don't drop frames if the base video fluctuates a bit
+        double min_gap = segment_duration(speed) / TARGET_FRAMES_PER_SEGMENT * 0.999;
+        if (start_time - segment.key.end_time < min_gap) return;
+
+        key.start_time = segment.key.start_time;
+        key.frames += segment.key.frames;
+        key.size += segment.key.size;
+        path = folder + encode_video_key(key);
+        offset = append_file(segment.path);
+        if (rename(segment.path.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Failed to rename " + segment.path + ": " + strerror(errno));
+        }
+        // Segments from before the .mp4s were turned on don't get one (remux.cpp can add it)
+        std::string mp4_path = mp4_segment_path(segment.path);
+        if (mp4_output && access(mp4_path.c_str(), F_OK) == 0) {
+            build_mp4(speed, segment.key.start_time, end_time, segment.key.frames + 1, false);
+            write_mp4(mp4_path);
+            if (mp4_header.empty()) {
+                // It can't be continued, better none than one missing frames
+                unlink(mp4_path.c_str());
+            } else if (rename(mp4_path.c_str(), mp4_segment_path(path).c_str()) != 0) {
+                std::cerr << "SegmentWriter: failed to rename " << mp4_path << ": " << strerror(errno) << std::endl;
+            }
+        }
+    } else {
+        path = folder + encode_video_key(key);
+        make_directories(path);
+        offset = append_file(path);
+        written_segments++;
+        if (mp4_output) {
+            build_mp4(speed, start_time, end_time, 1, true);
+            write_mp4(mp4_segment_path(path));
+        }
+    }
+    segment.path = path;
+    segment.key = key;
+
+    KeyframeIndexEntry entry;
+    entry.time = start_time;
+    entry.segment_time = key.segment_time;
+    entry.offset = (uint32_t)offset;
+    entry.size = (uint32_t)write_buffer.size();
+    entry.activity = group_info.activity;
+    append_keyframe_index(folder, entry, group_info.keyframe_jpeg.data(), group_info.keyframe_jpeg.size());
+    if (segment_callback) segment_callback(speed, path, key);
+}
+
+// Puts the .mp4's header for write_buffer in mp4_header (empty if it can't be muxed): the init
+//  segment if it's a new file, then a fragment. Times are from the file's start, at the speed's
+//  playback rate. 1x gets a sample per picture, at the times they came, faster speeds only have
+//  the keyframe, showing until the next group.
+void SegmentWriter::build_mp4(int speed, double file_start_time, double end_time, uint32_t sequence, bool new_file) {
+    mp4_header.clear();
+    if (!mp4_muxer.set_parameter_sets({sps.data(), sps.size()}, {pps.data(), pps.size()})) {
+        std::cerr << "SegmentWriter: can't parse the SPS, not writing .mp4" << std::endl;
+        return;
+    }
+    mp4_samples.clear();
+    split_mp4_samples(write_buffer.data(), write_buffer.size(), mp4_samples);
+    if (mp4_samples.empty()) return;
+    // Pictures come in decode order, and the muxer shows the nth in display order at the nth
+    //  decode time, so that's the nth capture time
+    std::vector<double> picture_times = group_picture_times;
+    std::sort(picture_times.begin(), picture_times.end());
+    for (size_t i = 0; i < mp4_samples.size(); i++) {
+        double time = group_start_time;
+        if (speed == 1) {
+            time = mp4_samples.size() == picture_times.size() ? picture_times[i]
+                : group_start_time + (end_time - group_start_time) * i / mp4_samples.size();
+        }
+        mp4_samples[i].time_ms = (time - file_start_time) / speed;
+    }
+    if (new_file) mp4_header = mp4_muxer.init_segment();
+    try {
+        mp4_muxer.append_fragment(sequence, mp4_samples, (end_time - file_start_time) / speed,
+                                  write_buffer.data(), write_buffer.size(), mp4_header);
+    } catch (const std::exception& ex) {
+        std::cerr << "SegmentWriter: " << ex.what() << ", not writing .mp4" << std::endl;
+        mp4_header.clear();
+    }
+}
+
+// Writes mp4_header and write_buffer. The .nal is already written, so failing here doesn't
+//  drop the group.
+void SegmentWriter::write_mp4(const std::string& path) {
+    if (mp4_header.empty()) return;
+    try {
+        append_file(path, &mp4_header);
+    } catch (const std::exception& ex) {
+        std::cerr << "SegmentWriter: failed to write " << path << ": " << ex.what() << std::endl;
+        mp4_header.clear();
+    }
+}
+
+// Writes the group in write_buffer, or holds it in case activity follows
+void SegmentWriter::emit_1x(const VideoKey& key) {
+    if (!preroll_options.only_activity) {
+        write_1x(key);
+        return;
+    }
+    if (group_info.activity != 0) {
+        // Held groups are from before this one, so go first, as if they had been written then
+        std::vector<uint8_t> active_group;
+        std::vector<uint8_t> active_mp4_header;
+        active_group.swap(write_buffer);
+        active_mp4_header.swap(mp4_header);
+        while (!held_groups.empty()) {
+            HeldGroup& held = held_groups.front();
+            if (held.key.end_time >= key.start_time - preroll_options.preroll_ms) {
+                write_buffer.swap(held.data);
+                mp4_header.swap(held.mp4_header);
+                try {
+                    write_1x(held.key);
+                } catch (const std::exception& ex) {
+                    std::cerr << "SegmentWriter: failed to write 1x preroll: " << ex.what() << std::endl;
+                    dropped++;
+                }
+                write_buffer.swap(held.data);
+                mp4_header.swap(held.mp4_header);
+            } else {
+                skipped++;
+                skipped_byte_count += held.data.size();
+            }
+            drop_held_group();
+        }
+        write_buffer.swap(active_group);
+        mp4_header.swap(active_mp4_header);
+        postroll_end_time = key.end_time + preroll_options.postroll_ms;
+        write_1x(key);
+        return;
+    }
+    if (key.start_time < postroll_end_time) {
+        write_1x(key);
+        return;
+    }
+    hold_group(key);
+}
+
+void SegmentWriter::write_1x(const VideoKey& key) {
+    std::string path = output_folder + "1x/" + time_folder(key.start_time, 1) + encode_video_key(key);
+    make_directories(path);
+    append_file(path);
+    written_segments++;
+    if (mp4_output) write_mp4(mp4_segment_path(path));
+    if (segment_callback) segment_callback(1, path, key);
+}
+
+void SegmentWriter::hold_group(const VideoKey& key) {
+    // Drop what is too old to be preroll for anything after this, then what doesn't fit
+    while (!held_groups.empty() && held_groups.front().key.end_time < key.end_time - preroll_options.preroll_ms) {
+        skipped++;
+        skipped_byte_count += held_groups.front().data.size();
+        drop_held_group();
+    }
+    while (!held_groups.empty() && held_bytes + write_buffer.size() > preroll_options.max_bytes) {
+        skipped++;
+        skipped_byte_count += held_groups.front().data.size();
+        drop_held_group();
+    }
+    if (write_buffer.size() > preroll_options.max_bytes) {
+        skipped++;
+        skipped_byte_count += write_buffer.size();
+        return;
+    }
+    // Take the group's buffer, leaving a spare one to build the next group in
+    HeldGroup held;
+    held.key = key;
+    for (std::vector<uint8_t>* buffer : {&held.data, &held.mp4_header}) {
+        if (spare_buffers.empty()) break;
+        buffer->swap(spare_buffers.back());
+        spare_buffers.pop_back();
+    }
+    held.data.swap(write_buffer);
+    held.mp4_header.swap(mp4_header);
+    held_bytes += held.data.size();
+    held_groups.push_back(std::move(held));
+}
+
+void SegmentWriter::drop_held_group() {
+    HeldGroup& held = held_groups.front();
+    held_bytes -= held.data.size();
+    spare_buffers.push_back(std::move(held.data));
+    spare_buffers.back().clear();
+    spare_buffers.push_back(std::move(held.mp4_header));
+    spare_buffers.back().clear();
+    held_groups.pop_front();
+}
+
+// findFilePrefix, the first file (by name) for this segmentTime in the folder
+bool SegmentWriter::find_segment(const std::string& folder, double segment_time, OpenSegment& segment) {
+    DIR* dir = opendir(folder.c_str());
+    if (!dir) return false;
+    // With the separator, so segmentTime=100 doesn't match segmentTime=1000
+    std::string prefix = encode_video_key_prefix(segment_time) + "   ";
+    std::string best;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        // Not the .mp4 beside it
+        bool nal = name.size() > 4 && name.compare(name.size() - 4, 4, ".nal") == 0;
+        if (nal && name.compare(0, prefix.size(), prefix) == 0 && (best.empty() || name < best)) {
+            best = name;
+        }
+    }
+    closedir(dir);
+    VideoKey key;
+    if (best.empty() || !parse_video_key(best, key)) return false;
+    segment.path = folder + best;
+    segment.key = key;
+    return true;
+}
+
+uint64_t SegmentWriter::append_file(const std::string& path, const std::vector<uint8_t>* header) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    off_t offset = lseek(fd, 0, SEEK_END);
+    const std::vector<uint8_t>* buffers[2] = {header, &write_buffer};
+    for (const std::vector<uint8_t>* buffer : buffers) {
+        if (!buffer) continue;
+        size_t done = 0;
+        while (done < buffer->size()) {
+            ssize_t count = write(fd, buffer->data() + done, buffer->size() - done);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                std::string error = strerror(errno);
+                close(fd);
+                throw std::runtime_error("Failed to write " + path + ": " + error);
+            }
+            done += count;
+        }
+        written_bytes += buffer->size();
+    }
+    close(fd);
+    return offset;
+}
@@ -0,0 +1,300 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <cctype>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "FrameBuffer.cpp"
+
+// Burns the time into frames, instead of gst's clockoverlay (command.txt), which renders the
+//  text with Pango on every frame. Glyphs come from a 5x7 bitmap font, scaled up once into an
+//  atlas, and the text is composed into a strip beside the frame, only redrawing the characters
+//  that changed (so usually just the last digit, once a second). Drawing is then a masked copy
+//  of the strip into each frame's planes, 16 bytes at a time.
+
+struct TimestampOverlayOptions {
+    // strftime, in local time. clockoverlay's time-format from command.txt. Empty for no overlay.
+    std::string format = "%D %H:%M:%S";
+    // Frame pixels per font pixel, 0 picks one from the frame height (4 at 1080p)
+    int scale = 0;
+    // An opaque black box behind the text, otherwise just a black outline around it (like clockoverlay)
+    bool background = false;
+};
+
+// In full size pixels. Even, so it lines up with the chroma planes.
+struct OverlayBounds {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// Digits, the separators strftime's numeric formats use, and upper case letters (lower case is
+//  drawn as upper case). Anything else is drawn as a space. Each row is 5 bits, the top bit on the left.
+struct OverlayGlyph {
+    char character;
+    uint8_t rows[7];
+};
+static const OverlayGlyph overlay_font[] = {
+    {'0', {0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E}},
+    {'1', {0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E}},
+    {'2', {0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F}},
+    {'3', {0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E}},
+    {'4', {0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02}},
+    {'5', {0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E}},
+    {'6', {0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E}},
+    {'7', {0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}},
+    {'8', {0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E}},
+    {'9', {0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C}},
+    {':', {0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00}},
+    {'/', {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}},
+    {'-', {0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00}},
+    {'.', {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C}},
+    {',', {0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08}},
+    {'A', {0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11}},
+    {'B', {0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E}},
+    {'C', {0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E}},
+    {'D', {0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C}},
+    {'E', {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F}},
+    {'F', {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10}},
+    {'G', {0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F}},
+    {'H', {0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11}},
+    {'I', {0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E}},
+    {'J', {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C}},
+    {'K', {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}},
+    {'L', {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F}},
+    {'M', {0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11}},
+    {'N', {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}},
+    {'O', {0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}},
+    {'P', {0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10}},
+    {'Q', {0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D}},
+    {'R', {0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11}},
+    {'S', {0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E}},
+    {'T', {0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}},
+    {'U', {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}},
+    {'V', {0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04}},
+    {'W', {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A}},
+    {'X', {0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11}},
+    {'Y', {0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04}},
+    {'Z', {0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F}},
+};
+
+class TimestampOverlay {
+public:
+    TimestampOverlay(int width, int height, const TimestampOverlayOptions& options = TimestampOverlayOptions());
+
+    // Renders the text for time_ms (milliseconds since the epoch), if its second changed since
+    //  the last call. Returns true if bounds() changed (the text got longer).
+    bool update(double time_ms);
+    // The text as of the last update, into an I420 frame of our size
+    void draw(FrameBuffer& frame) const;
+
+    // Every pixel draw can change
+    const OverlayBounds& bounds() const { return box; }
+    const std::string& text() const { return shown; }
+
+private:
+    struct Cell {
+        std::vector<uint8_t> luma;  // cell_width x cell_height
+        std::vector<uint8_t> mask;  // 0xFF where the cell is drawn, 0 where the frame shows through
+    };
+
+    int width;
+    int height;
+    TimestampOverlayOptions options;
+    int scale;
+    int outline;
+    int cell_width;
+    int cell_height;
+    Cell blank;
+    std::vector<Cell> atlas;            // By character, empty for characters the font doesn't have
+
+    int64_t shown_second;
+    std::string shown;                  // Padded with spaces to columns
+    int columns;
+    OverlayBounds box;
+    // The composed text, columns * cell_width wide. box can be narrower, if the frame is.
+    std::vector<uint8_t> strip_luma;
+    std::vector<uint8_t> strip_mask;
+    std::vector<uint8_t> strip_chroma_mask;     // Half size, set if any of its 4 luma pixels are
+    std::vector<uint8_t> neutral_chroma;        // A row of 128s, the chroma of black and white
+
+    Cell render_glyph(const uint8_t* rows) const;
+    const Cell& cell_for(char character) const;
+    void layout(int new_columns);
+    void put_cell(int column, char character);
+};
+
+// dst = mask ? src : dst, per byte
+static void overlay_select_row(uint8_t* dst, const uint8_t* src, const uint8_t* mask, int count) {
+    int i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 16 <= count; i += 16) {
+        vst1q_u8(dst + i, vbslq_u8(vld1q_u8(mask + i), vld1q_u8(src + i), vld1q_u8(dst + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= count; i += 16) {
+        __m128i m = _mm_loadu_si128((const __m128i*)(mask + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, d)));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = (dst[i] & ~mask[i]) | (src[i] & mask[i]);
+    }
+}
+
+TimestampOverlay::TimestampOverlay(int width, int height, const TimestampOverlayOptions& options)
+    : width(width), height(height), options(options), shown_second(INT64_MIN), columns(0) {
+    if (options.format.empty()) {
+        throw std::runtime_error("TimestampOverlay: format is empty");
+    }
+    if (width < 2 || height < 2 || width % 2 || height % 2) {
+        throw std::runtime_error("TimestampOverlay: frame size must be even");
+    }
+    scale = options.scale > 0 ? options.scale : std::max(1, height / 270);
+    outline = std::max(1, scale / 2);
+    // Even, so cells line up with chroma
+    cell_width = (5 * scale + 2 * outline + 1) & ~1;
+    cell_height = (7 * scale + 2 * outline + 1) & ~1;
+
+    static const uint8_t empty_rows[7] = {0};
+    blank = render_glyph(empty_rows);
+    atlas.resize(128);
+    for (const OverlayGlyph& glyph : overlay_font) {
+        atlas[(unsigned char)glyph.character] = render_glyph(glyph.rows);
+    }
+    // Sized for the text now, it grows if a later time is longer
+    update(time(nullptr) * 1000.0);
+}
+
+TimestampOverlay::Cell TimestampOverlay::render_glyph(const uint8_t* rows) const {
+    Cell cell;
+    size_t size = (size_t)cell_width * cell_height;
+    cell.luma.assign(size, 16);
+    cell.mask.assign(size, options.background ? 0xFF : 0);
+    auto font_pixel = [&](int x, int y) {
+        int column = (x - outline) / scale;
+        int row = (y - outline) / scale;
+        if (x < outline || y < outline || column >= 5 || row >= 7) return false;
+        return ((rows[row] >> (4 - column)) & 1) != 0;
+    };
+    for (int y = 0; y < cell_height; y++) {
+        for (int x = 0; x < cell_width; x++) {
+            size_t i = (size_t)y * cell_width + x;
+            if (font_pixel(x, y)) {
+                cell.luma[i] = 235;
+                cell.mask[i] = 0xFF;
+                continue;
+            }
+            // The outline is the text grown by outline pixels, and it stays inside the cell
+            for (int dy = -outline; dy <= outline && !cell.mask[i]; dy++) {
+                for (int dx = -outline; dx <= outline; dx++) {
+                    if (font_pixel(x + dx, y + dy)) {
+                        cell.mask[i] = 0xFF;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return cell;
+}
+
+const TimestampOverlay::Cell& TimestampOverlay::cell_for(char character) const {
+    unsigned char index = (unsigned char)toupper((unsigned char)character);
+    if (index < atlas.size() && !atlas[index].luma.empty()) return atlas[index];
+    return blank;
+}
+
+void TimestampOverlay::layout(int new_columns) {
+    columns = new_columns;
+    int strip_width = columns * cell_width;
+    strip_luma.assign((size_t)strip_width * cell_height, 16);
+    strip_mask.assign(strip_luma.size(), 0);
+    strip_chroma_mask.assign(strip_luma.size() / 4, 0);
+    neutral_chroma.assign(strip_width / 2, 128);
+    std::string text = shown;
+    shown.assign(columns, '\0');
+    for (int column = 0; column < columns; column++) {
+        put_cell(column, column < (int)text.size() ? text[column] : ' ');
+    }
+
+    // Top left, clockoverlay's default, clipped to the frame
+    int margin = scale * 2;
+    box.x = std::min(margin, width);
+    box.y = std::min(margin, height);
+    box.width = std::min(strip_width, width - box.x);
+    box.height = std::min(cell_height, height - box.y);
+}
+
+void TimestampOverlay::put_cell(int column, char character) {
+    const Cell& cell = cell_for(character);
+    int strip_width = columns * cell_width;
+    for (int y = 0; y < cell_height; y++) {
+        size_t offset = (size_t)y * strip_width + column * cell_width;
+        memcpy(strip_luma.data() + offset, cell.luma.data() + (size_t)y * cell_width, cell_width);
+        memcpy(strip_mask.data() + offset, cell.mask.data() + (size_t)y * cell_width, cell_width);
+    }
+    for (int y = 0; y < cell_height / 2; y++) {
+        const uint8_t* top = cell.mask.data() + (size_t)(y * 2) * cell_width;
+        const uint8_t* bottom = top + cell_width;
+        uint8_t* out = strip_chroma_mask.data() + (size_t)y * (strip_width / 2) + column * (cell_width / 2);
+        for (int x = 0; x < cell_width / 2; x++) {
+            out[x] = top[x * 2] | top[x * 2 + 1] | bottom[x * 2] | bottom[x * 2 + 1];
+        }
+    }
+    shown[column] = character;
+}
+
+bool TimestampOverlay::update(double time_ms) {
+    int64_t second = (int64_t)floor(time_ms / 1000);
+    if (second == shown_second) return false;
+    shown_second = second;
+    time_t seconds = (time_t)second;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char text[128];
+    size_t length = strftime(text, sizeof(text), options.format.c_str(), &local);
+    bool grew = (int)length > columns;
+    if (grew) {
+        shown.assign(text, length);
+        layout(length);
+        return true;
+    }
+    for (int column = 0; column < columns; column++) {
+        char character = column < (int)length ? text[column] : ' ';
+        if (character != shown[column]) put_cell(column, character);
+    }
+    return false;
+}
+
+void TimestampOverlay::draw(FrameBuffer& frame) const {
+    if (frame.width != width || frame.height != height) {
+        throw std::runtime_error("TimestampOverlay: frame size does not match");
+    }
+    int strip_width = columns * cell_width;
+    for (int y = 0; y < box.height; y++) {
+        overlay_select_row(frame.y() + (size_t)(box.y + y) * width + box.x, strip_luma.data() + (size_t)y * strip_width,
+                           strip_mask.data() + (size_t)y * strip_width, box.width);
+    }
+    int chroma_width = width / 2;
+    for (int y = 0; y < box.height / 2; y++) {
+        size_t offset = (size_t)(box.y / 2 + y) * chroma_width + box.x / 2;
+        const uint8_t* mask = strip_chroma_mask.data() + (size_t)y * (strip_width / 2);
+        overlay_select_row(frame.u() + offset, neutral_chroma.data(), mask, box.width / 2);
+        overlay_select_row(frame.v() + offset, neutral_chroma.data(), mask, box.width / 2);
+    }
+}
@@ -0,0 +1,1002 @@
+// Benchmarks each stage of the pipeline on a corpus of MJPEG frames, and reports frames per
+//  second, p50/p99 latency, and heap allocations per frame. Build with build_bench.sh.
+//
+// Usage: bench [--corpus=PATH] [--frames=N] [--stages=a,b,...] [--json] [--activity-dump=DIR]
+//  --corpus   A folder of .jpg frames, or a file of concatenated JPEGs (an MJPEG stream saved
+//             to disk). Can be given more than once. Without it, synthetic frames (with restart
+//             markers, like UVC cameras emit) are generated at 640x480, 1280x720 and 1920x1080.
+//  --frames   Timed iterations per stage (default 200)
+//  --stages   Only run stages whose name starts with one of these (default all)
+//  --json     Print one JSON object instead of a table, for comparing builds
+//  --activity-dump  Only write check_activity's frames and scores into DIR (an existing
+//             folder), for check_activity.py to compare with src/activity.py
+// Stages named check_* assert behaviour instead of timing it (on synthetic frames, once per
+//  run, not per corpus), and bench exits with 1 if one fails.
+//
+// Allocations are counted by replacing operator new, so libjpeg's internal malloc calls
+//  (its per-image memory pool) are not included.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <new>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+
+#include "ConverterRegistry.cpp"
+#include "Nal.cpp"
+#include "ActivityDetector.cpp"
+#include "PreviewWriter.cpp"
+#include "TimestampOverlay.cpp"
+#include "FrameScaler.cpp"
+#include "LiveStream.cpp"
+#include "CaptureManager.cpp"
+#include "ReplaySource.cpp"
+
+static std::atomic<uint64_t> allocation_count{0};
+static std::atomic<uint64_t> allocation_bytes{0};
+
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+    void* pointer = malloc(size ? size : 1);
+    if (!pointer) throw std::bad_alloc();
+    return pointer;
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+// Not inlined, or GCC sees free() on memory from operator new (-Wmismatched-new-delete)
+__attribute__((noinline)) void operator delete(void* pointer) noexcept { free(pointer); }
+void operator delete[](void* pointer) noexcept { operator delete(pointer); }
+void operator delete(void* pointer, size_t) noexcept { operator delete(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { operator delete(pointer); }
+
+struct Corpus {
+    std::string name;
+    int width = 0;
+    int height = 0;
+    std::vector<std::vector<uint8_t>> frames;
+};
+
+struct StageResult {
+    std::string stage;
+    std::string corpus;
+    int width = 0;
+    int height = 0;
+    int frames = 0;
+    double fps = 0;
+    double p50_ms = 0;
+    double p99_ms = 0;
+    double allocations_per_frame = 0;
+    double allocated_bytes_per_frame = 0;
+    std::string error;
+};
+
+// Something like a camera image: smooth gradients, edges, and a bit of sensor noise, moving a little each frame
+static std::vector<uint8_t> synthetic_jpeg(int width, int height, int frame_index) {
+    std::vector<uint8_t> rgb((size_t)width * height * 3);
+    uint32_t noise = 12345 + frame_index;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            noise = noise * 1103515245 + 12345;
+            int grain = (noise >> 16) % 9 - 4;
+            uint8_t* pixel = &rgb[((size_t)y * width + x) * 3];
+            int shift = x + frame_index * 4;
+            pixel[0] = std::max(0, std::min(255, (int)(128 + 90 * sin(shift * 0.02) * cos(y * 0.015)) + grain));
+            pixel[1] = std::max(0, std::min(255, (shift / 3 + y / 2) % 256 + grain));
+            pixel[2] = std::max(0, std::min(255, (((shift / 64) ^ (y / 64)) & 1 ? 200 : 50) + grain));
+        }
+    }
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    unsigned char* output = nullptr;
+    unsigned long output_size = 0;
+    jpeg_mem_dest(&cinfo, &output, &output_size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    // 4:2:2, with a restart marker every MCU row, which is what UVC cameras usually send
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 1;
+    cinfo.restart_in_rows = 1;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = &rgb[(size_t)cinfo.next_scanline * width * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    std::vector<uint8_t> jpeg(output, output + output_size);
+    free(output);
+    return jpeg;
+}
+
+static std::vector<uint8_t> read_file(const std::string& path) {
+    std::vector<uint8_t> data;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    struct stat info;
+    fstat(fd, &info);
+    data.resize(info.st_size);
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t count = read(fd, data.data() + done, data.size() - done);
+        if (count <= 0) break;
+        done += count;
+    }
+    close(fd);
+    data.resize(done);
+    return data;
+}
+
+// A folder of JPEG files, or one file of back to back JPEGs
+static Corpus load_corpus(const std::string& path) {
+    Corpus corpus;
+    corpus.name = path;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        throw std::runtime_error("Failed to stat " + path + ": " + strerror(errno));
+    }
+    if (S_ISDIR(info.st_mode)) {
+        std::vector<std::string> names;
+        DIR* dir = opendir(path.c_str());
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && (name.substr(name.size() - 4) == ".jpg" || name.substr(name.size() - 5) == ".jpeg")) {
+                names.push_back(name);
+            }
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+        for (auto& name : names) {
+            corpus.frames.push_back(read_file(path + "/" + name));
+        }
+    } else {
+        // Split at each SOI that follows an EOI
+        std::vector<uint8_t> data = read_file(path);
+        size_t start = 0;
+        for (size_t i = 2; i + 2 < data.size(); i++) {
+            if (data[i - 2] == 0xFF && data[i - 1] == 0xD9 && data[i] == 0xFF && data[i + 1] == 0xD8) {
+                corpus.frames.emplace_back(data.begin() + start, data.begin() + i);
+                start = i;
+            }
+        }
+        if (start < data.size()) {
+            corpus.frames.emplace_back(data.begin() + start, data.end());
+        }
+    }
+    if (corpus.frames.empty() || !jpeg_dimensions(corpus.frames[0], corpus.width, corpus.height)) {
+        throw std::runtime_error("No JPEG frames in " + path);
+    }
+    return corpus;
+}
+
+// A fake H.264 stream for the NAL stages, sized like what the encoder produces at this
+//  resolution: SPS, PPS and a keyframe, then 29 frames. Random payloads (with no zero bytes,
+//  so no accidental start codes). Returns one Annex B buffer per access unit.
+static std::vector<std::vector<uint8_t>> synthetic_h264(int width, int height) {
+    std::vector<std::vector<uint8_t>> access_units;
+    uint32_t random = 1;
+    auto append_nal = [&](std::vector<uint8_t>& out, uint8_t header, size_t size) {
+        static const uint8_t start_code[4] = {0, 0, 0, 1};
+        out.insert(out.end(), start_code, start_code + 4);
+        out.push_back(header);
+        for (size_t i = 1; i < size; i++) {
+            random = random * 1103515245 + 12345;
+            out.push_back((random >> 16) % 255 + 1);
+        }
+    };
+    for (int i = 0; i < 30; i++) {
+        std::vector<uint8_t> unit;
+        if (i == 0) {
+            append_nal(unit, 0x67, 24);
+            append_nal(unit, 0x68, 8);
+            append_nal(unit, 0x65, (size_t)width * height / 8);
+        } else {
+            append_nal(unit, 0x41, (size_t)width * height / 60);
+        }
+        access_units.push_back(std::move(unit));
+    }
+    return access_units;
+}
+
+// Runs process(i) for warmup + frames iterations, timing each one
+template<typename Process>
+static StageResult run_stage(const std::string& stage, const Corpus& corpus, int frames, Process process) {
+    StageResult result;
+    result.stage = stage;
+    result.corpus = corpus.name;
+    result.width = corpus.width;
+    result.height = corpus.height;
+
+    const int warmup = 3;
+    std::vector<double> latencies;
+    latencies.reserve(frames);
+    try {
+        for (int i = 0; i < warmup; i++) {
+            process(i);
+        }
+        uint64_t count_before = allocation_count.load();
+        uint64_t bytes_before = allocation_bytes.load();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++) {
+            auto frame_start = std::chrono::steady_clock::now();
+            process(warmup + i);
+            latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        // latencies has its capacity already, so the loop itself doesn't allocate
+        result.allocations_per_frame = (double)(allocation_count.load() - count_before) / frames;
+        result.allocated_bytes_per_frame = (double)(allocation_bytes.load() - bytes_before) / frames;
+        result.frames = frames;
+        result.fps = frames / seconds;
+    } catch (const std::exception& ex) {
+        result.error = ex.what();
+        return result;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    result.p50_ms = latencies[latencies.size() / 2];
+    result.p99_ms = latencies[std::min(latencies.size() - 1, (size_t)ceil(latencies.size() * 0.99) - 1)];
+    return result;
+}
+
+// Submits frames to a pipelined decoder, keeping it full. Latency is submit to decoded.
+static StageResult run_async_stage(const std::string& stage, const Corpus& corpus, int frames, AsyncFrameDecoder& decoder) {
+    StageResult result;
+    result.stage = stage;
+    result.corpus = corpus.name;
+    result.width = corpus.width;
+    result.height = corpus.height;
+
+    const int warmup = 3;
+    int total = warmup + frames;
+    std::vector<std::chrono::steady_clock::time_point> submitted(total);
+    std::vector<double> latencies;
+    latencies.reserve(frames);
+    try {
+        uint64_t count_before = 0;
+        uint64_t bytes_before = 0;
+        std::chrono::steady_clock::time_point start;
+        int next_submit = 0;
+        int next_decoded = 0;
+        while (next_decoded < total) {
+            if (next_submit < total && decoder.in_flight() < decoder.max_in_flight()) {
+                if (next_submit == warmup) {
+                    count_before = allocation_count.load();
+                    bytes_before = allocation_bytes.load();
+                    start = std::chrono::steady_clock::now();
+                }
+                submitted[next_submit] = std::chrono::steady_clock::now();
+                FrameView view(corpus.frames[next_submit % corpus.frames.size()]);
+                view.sequence = next_submit;
+                decoder.submit(view);
+                next_submit++;
+                continue;
+            }
+            DecodedImage image;
+            if (!decoder.next_decoded(image, 5000)) {
+                throw std::runtime_error("Timed out waiting for the decoder");
+            }
+            if ((int)image.sequence >= warmup) {
+                latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - submitted[image.sequence]).count());
+            }
+            next_decoded = image.sequence + 1;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.allocations_per_frame = (double)(allocation_count.load() - count_before) / frames;
+        result.allocated_bytes_per_frame = (double)(allocation_bytes.load() - bytes_before) / frames;
+        result.frames = latencies.size();
+        result.fps = frames / seconds;
+    } catch (const std::exception& ex) {
+        result.error = ex.what();
+        return result;
+    }
+    if (latencies.empty()) {
+        result.error = "No frames decoded";
+        return result;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    result.p50_ms = latencies[latencies.size() / 2];
+    result.p99_ms = latencies[std::min(latencies.size() - 1, (size_t)ceil(latencies.size() * 0.99) - 1)];
+    return result;
+}
+
+// Plays the corpus as camera_count cameras, as fast as possible, through a CaptureManager (so
+//  every core decodes), until each camera delivered frames frames. fps is for all cameras
+//  together, divide by a camera's frame rate for how many cameras this machine can take.
+//  Latency is the time between one camera's frames, so p99 shows cameras being starved.
+static StageResult run_cameras_stage(const std::string& stage, const Corpus& corpus, int frames, int camera_count) {
+    StageResult result;
+    result.stage = stage;
+    result.corpus = corpus.name;
+    result.width = corpus.width;
+    result.height = corpus.height;
+
+    std::vector<FrameView> views(corpus.frames.begin(), corpus.frames.end());
+    ReplayOptions replay_options;
+    replay_options.speed = 0;
+    replay_options.buffer_count = CaptureManagerOptions().in_flight_per_camera + 3;
+    struct CameraTimes {
+        int delivered = 0;
+        std::chrono::steady_clock::time_point last_time;
+        std::vector<double> intervals;
+    };
+    std::vector<CameraTimes> times(camera_count);
+    std::atomic<int> finished{0};
+    try {
+        CaptureManager manager;
+        for (int camera = 0; camera < camera_count; camera++) {
+            times[camera].intervals.reserve(frames);
+            std::unique_ptr<FrameSource> source(new ReplaySource(corpus.name, views, {}, replay_options));
+            manager.add_source(std::move(source), corpus.width, corpus.height, [&, camera](const FrameBuffer&) {
+                CameraTimes& camera_times = times[camera];
+                auto now = std::chrono::steady_clock::now();
+                if (camera_times.delivered > 0 && camera_times.delivered <= frames) {
+                    camera_times.intervals.push_back(std::chrono::duration<double, std::milli>(now - camera_times.last_time).count());
+                }
+                camera_times.last_time = now;
+                if (++camera_times.delivered == frames + 1 && ++finished == camera_count) {
+                    manager.stop();
+                }
+            });
+        }
+        uint64_t count_before = allocation_count.load();
+        uint64_t bytes_before = allocation_bytes.load();
+        auto start = std::chrono::steady_clock::now();
+        manager.run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        int delivered = 0;
+        for (int camera = 0; camera < camera_count; camera++) {
+            delivered += manager.stats(camera).delivered;
+        }
+        result.allocations_per_frame = (double)(allocation_count.load() - count_before) / delivered;
+        result.allocated_bytes_per_frame = (double)(allocation_bytes.load() - bytes_before) / delivered;
+        result.frames = delivered;
+        result.fps = delivered / seconds;
+    } catch (const std::exception& ex) {
+        result.error = ex.what();
+        return result;
+    }
+
+    std::vector<double> latencies;
+    for (auto& camera_times : times) {
+        latencies.insert(latencies.end(), camera_times.intervals.begin(), camera_times.intervals.end());
+    }
+    if (latencies.empty()) {
+        result.error = "No frames delivered";
+        return result;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    result.p50_ms = latencies[latencies.size() / 2];
+    result.p99_ms = latencies[std::min(latencies.size() - 1, (size_t)ceil(latencies.size() * 0.99) - 1)];
+    return result;
+}
+
+static StageResult failed_stage(const std::string& stage, const Corpus& corpus, const std::string& error) {
+    StageResult result;
+    result.stage = stage;
+    result.corpus = corpus.name;
+    result.width = corpus.width;
+    result.height = corpus.height;
+    result.error = error;
+    return result;
+}
+
+// Feeds the fake stream to a LiveStreamServer, as the encoder's writer thread would, with
+//  client_count raw clients on loopback. Latency is from add_nals until every client has the
+//  whole access unit.
+static StageResult run_live_stage(const std::string& stage, const Corpus& corpus, int frames,
+                                  const std::vector<std::vector<uint8_t>>& access_units, int client_count) {
+    std::vector<int> clients;
+    auto close_clients = [&]() {
+        for (int fd : clients) close(fd);
+    };
+    try {
+        LiveStreamOptions options;
+        options.listen = "127.0.0.1:0";
+        options.log_clients = false;
+        LiveStreamServer server(options);
+        LiveStream* stream = server.add_stream("bench");
+        server.start();
+        std::string request = "GET /live/bench.h264 HTTP/1.1\r\n\r\n";
+        for (int i = 0; i < client_count; i++) {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            clients.push_back(fd);
+            struct sockaddr_in address;
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_port = htons(server.port());
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1
+                || write(fd, request.data(), request.size()) != (ssize_t)request.size()) {
+                throw std::runtime_error("Failed to connect to the live stream: " + std::string(strerror(errno)));
+            }
+            // The response comes once the server has it watching, so it gets every unit from the first
+            std::string headers;
+            char c;
+            while (headers.find("\r\n\r\n") == std::string::npos) {
+                if (read(fd, &c, 1) != 1) throw std::runtime_error("Live stream closed before its headers");
+                headers += c;
+            }
+        }
+        std::vector<uint8_t> received(access_units[0].size());
+        StageResult result = run_stage(stage, corpus, frames, [&](int i) {
+            const std::vector<uint8_t>& unit = access_units[i % access_units.size()];
+            stream->add_nals(unit, std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count());
+            for (int fd : clients) {
+                size_t remaining = unit.size();
+                while (remaining > 0) {
+                    ssize_t count = read(fd, received.data(), std::min(remaining, received.size()));
+                    if (count <= 0) throw std::runtime_error("Live stream client lost its connection");
+                    remaining -= count;
+                }
+            }
+        });
+        close_clients();
+        return result;
+    } catch (const std::exception& ex) {
+        close_clients();
+        return failed_stage(stage, corpus, ex.what());
+    }
+}
+
+// Runs check() once, which throws if what it checks doesn't hold, and returns the frames it
+//  processed. fps is over the whole check.
+template<typename Check>
+static StageResult run_check_stage(const std::string& stage, const Corpus& corpus, Check check) {
+    StageResult result;
+    result.stage = stage;
+    result.corpus = corpus.name;
+    result.width = corpus.width;
+    result.height = corpus.height;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        result.frames = check();
+    } catch (const std::exception& ex) {
+        result.error = "FAILED: " + std::string(ex.what());
+        return result;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.fps = seconds > 0 ? result.frames / seconds : 0;
+    return result;
+}
+
+// Reads every frame into one DecodedImage without releasing it in between, as main does.
+//  next_decoded has to give the image's last frame back itself.
+static int check_reused_image(const Corpus& corpus, std::unique_ptr<AsyncFrameDecoder> decoder) {
+    const int total = decoder->max_in_flight();
+    for (int i = 0; i < total; i++) {
+        std::vector<uint8_t> frame = corpus.frames[i % corpus.frames.size()];
+        decoder->submit(std::move(frame), i);
+    }
+    DecodedImage image;
+    for (int i = 0; i < total; i++) {
+        if (!decoder->next_decoded(image, 5000)) {
+            throw std::runtime_error("timed out waiting for frame " + std::to_string(i) + " into a reused image");
+        }
+        if (image.sequence != (uint32_t)i) {
+            throw std::runtime_error("got frame " + std::to_string(image.sequence) + " into a reused image, expected " + std::to_string(i));
+        }
+    }
+    return total;
+}
+
+// CPUAsyncDecoder with latency_ms, so frames really are in flight together, and one that isn't
+//  a JPEG among them. next_decoded must return the rest in submit order, dropped_frames count
+//  the bad one, and in_flight never go over max_in_flight (submit blocking instead). Then
+//  check_reused_image, for it and for MJPEGPoolDecoder (the cpu backend's async decoder).
+static int check_async_decoder(const Corpus& corpus) {
+    const int total = 40;
+    const uint32_t bad_frame = 7;
+    CPUAsyncDecoder decoder(corpus.width, corpus.height, 3, 0, 5);
+    std::string submit_error;
+    std::thread submitter([&]() {
+        try {
+            for (uint32_t i = 0; i < total; i++) {
+                std::vector<uint8_t> frame = i == bad_frame ? std::vector<uint8_t>(256, 0) : corpus.frames[i % corpus.frames.size()];
+                decoder.submit(std::move(frame), i, i * 33333);
+                if (decoder.in_flight() > decoder.max_in_flight()) {
+                    throw std::runtime_error(std::to_string(decoder.in_flight()) + " frames in flight after a submit");
+                }
+            }
+        } catch (const std::exception& ex) {
+            submit_error = ex.what();
+        }
+    });
+
+    std::string error;
+    uint32_t expected = 0;
+    int decoded = 0;
+    while (decoded < total - 1 && error.empty()) {
+        DecodedImage image;
+        if (!decoder.next_decoded(image, 5000)) {
+            error = "timed out waiting for frame " + std::to_string(expected);
+            break;
+        }
+        if (expected == bad_frame) expected++;
+        if (image.sequence != expected) {
+            error = "got frame " + std::to_string(image.sequence) + ", expected " + std::to_string(expected);
+        }
+        if (decoder.in_flight() > decoder.max_in_flight()) {
+            error = std::to_string(decoder.in_flight()) + " frames in flight";
+        }
+        expected++;
+        decoded++;
+    }
+    submitter.join();
+    if (error.empty()) error = submit_error;
+    if (error.empty() && decoder.dropped_frames() != 1) {
+        error = "dropped_frames() is " + std::to_string(decoder.dropped_frames()) + ", expected 1";
+    }
+    if (!error.empty()) throw std::runtime_error(error);
+    decoded += check_reused_image(corpus, std::unique_ptr<AsyncFrameDecoder>(new CPUAsyncDecoder(corpus.width, corpus.height, 3)));
+    decoded += check_reused_image(corpus, std::unique_ptr<AsyncFrameDecoder>(new MJPEGPoolDecoder(corpus.width, corpus.height, 3)));
+    return decoded;
+}
+
+// Luma of frame index of a 640x480 scene for check_activity: noise over a gradient, with the
+//  clock changing under the default timestamp mask, and per scene a rectangle that is there for
+//  the first frames ("first"), appears late ("late"), or moves and grows in ("arrive") or out of
+//  view ("leave"). "static" is just the noise.
+static void activity_scene(const std::string& scene, int index, uint8_t* y) {
+    const int width = 640;
+    const int height = 480;
+    uint32_t noise = 12345 + index * 7919;
+    for (int row = 0; row < height; row++) {
+        for (int x = 0; x < width; x++) {
+            noise = noise * 1103515245 + 12345;
+            int value = (row + x) / 8 % 100 + 60 + (int)((noise >> 16) % 13) - 6;
+            y[row * width + x] = (uint8_t)value;
+        }
+    }
+    auto fill = [&](int top, int left, int rect_height, int rect_width, uint8_t value) {
+        for (int row = top; row < top + rect_height; row++) memset(y + row * width + left, value, rect_width);
+    };
+    // Moving edges are multiples of 4 pixels, so downsampling can't put close frames either way
+    if (scene == "first" && index < 3) fill(150, 200, 200, 200, 10);
+    if (scene == "late" && index > 20) fill(300, 400, 120, 120, 240);
+    if (scene == "arrive" && index >= 10) fill(200, 40 + index * 16, 40 + index * 8, 60, 230);
+    if (scene == "leave" && index < 20) fill(200, 40 + index * 16, 40 + index * 8, 60, 230);
+    fill(0, 0, 100, 300, index % 2 ? 255 : 0);
+}
+
+static const int ACTIVITY_SCENE_WIDTH = 640;
+static const int ACTIVITY_SCENE_HEIGHT = 480;
+static const int ACTIVITY_SCENE_FRAMES = 30;
+
+struct SceneActivity {
+    ActivitySegment segment;
+    bool forward = true;    // Which of Bidirectional's passes won
+};
+
+// Scores a scene's frames as one ActivityBaseline::Bidirectional segment. Each frame's luma is
+//  also written to frames_file, if given.
+static SceneActivity score_activity_scene(const std::string& scene, FILE* frames_file = nullptr) {
+    ActivityOptions options;
+    options.baseline = ActivityBaseline::Bidirectional;
+    ActivityDetector detector(ACTIVITY_SCENE_WIDTH, ACTIVITY_SCENE_HEIGHT, options);
+    std::vector<uint8_t> y((size_t)ACTIVITY_SCENE_WIDTH * ACTIVITY_SCENE_HEIGHT);
+    std::vector<int64_t> forward_changes;
+    for (int i = 0; i < ACTIVITY_SCENE_FRAMES; i++) {
+        activity_scene(scene, i, y.data());
+        if (frames_file && fwrite(y.data(), 1, y.size(), frames_file) != y.size()) {
+            throw std::runtime_error("Failed to write the frames of scene " + scene);
+        }
+        forward_changes.push_back(detector.add_frame(y.data(), ACTIVITY_SCENE_WIDTH, i).changes);
+    }
+    SceneActivity result;
+    result.segment = detector.finish_segment();
+    // add_frame scores forwards, so the segment kept those if they're its changes
+    result.forward = result.segment.changes == forward_changes;
+    return result;
+}
+
+// ActivityBaseline::Bidirectional against src/activity.py, which scores a segment forwards and
+//  backwards and keeps the direction with fewer changes. Only the direction and most active
+//  frame are checked here, they are what activity.py's process_frames gives for these scenes.
+//  check_activity.py compares every frame's score with activity.py's (see --activity-dump).
+static int check_activity() {
+    struct Expected {
+        const char* scene;
+        bool forward;
+        int most_active_index;  // -1 for none
+    };
+    const Expected expected[] = {
+        {"first", false, 2},
+        {"late", true, 21},
+        {"arrive", true, 29},
+        {"leave", false, 19},
+        {"static", true, -1},
+    };
+    int scored = 0;
+    for (auto& scene : expected) {
+        SceneActivity result = score_activity_scene(scene.scene);
+        scored += ACTIVITY_SCENE_FRAMES;
+        if (result.forward != scene.forward || result.segment.most_active_index != scene.most_active_index) {
+            throw std::runtime_error(std::string("scene ") + scene.scene + " scored " + (result.forward ? "forwards" : "backwards")
+                + " with most active frame " + std::to_string(result.segment.most_active_index) + ", activity.py scores it "
+                + (scene.forward ? "forwards" : "backwards") + " with " + std::to_string(scene.most_active_index));
+        }
+    }
+    return scored;
+}
+
+// For --activity-dump: each scene's frames as raw luma (<scene>.y, one frame after another) and
+//  our scores (scores.json) in folder, for check_activity.py to score with activity.py
+static void dump_activity_scenes(const std::string& folder) {
+    std::string json = "{\"width\":" + std::to_string(ACTIVITY_SCENE_WIDTH) + ",\"height\":" + std::to_string(ACTIVITY_SCENE_HEIGHT)
+        + ",\"frames\":" + std::to_string(ACTIVITY_SCENE_FRAMES) + ",\"changeThreshold\":" + std::to_string(ActivityOptions().change_threshold)
+        + ",\"scenes\":{";
+    const char* scenes[] = {"first", "late", "arrive", "leave", "static"};
+    for (size_t i = 0; i < sizeof(scenes) / sizeof(scenes[0]); i++) {
+        std::string path = folder + "/" + scenes[i] + ".y";
+        FILE* frames_file = fopen(path.c_str(), "wb");
+        if (!frames_file) {
+            throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+        }
+        SceneActivity result;
+        try {
+            result = score_activity_scene(scenes[i], frames_file);
+        } catch (...) {
+            fclose(frames_file);
+            throw;
+        }
+        fclose(frames_file);
+        json += std::string(i ? "," : "") + "\"" + scenes[i] + "\":{\"forward\":" + (result.forward ? "true" : "false")
+            + ",\"mostActiveIndex\":" + std::to_string(result.segment.most_active_index) + ",\"changes\":[";
+        for (size_t frame = 0; frame < result.segment.changes.size(); frame++) {
+            json += (frame ? "," : "") + std::to_string(result.segment.changes[frame]);
+        }
+        json += "]}";
+    }
+    json += "}}\n";
+    std::string path = folder + "/scores.json";
+    FILE* scores_file = fopen(path.c_str(), "w");
+    if (!scores_file || fwrite(json.data(), 1, json.size(), scores_file) != json.size()) {
+        if (scores_file) fclose(scores_file);
+        throw std::runtime_error("Failed to write " + path);
+    }
+    fclose(scores_file);
+}
+
+static bool stage_wanted(const std::vector<std::string>& filters, const std::string& stage) {
+    if (filters.empty()) return true;
+    for (auto& filter : filters) {
+        if (stage.compare(0, filter.size(), filter) == 0) return true;
+    }
+    return false;
+}
+
+static void run_corpus(const Corpus& corpus, int frames, const std::vector<std::string>& filters, std::vector<StageResult>& results) {
+    int width = corpus.width;
+    int height = corpus.height;
+    FramePool pool(width, height, 1);
+    FrameRef output = pool.acquire();
+    auto frame_at = [&](int i) { return FrameView(corpus.frames[i % corpus.frames.size()]); };
+
+    if (stage_wanted(filters, "decode_rgb")) {
+        // The old path: libjpeg to RGB, then RGB to I420
+        MJPEGtoI420Converter converter;
+        converter.set_raw_decode(false);
+        results.push_back(run_stage("decode_rgb", corpus, frames, [&](int i) { converter.convert_frame_into(frame_at(i), *output); }));
+    }
+    if (stage_wanted(filters, "decode_ycbcr")) {
+        MJPEGtoI420Converter converter;
+        results.push_back(run_stage("decode_ycbcr", corpus, frames, [&](int i) { converter.convert_frame_into(frame_at(i), *output); }));
+    }
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    if (stage_wanted(filters, "decode_sliced")) {
+        MJPEGtoI420Converter converter(threads);
+        results.push_back(run_stage("decode_sliced", corpus, frames, [&](int i) { converter.convert_frame_into(frame_at(i), *output); }));
+    }
+    if (stage_wanted(filters, "decode_pool")) {
+        // Throughput of independent frames on every core (MJPEGDecodePool, a frame per worker)
+        MJPEGPoolDecoder decoder(width, height, threads * 2, threads);
+        results.push_back(run_async_stage("decode_pool", corpus, frames, decoder));
+    }
+    for (int cameras : {1, 4, 16}) {
+        std::string stage = "cameras_" + std::to_string(cameras);
+        if (stage_wanted(filters, stage)) {
+            results.push_back(run_cameras_stage(stage, corpus, frames, cameras));
+        }
+    }
+
+    for (auto& backend : converter_backends()) {
+        std::string stage = "converter:" + backend.name;
+        if (stage_wanted(filters, stage)) {
+            std::unique_ptr<FrameConverter> converter;
+            try {
+                converter = backend.create(width, height);
+            } catch (const std::exception& ex) {
+                results.push_back(failed_stage(stage, corpus, std::string("unavailable: ") + ex.what()));
+                continue;
+            }
+            results.push_back(run_stage(stage, corpus, frames, [&](int i) { converter->convert_frame_into(frame_at(i), *output); }));
+        }
+        stage = "async:" + backend.name;
+        if (stage_wanted(filters, stage)) {
+            std::unique_ptr<AsyncFrameDecoder> decoder;
+            try {
+                decoder = create_async_decoder(backend.name, width, height, 3);
+            } catch (const std::exception& ex) {
+                results.push_back(failed_stage(stage, corpus, std::string("unavailable: ") + ex.what()));
+                continue;
+            }
+            results.push_back(run_async_stage(stage, corpus, frames, *decoder));
+        }
+    }
+
+    if (stage_wanted(filters, "activity")) {
+        // Scoring decoded frames, so decode the corpus up front
+        MJPEGtoI420Converter converter;
+        FramePool decoded_pool(width, height, (int)std::min<size_t>(corpus.frames.size(), 30));
+        std::vector<FrameRef> decoded;
+        for (int i = 0; i < decoded_pool.frame_count(); i++) {
+            decoded.push_back(decoded_pool.acquire());
+            converter.convert_frame_into(frame_at(i), *decoded.back());
+        }
+        for (ActivityBaseline baseline : {ActivityBaseline::Running, ActivityBaseline::Bidirectional}) {
+            ActivityOptions options;
+            options.baseline = baseline;
+            ActivityDetector detector(width, height, options);
+            std::string stage = baseline == ActivityBaseline::Running ? "activity" : "activity_bidirectional";
+            results.push_back(run_stage(stage, corpus, frames, [&](int i) {
+                detector.add_frame(*decoded[i % decoded.size()]);
+                if (detector.segment_frames() >= 30) detector.finish_segment();
+            }));
+        }
+    }
+
+    if (stage_wanted(filters, "preview")) {
+        // Every preview size of one frame, written to a temporary folder
+        char folder[] = "/tmp/bench_preview_XXXXXX";
+        if (!mkdtemp(folder)) {
+            results.push_back(failed_stage("preview", corpus, std::string("mkdtemp failed: ") + strerror(errno)));
+        } else {
+            MJPEGtoI420Converter converter;
+            converter.convert_frame_into(frame_at(0), *output);
+            PreviewWriter writer(width, height);
+            std::string video_path = std::string(folder) + "/segment";
+            results.push_back(run_stage("preview", corpus, frames, [&](int) { writer.write(*output, video_path); }));
+            for (const char* suffix : {"full", "400", "200", "100"}) {
+                unlink((video_path + "   size2=" + suffix + ".jpeg").c_str());
+            }
+            rmdir(folder);
+        }
+    }
+
+    if (stage_wanted(filters, "overlay")) {
+        // A new second every frame, so each one also redraws the digits that changed
+        MJPEGtoI420Converter converter;
+        converter.convert_frame_into(frame_at(0), *output);
+        TimestampOverlay overlay(width, height);
+        results.push_back(run_stage("overlay", corpus, frames, [&](int i) {
+            overlay.update(1.7e12 + i * 1000.0);
+            overlay.draw(*output);
+        }));
+    }
+
+    if (stage_wanted(filters, "scale")) {
+        // Half size is only 2x2 averages, two thirds size is the area filter (1080p to 720p)
+        MJPEGtoI420Converter converter;
+        converter.convert_frame_into(frame_at(0), *output);
+        for (int divisor : {2, 3}) {
+            int scale = divisor == 2 ? 1 : 2;
+            int scaled_width = width * scale / divisor & ~1;
+            int scaled_height = height * scale / divisor & ~1;
+            FrameScaler scaler(width, height, scaled_width, scaled_height);
+            FramePool scaled_pool(scaled_width, scaled_height, 1);
+            FrameRef scaled = scaled_pool.acquire();
+            results.push_back(run_stage(divisor == 2 ? "scale_half" : "scale_area", corpus, frames, [&](int) {
+                scaler.scale(*output, *scaled);
+            }));
+        }
+    }
+
+    // Each iteration is one access unit (frame) of a fake stream at this resolution
+    std::vector<std::vector<uint8_t>> access_units = synthetic_h264(width, height);
+    std::vector<NalSpan> nals;
+    nals.reserve(16);
+    std::vector<uint8_t> joined;
+    joined.reserve(access_units[0].size() * 2);
+    if (stage_wanted(filters, "nal_split")) {
+        // Annex B in, length prefixed (joinNALs) out
+        results.push_back(run_stage("nal_split", corpus, frames, [&](int i) {
+            const std::vector<uint8_t>& unit = access_units[i % access_units.size()];
+            nals.clear();
+            joined.clear();
+            split_annexb(unit.data(), unit.size(), nals);
+            for (auto& nal : nals) {
+                append_length_prefixed(nal, joined);
+            }
+        }));
+    }
+    if (stage_wanted(filters, "nal_write")) {
+        char path[] = "/tmp/bench_nal_XXXXXX";
+        int fd = mkstemp(path);
+        if (fd == -1) {
+            results.push_back(failed_stage("nal_write", corpus, std::string("mkstemp failed: ") + strerror(errno)));
+        } else {
+            unlink(path);
+            results.push_back(run_stage("nal_write", corpus, frames, [&](int i) {
+                const std::vector<uint8_t>& unit = access_units[i % access_units.size()];
+                nals.clear();
+                joined.clear();
+                split_annexb(unit.data(), unit.size(), nals);
+                for (auto& nal : nals) {
+                    append_length_prefixed(nal, joined);
+                }
+                if (write(fd, joined.data(), joined.size()) != (ssize_t)joined.size()) {
+                    throw std::runtime_error("Failed to write NALs: " + std::string(strerror(errno)));
+                }
+            }));
+            close(fd);
+        }
+    }
+    for (int client_count : {1, 16}) {
+        std::string stage = "live_" + std::to_string(client_count);
+        if (!stage_wanted(filters, stage)) continue;
+        results.push_back(run_live_stage(stage, corpus, frames, access_units, client_count));
+    }
+}
+
+static void run_checks(const std::vector<std::string>& filters, std::vector<StageResult>& results) {
+    Corpus corpus;
+    corpus.name = "synthetic";
+    corpus.width = 640;
+    corpus.height = 480;
+    for (int i = 0; i < 8; i++) {
+        corpus.frames.push_back(synthetic_jpeg(corpus.width, corpus.height, i));
+    }
+    if (stage_wanted(filters, "check_async")) {
+        results.push_back(run_check_stage("check_async", corpus, [&]() { return check_async_decoder(corpus); }));
+    }
+    if (stage_wanted(filters, "check_activity")) {
+        results.push_back(run_check_stage("check_activity", corpus, []() { return check_activity(); }));
+    }
+}
+
+static std::string json_string(const std::string& value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static void print_json(const std::vector<StageResult>& results) {
+    printf("{\"threads\":%u,\"results\":[", std::thread::hardware_concurrency());
+    for (size_t i = 0; i < results.size(); i++) {
+        const StageResult& result = results[i];
+        printf("%s\n{\"stage\":%s,\"corpus\":%s,\"width\":%d,\"height\":%d,\"frames\":%d,"
+               "\"fps\":%.3f,\"p50_ms\":%.4f,\"p99_ms\":%.4f,\"allocations_per_frame\":%.3f,\"allocated_bytes_per_frame\":%.1f,\"error\":%s}",
+               i ? "," : "", json_string(result.stage).c_str(), json_string(result.corpus).c_str(), result.width, result.height,
+               result.frames, result.fps, result.p50_ms, result.p99_ms, result.allocations_per_frame, result.allocated_bytes_per_frame,
+               result.error.empty() ? "null" : json_string(result.error).c_str());
+    }
+    printf("\n]}\n");
+}
+
+static void print_table(const std::vector<StageResult>& results) {
+    printf("%-18s %-11s %10s %9s %9s %12s %14s\n", "stage", "size", "fps", "p50 ms", "p99 ms", "allocs/frame", "bytes/frame");
+    for (auto& result : results) {
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", result.width, result.height);
+        if (!result.error.empty()) {
+            printf("%-18s %-11s %s\n", result.stage.c_str(), size, result.error.c_str());
+            continue;
+        }
+        printf("%-18s %-11s %10.1f %9.3f %9.3f %12.2f %14.1f\n", result.stage.c_str(), size, result.fps,
+               result.p50_ms, result.p99_ms, result.allocations_per_frame, result.allocated_bytes_per_frame);
+    }
+}
+
+int main(int argc, char** argv) {
+    try {
+        std::vector<std::string> corpus_paths;
+        std::vector<std::string> filters;
+        int frames = 200;
+        bool json = false;
+        std::string activity_dump;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--corpus=", 0) == 0) {
+                corpus_paths.push_back(arg.substr(strlen("--corpus=")));
+            } else if (arg.rfind("--frames=", 0) == 0) {
+                frames = std::max(1, atoi(arg.c_str() + strlen("--frames=")));
+            } else if (arg.rfind("--stages=", 0) == 0) {
+                std::string list = arg.substr(strlen("--stages="));
+                size_t start = 0;
+                while (start < list.size()) {
+                    size_t end = list.find(',', start);
+                    if (end == std::string::npos) end = list.size();
+                    filters.push_back(list.substr(start, end - start));
+                    start = end + 1;
+                }
+            } else if (arg == "--json") {
+                json = true;
+            } else if (arg.rfind("--activity-dump=", 0) == 0) {
+                activity_dump = arg.substr(strlen("--activity-dump="));
+            } else {
+                std::cerr << "Unknown argument " << arg << std::endl;
+                return 1;
+            }
+        }
+
+        if (!activity_dump.empty()) {
+            dump_activity_scenes(activity_dump);
+            return 0;
+        }
+
+        std::vector<Corpus> corpora;
+        for (auto& path : corpus_paths) {
+            corpora.push_back(load_corpus(path));
+        }
+        if (corpora.empty()) {
+            int sizes[][2] = {{640, 480}, {1280, 720}, {1920, 1080}};
+            for (auto& size : sizes) {
+                Corpus corpus;
+                corpus.name = "synthetic";
+                corpus.width = size[0];
+                corpus.height = size[1];
+                for (int i = 0; i < 8; i++) {
+                    corpus.frames.push_back(synthetic_jpeg(size[0], size[1], i));
+                }
+                corpora.push_back(std::move(corpus));
+            }
+        }
+
+        std::vector<StageResult> results;
+        for (auto& corpus : corpora) {
+            if (!json) {
+                std::cerr << "Benchmarking " << corpus.name << " " << corpus.width << "x" << corpus.height
+                          << " (" << corpus.frames.size() << " frames)" << std::endl;
+            }
+            run_corpus(corpus, frames, filters, results);
+        }
+        run_checks(filters, results);
+        if (json) {
+            print_json(results);
+        } else {
+            print_table(results);
+        }
+        for (auto& result : results) {
+            if (result.stage.rfind("check_", 0) == 0 && !result.error.empty()) return 1;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
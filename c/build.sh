@@ -1,3 +1,9 @@
+# The software encoder is compiled in when libx264 is installed (apt install libx264-dev)
+X264_FLAGS=""
+if [ -e /usr/include/x264.h ]; then
+  X264_FLAGS="-DCAMERA_HAVE_X264 -lx264"
+fi
+
 g++ -o main main.cpp \
   -I/usr/include/libcamera \
   -I/usr/include/interface/mmal \
@@ -11,4 +17,7 @@ g++ -o main main.cpp \
   -lcamera \
   -lstdc++ \
   -pthread \
+  -DCAMERA_HAVE_MMAL \
+  $X264_FLAGS \
+  -O2 \
   -std=c++17
@@ -0,0 +1,21 @@
+# Builds the benchmark (bench.cpp). The MMAL backend is compiled in when its headers exist,
+#  so this also builds on x86 replay boxes.
+MMAL_FLAGS=""
+if [ -e /opt/vc/include/interface/mmal/mmal.h ] || [ -e /usr/include/interface/mmal/mmal.h ]; then
+  MMAL_FLAGS="-DCAMERA_HAVE_MMAL \
+    -I/usr/include/interface/mmal \
+    -I/opt/vc/include/interface/mmal \
+    -I/usr/include/interface/mmal/util \
+    -I/usr/include/interface/vcos/pthreads \
+    -I/usr/include/interface/vmcs_host/linux \
+    -L/opt/vc/lib \
+    -lmmal -lmmal_core -lmmal_util -lbcm_host"
+fi
+
+g++ -o bench bench.cpp \
+  $MMAL_FLAGS \
+  -ljpeg \
+  -lstdc++ \
+  -pthread \
+  -O2 \
+  -std=c++17
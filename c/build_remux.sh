@@ -0,0 +1,5 @@
+# Builds the segment remuxer (remux.cpp), which only needs the standard library
+g++ -o remux remux.cpp \
+  -lstdc++ \
+  -O2 \
+  -std=c++17
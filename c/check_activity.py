@@ -0,0 +1,79 @@
+# Compares ActivityDetector (ActivityBaseline::Bidirectional) with src/activity.py on bench's
+#  synthetic activity scenes: which direction wins, the most active frame, and every frame's
+#  score. Scores can't match exactly, as we count changed pixels after downsampling and a 2x2
+#  opening, where activity.py sums the contour areas of a 5x5 opening at full size, so each
+#  frame's score has to be within SCORE_TOLERANCE of activity.py's, plus SCORE_SLACK pixels.
+#
+# Usage: python3 check_activity.py [bench]   (bench defaults to ./bench, see build_bench.sh)
+# Needs opencv-python and numpy, like activity.py. Exits with 1 if anything differs.
+
+import ast
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import numpy as np
+import cv2
+
+SCORE_TOLERANCE = 0.06
+SCORE_SLACK = 256
+
+def load_process_frames(threshold):
+    # activity.py runs on a video as soon as it's imported, so only take its imports, kernel
+    #  and process_frames
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "activity.py")
+    with open(path) as f:
+        module = ast.parse(f.read(), path)
+    def wanted(node):
+        if isinstance(node, (ast.Import, ast.ImportFrom, ast.FunctionDef)):
+            return True
+        return isinstance(node, ast.Assign) and any(isinstance(target, ast.Name) and target.id == "kernel" for target in node.targets)
+    module.body = [node for node in module.body if wanted(node)]
+    namespace = {"threshold": threshold}
+    exec(compile(module, path, "exec"), namespace)
+    return namespace["process_frames"]
+
+def main():
+    bench = sys.argv[1] if len(sys.argv) > 1 else "./bench"
+    failures = []
+    with tempfile.TemporaryDirectory() as folder:
+        subprocess.run([bench, "--activity-dump=" + folder], check=True)
+        with open(os.path.join(folder, "scores.json")) as f:
+            dump = json.load(f)
+        process_frames = load_process_frames(dump["changeThreshold"])
+        width, height, frameCount = dump["width"], dump["height"], dump["frames"]
+
+        for scene, ours in dump["scenes"].items():
+            luma = np.fromfile(os.path.join(folder, scene + ".y"), dtype=np.uint8).reshape(frameCount, height, width)
+            frames = [cv2.cvtColor(y, cv2.COLOR_GRAY2BGR) for y in luma]
+
+            # As activity.py does, but with each reverse score lined up with its own frame
+            #  (process_frames appends a 0 for the last frame, which activity.py's flip moves
+            #  to the front)
+            forwardChanges, forwardMostActive = process_frames(frames)
+            reverseChanges, reverseMostActive = process_frames(frames[::-1])
+            forward = sum(forwardChanges) <= sum(reverseChanges)
+            if forward:
+                changes, mostActive = forwardChanges[:-1], forwardMostActive
+            else:
+                changes, mostActive = reverseChanges[:-1][::-1], reverseMostActive
+            mostActiveIndex = -1 if mostActive is None else next(i for i, frame in enumerate(frames) if frame is mostActive["frame"])
+
+            if forward != ours["forward"]:
+                failures.append(f"{scene}: activity.py scores it {'forwards' if forward else 'backwards'}, we don't")
+            if mostActiveIndex != ours["mostActiveIndex"]:
+                failures.append(f"{scene}: activity.py's most active frame is {mostActiveIndex}, ours is {ours['mostActiveIndex']}")
+            worst = 0.0
+            for i, (theirs, mine) in enumerate(zip(changes, ours["changes"])):
+                allowed = theirs * SCORE_TOLERANCE + SCORE_SLACK
+                worst = max(worst, abs(mine - theirs) / allowed)
+                if abs(mine - theirs) > allowed:
+                    failures.append(f"{scene}: frame {i} scores {mine}, activity.py {int(theirs)}")
+            print(f"{scene:8} {'forward' if forward else 'reverse'}  most active {mostActiveIndex:3}  worst score difference {worst:.0%} of allowed")
+
+    for failure in failures:
+        print("FAILED: " + failure)
+    sys.exit(1 if failures else 0)
+
+main()
@@ -3,30 +3,113 @@
 #include <iostream>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
-#include <mmal.h>
-#include <mmal_logging.h>
-#include <mmal_util.h>
-#include <mmal_util_params.h>
-#include <mmal_parameters_video.h>
-#include <bcm_host.h>
+#include <string>
 #include <jpeglib.h>
 
 #include "CameraFrameCapture.cpp"
-//#include "ConvertCPU.cpp"
-#include "ConvertMMAL.cpp"
-//#include "H264Encoder.cpp"
-//#include "ConvertLibCamera.cpp"
-//#include "ConvertOMX.cpp"
+// Picks the decoder at runtime, from the backends build.sh compiled in (CAMERA_HAVE_MMAL, ...)
+#include "ConverterRegistry.cpp"
+#include "BranchedPipeline.cpp"
+#include "CaptureManager.cpp"
+#include "ReplaySource.cpp"
 //#include "ConvertGStreamer.cpp"
 
 // https://github.com/6by9/mmal_encode_example/blob/master/example_basic_1.c
 // https://github.com/raspberrypi/raspiraw/blob/master/raspiraw.c
 
-int main() {
+int main(int argc, char** argv) {
     try {
+        // Usage: main [device] [--decoder=auto|mmal|omx|libcamera|cpu[,...]]
+        //      [--output=/media/video/output/] [--encoder=auto|mmal|x264[,...]]
+        //      [--activity=running|bidirectional] [--record=all|activity]
+        //      [--preroll=seconds] [--postroll=seconds] [--camera=spec[@name] ...]
+        //      [--replay=path[@name] ...] [--replay-speed=1|N|max] [--replay-copies=N]
+        //      [--timestamp=off|strftime format] [--capture=WIDTHxHEIGHT@FPS]
+        //      [--branch=WIDTHxHEIGHT@FPS,folder[,encoder] ...] [--live=[address:]port] [--mp4]
+        // The device is overridable so we can test against other devices (e.g. the vivid virtual driver),
+        //  and can be a find_camera spec (bus=..., serial=...), so it is found again if it is replugged
+        // With --camera (repeatable), every camera is captured by one CaptureManager, found by
+        //  find_camera's spec (e.g. bus=usb-0000:01:00.0-1.2, serial=..., or a path), and written
+        //  to <output>/<name>/. name defaults to the spec. They share the CPU decoders.
+        // --replay (repeatable) adds a recording (see ReplaySource) as a camera, played at
+        //  --replay-speed times its recorded rate (max as fast as the decoders go), looping.
+        //  --replay-copies plays each one as that many cameras, to find how many a machine can
+        //  take. The delivered frame rates are logged every 5 seconds.
+        // --timestamp sets the time drawn on written frames (clockoverlay's "%D %H:%M:%S" by default)
+        // --capture sets the camera's mode (1280x960@5 by default). With --branch (repeatable), each
+        //  decoded frame is fanned out to several outputs instead of just --output, each dropping
+        //  frames to its own rate, downscaling to its own size ("full" for the camera's), and with
+        //  its own encoder and folder (spec.md's 4K@1fps and 1080p@15fps from one 4K camera).
+        // --live serves every camera (and branch) as it is encoded, at /live/NAME.h264 (raw Annex B)
+        //  or as a WebSocket at /live/NAME (see LiveStreamServer). NAME is the camera's name
+        //  ("camera" without --camera), with _WIDTHxHEIGHT@FPS after it if there are branches.
+        // With --output, decoded frames are encoded and written into the speed folders (replacing
+        //  gst's multifilesink and emitFrames). With --record=activity, 1x is only written around
+        //  activity (the faster speeds are still always written). --mp4 also writes each segment as
+        //  fragmented MP4 beside it (a .mp4 with the same key), which browsers play directly.
+        std::string device = "/dev/video0";
+        std::string decoder_config = "auto";
+        std::string encoder_config = "auto";
+        ActivityOptions activity_options;
+        std::string output_folder;
+        PrerollOptions preroll_options;
+        TimestampOverlayOptions timestamp_options;
+        std::vector<std::string> camera_specs;
+        std::vector<std::string> replay_specs;
+        std::vector<std::string> branch_specs;
+        std::string capture_mode;
+        std::string live_listen;
+        bool mp4 = false;
+        ReplayOptions replay_options;
+        int replay_copies = 1;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--decoder=", 0) == 0) {
+                decoder_config = arg.substr(strlen("--decoder="));
+            } else if (arg.rfind("--encoder=", 0) == 0) {
+                encoder_config = arg.substr(strlen("--encoder="));
+            } else if (arg == "--activity=running") {
+                activity_options.baseline = ActivityBaseline::Running;
+            } else if (arg == "--activity=bidirectional") {
+                activity_options.baseline = ActivityBaseline::Bidirectional;
+            } else if (arg == "--record=all") {
+                preroll_options.only_activity = false;
+            } else if (arg == "--record=activity") {
+                preroll_options.only_activity = true;
+            } else if (arg.rfind("--preroll=", 0) == 0) {
+                preroll_options.preroll_ms = atof(arg.c_str() + strlen("--preroll=")) * 1000;
+            } else if (arg.rfind("--postroll=", 0) == 0) {
+                preroll_options.postroll_ms = atof(arg.c_str() + strlen("--postroll=")) * 1000;
+            } else if (arg.rfind("--timestamp=", 0) == 0) {
+                std::string format = arg.substr(strlen("--timestamp="));
+                timestamp_options.format = format == "off" ? "" : format;
+            } else if (arg.rfind("--capture=", 0) == 0) {
+                capture_mode = arg.substr(strlen("--capture="));
+            } else if (arg.rfind("--branch=", 0) == 0) {
+                branch_specs.push_back(arg.substr(strlen("--branch=")));
+            } else if (arg.rfind("--live=", 0) == 0) {
+                live_listen = arg.substr(strlen("--live="));
+            } else if (arg == "--mp4") {
+                mp4 = true;
+            } else if (arg.rfind("--output=", 0) == 0) {
+                output_folder = arg.substr(strlen("--output="));
+            } else if (arg.rfind("--camera=", 0) == 0) {
+                camera_specs.push_back(arg.substr(strlen("--camera=")));
+            } else if (arg.rfind("--replay=", 0) == 0) {
+                replay_specs.push_back(arg.substr(strlen("--replay=")));
+            } else if (arg.rfind("--replay-speed=", 0) == 0) {
+                std::string speed = arg.substr(strlen("--replay-speed="));
+                replay_options.speed = speed == "max" ? 0 : atof(speed.c_str());
+            } else if (arg.rfind("--replay-copies=", 0) == 0) {
+                replay_copies = std::max(1, atoi(arg.c_str() + strlen("--replay-copies=")));
+            } else {
+                device = arg;
+            }
+        }
         int width = 1920;
         int height = 1080;
         int fps = 30;
@@ -34,15 +117,128 @@ int main() {
         width = 1280;
         height = 960;
         fps = 5;
+        if (!capture_mode.empty()) {
+            if (sscanf(capture_mode.c_str(), "%dx%d@%d", &width, &height, &fps) != 3) {
+                throw std::runtime_error("Expected --capture=WIDTHxHEIGHT@FPS, got " + capture_mode);
+            }
+        }
 
-        USBCamera camera("/dev/video0", width, height, fps, V4L2_PIX_FMT_MJPEG);
+        CameraPipelineOptions pipeline_options;
+        pipeline_options.output_folder = output_folder;
+        pipeline_options.encoder_config = encoder_config;
+        pipeline_options.activity = activity_options;
+        pipeline_options.preroll = preroll_options;
+        pipeline_options.timestamp = timestamp_options;
+        pipeline_options.mp4 = mp4;
+        std::vector<OutputBranchOptions> branches;
+        for (auto& branch_spec : branch_specs) {
+            branches.push_back(parse_output_branch(branch_spec, pipeline_options));
+        }
+        if (branches.empty()) {
+            OutputBranchOptions branch;
+            branch.pipeline = pipeline_options;
+            branches.push_back(branch);
+        }
+        // Before the pipelines, which feed it, so it is destroyed after them
+        std::unique_ptr<LiveStreamServer> live_server;
+        if (!live_listen.empty()) {
+            LiveStreamOptions live_options;
+            live_options.listen = live_listen;
+            live_server.reset(new LiveStreamServer(live_options));
+            std::cout << "Live streams on port " << live_server->port() << std::endl;
+        }
+        auto file_name = [](std::string name) {
+            for (char& c : name) {
+                if (c == '/' || c == ':' || c == ' ') c = '_';
+            }
+            return name;
+        };
+        // Gives each branch a live stream, if there is a server
+        auto add_live_streams = [&](const std::string& name, std::vector<OutputBranchOptions>& camera_branches) {
+            if (!live_server) return;
+            for (size_t i = 0; i < camera_branches.size(); i++) {
+                std::string stream_name = branch_specs.empty() ? name : name + "_" + branches[i].pipeline.name;
+                camera_branches[i].pipeline.live = live_server->add_stream(file_name(stream_name));
+            }
+        };
+
+        if (!camera_specs.empty() || !replay_specs.empty()) {
+            if (decoder_config != "auto" && decoder_config != "cpu") {
+                std::cerr << "--decoder is ignored with --camera and --replay, cameras share the CPU decoders" << std::endl;
+            }
+            // Pipelines go first, so they are destroyed after the manager stops calling them
+            std::vector<std::unique_ptr<BranchedPipeline>> pipelines;
+            CaptureManagerOptions manager_options;
+            if (!replay_specs.empty()) manager_options.stats_interval_ms = 5000;
+            CaptureManager manager(manager_options);
+            auto split_name = [](const std::string& camera_spec, std::string& spec, std::string& name) {
+                size_t at = camera_spec.rfind('@');
+                spec = camera_spec.substr(0, at);
+                name = at == std::string::npos ? spec : camera_spec.substr(at + 1);
+            };
+            auto add_pipeline = [&](const std::string& name, int width, int height) {
+                std::vector<OutputBranchOptions> camera_branches = branches;
+                for (auto& branch : camera_branches) {
+                    std::string& folder = branch.pipeline.output_folder;
+                    branch.pipeline.name = branches.size() > 1 ? name + " " + branch.pipeline.name : name;
+                    if (folder.empty()) continue;
+                    folder = folder + (folder.back() == '/' ? "" : "/") + file_name(name) + "/";
+                }
+                add_live_streams(name, camera_branches);
+                pipelines.emplace_back(new BranchedPipeline(width, height, fps, camera_branches));
+                BranchedPipeline* pipeline = pipelines.back().get();
+                return [pipeline](const FrameBuffer& frame) { pipeline->add_frame(frame); };
+            };
+            for (auto& camera_spec : camera_specs) {
+                std::string spec, name;
+                split_name(camera_spec, spec, name);
+                manager.add_camera(spec, width, height, fps, add_pipeline(name, width, height), name);
+            }
+            for (auto& replay_spec : replay_specs) {
+                std::string path, name;
+                split_name(replay_spec, path, name);
+                for (int copy = 0; copy < replay_copies; copy++) {
+                    std::string copy_name = replay_copies > 1 ? name + "_" + std::to_string(copy) : name;
+                    replay_options.buffer_count = manager_options.in_flight_per_camera + 3;
+                    std::unique_ptr<ReplaySource> replay(new ReplaySource(path, replay_options));
+                    int replay_width = replay->width();
+                    int replay_height = replay->height();
+                    manager.add_source(std::move(replay), replay_width, replay_height,
+                                       add_pipeline(copy_name, replay_width, replay_height), copy_name);
+                }
+            }
+            if (live_server) live_server->start();
+            manager.run();
+            return 0;
+        }
+
+        // Frames stay leased while the decoder has them in flight, so the camera needs spare buffers.
+        //  The cpu backend decodes a frame per core at once (MJPEGPoolDecoder), up to a point.
+        int decode_in_flight = std::max(3, std::min(8, (int)std::thread::hardware_concurrency()));
+        USBCameraOptions options;
+        options.buffer_count = decode_in_flight + 3;
+        // If it is unplugged, it may come back as another node
+        options.find_device = [device]() { return find_camera(device); };
+        USBCamera camera(find_camera(device), width, height, fps, V4L2_PIX_FMT_MJPEG, options);
         //USBCamera camera("/dev/video0", width, height, 5, V4L2_PIX_FMT_YUYV);
 
-        //MJPEGtoI420Converter converter;
-        MJPEGtoI420ConverterMMAL converter(width, height);
-         
         std::cout << "Camera opened successfully" << std::endl;
-        camera.start();
+        // Capture on a background thread, so slow conversions drop stale frames instead of delaying DQBUF
+        camera.start(CapturePolicy::LatestFrame);
+
+        // Time each available decoder on a real frame, pipelined as it will be, and use the
+        //  fastest that works
+        std::string backend;
+        {
+            FrameLease probe_frame = camera.acquire_frame();
+            backend = choose_converter_backend(decoder_config, width, height, probe_frame.view(), decode_in_flight);
+        }
+        std::cout << "Using converter " << backend << std::endl;
+        std::unique_ptr<AsyncFrameDecoder> decoder = create_async_decoder(backend, width, height, decode_in_flight);
+
+        add_live_streams("camera", branches);
+        BranchedPipeline pipeline(width, height, fps, branches);
+        if (live_server) live_server->start();
 
         // std::vector<uint8_t> get_frame();  // Retrieve the latest frame
         // 
@@ -50,20 +246,33 @@ int main() {
         auto last_time = std::chrono::high_resolution_clock::now();
 
         while (true) {
-            std::vector<uint8_t> frame = camera.get_frame();  // Get the latest frame
-            
+            // Read straight out of the driver's buffer, it is re-queued when the lease goes out of scope
+            FrameLease frame = camera.acquire_frame();
+
+
             auto current_time = std::chrono::high_resolution_clock::now();
             double elapsed_seconds = std::chrono::duration<double>(current_time - last_time).count();
             last_time = current_time;
 
-            std::cout << "Captured frame of size: " << frame.size() << " bytes " << (elapsed_seconds * 1000) << " ms" << std::endl;
+            CaptureStats stats = camera.stats();
+            std::cout << "Captured frame of size: " << frame.size() << " bytes " << (elapsed_seconds * 1000) << " ms"
+                      << " (dropped " << stats.dropped_stale << " stale, " << stats.dropped_driver << " in driver, queue " << stats.queue_depth
+                      << ", " << stats.reconnects << " reconnects)" << std::endl;
 
-            {
-                auto start = std::chrono::high_resolution_clock::now();
-                auto converted = converter.convert_frame(frame);
-                std::cout << "Converted frame of size: " << converted.size() << " bytes" << std::endl;
-                auto end = std::chrono::high_resolution_clock::now();
-                std::cout << "Conversion time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms" << std::endl;
+            // Keep the decoder busy while we wait for the next frame, and take whatever finished.
+            //  submit() blocks while the decoder is full, so if it is, wait for a frame first.
+            DecodedImage image;
+            auto report = [&]() {
+                std::cout << "Decoded frame " << image.sequence << " (" << decoder->in_flight() << " in flight, "
+                          << decoder->dropped_frames() << " dropped by decoder)" << std::endl;
+                pipeline.add_frame(image);
+            };
+            if (decoder->in_flight() >= decoder->max_in_flight() && decoder->next_decoded(image, 1000)) {
+                report();
+            }
+            decoder->submit(std::move(frame));
+            while (decoder->next_decoded(image, 0)) {
+                report();
             }
 
         }
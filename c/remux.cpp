@@ -0,0 +1,106 @@
+// Writes the fragmented MP4 (.mp4) beside each segment file (.nal) under the given folders, for
+//  archives recorded before main's --mp4 (or by gst and emitFrames). Build with build_remux.sh.
+//
+// Usage: remux [--overwrite] path...
+//  path         A folder (searched recursively, e.g. /media/video/output/) or a segment file
+//  --overwrite  Also remux segments that already have a .mp4 (by default they're skipped)
+// A segment's speed is from its folder (60x/..., see segment_speed_from_path). Faster speed
+//  segments are renamed as frames are appended, so remuxing a folder main is still writing
+//  (without --mp4) leaves .mp4s under the old names, which limit.ts deletes like any segment.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Mp4Remux.cpp"
+
+struct RemuxCounts {
+    uint64_t remuxed = 0;
+    uint64_t skipped = 0;
+    uint64_t failed = 0;
+};
+
+static void remux_path(const std::string& path, bool overwrite, RemuxCounts& counts) {
+    struct stat info;
+    if (lstat(path.c_str(), &info) != 0) {
+        std::cerr << "Failed to stat " << path << ": " << strerror(errno) << std::endl;
+        counts.failed++;
+        return;
+    }
+    if (S_ISDIR(info.st_mode)) {
+        DIR* dir = opendir(path.c_str());
+        if (!dir) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            counts.failed++;
+            return;
+        }
+        std::vector<std::string> names;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name != "." && name != "..") names.push_back(name);
+        }
+        closedir(dir);
+        std::string folder = path.back() == '/' ? path : path + "/";
+        for (auto& name : names) {
+            remux_path(folder + name, overwrite, counts);
+        }
+        return;
+    }
+
+    size_t slash = path.rfind('/');
+    VideoKey key;
+    if (!S_ISREG(info.st_mode) || !parse_video_key(slash == std::string::npos ? path : path.substr(slash + 1), key)) {
+        return;
+    }
+    std::string mp4_path = mp4_segment_path(path);
+    if (!overwrite && access(mp4_path.c_str(), F_OK) == 0) {
+        counts.skipped++;
+        return;
+    }
+    try {
+        remux_segment_file(path, mp4_path, segment_speed_from_path(path));
+        counts.remuxed++;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to remux: " << ex.what() << std::endl;
+        counts.failed++;
+    }
+}
+
+int main(int argc, char** argv) {
+    try {
+        bool overwrite = false;
+        std::vector<std::string> paths;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--overwrite") {
+                overwrite = true;
+            } else if (arg.rfind("--", 0) == 0) {
+                std::cerr << "Unknown argument " << arg << std::endl;
+                return 1;
+            } else {
+                paths.push_back(arg);
+            }
+        }
+        if (paths.empty()) {
+            std::cerr << "Usage: remux [--overwrite] path..." << std::endl;
+            return 1;
+        }
+
+        RemuxCounts counts;
+        for (auto& path : paths) {
+            remux_path(path, overwrite, counts);
+        }
+        std::cout << "Remuxed " << counts.remuxed << " segments, skipped " << counts.skipped
+                  << " that had a .mp4, " << counts.failed << " failed" << std::endl;
+        return counts.failed > 0 ? 1 : 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+}
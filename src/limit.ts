@@ -8,6 +8,8 @@ import { videoFolder } from "./frameEmitHelpers";
 import { MAX_DISK_USAGE, MAX_FILE_COUNT } from "./constants";
 import { recursiveIterate, safeUnlink, safeReadDir } from "./readHelpers";
 
+const keyframeIndexFiles = ["keyframes.index", "keyframes.jpegs"];
+
 
 
 
@@ -65,6 +67,13 @@ async function limitFiles() {
         // Remove empty folders, as they lag reading by quite a bit
         for (let folder of folderToCheck) {
             let files = await safeReadDir(folder);
+            // The keyframe index (see KeyframeIndex.cpp) only describes the segments beside it
+            if (files.length > 0 && files.every(x => keyframeIndexFiles.includes(x))) {
+                for (let file of files) {
+                    await safeUnlink(folder + file);
+                }
+                files = [];
+            }
             if (files.length === 0) {
                 await safeUnlink(folder);
             }